@@ -0,0 +1,91 @@
+#include "always.h"
+#include "vtable.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+/* A minified bundle or binary blob can have tens of thousands of distinct
+ * trigrams, and would add its id to almost every doclist. With the maxtrigrams
+ * option, documents with more distinct trigrams than that are not indexed by
+ * trigrams, instead their document ids are listed in %_always. Documents in
+ * this list are candidates for every match scan, and are verified by the match
+ * function like any other candidate.
+ *
+ * The list is expected to be small, so it's loaded by each match scan, like
+ * the list of segments.
+ */
+
+/** Load document ids of always-candidates from %_always in ascending order
+ * Ids are output as *paIds, which must be released with sqlite3_free, and the
+ * number of ids as *pnIds. Tables from before %_always have none. */
+int alwaysLoad(trilite_vtab *pTrgVtab, sqlite3_int64 **paIds, int *pnIds){
+  sqlite3_stmt *pStmt;
+  int nAvail = 0;
+  int rc;
+
+  *paIds = NULL;
+  *pnIds = 0;
+
+  char *zSql = sqlite3_mprintf("SELECT id FROM %Q.'%q_always' ORDER BY id", pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return SQLITE_OK;
+
+  while(sqlite3_step(pStmt) == SQLITE_ROW){
+    if(*pnIds == nAvail){
+      nAvail = nAvail * 2 + 16;
+      sqlite3_int64 *aIds = (sqlite3_int64*)sqlite3_realloc(*paIds, sizeof(sqlite3_int64) * nAvail);
+      if(!aIds){
+        sqlite3_finalize(pStmt);
+        sqlite3_free(*paIds);
+        *paIds = NULL;
+        *pnIds = 0;
+        return SQLITE_NOMEM;
+      }
+      *paIds = aIds;
+    }
+    (*paIds)[(*pnIds)++] = sqlite3_column_int64(pStmt, 0);
+  }
+  rc = sqlite3_finalize(pStmt);
+
+  trilite_log("Loaded %i always-candidates", *pnIds);
+  return rc;
+}
+
+/** True, if id is in the ascending list of always-candidates aIds */
+bool alwaysCandidate(const sqlite3_int64 *aIds, int nIds, sqlite3_int64 id){
+  int lo = 0, hi = nIds;
+  while(lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    if(aIds[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < nIds && aIds[lo] == id;
+}
+
+/** Add document id to the always-candidates in %_always */
+int alwaysAdd(trilite_vtab *pTrgVtab, sqlite3_int64 id){
+  trilite_log("Document %lli is an always-candidate", id);
+  char *zSql = sqlite3_mprintf("INSERT OR IGNORE INTO %Q.'%q_always' (id) VALUES (%lld);",
+                               pTrgVtab->zDb, pTrgVtab->zName, id);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/** Remove document id from the always-candidates in %_always, when an edit
+ * leaves it with few enough trigrams to be indexed by them */
+int alwaysRemove(trilite_vtab *pTrgVtab, sqlite3_int64 id){
+  char *zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_always' WHERE id = %lld;",
+                               pTrgVtab->zDb, pTrgVtab->zName, id);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
@@ -0,0 +1,14 @@
+#ifndef TRILITE_ALWAYS_H
+#define TRILITE_ALWAYS_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+
+int alwaysLoad(trilite_vtab*, sqlite3_int64**, int*);
+bool alwaysCandidate(const sqlite3_int64*, int, sqlite3_int64);
+int alwaysAdd(trilite_vtab*, sqlite3_int64);
+int alwaysRemove(trilite_vtab*, sqlite3_int64);
+
+#endif /* TRILITE_ALWAYS_H */
@@ -0,0 +1,447 @@
+#include "bigrams.h"
+#include "vtable.h"
+#include "trigram.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX(a,b)    ((a) < (b) ? (b) : (a))
+#define MIN(a,b)    ((a) > (b) ? (b) : (a))
+
+/* With the bigrams option, texts are also indexed by the bigrams and single
+ * characters they hold, so substrings shorter than a trigram have candidates
+ * too. Such short keys are in most documents, so rather than doclists they
+ * have bitmaps of ids in %_bigrams, each covering BIGRAM_BITMAP_IDS ids.
+ * Bitmaps are stored without trailing zero bytes, and only if they have a bit
+ * set, so sparse ids don't take much space either.
+ *
+ * Bigrams are of folded characters, as the trigrams, so they only rule out
+ * documents. Adjacency isn't known, candidates hold all bigrams of a substring
+ * somewhere, and are verified as any other candidate.
+ *
+ * Bigrams of added texts are pending in a bigram_index, until they're merged
+ * into the bitmaps when the transaction is synced.
+ */
+
+/** Block of the bitmap holding id, ids are divided rounding down */
+#define BITMAP_BLOCK(id)    ((id) >= 0 ? (id) / BIGRAM_BITMAP_IDS : -((-(id) - 1) / BIGRAM_BITMAP_IDS) - 1)
+
+/** Bit of id in the bitmap of its block */
+#define BITMAP_BIT(id)      ((int)((id) - BITMAP_BLOCK(id) * BIGRAM_BITMAP_IDS))
+
+/** Initial number of pending postings allocated */
+#define MIN_POSTINGS_ALLOCATION   1024
+
+typedef struct bigram_posting bigram_posting;
+
+/** Pending posting, a bigram of the text with id */
+struct bigram_posting{
+  /** Key of the bigram, see BIGRAM_KEY */
+  sqlite3_int64 key;
+
+  /** Id of the text */
+  sqlite3_int64 id;
+};
+
+/** Pending bigrams of texts added in this transaction */
+struct bigram_index{
+  /** Pending postings, the first nSorted are sorted by key then id without
+   * duplicates, those added since follow in order of addition */
+  bigram_posting *aPostings;
+
+  /** Number of pending postings */
+  int nPostings;
+
+  /** Number of sorted postings, see sortPostings */
+  int nSorted;
+
+  /** Number of postings allocated for aPostings */
+  int nAlloc;
+};
+
+static int addPosting(bigram_index*, sqlite3_int64, sqlite3_int64);
+static void sortPostings(bigram_index*);
+static int textKeys(trilite_vtab*, const unsigned char*, int, bool, sqlite3_int64**, int*);
+static bool fetchBitmap(bitmap_reader*, sqlite3_int64);
+static bool scanBitmaps(bitmap_reader*, int);
+static int compareKeys(const void*, const void*);
+static int comparePostings(const void*, const void*);
+
+
+/** Allocate a new bigram index, for pending bigrams */
+int bigramsOpen(bigram_index **ppBigrams){
+  bigram_index *pBigrams = (bigram_index*)sqlite3_malloc(sizeof(bigram_index));
+  *ppBigrams = pBigrams;
+  if(!pBigrams) return SQLITE_NOMEM;
+  memset(pBigrams, 0, sizeof(bigram_index));
+  return SQLITE_OK;
+}
+
+/** Release bigram index, pending bigrams must be flushed first */
+void bigramsClose(bigram_index *pBigrams){
+  if(!pBigrams) return;
+  bigramsReset(pBigrams);
+  sqlite3_free(pBigrams);
+}
+
+/** Forget pending bigrams, called when rolling back */
+void bigramsReset(bigram_index *pBigrams){
+  sqlite3_free(pBigrams->aPostings);
+  pBigrams->aPostings = NULL;
+  pBigrams->nPostings = 0;
+  pBigrams->nSorted   = 0;
+  pBigrams->nAlloc    = 0;
+}
+
+/** Bytes allocated for pending bigrams */
+int bigramsMemoryUsage(bigram_index *pBigrams){
+  return pBigrams->nAlloc * sizeof(bigram_posting);
+}
+
+/** Add the distinct bigrams and characters of a text with id to the pending
+ * bigrams */
+int bigramsAddText(trilite_vtab *pTrgVtab, sqlite3_int64 id, const unsigned char *zText, int nText){
+  sqlite3_int64 *aKeys;
+  int nKeys;
+  int rc = textKeys(pTrgVtab, zText, nText, true, &aKeys, &nKeys);
+  int i;
+  for(i = 0; i < nKeys && rc == SQLITE_OK; i++)
+    rc = addPosting(pTrgVtab->pBigrams, aKeys[i], id);
+  sqlite3_free(aKeys);
+  return rc;
+}
+
+/** Add the bigrams and characters of the new text of document id, that its
+ * old text doesn't have, to the pending bigrams. Bits of bigrams only in the
+ * old text are left set, they just add candidates. */
+int bigramsUpdateText(trilite_vtab *pTrgVtab, sqlite3_int64 id, const unsigned char *zOld, int nOld,
+                      const unsigned char *zText, int nText){
+  sqlite3_int64 *aOld, *aKeys;
+  int nOldKeys, nKeys;
+  int rc = textKeys(pTrgVtab, zOld, nOld, true, &aOld, &nOldKeys);
+  if(rc != SQLITE_OK) return rc;
+  rc = textKeys(pTrgVtab, zText, nText, true, &aKeys, &nKeys);
+  int i, j = 0;
+  for(i = 0; i < nKeys && rc == SQLITE_OK; i++){
+    /* Both lists of keys are in ascending order */
+    while(j < nOldKeys && aOld[j] < aKeys[i]) j++;
+    if(j < nOldKeys && aOld[j] == aKeys[i]) continue;
+    rc = addPosting(pTrgVtab->pBigrams, aKeys[i], id);
+  }
+  sqlite3_free(aOld);
+  sqlite3_free(aKeys);
+  return rc;
+}
+
+/** Ids with the bigram key among the pending bigrams, so queries see texts
+ * added in the current transaction. Ids are output in ascending order as
+ * *paIds, allocated with sqlite3_malloc, and the number of ids as *pnIds.
+ * Postings are sorted once for all keys of a query, unless texts are added
+ * between lookups, and the postings of key are found by binary search. */
+int bigramsPending(trilite_vtab *pTrgVtab, sqlite3_int64 key, sqlite3_int64 **paIds, int *pnIds){
+  bigram_index *pBigrams = pTrgVtab->pBigrams;
+  *paIds = NULL;
+  *pnIds = 0;
+  sortPostings(pBigrams);
+
+  /* Find the first posting of key */
+  int lo = 0, hi = pBigrams->nPostings;
+  while(lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    if(pBigrams->aPostings[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int n = 0;
+  while(lo + n < pBigrams->nPostings && pBigrams->aPostings[lo + n].key == key) n++;
+  if(n == 0) return SQLITE_OK;
+
+  /* Ids of a key are distinct and in ascending order, once sorted */
+  sqlite3_int64 *aIds = (sqlite3_int64*)sqlite3_malloc(sizeof(sqlite3_int64) * n);
+  if(!aIds) return SQLITE_NOMEM;
+  int i;
+  for(i = 0; i < n; i++)
+    aIds[i] = pBigrams->aPostings[lo + i].id;
+  *paIds = aIds;
+  *pnIds = n;
+  return SQLITE_OK;
+}
+
+/** Merge pending bigrams into the bitmaps of %_bigrams */
+int bigramsFlush(trilite_vtab *pTrgVtab){
+  bigram_index *pBigrams = pTrgVtab->pBigrams;
+  int rc = SQLITE_OK;
+
+  /* Group postings by bigram, and ids of a bigram by bitmap */
+  sortPostings(pBigrams);
+  bigram_posting *aPostings = pBigrams->aPostings;
+  int nPostings = pBigrams->nPostings;
+
+  unsigned char bitmap[BIGRAM_BITMAP_IDS / BITSPERBYTE];
+  int i = 0;
+  while(i < nPostings && rc == SQLITE_OK){
+    sqlite3_int64 key = aPostings[i].key;
+    sqlite3_int64 block = BITMAP_BLOCK(aPostings[i].id);
+
+    /* Start from the stored bitmap, if there's one */
+    int nBitmap = 0;
+    memset(bitmap, 0, sizeof(bitmap));
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_bitmap;
+    sqlite3_bind_int64(pStmt, 1, key);
+    sqlite3_bind_int64(pStmt, 2, block);
+    if(sqlite3_step(pStmt) == SQLITE_ROW && sqlite3_column_int64(pStmt, 0) == block){
+      const void *blob = sqlite3_column_blob(pStmt, 1);
+      nBitmap = MIN(sqlite3_column_bytes(pStmt, 1), (int)sizeof(bitmap));
+      memcpy(bitmap, blob, nBitmap);
+    }
+    rc = sqlite3_reset(pStmt);
+    if(rc != SQLITE_OK) break;
+
+    /* Set bits of pending ids */
+    for(; i < nPostings && aPostings[i].key == key && BITMAP_BLOCK(aPostings[i].id) == block; i++){
+      int bit = BITMAP_BIT(aPostings[i].id);
+      bitmap[bit / BITSPERBYTE] |= 1 << (bit % BITSPERBYTE);
+      nBitmap = MAX(nBitmap, bit / BITSPERBYTE + 1);
+    }
+
+    pStmt = pTrgVtab->stmt_insert_bitmap;
+    sqlite3_bind_int64(pStmt, 1, key);
+    sqlite3_bind_int64(pStmt, 2, block);
+    sqlite3_bind_blob(pStmt, 3, bitmap, nBitmap, SQLITE_STATIC);
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+  }
+
+  bigramsReset(pBigrams);
+  return rc;
+}
+
+/** Rewrite bitmaps with the ids aOld[i] changed to aNew[i], aOld holds nIds
+ * ids in ascending order, ids not in aOld are dropped. Pending bigrams must be
+ * flushed first. */
+int bigramsRemap(trilite_vtab *pTrgVtab, const sqlite3_int64 *aOld, const sqlite3_int64 *aNew, int nIds){
+  sqlite3_stmt *pStmt;
+  int rc;
+
+  assert(pTrgVtab->pBigrams->nPostings == 0);
+
+  /* Read all bitmaps as postings with new ids */
+  char *zSql = sqlite3_mprintf("SELECT bigram, block, bitmap FROM %Q.'%q_bigrams'",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  while(rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW){
+    sqlite3_int64 key = sqlite3_column_int64(pStmt, 0);
+    sqlite3_int64 block = sqlite3_column_int64(pStmt, 1);
+    const unsigned char *bitmap = (const unsigned char*)sqlite3_column_blob(pStmt, 2);
+    int nBitmap = sqlite3_column_bytes(pStmt, 2);
+    int bit;
+    for(bit = 0; bit < nBitmap * BITSPERBYTE && rc == SQLITE_OK; bit++){
+      if(!(bitmap[bit / BITSPERBYTE] & (1 << (bit % BITSPERBYTE)))) continue;
+      sqlite3_int64 id = block * BIGRAM_BITMAP_IDS + bit;
+      /* Find id in aOld, ids not in it are of deleted documents */
+      int lo = 0, hi = nIds;
+      while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(aOld[mid] < id)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if(lo < nIds && aOld[lo] == id)
+        rc = addPosting(pTrgVtab->pBigrams, key, aNew[lo]);
+    }
+  }
+  int rc2 = sqlite3_finalize(pStmt);
+  if(rc == SQLITE_OK) rc = rc2;
+
+  /* Replace bitmaps with those of the new ids */
+  if(rc == SQLITE_OK){
+    zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_bigrams'", pTrgVtab->zDb, pTrgVtab->zName);
+    if(!zSql)
+      rc = SQLITE_NOMEM;
+    else
+      rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+  }
+  if(rc == SQLITE_OK)
+    return bigramsFlush(pTrgVtab);
+  bigramsReset(pTrgVtab->pBigrams);
+  return rc;
+}
+
+/** Keys of a substring of nString bytes, its distinct bigrams, or its
+ * characters if it has no bigrams, as with just one character. Keys are output as *paKeys, allocated
+ * with sqlite3_malloc, and the number of keys as *pnKeys. */
+int bigramsKeys(trilite_vtab *pTrgVtab, const unsigned char *string, int nString, sqlite3_int64 **paKeys, int *pnKeys){
+  return textKeys(pTrgVtab, string, nString, false, paKeys, pnKeys);
+}
+
+/** Add a pending posting */
+static int addPosting(bigram_index *pBigrams, sqlite3_int64 key, sqlite3_int64 id){
+  if(pBigrams->nPostings == pBigrams->nAlloc){
+    int nAlloc = MAX(pBigrams->nAlloc * 2, MIN_POSTINGS_ALLOCATION);
+    bigram_posting *aPostings = (bigram_posting*)sqlite3_realloc(pBigrams->aPostings, sizeof(bigram_posting) * nAlloc);
+    if(!aPostings) return SQLITE_NOMEM;
+    pBigrams->aPostings = aPostings;
+    pBigrams->nAlloc    = nAlloc;
+  }
+  pBigrams->aPostings[pBigrams->nPostings].key  = key;
+  pBigrams->aPostings[pBigrams->nPostings].id   = id;
+  pBigrams->nPostings++;
+  return SQLITE_OK;
+}
+
+/** Sort pending postings by key then id and drop duplicates, unless no
+ * postings have been added since they were last sorted */
+static void sortPostings(bigram_index *pBigrams){
+  if(pBigrams->nSorted == pBigrams->nPostings) return;
+  bigram_posting *aPostings = pBigrams->aPostings;
+  qsort(aPostings, pBigrams->nPostings, sizeof(bigram_posting), comparePostings);
+  int i, n = 0;
+  for(i = 0; i < pBigrams->nPostings; i++){
+    if(n > 0 && aPostings[n - 1].key == aPostings[i].key && aPostings[n - 1].id == aPostings[i].id)
+      continue;
+    aPostings[n++] = aPostings[i];
+  }
+  pBigrams->nPostings = n;
+  pBigrams->nSorted   = n;
+}
+
+/** Distinct keys of a text in ascending order, its bigrams, and characters if
+ * characters is true or the text has no bigrams. Boundary markers of anchored
+ * regexps are skipped, they aren't in texts. Keys are output as *paKeys,
+ * allocated with sqlite3_malloc, and the number of keys as *pnKeys. */
+static int textKeys(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText, bool characters,
+                    sqlite3_int64 **paKeys, int *pnKeys){
+  *paKeys = NULL;
+  *pnKeys = 0;
+  if(nText == 0) return SQLITE_OK;
+
+  int nChars;
+  uint32_t *aChars = trigramChars(pTrgVtab, zText, nText, true, &nChars);
+  if(!aChars) return SQLITE_NOMEM;
+  sqlite3_int64 *aKeys = (sqlite3_int64*)sqlite3_malloc(sizeof(sqlite3_int64) * nChars * 2);
+  if(!aKeys){
+    sqlite3_free(aChars);
+    return SQLITE_NOMEM;
+  }
+
+  int nKeys = 0;
+  int i;
+  for(i = 0; i + 1 < nChars; i++){
+    if(!IS_BOUNDARY(aChars[i]) && !IS_BOUNDARY(aChars[i + 1]))
+      aKeys[nKeys++] = BIGRAM_KEY(aChars[i], aChars[i + 1]);
+  }
+  if(characters || nKeys == 0){
+    for(i = 0; i < nChars; i++){
+      if(!IS_BOUNDARY(aChars[i]))
+        aKeys[nKeys++] = BIGRAM_KEY(aChars[i], BIGRAM_NONE);
+    }
+  }
+  sqlite3_free(aChars);
+
+  /* Sort and drop duplicates */
+  qsort(aKeys, nKeys, sizeof(sqlite3_int64), compareKeys);
+  int n = 0;
+  for(i = 0; i < nKeys; i++){
+    if(n > 0 && aKeys[n - 1] == aKeys[i]) continue;
+    aKeys[n++] = aKeys[i];
+  }
+
+  *paKeys = aKeys;
+  *pnKeys = n;
+  return SQLITE_OK;
+}
+
+
+/*************************** Bitmap Reader **********************************/
+
+/** Open reader for the bitmaps of the bigram with key, positioned at the first
+ * id. Returns false, if there's no ids. */
+bool bitmapReaderOpen(bitmap_reader *pReader, trilite_vtab *pTrgVtab, sqlite3_int64 key){
+  pReader->pTrgVtab = pTrgVtab;
+  pReader->key      = key;
+  pReader->block    = SQLITE3_INT64_MIN;
+  pReader->nBitmap  = 0;
+  pReader->curId    = SQLITE3_INT64_MIN;
+  if(!fetchBitmap(pReader, SQLITE3_INT64_MIN))
+    return false;
+  return scanBitmaps(pReader, 0);
+}
+
+/** Move to the first id greater than or equal to id
+ * Returns false, if there's no such id */
+bool bitmapReaderSeek(bitmap_reader *pReader, sqlite3_int64 id){
+  if(id <= pReader->curId) return true;
+  sqlite3_int64 block = BITMAP_BLOCK(id);
+  int bit = BITMAP_BIT(id);
+  /* Fetch the first bitmap that may hold id, unless it's the current */
+  if(block != pReader->block){
+    if(!fetchBitmap(pReader, block))
+      return false;
+    if(pReader->block != block)
+      bit = 0;
+  }
+  return scanBitmaps(pReader, bit);
+}
+
+/** Fetch the first bitmap from block or later, returns false if none */
+static bool fetchBitmap(bitmap_reader *pReader, sqlite3_int64 block){
+  sqlite3_stmt *pStmt = pReader->pTrgVtab->stmt_fetch_bitmap;
+  sqlite3_bind_int64(pStmt, 1, pReader->key);
+  sqlite3_bind_int64(pStmt, 2, block);
+  bool found = sqlite3_step(pStmt) == SQLITE_ROW;
+  if(found){
+    pReader->block = sqlite3_column_int64(pStmt, 0);
+    const void *blob = sqlite3_column_blob(pStmt, 1);
+    pReader->nBitmap = MIN(sqlite3_column_bytes(pStmt, 1), (int)sizeof(pReader->bitmap));
+    memcpy(pReader->bitmap, blob, pReader->nBitmap);
+  }
+  sqlite3_reset(pStmt);
+  return found;
+}
+
+/** Move to the first set bit from bit in the current bitmap, or in the
+ * bitmaps following it. Returns false, if there's none */
+static bool scanBitmaps(bitmap_reader *pReader, int bit){
+  while(true){
+    for(; bit < pReader->nBitmap * BITSPERBYTE; bit++){
+      /* Skip bytes without bits */
+      if(bit % BITSPERBYTE == 0 && !pReader->bitmap[bit / BITSPERBYTE]){
+        bit += BITSPERBYTE - 1;
+        continue;
+      }
+      if(pReader->bitmap[bit / BITSPERBYTE] & (1 << (bit % BITSPERBYTE))){
+        pReader->curId = pReader->block * BIGRAM_BITMAP_IDS + bit;
+        return true;
+      }
+    }
+    if(!fetchBitmap(pReader, pReader->block + 1))
+      return false;
+    bit = 0;
+  }
+}
+
+/** Compare keys for sorting */
+static int compareKeys(const void *pKey1, const void *pKey2){
+  sqlite3_int64 k1 = *(const sqlite3_int64*)pKey1;
+  sqlite3_int64 k2 = *(const sqlite3_int64*)pKey2;
+  return (k1 > k2) - (k1 < k2);
+}
+
+/** Compare postings for sorting, by key then id */
+static int comparePostings(const void *pPosting1, const void *pPosting2){
+  const bigram_posting *p1 = (const bigram_posting*)pPosting1;
+  const bigram_posting *p2 = (const bigram_posting*)pPosting2;
+  if(p1->key != p2->key)
+    return (p1->key > p2->key) - (p1->key < p2->key);
+  return (p1->id > p2->id) - (p1->id < p2->id);
+}
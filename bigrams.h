@@ -0,0 +1,47 @@
+#ifndef TRILITE_BIGRAMS_H
+#define TRILITE_BIGRAMS_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+
+#include <stdbool.h>
+
+/** Reader for the bitmaps of a bigram in %_bigrams
+ * Only the current bitmap is held in memory, seeking beyond it fetches the
+ * first bitmap that may hold the id. */
+struct bitmap_reader{
+  /** Virtual table the bitmaps are read from */
+  trilite_vtab *pTrgVtab;
+
+  /** Key of the bigram, see BIGRAM_KEY */
+  sqlite3_int64 key;
+
+  /** Number of the current bitmap, ids divided by BIGRAM_BITMAP_IDS */
+  sqlite3_int64 block;
+
+  /** Current bitmap, trailing zero bytes aren't stored */
+  unsigned char bitmap[BIGRAM_BITMAP_IDS / BITSPERBYTE];
+
+  /** Size of bitmap in bytes */
+  int nBitmap;
+
+  /** Current id */
+  sqlite3_int64 curId;
+};
+
+int bigramsOpen(bigram_index**);
+void bigramsClose(bigram_index*);
+void bigramsReset(bigram_index*);
+int bigramsMemoryUsage(bigram_index*);
+int bigramsAddText(trilite_vtab*, sqlite3_int64, const unsigned char*, int);
+int bigramsUpdateText(trilite_vtab*, sqlite3_int64, const unsigned char*, int, const unsigned char*, int);
+int bigramsPending(trilite_vtab*, sqlite3_int64, sqlite3_int64**, int*);
+int bigramsFlush(trilite_vtab*);
+int bigramsRemap(trilite_vtab*, const sqlite3_int64*, const sqlite3_int64*, int);
+int bigramsKeys(trilite_vtab*, const unsigned char*, int, sqlite3_int64**, int*);
+
+bool bitmapReaderOpen(bitmap_reader*, trilite_vtab*, sqlite3_int64);
+bool bitmapReaderSeek(bitmap_reader*, sqlite3_int64);
+
+#endif /* TRILITE_BIGRAMS_H */
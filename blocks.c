@@ -0,0 +1,155 @@
+#include "blocks.h"
+#include "vtable.h"
+#include "varint.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX(a,b)    ((a) < (b) ? (b) : (a))
+#define MIN(a,b)    ((a) > (b) ? (b) : (a))
+
+static int compareTrigrams(const void*, const void*);
+static int comparePostings(const void*, const void*);
+
+/** Index text of a large document by blocks of DOCUMENT_BLOCK_SIZE bytes
+ * For each distinct trigram of the document a row is stored in %_blocks, with
+ * the blocks the trigram occurs in as varint deltas. A trigram belongs to the
+ * block it starts in. The document is still indexed as a whole, these rows
+ * are only used for verifying candidates, see blocksCandidates. */
+int blocksIndexText(trilite_vtab *pTrgVtab, sqlite3_int64 id, const unsigned char *zText, int nText){
+  int rc = SQLITE_OK;
+  int nTrigrams = nText - 2;
+  if(nTrigrams <= 0) return SQLITE_OK;
+  int nBlocks = (nTrigrams + DOCUMENT_BLOCK_SIZE - 1) / DOCUMENT_BLOCK_SIZE;
+
+  /* Distinct postings as trigram in the high 32 bits and block in the low */
+  uint64_t *postings = (uint64_t*)sqlite3_malloc(sizeof(uint64_t) * nTrigrams);
+  trilite_trigram *trigrams = (trilite_trigram*)sqlite3_malloc(sizeof(trilite_trigram) * DOCUMENT_BLOCK_SIZE);
+  unsigned char *buf = (unsigned char*)sqlite3_malloc(MAX_VARINT_SIZE * nBlocks);
+  if(!postings || !trigrams || !buf){
+    rc = SQLITE_NOMEM;
+    goto abort;
+  }
+
+  /* Find distinct trigrams of each block */
+  int nPostings = 0;
+  int iBlock, i;
+  for(iBlock = 0; iBlock < nBlocks; iBlock++){
+    int start = iBlock * DOCUMENT_BLOCK_SIZE;
+    int n = MIN(DOCUMENT_BLOCK_SIZE, nTrigrams - start);
+    for(i = 0; i < n; i++)
+      trigrams[i] = HASH_TRIGRAM(zText + start + i);
+    qsort(trigrams, n, sizeof(trilite_trigram), compareTrigrams);
+    for(i = 0; i < n; i++){
+      if(i > 0 && trigrams[i] == trigrams[i - 1]) continue;
+      postings[nPostings++] = ((uint64_t)trigrams[i] << 32) | (uint64_t)iBlock;
+    }
+  }
+
+  /* Group postings by trigram, blocks of a trigram stay in ascending order */
+  qsort(postings, nPostings, sizeof(uint64_t), comparePostings);
+
+  /* Store blocks of each trigram */
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_insert_blocks;
+  i = 0;
+  while(i < nPostings && rc == SQLITE_OK){
+    trilite_trigram trigram = (trilite_trigram)(postings[i] >> 32);
+    sqlite3_int64 prev = DELTA_LIST_OFFSET;
+    int nBuf = 0;
+    for(; i < nPostings && (trilite_trigram)(postings[i] >> 32) == trigram; i++){
+      sqlite3_int64 block = (sqlite3_int64)(postings[i] & 0xFFFFFFFF);
+      nBuf += writeVarInt(buf + nBuf, block - prev);
+      prev = block;
+    }
+    sqlite3_bind_int64(pStmt, 1, id);
+    sqlite3_bind_int64(pStmt, 2, trigram);
+    sqlite3_bind_blob(pStmt, 3, buf, nBuf, SQLITE_STATIC);
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+  }
+
+abort:
+  sqlite3_free(postings);
+  sqlite3_free(trigrams);
+  sqlite3_free(buf);
+  return rc;
+}
+
+/** Find blocks of document id, where an occurrence of pattern may start
+ * The document is nText bytes, and pattern must have at least one trigram.
+ * A block is a candidate, if every trigram of pattern occurs in a block it can
+ * be in, when the pattern starts in the candidate block. Candidate blocks are
+ * output in ascending order as *paBlocks, allocated with sqlite3_malloc, and
+ * the number of blocks as *pnBlocks. */
+int blocksCandidates(trilite_vtab *pTrgVtab, sqlite3_int64 id, int nText, const unsigned char *pattern,
+                     int nPattern, int **paBlocks, int *pnBlocks){
+  int rc = SQLITE_OK;
+  int nBlocks = (nText + DOCUMENT_BLOCK_SIZE - 1) / DOCUMENT_BLOCK_SIZE;
+  assert(nPattern >= 3);
+  *paBlocks = NULL;
+  *pnBlocks = 0;
+
+  /* Candidate flag of each block, followed by flags for the current trigram */
+  unsigned char *candidate = (unsigned char*)sqlite3_malloc(nBlocks * 2);
+  if(!candidate) return SQLITE_NOMEM;
+  unsigned char *present = candidate + nBlocks;
+  memset(candidate, 1, nBlocks);
+
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_blocks;
+  int i, b;
+  for(i = 0; i < nPattern - 2 && rc == SQLITE_OK; i++){
+    /* Trigram i in block b, implies that pattern starts from b - span to b */
+    int span = (i + DOCUMENT_BLOCK_SIZE - 1) / DOCUMENT_BLOCK_SIZE;
+    memset(present, 0, nBlocks);
+    sqlite3_bind_int64(pStmt, 1, id);
+    sqlite3_bind_int64(pStmt, 2, HASH_TRIGRAM(pattern + i));
+    if(sqlite3_step(pStmt) == SQLITE_ROW){
+      const unsigned char *pBuf = (const unsigned char*)sqlite3_column_blob(pStmt, 0);
+      const unsigned char *pEnd = pBuf + sqlite3_column_bytes(pStmt, 0);
+      sqlite3_int64 block = DELTA_LIST_OFFSET;
+      while(pBuf < pEnd){
+        sqlite3_int64 delta;
+        pBuf += readVarInt((unsigned char*)pBuf, &delta);
+        block += delta;
+        for(b = MAX(0, (int)block - span); b <= (int)block && b < nBlocks; b++)
+          present[b] = 1;
+      }
+    }
+    rc = sqlite3_reset(pStmt);
+    for(b = 0; b < nBlocks; b++)
+      candidate[b] &= present[b];
+  }
+
+  /* Output candidate blocks */
+  int nCandidates = 0;
+  for(b = 0; b < nBlocks; b++)
+    nCandidates += candidate[b];
+  if(rc == SQLITE_OK && nCandidates > 0){
+    *paBlocks = (int*)sqlite3_malloc(sizeof(int) * nCandidates);
+    if(!*paBlocks) rc = SQLITE_NOMEM;
+  }
+  if(rc == SQLITE_OK){
+    for(b = 0; b < nBlocks; b++)
+      if(candidate[b])
+        (*paBlocks)[(*pnBlocks)++] = b;
+  }
+  sqlite3_free(candidate);
+  return rc;
+}
+
+/** Compare trigrams for qsort */
+static int compareTrigrams(const void *pA, const void *pB){
+  trilite_trigram a = *(const trilite_trigram*)pA;
+  trilite_trigram b = *(const trilite_trigram*)pB;
+  return a < b ? -1 : a > b;
+}
+
+/** Compare postings for qsort */
+static int comparePostings(const void *pA, const void *pB){
+  uint64_t a = *(const uint64_t*)pA;
+  uint64_t b = *(const uint64_t*)pB;
+  return a < b ? -1 : a > b;
+}
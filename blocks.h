@@ -0,0 +1,11 @@
+#ifndef TRILITE_BLOCKS_H
+#define TRILITE_BLOCKS_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+
+int blocksIndexText(trilite_vtab*, sqlite3_int64, const unsigned char*, int);
+int blocksCandidates(trilite_vtab*, sqlite3_int64, int, const unsigned char*, int, int**, int*);
+
+#endif /* TRILITE_BLOCKS_H */
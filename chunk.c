@@ -0,0 +1,214 @@
+#include "chunk.h"
+#include "vtable.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+static bool fetchChunk(chunk_reader*, sqlite3_stmt*);
+static int storeChunk(chunk_writer*);
+
+/*************************** Chunk Reader ***********************************/
+
+/** Open reader for doclist with key, positioned at the first id
+ * Returns false, if there's no such doclist or pReader->rc holds an error. The
+ * reader must be released with chunkReaderRelease either way. */
+bool chunkReaderOpen(chunk_reader *pReader, trilite_vtab *pTrgVtab, sqlite3_int64 key){
+  pReader->pTrgVtab = pTrgVtab;
+  pReader->key      = key;
+  pReader->chunkId  = SQLITE3_INT64_MIN;
+  pReader->chunk    = NULL;
+  pReader->nChunk   = 0;
+  pReader->nAlloc   = 0;
+  pReader->sealed   = false;
+  pReader->rc       = SQLITE_OK;
+
+  /* Tables from before chunks have the entire doclist in %_index */
+  if(pTrgVtab->formatVersion < 3){
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_doclist;
+    sqlite3_bind_int64(pStmt, 1, key);
+    return fetchChunk(pReader, pStmt);
+  }
+  return chunkReaderNextChunk(pReader);
+}
+
+/** Open reader for a doclist of a sealed index in format version iVersion,
+ * positioned at the first id. The doclist is read in place, without copying.
+ * Returns false, if the doclist is empty. */
+bool chunkReaderOpenSealed(chunk_reader *pReader, trilite_vtab *pTrgVtab, const unsigned char *docList, int nDocList, int iVersion){
+  pReader->pTrgVtab = pTrgVtab;
+  pReader->key      = -1;
+  pReader->chunkId  = SQLITE3_INT64_MIN;
+  pReader->chunk    = (unsigned char*)docList;
+  pReader->nChunk   = nDocList;
+  pReader->nAlloc   = 0;
+  pReader->sealed   = true;
+  pReader->rc       = SQLITE_OK;
+  return docListReaderInit(&pReader->reader, docList, nDocList, iVersion);
+}
+
+/** Move to the next id, returns false if there's no more ids */
+bool chunkReaderAdvance(chunk_reader *pReader){
+  if(docListAdvance(&pReader->reader))
+    return true;
+  return chunkReaderNextChunk(pReader);
+}
+
+/** Move to the first id greater than or equal to id
+ * Returns false, if there's no such id */
+bool chunkReaderSeek(chunk_reader *pReader, sqlite3_int64 id){
+  if(docListSeek(&pReader->reader, id))
+    return true;
+  if(pReader->pTrgVtab->formatVersion < 3 || pReader->sealed)
+    return false;
+
+  /* Fetch the last chunk starting at or before id, if it's after this one */
+  sqlite3_stmt *pStmt = pReader->pTrgVtab->stmt_seek_chunk;
+  sqlite3_bind_int64(pStmt, 1, pReader->key);
+  sqlite3_bind_int64(pStmt, 2, pReader->chunkId);
+  sqlite3_bind_int64(pStmt, 3, id);
+  if(fetchChunk(pReader, pStmt) && docListSeek(&pReader->reader, id))
+    return true;
+
+  /* Otherwise, all ids from the next chunk are greater than id */
+  return chunkReaderNextChunk(pReader);
+}
+
+/** Move to the first id of the next chunk
+ * Returns false, if there's no more chunks */
+bool chunkReaderNextChunk(chunk_reader *pReader){
+  if(pReader->pTrgVtab->formatVersion < 3 || pReader->sealed)
+    return false;
+  sqlite3_stmt *pStmt = pReader->pTrgVtab->stmt_fetch_chunk;
+  sqlite3_bind_int64(pStmt, 1, pReader->key);
+  sqlite3_bind_int64(pStmt, 2, pReader->chunkId);
+  return fetchChunk(pReader, pStmt);
+}
+
+/** Release resources held by reader */
+void chunkReaderRelease(chunk_reader *pReader){
+  if(!pReader->sealed)
+    sqlite3_free(pReader->chunk);
+  pReader->chunk  = NULL;
+  pReader->nChunk = 0;
+  pReader->nAlloc = 0;
+}
+
+/** Find the last id of doclist with key, outputs DELTA_LIST_OFFSET as *pLastId
+ * if there's no such doclist */
+int chunkLastId(trilite_vtab *pTrgVtab, sqlite3_int64 key, sqlite3_int64 *pLastId){
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_last_chunk;
+  *pLastId = DELTA_LIST_OFFSET;
+  sqlite3_bind_int64(pStmt, 1, key);
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    *pLastId = docListLastId((const unsigned char*)sqlite3_column_blob(pStmt, 0),
+                             sqlite3_column_bytes(pStmt, 0),
+                             pTrgVtab->formatVersion);
+  }
+  return sqlite3_reset(pStmt);
+}
+
+/** Fetch chunk selected by pStmt, which must be bound, selecting first id and
+ * doclist, or just doclist for tables from before chunks.
+ * Returns false, if no chunk was found, errors are left in pReader->rc */
+static bool fetchChunk(chunk_reader *pReader, sqlite3_stmt *pStmt){
+  bool found = false;
+  if(pReader->rc != SQLITE_OK){
+    sqlite3_reset(pStmt);
+    return false;
+  }
+  int rc = sqlite3_step(pStmt);
+  if(rc == SQLITE_ROW){
+    rc = SQLITE_OK;
+    int iCol = sqlite3_column_count(pStmt) - 1;
+    int nChunk = sqlite3_column_bytes(pStmt, iCol);
+    /* Grow buffer if needed, chunks are small so we keep the buffer */
+    if(nChunk > pReader->nAlloc){
+      unsigned char *chunk = (unsigned char*)sqlite3_realloc(pReader->chunk, nChunk);
+      if(chunk){
+        pReader->chunk  = chunk;
+        pReader->nAlloc = nChunk;
+      }else
+        rc = SQLITE_NOMEM;
+    }
+    if(rc == SQLITE_OK){
+      memcpy(pReader->chunk, sqlite3_column_blob(pStmt, iCol), nChunk);
+      pReader->nChunk = nChunk;
+      if(iCol > 0)
+        pReader->chunkId = sqlite3_column_int64(pStmt, 0);
+      found = docListReaderInit(&pReader->reader, pReader->chunk, nChunk,
+                                pReader->pTrgVtab->formatVersion);
+    }
+  }else if(rc == SQLITE_DONE)
+    rc = SQLITE_OK;
+  int rc2 = sqlite3_reset(pStmt);
+  pReader->rc = rc != SQLITE_OK ? rc : rc2;
+  return found && pReader->rc == SQLITE_OK;
+}
+
+/*************************** Chunk Writer ***********************************/
+
+/** Initialize writer for doclist with key */
+void chunkWriterInit(chunk_writer *pWriter, trilite_vtab *pTrgVtab, sqlite3_int64 key){
+  pWriter->pTrgVtab = pTrgVtab;
+  pWriter->key      = key;
+  pWriter->chunkId  = 0;
+  pWriter->nWritten = 0;
+  docListWriterInit(&pWriter->writer);
+}
+
+/** Add id with masks to doclist, id must be greater than any id previously added */
+int chunkWriterAdd(chunk_writer *pWriter, sqlite3_int64 id, trilite_masks masks){
+  if(pWriter->writer.nSize == 0 && pWriter->writer.nIds == 0)
+    pWriter->chunkId = id;
+  int rc = docListWriterAdd(&pWriter->writer, id, masks);
+  if(rc == SQLITE_OK && pWriter->writer.nSize >= DOCLIST_CHUNK_SIZE)
+    rc = storeChunk(pWriter);
+  return rc;
+}
+
+/** Append a chunk starting with chunkId, its ids must be greater than any id
+ * previously added. The chunk is appended without decoding it. */
+int chunkWriterAppend(chunk_writer *pWriter, const unsigned char *chunk, int nChunk, sqlite3_int64 chunkId){
+  if(pWriter->writer.nSize == 0 && pWriter->writer.nIds == 0)
+    pWriter->chunkId = chunkId;
+  int rc = docListWriterAppend(&pWriter->writer, chunk, nChunk, pWriter->pTrgVtab->formatVersion);
+  if(rc == SQLITE_OK && pWriter->writer.nSize >= DOCLIST_CHUNK_SIZE)
+    rc = storeChunk(pWriter);
+  return rc;
+}
+
+/** Store the pending chunk, if any, and release the writer */
+int chunkWriterFinish(chunk_writer *pWriter){
+  int rc = SQLITE_OK;
+  if(pWriter->writer.nSize > 0 || pWriter->writer.nIds > 0)
+    rc = storeChunk(pWriter);
+  chunkWriterRelease(pWriter);
+  return rc;
+}
+
+/** Release resources held by writer */
+void chunkWriterRelease(chunk_writer *pWriter){
+  docListWriterRelease(&pWriter->writer);
+}
+
+/** Store pending chunk and start a new one */
+static int storeChunk(chunk_writer *pWriter){
+  sqlite3_stmt *pStmt = pWriter->pTrgVtab->stmt_insert_chunk;
+  unsigned char *chunk;
+  int nChunk;
+  int rc;
+
+  rc = docListWriterFinish(&pWriter->writer, &chunk, &nChunk);
+  if(rc != SQLITE_OK) return rc;
+  docListWriterInit(&pWriter->writer);
+
+  sqlite3_bind_int64(pStmt, 1, pWriter->key);
+  sqlite3_bind_int64(pStmt, 2, pWriter->chunkId);
+  sqlite3_bind_blob(pStmt, 3, chunk, nChunk, sqlite3_free);
+  sqlite3_step(pStmt);
+  rc = sqlite3_reset(pStmt);
+  pWriter->nWritten += nChunk;
+  return rc;
+}
@@ -0,0 +1,84 @@
+#ifndef TRILITE_CHUNK_H
+#define TRILITE_CHUNK_H
+
+#include "config.h"
+#include "doclist.h"
+
+#include <sqlite3ext.h>
+
+#include <stdbool.h>
+
+/** Reader for a doclist stored as chunks in %_chunks
+ * Each chunk is a doclist of its own, keyed by the doclist key and the first id
+ * of the chunk. Only the current chunk is held in memory, and seeking beyond it
+ * fetches the chunk that may hold the id, without reading the chunks between.
+ *
+ * Tables from before format version 3 have the entire doclist in %_index, it's
+ * read as a single chunk. So are doclists of a sealed index, which are read in
+ * place, see seal.c
+ */
+struct chunk_reader{
+  /** Virtual table the doclist is read from */
+  trilite_vtab *pTrgVtab;
+
+  /** Key of the doclist, see SEGMENT_KEY */
+  sqlite3_int64 key;
+
+  /** First id of the current chunk */
+  sqlite3_int64 chunkId;
+
+  /** Current chunk, allocated with sqlite3_malloc */
+  unsigned char *chunk;
+
+  /** Size of chunk in bytes */
+  int nChunk;
+
+  /** Number of bytes allocated for chunk */
+  int nAlloc;
+
+  /** Chunk is the entire doclist, held in place by a sealed index, rather
+   * than allocated by the reader */
+  bool sealed;
+
+  /** Reader for the current chunk, the current id is reader.curId */
+  doclist_reader reader;
+
+  /** Error from fetching chunks, the reader has no more ids after an error,
+   * so readers must check this when they reach the end */
+  int rc;
+};
+
+/** Writer for storing a doclist as chunks in %_chunks
+ * A chunk is stored when it exceeds DOCLIST_CHUNK_SIZE. */
+struct chunk_writer{
+  /** Virtual table the doclist is written to */
+  trilite_vtab *pTrgVtab;
+
+  /** Key of the doclist, see SEGMENT_KEY */
+  sqlite3_int64 key;
+
+  /** First id of the pending chunk */
+  sqlite3_int64 chunkId;
+
+  /** Number of bytes stored so far */
+  sqlite3_int64 nWritten;
+
+  /** Writer for the pending chunk */
+  doclist_writer writer;
+};
+
+bool chunkReaderOpen(chunk_reader*, trilite_vtab*, sqlite3_int64);
+bool chunkReaderOpenSealed(chunk_reader*, trilite_vtab*, const unsigned char*, int, int);
+bool chunkReaderAdvance(chunk_reader*);
+bool chunkReaderSeek(chunk_reader*, sqlite3_int64);
+bool chunkReaderNextChunk(chunk_reader*);
+void chunkReaderRelease(chunk_reader*);
+int chunkLastId(trilite_vtab*, sqlite3_int64, sqlite3_int64*);
+
+void chunkWriterInit(chunk_writer*, trilite_vtab*, sqlite3_int64);
+int chunkWriterAdd(chunk_writer*, sqlite3_int64, trilite_masks);
+int chunkWriterAppend(chunk_writer*, const unsigned char*, int, sqlite3_int64);
+int chunkWriterFinish(chunk_writer*);
+void chunkWriterRelease(chunk_writer*);
+
+#endif /* TRILITE_CHUNK_H */
@@ -30,6 +30,34 @@ typedef uint32_t trilite_trigram;
 /** Really stupid case folding */
 #define LOWER(a)          ('A' <= a && a <= 'Z' ? a + 'a' - 'A' : a)
 
+/** Type for posting masks, stored with each id in a doclist
+ * The low byte is a mask of hashes of the bytes following the trigram in the
+ * document, and the high byte a mask of byte offsets of the trigram modulo 8,
+ * from the start of its line in tables with line positions.
+ * They allow us to reject documents where the trigrams of a substring can't be
+ * adjacent, without fetching the document. */
+typedef uint16_t trilite_masks;
+
+/** Masks matching anything, for postings where masks are unknown */
+#define MASKS_ALL                           ((trilite_masks)0xFFFF)
+
+/** Next-character mask for byte c following a trigram */
+#define MASK_NEXT(c)        ((trilite_masks)(1 << ((LOWER(c) ^ (LOWER(c) >> 3)) & 7)))
+
+/** Next-character mask for folded codepoint cp following a trigram, matches
+ * MASK_NEXT for ASCII */
+#define MASK_NEXT_CODEPOINT(cp) ((trilite_masks)(1 << (((cp) ^ ((cp) >> 3)) & 7)))
+
+/** Position mask for a trigram at byte offset pos, or codepoint offset with
+ * the utf8 option */
+#define MASK_POS(pos)       ((trilite_masks)(1 << (8 + ((pos) & 7))))
+
+/** Next-character bits of masks */
+#define MASK_NEXT_BITS(masks)   ((masks) & 0xFF)
+
+/** Position bits of masks */
+#define MASK_POS_BITS(masks)    (((masks) >> 8) & 0xFF)
+
 /** Compute a unique 32 bit hash of a trigram
  * We use this hash as rowid for the document lists.
  */
@@ -37,6 +65,76 @@ typedef uint32_t trilite_trigram;
                             | (((trilite_trigram)LOWER((str)[1])) << BITSPERBYTE)     \
                             | (((trilite_trigram)LOWER((str)[2])) << (BITSPERBYTE*2)) )
 
+/** Flag of exact-case trigrams, indexed next to the folded ones with the
+ * exactcase option. Exact-case trigrams sort after all folded trigrams. */
+#define TRIGRAM_EXACT       ((trilite_trigram)1 << (BITSPERBYTE*3))
+
+/** Flag of keys hashed from grams of more than three bytes, codepoint trigrams
+ * of the utf8 option and sparse grams of the sparse option. Hashed keys may
+ * collide, that only adds candidates. */
+#define TRIGRAM_HASHED      ((trilite_trigram)1 << 31)
+
+/** Compute the key of an exact-case trigram, the bytes of the trigram without
+ * case folding, and TRIGRAM_EXACT */
+#define HASH_EXACT_TRIGRAM(str) ( (((trilite_trigram)(str)[0]))                    \
+                                | (((trilite_trigram)(str)[1]) << BITSPERBYTE)     \
+                                | (((trilite_trigram)(str)[2]) << (BITSPERBYTE*2)) \
+                                | TRIGRAM_EXACT )
+
+
+/** Key of the bigram of folded characters a and b in %_bigrams, bytes or
+ * codepoints with the utf8 option. A single character is keyed with
+ * b = BIGRAM_NONE, so substrings of one character can use the index too */
+#define BIGRAM_KEY(a, b)    ((((sqlite3_int64)(a)) << 22) | ((sqlite3_int64)(b)))
+
+/** Second character of the key of a single character, see BIGRAM_KEY */
+#define BIGRAM_NONE         (1 << 21)
+
+/** Number of bits of the ids in a bitmap of %_bigrams, each bitmap covers
+ * 1 << BIGRAM_BITMAP_BITS consecutive ids, see bigrams.c */
+#define BIGRAM_BITMAP_BITS                  12
+
+/** Number of ids covered by a bitmap of %_bigrams */
+#define BIGRAM_BITMAP_IDS                   (1 << BIGRAM_BITMAP_BITS)
+
+/** Number of ids covered by a bitmap of tombstones of deleted documents in
+ * %_deleted, see tombstone.c */
+#define TOMBSTONE_BITMAP_IDS                (1 << 12)
+
+/** Reserved characters marking the document, line and word boundaries in
+ * boundary grams, see the anchors option. Grams are not given next-character
+ * masks for them, as they aren't in the text. */
+#define BOUNDARY_DOCUMENT   0x01
+#define BOUNDARY_LINE       0x02
+#define BOUNDARY_WORD       0x03
+
+/** True if character c is a boundary marker */
+#define IS_BOUNDARY(c)      ((c) >= BOUNDARY_DOCUMENT && (c) <= BOUNDARY_WORD)
+
+/** True if character c is a word character, ASCII letters, digits and
+ * underscore, as for \b in regular expressions */
+#define IS_WORD_CHAR(c)     (  ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z')   \
+                            || ((c) >= '0' && (c) <= '9') || (c) == '_')
+
+/** Shortest and longest grams hashed into the signature of a document, see
+ * the signature option and signature.c */
+#define SIGNATURE_MIN_GRAM                  4
+#define SIGNATURE_MAX_GRAM                  5
+
+/** Number of bits set in a signature for each gram */
+#define SIGNATURE_HASHES                    3
+
+/** Largest signature in bytes with the signature option */
+#define MAX_SIGNATURE_SIZE                  (64 * 1024)
+
+/** Maximum number of grams of a query tested against each signature */
+#define SIGNATURE_MAX_PROBES                64
+
+/** Default number of characters in trigrams, see the gram option */
+#define DEFAULT_GRAM_SIZE                   3
+
+/** Largest number of characters in trigrams with the gram option */
+#define MAX_GRAM_SIZE                       8
 
 /** Maximum value of an sqlite3_int64 */
 #define SQLITE3_INT64_MAX                   (  (sqlite3_int64)0x7FFFFFFFFFFFFFFF)
@@ -44,6 +142,82 @@ typedef uint32_t trilite_trigram;
 
 #define DELTA_LIST_OFFSET                   0
 
+/** Version of the on-disk format, stored in %_config
+ * Tables without %_config are in the legacy format (version 0), where each
+ * doclist is a flat list of varint deltas. Legacy tables can be queried as is,
+ * and are upgraded to the current format on the first write. From version 5
+ * ids may be mapped to document ids through %_docids, see optimize.c, and from
+ * version 6 doclists may hold ids of deleted documents, see tombstone.c */
+#define TRILITE_FORMAT_VERSION              6
+
+/** Number of ids per doclist block
+ * Each block has a header with first and last id, so that iterators can skip
+ * entire blocks when intersecting doclists. */
+#define DOCLIST_BLOCK_SIZE                  128
+
+/** Size in bytes at which a doclist chunk is stored, and a new chunk started
+ * Chunks are stored as rows of %_chunks keyed by their first id, so readers
+ * only fetch the chunks they need. Chunks appended while merging may be up to
+ * twice this size. */
+#define DOCLIST_CHUNK_SIZE                  2048
+
+/** Largest trigram value */
+#define TRIGRAM_MAX                         ((trilite_trigram)0xFFFFFFFF)
+
+/** Key of a doclist, segment in the high 32 bits, trigram in the low
+ * Doclists of segment 0 are keyed by trigram, as in tables from before segments
+ * were introduced (format version 1 and older). */
+#define SEGMENT_KEY(segment, trigram)       ( (((sqlite3_int64)(segment)) << 32)       \
+                                            | ((sqlite3_int64)(trigram)) )
+
+/** Trigram of a doclist key */
+#define KEY_TRIGRAM(key)                    ((trilite_trigram)((key) & 0xFFFFFFFF))
+
+/** Number of segments of a level merged into a segment of the next level */
+#define MERGE_FANIN                         4
+
+/** Bytes of merge work done per byte flushed to a new segment */
+#define MERGE_WORK_FACTOR                   4
+
+/** Maximum number of segments, before flushes complete all pending merges */
+#define MAX_SEGMENTS                        32
+
+/** Size of level 0 segments in bytes, only used to assign a level to segments
+ * converted from older format versions */
+#define MERGE_LEVEL_SIZE                    (256 * 1024)
+
+/** Size in bytes of the blocks large documents are indexed by
+ * Documents larger than the largedoc option are also indexed by blocks, so
+ * matching substrings only scans blocks that may hold the substring. */
+#define DOCUMENT_BLOCK_SIZE                 4096
+
+/** Size in bytes at which a block of the content store is compressed and
+ * written, and a new block started, see store.c */
+#define CONTENT_BLOCK_SIZE                  (64 * 1024)
+
+/** Maximum size of the dictionary blocks of the content store are compressed
+ * with */
+#define CONTENT_DICT_SIZE                   (16 * 1024)
+
+/** Number of decompressed blocks cached by the content store */
+#define CONTENT_CACHE_BLOCKS                4
+
+/** Number of hashes in the MinHash signature documents are clustered by, when
+ * reassigning document ids, see optimize.c */
+#define OPTIMIZE_SIGNATURE_SIZE             4
+
+/** Minimum number of documents before trigrams can be stop trigrams, so small
+ * tables don't have their most common trigrams dropped, see stop.c */
+#define STOP_MIN_DOCUMENTS                  1000
+
+/** Offset of the trigram directory in a sealed index, see seal.c
+ * The header and list of sealed segments must fit before it. */
+#define SEALED_DIRECTORY_OFFSET             4096
+
+/** Number of entries in the trigram directory of a sealed index, one for each
+ * folded byte trigram, larger trigrams are not sealed */
+#define SEALED_DIRECTORY_ENTRIES            (1 << 24)
+
 /** Use scanstr over KMP for substring matching
  * scanstr is better on PCs with a modern CPU, KMP is probably only relevant for
  * embedded system with non-pipelined CPUs. */
@@ -86,6 +260,23 @@ typedef struct hash_table_cursor hash_table_cursor;
 
 typedef struct expr expr;
 
+typedef struct doclist_reader doclist_reader;
+typedef struct doclist_writer doclist_writer;
+
+typedef struct chunk_reader chunk_reader;
+typedef struct chunk_writer chunk_writer;
+
 typedef struct regexp regexp;
 
+typedef struct content_store content_store;
+
+typedef struct sealed_index sealed_index;
+
+typedef struct bigram_index bigram_index;
+typedef struct bitmap_reader bitmap_reader;
+
+typedef struct tombstone_set tombstone_set;
+typedef struct tombstone_change tombstone_change;
+typedef struct tombstone_reader tombstone_reader;
+
 #endif /* TRILITE_CONFIG_H */
@@ -3,6 +3,14 @@
 #include "config.h"
 #include "varint.h"
 #include "expr.h"
+#include "segment.h"
+#include "blocks.h"
+#include "store.h"
+#include "seal.h"
+#include "always.h"
+#include "signature.h"
+#include "tombstone.h"
+#include "stop.h"
 
 const sqlite3_api_routines *sqlite3_api;
 
@@ -17,6 +25,7 @@ const sqlite3_api_routines *sqlite3_api;
 typedef struct doclist doclist;
 
 static int resetCursor(trilite_cursor *pTrgCur);
+static bool nextCandidate(trilite_cursor *pTrgCur, sqlite3_int64 *pId, int *pRc);
 
 
 /** Trigram cursor */
@@ -36,6 +45,37 @@ struct trilite_cursor{
   /** Expression begin evaluated */
   expr *pExpr;
 
+  /** Document ids of always-candidates in ascending order, merged with results
+   * of pExpr in a match scan, see always.c */
+  sqlite3_int64 *aAlways;
+
+  /** Number of always-candidates */
+  int nAlways;
+
+  /** Index of the next always-candidate in aAlways */
+  int iAlways;
+
+  /** Tombstones of deleted documents, skipped in a match scan, see
+   * tombstone.c */
+  tombstone_reader tombstones;
+
+  /** Next result of pExpr, if hasExprId is true */
+  sqlite3_int64 exprId;
+
+  /** True, if exprId holds a result not yet returned */
+  bool hasExprId;
+
+  /** Hashes of grams candidates must have in their signature, see
+   * signature.c */
+  uint64_t *aProbes;
+
+  /** Number of hashes in aProbes */
+  int nProbes;
+
+  /** Blob handle on %_signatures, moved from candidate to candidate, NULL
+   * until needed */
+  sqlite3_blob *pSignature;
+
   /** Extents recorded by triliteAddExtents */
   uint32_t* extents;
 
@@ -45,7 +85,7 @@ struct trilite_cursor{
   /** Number of extents recorded */
   int nExtents;
 
-  /** Fetch a row, holds the current row */
+  /** Fetch a row, holds the current row as id, text and document id */
   sqlite3_stmt *stmt_fetch_content;
 };
 
@@ -68,6 +108,21 @@ int triliteOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCur){
   /* Set expr NULL */
   pTrgCur->pExpr = NULL;
 
+  /* Set always-candidates NULL */
+  pTrgCur->aAlways = NULL;
+  pTrgCur->nAlways = 0;
+  pTrgCur->iAlways = 0;
+  pTrgCur->hasExprId = false;
+
+  /* Set tombstones NULL */
+  pTrgCur->tombstones.aPending = NULL;
+  pTrgCur->tombstones.nPending = 0;
+
+  /* Set signature probes and handle NULL */
+  pTrgCur->aProbes = NULL;
+  pTrgCur->nProbes = 0;
+  pTrgCur->pSignature = NULL;
+
   /* Set extents NULL */
   pTrgCur->extents = NULL;
   pTrgCur->nExtents = 0;
@@ -118,15 +173,34 @@ int triliteFilter(sqlite3_vtab_cursor *pCur, int idxNum, const char* zIdx, int a
     /* Get the pattern */
     /*TODO What happens if this is not a text value? */
 
+    /* Load segments to read doclists from */
+    rc = segmentLoad(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+    sealValidate(pTrgVtab);
+
+    /* Stop trigrams may have changed with the segments, by another connection
+     * optimizing the index */
+    rc = stopLoad(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+
+    /* Documents not indexed by trigrams are candidates for any query */
+    rc = alwaysLoad(pTrgVtab, &pTrgCur->aAlways, &pTrgCur->nAlways);
+    if(rc != SQLITE_OK) return rc;
+
+    /* Deleted documents may still be in doclists */
+    rc = tombstoneReaderOpen(&pTrgCur->tombstones, pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+
     /* Parse query */
-    bool all;
-    rc = exprParsePatterns(&pTrgCur->pExpr, &all, pTrgVtab, argc, argv);
+    bool all, stopAll = false;
+    rc = exprParsePatterns(&pTrgCur->pExpr, &all, &stopAll, pTrgVtab, argc, argv);
     /* Appropriate error should be reported by exprParse and friends */
     if(rc != SQLITE_OK) return rc;
 
     /* We didn't get any expression, because it matches all (ie. no filtering) */
     if(!pTrgCur->pExpr && all){
-      if(pTrgVtab->forbidFullMatchScan){
+      /* Substrings of stop trigrams are common, scanning is all we can do */
+      if(pTrgVtab->forbidFullMatchScan && !stopAll){
         triliteError(pTrgVtab, "QUERY: Search query cannot be accelerated, include longer required substrings!");
         return SQLITE_ERROR;
       }
@@ -135,12 +209,23 @@ int triliteFilter(sqlite3_vtab_cursor *pCur, int idxNum, const char* zIdx, int a
       pTrgCur->idxNum = (idxNum & ~IDX_MATCH_SCAN) | IDX_FULL_SCAN;
       idxNum = pTrgCur->idxNum;
     }else{
-      /* Prepare statement for triliteNext */
-      zSql = sqlite3_mprintf("SELECT id, text FROM %Q.'%q_content' WHERE id = ?", pTrgVtab->zDb, pTrgVtab->zName);
+      /* Prepare statement for triliteNext, selecting by document id */
+      if(pTrgVtab->mapIds){
+        zSql = sqlite3_mprintf("SELECT m.id, c.text, c.id FROM %Q.'%q_content' c, %Q.'%q_docids' m"
+                               " WHERE c.id = ? AND m.docid = c.id",
+                               pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->zDb, pTrgVtab->zName);
+      }else
+        zSql = sqlite3_mprintf("SELECT id, text, id FROM %Q.'%q_content' WHERE id = ?", pTrgVtab->zDb, pTrgVtab->zName);
       if(!zSql) return SQLITE_NOMEM;
       rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgCur->stmt_fetch_content, 0);
       sqlite3_free(zSql);
       assert(rc == SQLITE_OK);
+
+      /* Grams candidates must have, tested before their text is fetched */
+      if(pTrgVtab->signatureSize > 0){
+        rc = signatureProbes(pTrgVtab, argc, argv, &pTrgCur->aProbes, &pTrgCur->nProbes);
+        if(rc != SQLITE_OK) return rc;
+      }
     }
     trilite_log("Expr and sql ready!");
   }
@@ -148,21 +233,28 @@ int triliteFilter(sqlite3_vtab_cursor *pCur, int idxNum, const char* zIdx, int a
   /* Full table scan */
   if(idxNum & IDX_FULL_SCAN){
     trilite_log("Starting a full index scan");
+    /* Mapped ids are ordered by %_docids */
+    if(pTrgVtab->mapIds){
+      zSql = "SELECT m.id, c.text, c.id FROM %Q.'%q_content' c, %Q.'%q_docids' m WHERE m.docid = c.id";
+      if(idxNum & ORDER_BY_DESC)
+        zSql = "SELECT m.id, c.text, c.id FROM %Q.'%q_docids' m, %Q.'%q_content' c WHERE c.id = m.docid order by m.id DESC";
+      else if(idxNum & ORDER_BY_ASC)
+        zSql = "SELECT m.id, c.text, c.id FROM %Q.'%q_docids' m, %Q.'%q_content' c WHERE c.id = m.docid order by m.id ASC";
     /* Statement for descending ordering */
-    if(idxNum & ORDER_BY_DESC){
-      zSql = "SELECT id, text FROM %Q.'%q_content' order by id DESC";
+    }else if(idxNum & ORDER_BY_DESC){
+      zSql = "SELECT id, text, id FROM %Q.'%q_content' order by id DESC";
     /* Statement for ascending ordering */
     }else if(idxNum & ORDER_BY_ASC){
-      zSql = "SELECT id, text FROM %Q.'%q_content' order by id ASC";
+      zSql = "SELECT id, text, id FROM %Q.'%q_content' order by id ASC";
     /* Statement without ordering (if there's no requirement, let's not pass any along) */
     }else{
-      zSql = "SELECT id, text FROM %Q.'%q_content'";
+      zSql = "SELECT id, text, id FROM %Q.'%q_content'";
     }
     
     trilite_log("IDX_FULL_SCAN with '%s'", zSql);
     
-    /* Add database and table prefix */
-    zSql = sqlite3_mprintf(zSql, pTrgVtab->zDb, pTrgVtab->zName);
+    /* Add database and table prefix, twice for mapped ids */
+    zSql = sqlite3_mprintf(zSql, pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->zDb, pTrgVtab->zName);
     if(!zSql) return SQLITE_NOMEM;
     /* Prepare statement */
     rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgCur->stmt_fetch_content, 0);
@@ -175,8 +267,13 @@ int triliteFilter(sqlite3_vtab_cursor *pCur, int idxNum, const char* zIdx, int a
   /* Simple rowid lookup */
   if(idxNum & IDX_ROW_LOOKUP){
     assert(argc == 1);
-    /* Select row from %_content */
-    zSql = sqlite3_mprintf("SELECT id, text FROM %Q.'%q_content' WHERE id = ?", pTrgVtab->zDb, pTrgVtab->zName);
+    /* Select row from %_content, by id */
+    if(pTrgVtab->mapIds){
+      zSql = sqlite3_mprintf("SELECT m.id, c.text, c.id FROM %Q.'%q_docids' m, %Q.'%q_content' c"
+                             " WHERE m.id = ? AND c.id = m.docid",
+                             pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->zDb, pTrgVtab->zName);
+    }else
+      zSql = sqlite3_mprintf("SELECT id, text, id FROM %Q.'%q_content' WHERE id = ?", pTrgVtab->zDb, pTrgVtab->zName);
     if(!zSql) return SQLITE_NOMEM;
     /* Prepare statement */
     rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgCur->stmt_fetch_content, 0);
@@ -204,6 +301,23 @@ static int resetCursor(trilite_cursor *pTrgCur){
   if(pTrgCur->pExpr)
     exprRelease(pTrgCur->pExpr);
   pTrgCur->pExpr = NULL;
+
+  /* Release always-candidates */
+  sqlite3_free(pTrgCur->aAlways);
+  pTrgCur->aAlways = NULL;
+  pTrgCur->nAlways = 0;
+  pTrgCur->iAlways = 0;
+  pTrgCur->hasExprId = false;
+
+  /* Release tombstones */
+  tombstoneReaderClose(&pTrgCur->tombstones);
+
+  /* Release signature probes and handle */
+  sqlite3_free(pTrgCur->aProbes);
+  pTrgCur->aProbes = NULL;
+  pTrgCur->nProbes = 0;
+  sqlite3_blob_close(pTrgCur->pSignature);
+  pTrgCur->pSignature = NULL;
   
   /* Select row from %_content */
   if(pTrgCur->stmt_fetch_content){
@@ -227,6 +341,34 @@ static int resetCursor(trilite_cursor *pTrgCur){
 }
 
 
+/** Get the next candidate of a match scan, merging results of the expression
+ * with always-candidates in ascending order.
+ * Returns false, if there are no more candidates or an error is output as
+ * *pRc */
+static bool nextCandidate(trilite_cursor *pTrgCur, sqlite3_int64 *pId, int *pRc){
+  /* Read ahead a result from the expression */
+  if(!pTrgCur->hasExprId){
+    pTrgCur->hasExprId = exprNextResult(&pTrgCur->pExpr, &pTrgCur->exprId, pRc);
+    if(*pRc != SQLITE_OK) return false;
+  }
+
+  /* Take the always-candidate, if it comes first */
+  if(pTrgCur->iAlways < pTrgCur->nAlways &&
+     (!pTrgCur->hasExprId || pTrgCur->aAlways[pTrgCur->iAlways] <= pTrgCur->exprId)){
+    *pId = pTrgCur->aAlways[pTrgCur->iAlways++];
+    /* Don't return the same document twice */
+    if(pTrgCur->hasExprId && pTrgCur->exprId == *pId)
+      pTrgCur->hasExprId = false;
+    return true;
+  }
+
+  if(!pTrgCur->hasExprId)
+    return false;
+  *pId = pTrgCur->exprId;
+  pTrgCur->hasExprId = false;
+  return true;
+}
+
 /** Move to next row, or set eof = true (non-zero) */
 int triliteNext(sqlite3_vtab_cursor *pCur){
   trilite_cursor* pTrgCur = (trilite_cursor*)pCur;
@@ -250,11 +392,35 @@ int triliteNext(sqlite3_vtab_cursor *pCur){
   }else if(pTrgCur->idxNum & IDX_MATCH_SCAN){
     /*TODO Implement support for ascending ordering */
     assert(!(pTrgCur->idxNum & ORDER_BY_ASC));
+
+    /* More ids may share the document of the previous row, see dedup.c */
+    trilite_vtab *pTrgVtab = (trilite_vtab*)pTrgCur->base.pVtab;
+    if(pTrgVtab->dedup && sqlite3_stmt_busy(pTrgCur->stmt_fetch_content) &&
+       sqlite3_step(pTrgCur->stmt_fetch_content) == SQLITE_ROW){
+      if(pTrgCur->extents)
+        sqlite3_free(pTrgCur->extents);
+      pTrgCur->extents = NULL;
+      pTrgCur->nExtents = 0;
+      pTrgCur->nExtentsAvail = 0;
+      return SQLITE_OK;
+    }
    
     /* Okay, we're looking for an id and is a result */
     sqlite3_int64 id = - 1;
-    if(!exprNextResult(&pTrgCur->pExpr, &id))
+    bool more = nextCandidate(pTrgCur, &id, &rc);
+
+    /* Skip deleted documents, and candidates their signature rules out,
+     * without fetching them */
+    while(more && (tombstoneReaderCheck(&pTrgCur->tombstones, id) ||
+                   (pTrgCur->nProbes > 0 &&
+                    signatureReject(pTrgVtab, &pTrgCur->pSignature, pTrgCur->aProbes, pTrgCur->nProbes, id))))
+      more = nextCandidate(pTrgCur, &id, &rc);
+    if(!more)
       pTrgCur->eof = 1;
+    if(rc != SQLITE_OK)
+      return rc;
+    if(pTrgCur->tombstones.rc != SQLITE_OK)
+      return pTrgCur->tombstones.rc;
 
     /* Reset statement from previous row */
     /* Even if we don't have a result, we should release resources */
@@ -307,6 +473,18 @@ int triliteColumn(sqlite3_vtab_cursor *pCur, sqlite3_context *pCtx, int iCol){
     return SQLITE_OK;
   }
   
+  /* Text may have to be fetched from the content store */
+  trilite_vtab *pTrgVtab = (trilite_vtab*)pTrgCur->base.pVtab;
+  if(iCol == 1 && pTrgVtab->pStore &&
+     sqlite3_column_type(pTrgCur->stmt_fetch_content, 1) == SQLITE_BLOB){
+    const unsigned char *text;
+    int nText;
+    int rc = triliteText(pTrgCur, &text, &nText);
+    if(rc != SQLITE_OK) return rc;
+    sqlite3_result_text(pCtx, (const char*)text, nText, SQLITE_TRANSIENT);
+    return SQLITE_OK;
+  }
+  
   /* Fetch result from current row */
   assert(iCol < 2); /* We only have 2 actual columns */
   sqlite3_value *pVal = sqlite3_column_value(pTrgCur->stmt_fetch_content, iCol);
@@ -334,13 +512,45 @@ int triliteCursorFromBlob(trilite_cursor **ppTrgCur, sqlite3_value *pBlob){
   return SQLITE_OK;
 }
 
-/** Get current text held by cursor */
+/** Get current text held by cursor
+ * With a content store, text is fetched through its locator, the text is then
+ * only valid until the next call to triliteText. */
 int triliteText(trilite_cursor *pTrgCur, const unsigned char **pText, int *pnText){
+  trilite_vtab *pTrgVtab = (trilite_vtab*)pTrgCur->base.pVtab;
+  if(pTrgVtab->pStore && sqlite3_column_type(pTrgCur->stmt_fetch_content, 1) == SQLITE_BLOB){
+    const unsigned char *locator = sqlite3_column_blob(pTrgCur->stmt_fetch_content, 1);
+    int nLocator = sqlite3_column_bytes(pTrgCur->stmt_fetch_content, 1);
+    return storeFetch(pTrgVtab, locator, nLocator, pText, pnText);
+  }
   *pText  = sqlite3_column_text(pTrgCur->stmt_fetch_content, 1);
   *pnText = sqlite3_column_bytes(pTrgCur->stmt_fetch_content, 1);
   return SQLITE_OK;
 }
 
+/** Get the document id of the current row, ids sharing a document have the
+ * same document id */
+sqlite3_int64 triliteDocId(trilite_cursor *pTrgCur){
+  return sqlite3_column_int64(pTrgCur->stmt_fetch_content, 2);
+}
+
+/** True, if the table of the cursor indexes trigrams of codepoints, and
+ * case-insensitive patterns must be matched with Unicode case folding */
+bool triliteUtf8(trilite_cursor *pTrgCur){
+  return ((trilite_vtab*)pTrgCur->base.pVtab)->utf8;
+}
+
+/** Get blocks of the current text of nText bytes where pattern may start, for
+ * large documents indexed by blocks, see blocksCandidates.
+ * Returns false, if the current text isn't indexed by blocks, otherwise blocks
+ * are output as *paBlocks, which must be released with sqlite3_free. */
+bool triliteBlocks(trilite_cursor *pTrgCur, int nText, const unsigned char *pattern, int nPattern, int **paBlocks, int *pnBlocks){
+  trilite_vtab *pTrgVtab = (trilite_vtab*)pTrgCur->base.pVtab;
+  if(pTrgVtab->largeDocSize == 0 || nText <= pTrgVtab->largeDocSize || nPattern < 3)
+    return false;
+  sqlite3_int64 id = triliteDocId(pTrgCur);
+  return blocksCandidates(pTrgVtab, id, nText, pattern, nPattern, paBlocks, pnBlocks) == SQLITE_OK;
+}
+
 /** Record the start and end of a extent that constitutes a match against the
  * current row, these values are returned by extents(contents) function in SQL.
  * Note, that the extents is reset at each call to triliteNext, and there's no
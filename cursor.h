@@ -3,6 +3,7 @@
 
 #include <sqlite3ext.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "config.h"
 
@@ -15,6 +16,9 @@ int triliteColumn(sqlite3_vtab_cursor*, sqlite3_context*, int);
 int triliteRowid(sqlite3_vtab_cursor*, sqlite_int64*);
 int triliteCursorFromBlob(trilite_cursor**, sqlite3_value*);
 int triliteText(trilite_cursor*, const unsigned char**, int*);
+sqlite3_int64 triliteDocId(trilite_cursor*);
+bool triliteUtf8(trilite_cursor*);
+bool triliteBlocks(trilite_cursor*, int, const unsigned char*, int, int**, int*);
 int triliteAddExtents(trilite_cursor*, uint32_t, uint32_t);
 void extentsFunction(sqlite3_context*, int, sqlite3_value**);
 
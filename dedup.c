@@ -0,0 +1,80 @@
+#include "dedup.h"
+#include "vtable.h"
+#include "store.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+/* Code search corpora hold many byte-identical files, vendored dependencies
+ * and forks. With the dedup option, identical texts are stored and indexed
+ * once. Each new text is hashed, and %_hashes maps the hash to the document id
+ * of the first document with that text. If the texts are identical, the new id
+ * is mapped to the existing document in %_docids, and nothing else is written.
+ *
+ * Doclists list document ids, so a posting expands to every id sharing the
+ * document when rows are fetched through %_docids. The match function only
+ * verifies a shared document once, see matchFunction.
+ *
+ * A hash collision is harmless, the new text just isn't deduplicated.
+ */
+
+/** 64 bit FNV-1a hash of text */
+static sqlite3_int64 dedupHash(const unsigned char *text, int nText){
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  int i;
+  for(i = 0; i < nText; i++){
+    hash ^= text[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return (sqlite3_int64)hash;
+}
+
+/** Find a document with the same text as vText
+ * The hash of vText is output as *pHash, and *pShared is set true if there's a
+ * document with the same text, whose document id is output as *pDocId. */
+int dedupFind(trilite_vtab *pTrgVtab, sqlite3_value *vText, sqlite3_int64 *pHash, sqlite3_int64 *pDocId, bool *pShared){
+  const unsigned char *zText = sqlite3_value_text(vText);
+  int nText = sqlite3_value_bytes(vText);
+  int rc = SQLITE_OK;
+
+  *pShared = false;
+  *pHash = dedupHash(zText, nText);
+
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_find_hash;
+  sqlite3_bind_int64(pStmt, 1, *pHash);
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    const unsigned char *text;
+    int nDocText;
+    /* Text may be stored in the content store */
+    if(pTrgVtab->pStore && sqlite3_column_type(pStmt, 1) == SQLITE_BLOB){
+      rc = storeFetch(pTrgVtab, sqlite3_column_blob(pStmt, 1), sqlite3_column_bytes(pStmt, 1), &text, &nDocText);
+    }else{
+      text     = sqlite3_column_text(pStmt, 1);
+      nDocText = sqlite3_column_bytes(pStmt, 1);
+    }
+    if(rc == SQLITE_OK && nDocText == nText && memcmp(text, zText, nText) == 0){
+      *pDocId  = sqlite3_column_int64(pStmt, 0);
+      *pShared = true;
+    }
+  }
+  if(rc == SQLITE_OK)
+    rc = sqlite3_reset(pStmt);
+  else
+    sqlite3_reset(pStmt);
+
+  if(*pShared)
+    trilite_log("Text is identical to document %lli", *pDocId);
+  return rc;
+}
+
+/** Record hash as the hash of the text of document docId, unless there's a
+ * document with this hash already */
+int dedupAdd(trilite_vtab *pTrgVtab, sqlite3_int64 hash, sqlite3_int64 docId){
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_insert_hash;
+  sqlite3_bind_int64(pStmt, 1, hash);
+  sqlite3_bind_int64(pStmt, 2, docId);
+  sqlite3_step(pStmt);
+  return sqlite3_reset(pStmt);
+}
@@ -0,0 +1,12 @@
+#ifndef TRILITE_DEDUP_H
+#define TRILITE_DEDUP_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+
+int dedupFind(trilite_vtab*, sqlite3_value*, sqlite3_int64*, sqlite3_int64*, bool*);
+int dedupAdd(trilite_vtab*, sqlite3_int64, sqlite3_int64);
+
+#endif /* TRILITE_DEDUP_H */
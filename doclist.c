@@ -0,0 +1,547 @@
+#include "doclist.h"
+#include "varint.h"
+#include "streamvbyte.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+/** Maximum size of a block header, nIds, firstId, lastId and payload size */
+#define MAX_BLOCK_HEADER_SIZE     (4 * MAX_VARINT_SIZE)
+
+/** Maximum size of a block payload */
+#define MAX_BLOCK_PAYLOAD_SIZE    (DOCLIST_BLOCK_SIZE * MAX_VARINT_SIZE)
+
+#define MAX(a,b)    ((a) < (b) ? (b) : (a))
+
+static bool readBlockHeader(doclist_reader*);
+static bool readLegacyBlock(doclist_reader*);
+static void decodeBlock(doclist_reader*);
+static void blockAdvance(doclist_reader*);
+static void blockSeek(doclist_reader*, sqlite3_int64);
+static int nextSetBit(const unsigned char*, int, int);
+static int countBits(const unsigned char*, int);
+static int flushBlock(doclist_writer*);
+static int reserveSpace(doclist_writer*, int);
+static int writeBlockHeader(unsigned char*, int, int, sqlite3_int64, sqlite3_int64, sqlite3_int64, int);
+static int encodeArray(const sqlite3_int64*, int, unsigned char*, int*);
+static int encodeBitmap(const sqlite3_int64*, int, unsigned char*);
+static int encodeRuns(const sqlite3_int64*, int, unsigned char*);
+
+/*************************** Doclist Reader *********************************/
+
+/** Initialize a reader for docList in format iVersion, positioned at the first id
+ * Returns false, if the doclist is empty */
+bool docListReaderInit(doclist_reader *pReader, const unsigned char *docList, int nSize, int iVersion){
+  pReader->iVersion = iVersion;
+  pReader->docList  = docList;
+  pReader->nSize    = nSize;
+  pReader->iNext    = 0;
+  pReader->nIds     = 0;
+  pReader->eType    = DOCLIST_BLOCK_VARINT;
+  pReader->lastId   = DELTA_LIST_OFFSET;
+  pReader->decoded  = false;
+  pReader->iId      = 0;
+  if(!readBlockHeader(pReader))
+    return false;
+  pReader->curId    = pReader->firstId;
+  return true;
+}
+
+/** Move to the next id in the doclist
+ * Returns false, if there's no more ids */
+bool docListAdvance(doclist_reader *pReader){
+  /* Move to next block, if at the end of this one */
+  if(pReader->curId >= pReader->lastId){
+    if(!readBlockHeader(pReader))
+      return false;
+    pReader->curId = pReader->firstId;
+    return true;
+  }
+  blockAdvance(pReader);
+  return true;
+}
+
+/** Move to the first id greater than or equal to id
+ * Blocks where the last id is smaller than id are skipped without decoding.
+ * Returns false, if there's no such id */
+bool docListSeek(doclist_reader *pReader, sqlite3_int64 id){
+  if(pReader->curId >= id)
+    return true;
+  /* Skip blocks that can't contain id */
+  if(pReader->lastId < id){
+    do{
+      if(!readBlockHeader(pReader))
+        return false;
+    }while(pReader->lastId < id);
+    pReader->curId = pReader->firstId;
+    if(pReader->curId >= id)
+      return true;
+  }
+  /* Now id is in this block, as firstId < id <= lastId */
+  blockSeek(pReader, id);
+  return true;
+}
+
+/** Get masks of the current id, MASKS_ALL if the doclist has no masks */
+trilite_masks docListMasks(const doclist_reader *pReader){
+  int iOrdinal, i;
+  if(!pReader->masks)
+    return MASKS_ALL;
+  /* Find ordinal of curId within the block */
+  switch(pReader->eType){
+    case DOCLIST_BLOCK_BITMAP:
+      iOrdinal = countBits(pReader->payload, pReader->iId);
+      break;
+    case DOCLIST_BLOCK_RUNS:
+      /* Runs are decoded, unless curId is the first id of the block */
+      iOrdinal = 0;
+      if(!pReader->decoded)
+        break;
+      for(i = 0; i < pReader->iId; i++)
+        iOrdinal += (int)(pReader->ids[i * 2 + 1] - pReader->ids[i * 2]) + 1;
+      iOrdinal += (int)(pReader->curId - pReader->ids[pReader->iId * 2]);
+      break;
+    default:
+      iOrdinal = pReader->iId;
+      break;
+  }
+  assert(0 <= iOrdinal && iOrdinal < pReader->nIds);
+  return (trilite_masks)(pReader->masks[iOrdinal] | (pReader->masks[pReader->nIds + iOrdinal] << 8));
+}
+
+/** Find the last id of docList in format iVersion, by reading block headers
+ * Returns DELTA_LIST_OFFSET, if the doclist is empty */
+sqlite3_int64 docListLastId(const unsigned char *docList, int nSize, int iVersion){
+  doclist_reader reader;
+  if(!docListReaderInit(&reader, docList, nSize, iVersion))
+    return DELTA_LIST_OFFSET;
+  while(readBlockHeader(&reader));
+  return reader.lastId;
+}
+
+/** Move to next id within the current block, requires curId < lastId */
+static void blockAdvance(doclist_reader *pReader){
+  assert(pReader->curId < pReader->lastId);
+  switch(pReader->eType){
+    case DOCLIST_BLOCK_BITMAP:
+      pReader->iId   = nextSetBit(pReader->payload, pReader->nPayload, pReader->iId + 1);
+      pReader->curId = pReader->firstId + pReader->iId;
+      break;
+    case DOCLIST_BLOCK_RUNS:
+      if(!pReader->decoded)
+        decodeBlock(pReader);
+      if(pReader->curId < pReader->ids[pReader->iId * 2 + 1]){
+        pReader->curId++;
+      }else{
+        pReader->iId++;
+        pReader->curId = pReader->ids[pReader->iId * 2];
+      }
+      break;
+    default:
+      if(!pReader->decoded)
+        decodeBlock(pReader);
+      pReader->iId++;
+      pReader->curId = pReader->ids[pReader->iId];
+      break;
+  }
+}
+
+/** Move to first id >= id within current block, requires curId < id <= lastId */
+static void blockSeek(doclist_reader *pReader, sqlite3_int64 id){
+  assert(pReader->curId < id && id <= pReader->lastId);
+  switch(pReader->eType){
+    case DOCLIST_BLOCK_BITMAP:
+      /* Jump straight to the bit for id */
+      pReader->iId   = nextSetBit(pReader->payload, pReader->nPayload, (int)(id - pReader->firstId));
+      pReader->curId = pReader->firstId + pReader->iId;
+      break;
+    case DOCLIST_BLOCK_RUNS:
+      if(!pReader->decoded)
+        decodeBlock(pReader);
+      while(pReader->ids[pReader->iId * 2 + 1] < id)
+        pReader->iId++;
+      pReader->curId = MAX(id, pReader->ids[pReader->iId * 2]);
+      break;
+    default:
+      if(!pReader->decoded)
+        decodeBlock(pReader);
+      while(pReader->ids[pReader->iId] < id)
+        pReader->iId++;
+      assert(pReader->iId < pReader->nIds);
+      pReader->curId = pReader->ids[pReader->iId];
+      break;
+  }
+}
+
+/** Find offset of first bit set in bitmap of nBytes at or after iBit
+ * The caller must ensure that there is such a bit, this holds as long as we're
+ * not past the lastId of a block. Empty words are skipped eight bytes at a time.
+ */
+static int nextSetBit(const unsigned char *bitmap, int nBytes, int iBit){
+  int iByte = iBit / BITSPERBYTE;
+  /* Check the remaining bits of the first byte */
+  unsigned char byte = bitmap[iByte] >> (iBit % BITSPERBYTE);
+  if(byte){
+    while(!(byte & 1)){ byte >>= 1; iBit++; }
+    return iBit;
+  }
+  iByte++;
+  /* Skip empty words */
+  while(iByte + (int)sizeof(uint64_t) <= nBytes){
+    uint64_t word;
+    memcpy(&word, bitmap + iByte, sizeof(uint64_t));
+    if(word) break;
+    iByte += sizeof(uint64_t);
+  }
+  while(!bitmap[iByte])
+    iByte++;
+  assert(iByte < nBytes);
+  byte = bitmap[iByte];
+  iBit = iByte * BITSPERBYTE;
+  while(!(byte & 1)){ byte >>= 1; iBit++; }
+  return iBit;
+}
+
+/** Count bits set in bitmap before iBit */
+static int countBits(const unsigned char *bitmap, int iBit){
+  int nBits = 0;
+  int i;
+  for(i = 0; i < iBit / BITSPERBYTE; i++)
+    nBits += __builtin_popcount(bitmap[i]);
+  if(iBit % BITSPERBYTE)
+    nBits += __builtin_popcount(bitmap[i] & ((1 << (iBit % BITSPERBYTE)) - 1));
+  return nBits;
+}
+
+/** Read the next block header, returns false if there's no more blocks */
+static bool readBlockHeader(doclist_reader *pReader){
+  if(pReader->iNext >= pReader->nSize)
+    return false;
+  if(pReader->iVersion == 0)
+    return readLegacyBlock(pReader);
+  const unsigned char *pBuf = pReader->docList + pReader->iNext;
+  sqlite3_int64 info, delta, span, nPayload;
+  pBuf += readVarInt((unsigned char*)pBuf, &info);
+  pBuf += readVarInt((unsigned char*)pBuf, &delta);
+  pBuf += readVarInt((unsigned char*)pBuf, &span);
+  pBuf += readVarInt((unsigned char*)pBuf, &nPayload);
+  pReader->nIds     = (int)(info >> DOCLIST_BLOCK_TYPE_BITS);
+  pReader->eType    = (int)(info & ((1 << DOCLIST_BLOCK_TYPE_BITS) - 1));
+  assert(0 < pReader->nIds && pReader->nIds <= DOCLIST_BLOCK_SIZE);
+  pReader->firstId  = pReader->lastId + delta;
+  pReader->lastId   = pReader->firstId + span;
+  pReader->payload  = pBuf;
+  pReader->nPayload = (int)nPayload;
+  pReader->masks    = NULL;
+  pReader->decoded  = false;
+  pReader->iId      = 0;
+  pReader->iNext    = (pBuf - pReader->docList) + (int)nPayload;
+  assert(pReader->iNext <= pReader->nSize);
+  /* Masks are stored after the payload */
+  if(pReader->iVersion >= 4){
+    pReader->nPayload -= 2 * pReader->nIds;
+    pReader->masks     = pBuf + pReader->nPayload;
+    assert(pReader->nPayload >= 0);
+  }
+  return true;
+}
+
+/** Read up to DOCLIST_BLOCK_SIZE ids from a legacy doclist as a block
+ * Legacy doclists have no block headers, so the block is decoded right away */
+static bool readLegacyBlock(doclist_reader *pReader){
+  const unsigned char *pBuf = pReader->docList + pReader->iNext;
+  const unsigned char *pEnd = pReader->docList + pReader->nSize;
+  sqlite3_int64 prev = pReader->lastId;
+  int n = 0;
+  while(n < DOCLIST_BLOCK_SIZE && pBuf < pEnd){
+    sqlite3_int64 delta;
+    pBuf += readVarInt((unsigned char*)pBuf, &delta);
+    prev += delta;
+    pReader->ids[n++] = prev;
+  }
+  pReader->nIds     = n;
+  pReader->firstId  = pReader->ids[0];
+  pReader->lastId   = pReader->ids[n - 1];
+  pReader->masks    = NULL;
+  pReader->decoded  = true;
+  pReader->iId      = 0;
+  pReader->iNext    = pBuf - pReader->docList;
+  return true;
+}
+
+/** Decode ids of current block, or runs if it's a block of runs
+ * Bitmaps are read in place, so they are never decoded */
+static void decodeBlock(doclist_reader *pReader){
+  const unsigned char *pBuf = pReader->payload;
+  int i;
+  assert(pReader->eType != DOCLIST_BLOCK_BITMAP);
+  pReader->ids[0] = pReader->firstId;
+  if(pReader->eType == DOCLIST_BLOCK_RUNS){
+    /* Decode first and last id of each run */
+    const unsigned char *pEnd = pBuf + pReader->nPayload;
+    sqlite3_int64 prev = pReader->firstId;
+    i = 0;
+    while(pBuf < pEnd){
+      sqlite3_int64 gap, length;
+      pBuf += readVarInt((unsigned char*)pBuf, &gap);
+      pBuf += readVarInt((unsigned char*)pBuf, &length);
+      pReader->ids[i * 2]     = prev + gap;
+      pReader->ids[i * 2 + 1] = prev + gap + length;
+      prev = pReader->ids[i * 2 + 1];
+      i++;
+    }
+    assert(pReader->ids[i * 2 - 1] == pReader->lastId);
+    pReader->decoded = true;
+    return;
+  }
+  if(pReader->eType == DOCLIST_BLOCK_SVB){
+    /* Decode deltas, then compute prefix sum */
+    uint32_t deltas[DOCLIST_BLOCK_SIZE];
+    svbDecode(pBuf, pReader->nPayload, pReader->nIds - 1, deltas);
+    for(i = 1; i < pReader->nIds; i++)
+      pReader->ids[i] = pReader->ids[i - 1] + deltas[i - 1];
+  }else{
+    assert(pReader->eType == DOCLIST_BLOCK_VARINT);
+    for(i = 1; i < pReader->nIds; i++){
+      sqlite3_int64 delta;
+      pBuf += readVarInt((unsigned char*)pBuf, &delta);
+      pReader->ids[i] = pReader->ids[i - 1] + delta;
+    }
+  }
+  assert(pReader->ids[pReader->nIds - 1] == pReader->lastId);
+  pReader->decoded = true;
+}
+
+/*************************** Doclist Writer *********************************/
+
+/** Initialize an empty doclist writer */
+void docListWriterInit(doclist_writer *pWriter){
+  pWriter->docList    = NULL;
+  pWriter->nSize      = 0;
+  pWriter->nAlloc     = 0;
+  pWriter->prevLastId = DELTA_LIST_OFFSET;
+  pWriter->nIds       = 0;
+}
+
+/** Add id with masks to doclist, id must be greater than any id previously
+ * added */
+int docListWriterAdd(doclist_writer *pWriter, sqlite3_int64 id, trilite_masks masks){
+  assert(pWriter->nIds == 0 || pWriter->ids[pWriter->nIds - 1] < id);
+  pWriter->masks[pWriter->nIds] = masks;
+  pWriter->ids[pWriter->nIds++] = id;
+  if(pWriter->nIds == DOCLIST_BLOCK_SIZE)
+    return flushBlock(pWriter);
+  return SQLITE_OK;
+}
+
+/** Append docList in format iVersion, its ids must be greater than any id
+ * previously added. Blocks are copied without decoding them, only the header of
+ * the first block is rewritten, as it's relative to the block before it.
+ * Pending ids are written as a block first, so this may leave a short block.
+ * Doclists from before format version 4 are added id by id. */
+int docListWriterAppend(doclist_writer *pWriter, const unsigned char *docList, int nSize, int iVersion){
+  doclist_reader reader;
+  int rc = SQLITE_OK;
+  if(!docListReaderInit(&reader, docList, nSize, iVersion))
+    return SQLITE_OK;
+  assert(pWriter->nIds == 0 || pWriter->ids[pWriter->nIds - 1] < reader.firstId);
+
+  /* Blocks from before masks can't be copied, as their layout differs */
+  if(iVersion < 4){
+    do{
+      rc = docListWriterAdd(pWriter, reader.curId, docListMasks(&reader));
+    }while(rc == SQLITE_OK && docListAdvance(&reader));
+    return rc;
+  }
+
+  if(pWriter->nIds > 0){
+    rc = flushBlock(pWriter);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Rewrite the first header and copy everything after it */
+  int nRest = nSize - (int)(reader.payload - docList);
+  rc = reserveSpace(pWriter, MAX_BLOCK_HEADER_SIZE + nRest);
+  if(rc != SQLITE_OK) return rc;
+  unsigned char *pBuf = pWriter->docList + pWriter->nSize;
+  pBuf += writeBlockHeader(pBuf, reader.nIds, reader.eType, reader.firstId, reader.lastId,
+                           pWriter->prevLastId, reader.nPayload + 2 * reader.nIds);
+  memcpy(pBuf, reader.payload, nRest);
+  pBuf += nRest;
+  pWriter->nSize = pBuf - pWriter->docList;
+
+  /* Skip remaining blocks to find the last id */
+  while(readBlockHeader(&reader));
+  pWriter->prevLastId = reader.lastId;
+  return SQLITE_OK;
+}
+
+/** Finish the doclist, output it as *pDocList and size as *pnSize
+ * Ownership of *pDocList is transferred to the caller, who must release it
+ * with sqlite3_free. */
+int docListWriterFinish(doclist_writer *pWriter, unsigned char **pDocList, int *pnSize){
+  int rc = SQLITE_OK;
+  if(pWriter->nIds > 0)
+    rc = flushBlock(pWriter);
+  if(rc != SQLITE_OK){
+    docListWriterRelease(pWriter);
+    return rc;
+  }
+  *pDocList = pWriter->docList;
+  *pnSize   = pWriter->nSize;
+  pWriter->docList  = NULL;
+  pWriter->nSize    = 0;
+  pWriter->nAlloc   = 0;
+  return rc;
+}
+
+/** Release resources held by writer, if not transferred by docListWriterFinish */
+void docListWriterRelease(doclist_writer *pWriter){
+  sqlite3_free(pWriter->docList);
+  pWriter->docList  = NULL;
+  pWriter->nSize    = 0;
+  pWriter->nAlloc   = 0;
+}
+
+/** Write pending ids as a block, using the smallest container */
+static int flushBlock(doclist_writer *pWriter){
+  unsigned char payload[MAX_BLOCK_PAYLOAD_SIZE];
+  unsigned char candidate[MAX_BLOCK_PAYLOAD_SIZE];
+  int nPayload, nCandidate;
+  int eType;
+  const sqlite3_int64 *ids = pWriter->ids;
+  int nIds = pWriter->nIds;
+  assert(nIds > 0);
+
+  /* Array of deltas is always possible */
+  nPayload = encodeArray(ids, nIds, payload, &eType);
+
+  /* Bitmap, if the block is dense enough to make it smaller */
+  if(ids[nIds - 1] - ids[0] < (sqlite3_int64)nPayload * BITSPERBYTE){
+    nCandidate = encodeBitmap(ids, nIds, candidate);
+    if(nCandidate < nPayload){
+      memcpy(payload, candidate, nCandidate);
+      nPayload = nCandidate;
+      eType    = DOCLIST_BLOCK_BITMAP;
+    }
+  }
+
+  /* Runs, if they're fewer than half the ids, so they fit in reader ids */
+  nCandidate = encodeRuns(ids, nIds, candidate);
+  if(0 < nCandidate && nCandidate < nPayload){
+    memcpy(payload, candidate, nCandidate);
+    nPayload = nCandidate;
+    eType    = DOCLIST_BLOCK_RUNS;
+  }
+
+  /* Ensure there's space for header, payload and masks */
+  int rc = reserveSpace(pWriter, MAX_BLOCK_HEADER_SIZE + nPayload + 2 * nIds);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Write block header */
+  unsigned char *pBuf = pWriter->docList + pWriter->nSize;
+  sqlite3_int64 firstId = pWriter->ids[0];
+  sqlite3_int64 lastId  = pWriter->ids[pWriter->nIds - 1];
+  pBuf += writeBlockHeader(pBuf, nIds, eType, firstId, lastId, pWriter->prevLastId, nPayload + 2 * nIds);
+
+  /* Write payload */
+  memcpy(pBuf, payload, nPayload);
+  pBuf += nPayload;
+
+  /* Write next-character masks, then position masks */
+  int i;
+  for(i = 0; i < nIds; i++)
+    pBuf[i] = (unsigned char)MASK_NEXT_BITS(pWriter->masks[i]);
+  for(i = 0; i < nIds; i++)
+    pBuf[nIds + i] = (unsigned char)MASK_POS_BITS(pWriter->masks[i]);
+  pBuf += 2 * nIds;
+
+  pWriter->nSize      = pBuf - pWriter->docList;
+  pWriter->prevLastId = lastId;
+  pWriter->nIds       = 0;
+  return SQLITE_OK;
+}
+
+/** Ensure there's space for nBytes more in the doclist */
+static int reserveSpace(doclist_writer *pWriter, int nBytes){
+  if(pWriter->nAlloc - pWriter->nSize < nBytes){
+    int nAlloc = pWriter->nAlloc * 2 + nBytes;
+    unsigned char *docList = (unsigned char*)sqlite3_realloc(pWriter->docList, nAlloc);
+    if(!docList) return SQLITE_NOMEM;
+    pWriter->docList = docList;
+    pWriter->nAlloc  = nAlloc;
+  }
+  return SQLITE_OK;
+}
+
+/** Write block header to pBuf, firstId is stored relative to prevLastId
+ * Returns number of bytes written */
+static int writeBlockHeader(unsigned char *pBuf, int nIds, int eType, sqlite3_int64 firstId,
+                            sqlite3_int64 lastId, sqlite3_int64 prevLastId, int nPayload){
+  int nBuf = 0;
+  nBuf += writeVarInt(pBuf + nBuf, (nIds << DOCLIST_BLOCK_TYPE_BITS) | eType);
+  nBuf += writeVarInt(pBuf + nBuf, firstId - prevLastId);
+  nBuf += writeVarInt(pBuf + nBuf, lastId - firstId);
+  nBuf += writeVarInt(pBuf + nBuf, nPayload);
+  return nBuf;
+}
+
+/** Encode ids after the first as deltas, with stream vbyte unless a delta
+ * doesn't fit in 32 bits. Block type is output as *peType.
+ * Returns number of bytes written */
+static int encodeArray(const sqlite3_int64 *ids, int nIds, unsigned char *pBuf, int *peType){
+  uint32_t deltas[DOCLIST_BLOCK_SIZE];
+  int nBuf = 0;
+  int i;
+  for(i = 1; i < nIds; i++){
+    sqlite3_int64 delta = ids[i] - ids[i - 1];
+    if(delta > (sqlite3_int64)UINT32_MAX) break;
+    deltas[i - 1] = (uint32_t)delta;
+  }
+  if(i == nIds){
+    *peType = DOCLIST_BLOCK_SVB;
+    return svbEncode(deltas, nIds - 1, pBuf);
+  }
+  *peType = DOCLIST_BLOCK_VARINT;
+  for(i = 1; i < nIds; i++)
+    nBuf += writeVarInt(pBuf + nBuf, ids[i] - ids[i - 1]);
+  return nBuf;
+}
+
+/** Encode ids as bitmap starting from the first id
+ * The caller must ensure that the bitmap fits in MAX_BLOCK_PAYLOAD_SIZE.
+ * Returns number of bytes written */
+static int encodeBitmap(const sqlite3_int64 *ids, int nIds, unsigned char *pBuf){
+  int nBuf = (int)((ids[nIds - 1] - ids[0]) / BITSPERBYTE) + 1;
+  int i;
+  assert(nBuf <= MAX_BLOCK_PAYLOAD_SIZE);
+  memset(pBuf, 0, nBuf);
+  for(i = 0; i < nIds; i++){
+    int iBit = (int)(ids[i] - ids[0]);
+    pBuf[iBit / BITSPERBYTE] |= 1 << (iBit % BITSPERBYTE);
+  }
+  return nBuf;
+}
+
+/** Encode ids as runs of consecutive ids
+ * Returns number of bytes written, or 0 if there's more than nIds / 2 runs */
+static int encodeRuns(const sqlite3_int64 *ids, int nIds, unsigned char *pBuf){
+  sqlite3_int64 prev = ids[0];
+  int nBuf = 0;
+  int nRuns = 0;
+  int i = 0;
+  while(i < nIds){
+    /* Find end of run starting at i */
+    int j = i;
+    while(j + 1 < nIds && ids[j + 1] == ids[j] + 1)
+      j++;
+    if(++nRuns > DOCLIST_BLOCK_SIZE / 2) return 0;
+    nBuf += writeVarInt(pBuf + nBuf, ids[i] - prev);
+    nBuf += writeVarInt(pBuf + nBuf, ids[j] - ids[i]);
+    prev = ids[j];
+    i = j + 1;
+  }
+  return nBuf;
+}
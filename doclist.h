@@ -0,0 +1,126 @@
+#ifndef TRILITE_DOCLIST_H
+#define TRILITE_DOCLIST_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+
+#include <stdbool.h>
+
+/** Block containers, stored in the low bits of the block header
+ * The writer picks the smallest container for each block, so dense doclists
+ * are stored as bitmaps or runs, and sparse doclists as arrays of deltas. */
+enum doclist_block_type{
+  /** Deltas encoded as varints, used when a delta doesn't fit in 32 bits */
+  DOCLIST_BLOCK_VARINT  = 0,
+  /** Deltas encoded with stream vbyte */
+  DOCLIST_BLOCK_SVB     = 1,
+  /** Bitmap of ids from firstId to lastId, bit 0 is firstId */
+  DOCLIST_BLOCK_BITMAP  = 2,
+  /** Runs of consecutive ids, as varint gap from the previous run and length */
+  DOCLIST_BLOCK_RUNS    = 3
+};
+
+/** Number of bits used for block type in the block header */
+#define DOCLIST_BLOCK_TYPE_BITS     2
+
+/** Reader for iterating over an encoded doclist
+ * The doclist is a sequence of blocks, each prefixed with a header holding the
+ * number of ids and type of the block, first and last id of the block and the
+ * size of the block payload. This allows us to skip entire blocks without
+ * decoding the ids in them, see docListSeek.
+ *
+ * From format version 4 the payload is followed by the masks of each id in the
+ * block, see trilite_masks, first the next-character bytes then the position
+ * bytes. The size of the payload in the header includes the masks.
+ *
+ * Doclists in the legacy format (format version 0) is a flat list of varint
+ * deltas, these are read in chunks of DOCLIST_BLOCK_SIZE ids, but can't be
+ * skipped without decoding.
+ */
+struct doclist_reader{
+  /** Format version of docList */
+  int iVersion;
+
+  /** Encoded doclist */
+  const unsigned char *docList;
+
+  /** Size of docList in bytes */
+  int nSize;
+
+  /** Byte offset of the next block header in docList */
+  int iNext;
+
+  /** Number of ids in current block */
+  int nIds;
+
+  /** First id of current block */
+  sqlite3_int64 firstId;
+
+  /** Last id of current block */
+  sqlite3_int64 lastId;
+
+  /** Type of current block */
+  int eType;
+
+  /** Payload of current block, ie. deltas of ids after firstId */
+  const unsigned char *payload;
+
+  /** Size of payload in bytes, not including masks */
+  int nPayload;
+
+  /** Masks of ids in current block, NULL for format versions without masks */
+  const unsigned char *masks;
+
+  /** True, if ids of current block have been decoded into ids */
+  bool decoded;
+
+  /** Position of curId in current block, offset in ids for arrays, bit offset
+   * for bitmaps and run offset for runs */
+  int iId;
+
+  /** Current id */
+  sqlite3_int64 curId;
+
+  /** Decoded ids of current block, valid if decoded is true
+   * For runs this holds the first and last id of each run */
+  sqlite3_int64 ids[DOCLIST_BLOCK_SIZE];
+};
+
+/** Writer for encoding a doclist, ids must be added in ascending order */
+struct doclist_writer{
+  /** Encoded doclist, allocated with sqlite3_malloc */
+  unsigned char *docList;
+
+  /** Number of bytes written to docList */
+  int nSize;
+
+  /** Number of bytes allocated for docList */
+  int nAlloc;
+
+  /** Last id of the previous block written */
+  sqlite3_int64 prevLastId;
+
+  /** Number of ids pending in ids */
+  int nIds;
+
+  /** Ids pending for the next block */
+  sqlite3_int64 ids[DOCLIST_BLOCK_SIZE];
+
+  /** Masks of ids pending for the next block */
+  trilite_masks masks[DOCLIST_BLOCK_SIZE];
+};
+
+bool docListReaderInit(doclist_reader*, const unsigned char*, int, int);
+bool docListAdvance(doclist_reader*);
+bool docListSeek(doclist_reader*, sqlite3_int64);
+trilite_masks docListMasks(const doclist_reader*);
+sqlite3_int64 docListLastId(const unsigned char*, int, int);
+
+void docListWriterInit(doclist_writer*);
+int docListWriterAdd(doclist_writer*, sqlite3_int64, trilite_masks);
+int docListWriterAppend(doclist_writer*, const unsigned char*, int, int);
+int docListWriterFinish(doclist_writer*, unsigned char**, int*);
+void docListWriterRelease(doclist_writer*);
+
+#endif /* TRILITE_DOCLIST_H */
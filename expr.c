@@ -1,8 +1,13 @@
 #include "expr.h"
 #include "vtable.h"
 #include "cursor.h"
-#include "varint.h"
+#include "chunk.h"
 #include "regexp.h"
+#include "seal.h"
+#include "stop.h"
+#include "trigram.h"
+#include "bigrams.h"
+#include "hash.h"
 
 const sqlite3_api_routines *sqlite3_api;
 
@@ -12,6 +17,12 @@ const sqlite3_api_routines *sqlite3_api;
 #define MAX(a,b)    ((a) < (b) ? (b) : (a))
 #define MIN(a,b)    ((a) > (b) ? (b) : (a))
 
+static int exprSegmentTrigram(expr**, trilite_vtab*, sqlite3_int64);
+static int exprSealedTrigram(expr**, trilite_vtab*, const unsigned char*, int, int);
+static int exprBitmap(expr**, trilite_vtab*, sqlite3_int64);
+static int exprPending(expr**, sqlite3_int64*, trilite_masks*, int);
+static bool exprAdjacent(expr*, const trilite_masks*);
+
 /** Expression structure */
 struct expr{ 
   /** Type of this expression */
@@ -22,17 +33,53 @@ struct expr{
 
     /** Trigram Expression, valid when eType == EXPR_TRIGRAM */
     struct{
-      /** Number of bytes left in doclist */
-      int nSize;
-
-      /** Pointer to current offset in doclist
-       * Please be advised docList is allocated with the expression */
-      unsigned char *docList;
-
-      /** Last id read from docList */
-      sqlite3_int64 curId;
+      /** Reader for the doclist, current id is pReader->reader.curId
+       * Please be advised reader is allocated with the expression */
+      chunk_reader *pReader;
     } trigram;
 
+    /** Substring expression, valid when eType == EXPR_SUBSTRING
+     * Matches ids present in all trigram expressions, where masks don't rule
+     * out that the trigrams are adjacent, see exprAdjacent. */
+    struct{
+      /** Number of trigram expressions */
+      int nTrigrams;
+      /** Trigram expression for each offset in the substring, or for each gram
+       * covering it with the sparse option, except stop trigrams, allocated
+       * with the expression */
+      expr **aTrigrams;
+      /** Offset in the substring of each trigram */
+      int *aOffsets;
+      /** Offset from the start of its line of each trigram following a
+       * newline in the substring, with line positions, otherwise -1 */
+      int *aLines;
+      /** Masks of the current id for each trigram, allocated with the expression */
+      trilite_masks *aMasks;
+      /** Next-character bits for each trigram, 0 for the last trigram */
+      unsigned char *aNext;
+    } substring;
+
+    /** Bitmap expression, valid when eType == EXPR_BITMAP */
+    struct{
+      /** Reader for the bitmaps of a bigram, current id is pReader->curId,
+       * allocated with the expression */
+      bitmap_reader *pReader;
+    } bitmap;
+
+    /** Pending expression, valid when eType == EXPR_PENDING
+     * Ids added in the current transaction and not yet flushed, so queries see
+     * the writes of their own transaction. */
+    struct{
+      /** Ids in ascending order, allocated with sqlite3_malloc */
+      sqlite3_int64 *aIds;
+      /** Masks of each id, NULL for bigrams where masks aren't known */
+      trilite_masks *aMasks;
+      /** Number of ids */
+      int nIds;
+      /** Index of the current id */
+      int iId;
+    } pending;
+
     /** Operator expression, when eType & EXPR_OP */
     struct {
       /** Expression 1 */
@@ -46,8 +93,10 @@ struct expr{
 /** Parse a sequence of patterns that must hold into a single expression
  * Return *ppExpr = NULL and *pAll = true, if a full table scan is required
  * if *ppExpr = NULL and *pAll = false, implies that nothing matches the
- * patterns, ie. resultset is empty! */
-int exprParsePatterns(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, int argc, sqlite3_value **argv){
+ * patterns, ie. resultset is empty!
+ * *pStopAll is set to true, if a substring of the patterns has only stop
+ * trigrams, such queries may be evaluated as full table scan. */
+int exprParsePatterns(expr **ppExpr, bool *pAll, bool *pStopAll, trilite_vtab *pTrgVtab, int argc, sqlite3_value **argv){
   int rc = SQLITE_OK;
   *ppExpr = NULL;
   /* For each pattern add it to the others with a AND */
@@ -56,7 +105,7 @@ int exprParsePatterns(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, int arg
     const unsigned char* pattern  = sqlite3_value_text(argv[i]);
     int                  nPattern = sqlite3_value_bytes(argv[i]);
     expr *pExpr;
-    rc = exprParse(&pExpr, pAll, pTrgVtab, pattern, nPattern);
+    rc = exprParse(&pExpr, pAll, pStopAll, pTrgVtab, pattern, nPattern);
     /* Release and return on error, error message is already set */
     if(rc != SQLITE_OK) goto abort;
     /* If one of the and conditions fails, we're done */
@@ -82,43 +131,43 @@ abort:
 }
 
 /** Parse expression, load doclists and output it to ppExpr */
-int exprParse(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const unsigned char *pattern, int nPattern){
+int exprParse(expr **ppExpr, bool *pAll, bool *pStopAll, trilite_vtab *pTrgVtab, const unsigned char *pattern, int nPattern){
   if(strncmp((const char*)pattern, "substr:", 7) == 0){
     if(nPattern == 7){
       triliteError(pTrgVtab, "Empty patterned in MATCH not allowed!");
       return SQLITE_ERROR;
     }
-    return exprSubstring(ppExpr, pAll, pTrgVtab, pattern + 7, nPattern - 7);
+    return exprSubstring(ppExpr, pAll, pStopAll, pTrgVtab, pattern + 7, nPattern - 7, pTrgVtab->exactCase);
   }else if(strncmp((const char*)pattern, "isubstr:", 8) == 0){
     if(nPattern == 8){
       triliteError(pTrgVtab, "Empty patterned in MATCH not allowed!");
       return SQLITE_ERROR;
     }
-    return exprSubstring(ppExpr, pAll, pTrgVtab, pattern + 8, nPattern - 8);
+    return exprSubstring(ppExpr, pAll, pStopAll, pTrgVtab, pattern + 8, nPattern - 8, false);
   }else if(strncmp((const char*)pattern, "substr-extents:", 15) == 0){
     if(nPattern == 15){
       triliteError(pTrgVtab, "Empty patterned in MATCH not allowed!");
       return SQLITE_ERROR;
     }
-    return exprSubstring(ppExpr, pAll, pTrgVtab, pattern + 15, nPattern - 15);
+    return exprSubstring(ppExpr, pAll, pStopAll, pTrgVtab, pattern + 15, nPattern - 15, pTrgVtab->exactCase);
   }else if(strncmp((const char*)pattern, "isubstr-extents:", 16) == 0){
     if(nPattern == 16){
       triliteError(pTrgVtab, "Empty patterned in MATCH not allowed!");
       return SQLITE_ERROR;
     }
-    return exprSubstring(ppExpr, pAll, pTrgVtab, pattern + 16, nPattern - 16);
+    return exprSubstring(ppExpr, pAll, pStopAll, pTrgVtab, pattern + 16, nPattern - 16, false);
   }else if(strncmp((const char*)pattern, "regexp:", 7) == 0){
     if(nPattern == 7){
       triliteError(pTrgVtab, "Empty patterned in MATCH not allowed!");
       return SQLITE_ERROR;
     }
-    return regexpPreFilter(ppExpr, pAll, pTrgVtab, pattern + 7, nPattern - 7);
+    return regexpPreFilter(ppExpr, pAll, pStopAll, pTrgVtab, pattern + 7, nPattern - 7);
   }else if(strncmp((const char*)pattern, "regexp-extents:", 15) == 0){
     if(nPattern == 15){
       triliteError(pTrgVtab, "Empty patterned in MATCH not allowed!");
       return SQLITE_ERROR;
     }
-    return regexpPreFilter(ppExpr, pAll, pTrgVtab, pattern + 15, nPattern - 15);
+    return regexpPreFilter(ppExpr, pAll, pStopAll, pTrgVtab, pattern + 15, nPattern - 15);
   }else{
     triliteError(pTrgVtab, "MATCH pattern must be a regular expression or a substring pattern!");
     return SQLITE_ERROR;
@@ -134,6 +183,17 @@ void exprRelease(expr *pExpr){
     pExpr->expr.op.expr1 = NULL;
     exprRelease(pExpr->expr.op.expr2);
     pExpr->expr.op.expr2 = NULL;
+  }else if(pExpr->eType == EXPR_SUBSTRING){
+    int i;
+    for(i = 0; i < pExpr->expr.substring.nTrigrams; i++){
+      exprRelease(pExpr->expr.substring.aTrigrams[i]);
+      pExpr->expr.substring.aTrigrams[i] = NULL;
+    }
+  }else if(pExpr->eType == EXPR_TRIGRAM)
+    chunkReaderRelease(pExpr->expr.trigram.pReader);
+  else if(pExpr->eType == EXPR_PENDING){
+    sqlite3_free(pExpr->expr.pending.aIds);
+    sqlite3_free(pExpr->expr.pending.aMasks);
   }
   sqlite3_free(pExpr);
 }
@@ -148,19 +208,34 @@ static sqlite3_int64 exprNextCandidate(expr *pExpr){
       return MAX(v1, v2);
     assert(pExpr->eType == EXPR_OR);
     return MIN(v1, v2);
+  }else if(pExpr->eType == EXPR_SUBSTRING){
+    sqlite3_int64 v = SQLITE3_INT64_MIN;
+    int i;
+    for(i = 0; i < pExpr->expr.substring.nTrigrams; i++)
+      v = MAX(v, exprNextCandidate(pExpr->expr.substring.aTrigrams[i]));
+    return v;
+  }else if(pExpr->eType == EXPR_BITMAP){
+    return pExpr->expr.bitmap.pReader->curId;
+  }else if(pExpr->eType == EXPR_PENDING){
+    return pExpr->expr.pending.aIds[pExpr->expr.pending.iId];
   }else{
     assert(pExpr->eType == EXPR_TRIGRAM);
-    return pExpr->expr.trigram.curId;
+    return pExpr->expr.trigram.pReader->reader.curId;
   }
 }
 
 /** Check if id is a result and move to next id
- * Set ppExpr = NULL, if at end */
-static bool exprCheckAndMove(expr **ppExpr, sqlite3_int64 id){
+ * Masks of id is output as *pMasks, if id is a result. Masks are only known for
+ * trigrams, other results are given MASKS_ALL.
+ * Set ppExpr = NULL, if at end. Errors reading doclists are output as *pRc,
+ * the doclist is then at end. */
+static bool exprCheckAndMove(expr **ppExpr, sqlite3_int64 id, trilite_masks *pMasks, int *pRc){
   assert(ppExpr && *ppExpr);
+  *pMasks = MASKS_ALL;
   if((*ppExpr)->eType & EXPR_OP){
-    bool r1 = exprCheckAndMove(&(*ppExpr)->expr.op.expr1, id);
-    bool r2 = exprCheckAndMove(&(*ppExpr)->expr.op.expr2, id);
+    trilite_masks m1, m2;
+    bool r1 = exprCheckAndMove(&(*ppExpr)->expr.op.expr1, id, &m1, pRc);
+    bool r2 = exprCheckAndMove(&(*ppExpr)->expr.op.expr2, id, &m2, pRc);
     if((*ppExpr)->eType == EXPR_AND){
       /* If one of them is at end, we're done */
       if(!(*ppExpr)->expr.op.expr1 || !(*ppExpr)->expr.op.expr2){
@@ -184,41 +259,126 @@ static bool exprCheckAndMove(expr **ppExpr, sqlite3_int64 id){
       sqlite3_free(*ppExpr);
       *ppExpr = expr1;
     }
+    /* Id may be in a doclist of more than one segment */
+    *pMasks = (r1 ? m1 : 0) | (r2 ? m2 : 0);
     return r1 || r2;
+  }else if((*ppExpr)->eType == EXPR_SUBSTRING){
+    expr **aTrigrams = (*ppExpr)->expr.substring.aTrigrams;
+    int nTrigrams = (*ppExpr)->expr.substring.nTrigrams;
+    trilite_masks *aMasks = (*ppExpr)->expr.substring.aMasks;
+    int i;
+    /* Move all trigrams, if one of them is at end, we're done */
+    bool all = true, done = false;
+    for(i = 0; i < nTrigrams; i++){
+      all = exprCheckAndMove(&aTrigrams[i], id, &aMasks[i], pRc) && all;
+      done = done || !aTrigrams[i];
+    }
+    /* Only a result, if masks allow trigrams to be adjacent */
+    bool retval = all && exprAdjacent(*ppExpr, aMasks);
+    if(done){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+    }
+    return retval;
+  }else if((*ppExpr)->eType == EXPR_BITMAP){
+    bitmap_reader *pReader = (*ppExpr)->expr.bitmap.pReader;
+    bool more = bitmapReaderSeek(pReader, id);
+    bool retval = more && pReader->curId == id;
+    /* Move forward if we're at id, masks aren't known for bigrams */
+    if(retval)
+      more = id < SQLITE3_INT64_MAX && bitmapReaderSeek(pReader, id + 1);
+    if(!more){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+    }
+    return retval;
+  }else if((*ppExpr)->eType == EXPR_PENDING){
+    sqlite3_int64 *aIds = (*ppExpr)->expr.pending.aIds;
+    int nIds = (*ppExpr)->expr.pending.nIds;
+    int *piId = &(*ppExpr)->expr.pending.iId;
+    while(*piId < nIds && aIds[*piId] < id)
+      (*piId)++;
+    bool retval = *piId < nIds && aIds[*piId] == id;
+    /* Get masks and move forward if we're at id */
+    if(retval){
+      trilite_masks *aMasks = (*ppExpr)->expr.pending.aMasks;
+      *pMasks = aMasks ? aMasks[*piId] : MASKS_ALL;
+      (*piId)++;
+    }
+    if(*piId >= nIds){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+    }
+    return retval;
   }else{
     assert((*ppExpr)->eType == EXPR_TRIGRAM);
-    while((*ppExpr)->expr.trigram.nSize > 0 && (*ppExpr)->expr.trigram.curId < id){
-      sqlite3_int64 prev = (*ppExpr)->expr.trigram.curId;
-      int read = readVarInt((*ppExpr)->expr.trigram.docList, &(*ppExpr)->expr.trigram.curId);
-      (*ppExpr)->expr.trigram.curId   += prev;
-      (*ppExpr)->expr.trigram.nSize   -= read;
-      (*ppExpr)->expr.trigram.docList += read;
+    chunk_reader *pReader = (*ppExpr)->expr.trigram.pReader;
+    /* Skip to id, this skips chunks without reading them and blocks without
+     * decoding them */
+    bool more = chunkReaderSeek(pReader, id);
+    bool retval = more && pReader->reader.curId == id;
+    /* Get masks and move forward if we're at id */
+    if(retval){
+      *pMasks = docListMasks(&pReader->reader);
+      more = chunkReaderAdvance(pReader);
     }
-    bool retval = (*ppExpr)->expr.trigram.curId == id;
-    /* Check if we have to move forward */
-    if((*ppExpr)->expr.trigram.curId <= id){
-      /* If we can't we're at the end and done */
-      if((*ppExpr)->expr.trigram.nSize == 0){
-        sqlite3_free(*ppExpr);
-        *ppExpr = NULL;
-      }else{
-        sqlite3_int64 prev = (*ppExpr)->expr.trigram.curId;
-        int read = readVarInt((*ppExpr)->expr.trigram.docList, &(*ppExpr)->expr.trigram.curId);
-        (*ppExpr)->expr.trigram.curId   += prev;
-        (*ppExpr)->expr.trigram.nSize   -= read;
-        (*ppExpr)->expr.trigram.docList += read;
-      }
+    /* If we can't we're at the end and done */
+    if(!more){
+      if(pReader->rc != SQLITE_OK)
+        *pRc = pReader->rc;
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
     }
     return retval;
   }
 }
 
+/** Check if masks of the trigrams in a substring expression allows them to be
+ * adjacent in a document, aMasks holds the masks of each trigram. Position
+ * masks must have a common offset, when the mask of each trigram is shifted by
+ * its offset in the substring, and the next-character mask of each trigram must
+ * hold the character following it. Trigrams following a newline in the
+ * substring must be at their offset in their line, with line positions.
+ * Returns false, if the substring can't be in the document */
+static bool exprAdjacent(expr *pExpr, const trilite_masks *aMasks){
+  unsigned int positions = 0xFF;
+  int i;
+  assert(pExpr->eType == EXPR_SUBSTRING);
+  for(i = 0; i < pExpr->expr.substring.nTrigrams && positions; i++){
+    trilite_masks masks = aMasks[i];
+    unsigned int pos = MASK_POS_BITS(masks);
+    int offset = pExpr->expr.substring.aOffsets[i];
+    int line = pExpr->expr.substring.aLines[i];
+    if(pExpr->expr.substring.aNext[i] & ~MASK_NEXT_BITS(masks))
+      return false;
+    /* The line of the trigram starts in the substring */
+    if(line >= 0){
+      if(!(pos & (1 << (line & 7))))
+        return false;
+      continue;
+    }
+    /* Rotate so bit p is set, if trigram i can be at offset p + offset */
+    pos = ((pos >> (offset & 7)) | (pos << (8 - (offset & 7)))) & 0xFF;
+    positions &= pos;
+  }
+  return positions != 0;
+}
+
 /** Get the next result id
- * Returns true, if *pId is a result, sets ppExpr NULL there's nothing more */
-bool exprNextResult(expr **ppExpr, sqlite3_int64 *pId){
+ * Returns true, if *pId is a result, sets ppExpr NULL there's nothing more.
+ * Errors reading doclists are output as *pRc, there's no more results then. */
+bool exprNextResult(expr **ppExpr, sqlite3_int64 *pId, int *pRc){
+  *pRc = SQLITE_OK;
   while(*ppExpr){
+    trilite_masks masks;
     *pId = exprNextCandidate(*ppExpr);
-    if(exprCheckAndMove(ppExpr, *pId))
+    bool result = exprCheckAndMove(ppExpr, *pId, &masks, pRc);
+    if(*pRc != SQLITE_OK){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+      return false;
+    }
+    if(result)
       return true;
   }
   assert(!*ppExpr);
@@ -226,85 +386,335 @@ bool exprNextResult(expr **ppExpr, sqlite3_int64 *pId){
 }
 
 
-/** Create an expression for matching substrings */
-int exprSubstring(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const unsigned char *string, int nString){
+/** Create an expression for matching substrings
+ * Exact-case trigrams are used if exact is true, this requires a table with
+ * the exactcase option. *pStopAll is set to true, if the substring has only
+ * stop trigrams, it's left as is otherwise. */
+int exprSubstring(expr **ppExpr, bool *pAll, bool *pStopAll, trilite_vtab *pTrgVtab, const unsigned char *string, int nString, bool exact){
   int rc = SQLITE_OK;
   *ppExpr = NULL;
 
+  /* Trigrams of the substring, their masks and offsets, or the grams covering
+   * it with the sparse option */
+  trilite_trigram *aKeys;
+  trilite_masks *aKeyMasks;
+  int *aKeyOffsets = NULL;
+  int nKeys;
+  /* Boundary markers of anchored regexps aren't in sparse grams */
+  bool markers = false;
+  int i;
+  for(i = 0; i < nString && !markers; i++)
+    markers = IS_BOUNDARY(string[i]);
+  if(pTrgVtab->sparse && !exact && !markers)
+    rc = trigramCover(pTrgVtab, string, nString, &aKeys, &aKeyOffsets, &aKeyMasks, &nKeys);
+  else
+    rc = trigramExtract(pTrgVtab, string, nString, exact, &aKeys, &aKeyMasks, &nKeys);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Substrings shorter than a trigram are matched by their bigrams, if
+   * there's bigrams */
+  if(nKeys == 0 && pTrgVtab->pBigrams)
+    return exprBigrams(ppExpr, pAll, pTrgVtab, string, nString);
+
   /* There should be trigrams here, these special cases should be handled elsewhere */
-  if(nString < 3){
+  if(nKeys == 0){
     *pAll = true;
     return SQLITE_OK;
   }
 
-  int i;
-  for(i = 0; i < nString - 2; i++){
-    trilite_trigram trigram = HASH_TRIGRAM(string + i);
+  /* Stop trigrams have no doclists, they match all documents */
+  int nTrigrams = 0;
+  for(i = 0; i < nKeys; i++){
+    if(pTrgVtab->nStop == 0 || !stopTrigram(pTrgVtab, aKeys[i]))
+      nTrigrams++;
+  }
+  if(nTrigrams == 0){
+    sqlite3_free(aKeys);
+    *pStopAll = true;
+    *pAll = true;
+    return SQLITE_OK;
+  }
+
+  /* A single trigram has nothing to be adjacent to */
+  if(nKeys == 1){
+    rc = exprTrigram(ppExpr, pTrgVtab, aKeys[0]);
+    sqlite3_free(aKeys);
+    return rc;
+  }
+
+  /* Newlines of the substring, with line positions, see trigram.c */
+  uint32_t *aChars = NULL;
+  int nChars = 0;
+  if(pTrgVtab->linePositions && memchr(string, '\n', nString)){
+    aChars = trigramChars(pTrgVtab, string, nString, true, &nChars);
+    if(!aChars){
+      sqlite3_free(aKeys);
+      return SQLITE_NOMEM;
+    }
+  }
+
+  /* Allocate expression with trigrams, offsets, line offsets and next-character bits */
+  expr *pExpr = (expr*)sqlite3_malloc(sizeof(expr) + (sizeof(expr*) + sizeof(int) * 2 + sizeof(trilite_masks) + 1) * nTrigrams);
+  if(!pExpr){
+    sqlite3_free(aKeys);
+    sqlite3_free(aChars);
+    return SQLITE_NOMEM;
+  }
+  pExpr->eType                      = EXPR_SUBSTRING;
+  pExpr->expr.substring.nTrigrams   = nTrigrams;
+  pExpr->expr.substring.aTrigrams   = (expr**)(pExpr + 1);
+  pExpr->expr.substring.aOffsets    = (int*)(pExpr->expr.substring.aTrigrams + nTrigrams);
+  pExpr->expr.substring.aLines      = pExpr->expr.substring.aOffsets + nTrigrams;
+  pExpr->expr.substring.aMasks      = (trilite_masks*)(pExpr->expr.substring.aLines + nTrigrams);
+  pExpr->expr.substring.aNext       = (unsigned char*)(pExpr->expr.substring.aMasks + nTrigrams);
+  memset(pExpr->expr.substring.aTrigrams, 0, sizeof(expr*) * nTrigrams);
+
+  int j = 0;
+  for(i = 0; i < nKeys; i++){
+    trilite_trigram trigram = aKeys[i];
+    if(pTrgVtab->nStop > 0 && stopTrigram(pTrgVtab, trigram)) continue;
+    int offset = aKeyOffsets ? aKeyOffsets[i] : i;
+    pExpr->expr.substring.aOffsets[j] = offset;
+    /* Offset in the line following the last newline before the trigram */
+    int k = offset - 1;
+    while(aChars && k >= 0 && aChars[k] != '\n') k--;
+    pExpr->expr.substring.aLines[j] = aChars && k >= 0 ? offset - k - 1 : -1;
+    /* The last trigram has no next-character bits */
+    pExpr->expr.substring.aNext[j] = MASK_NEXT_BITS(aKeyMasks[i]);
     /* Get a trigram expression for the trigram */
-    expr *pTrgExpr;
-    rc = exprTrigram(&pTrgExpr, pTrgVtab, trigram);
+    rc = exprTrigram(&pExpr->expr.substring.aTrigrams[j], pTrgVtab, trigram);
     /* If there's no trigramExpr that satisfy our conditions */
     /* we're done here as the substring can't be matched! */
-    if(!pTrgExpr){
-      exprRelease(*ppExpr);
+    if(!pExpr->expr.substring.aTrigrams[j]){
+      sqlite3_free(aKeys);
+      sqlite3_free(aChars);
+      exprRelease(pExpr);
       *pAll = false;
-      *ppExpr = NULL; /* Can't satisfy this tree */
-      return rc;
+      return rc; /* Can't satisfy this tree */
     }
-
-    /* Combine with an AND expression */
-    if(*ppExpr){
-      rc = exprOperator(ppExpr, *ppExpr, pTrgExpr, EXPR_AND);
-      assert(rc == SQLITE_OK);
-    }else
-      *ppExpr = pTrgExpr;
+    j++;
   }
+  sqlite3_free(aKeys);
+  sqlite3_free(aChars);
 
+  *ppExpr = pExpr;
   return rc;
 }
 
 
-/** Create a trigram expression for matching against a single trigram */
+/** Create a trigram expression for matching against a single trigram
+ * The trigram may have a doclist in each segment, these are combined with OR.
+ * Segments covered by a sealed index have a single doclist in it, and ids added
+ * in the current transaction are in the pending doclist. */
 int exprTrigram(expr **ppExpr, trilite_vtab *pTrgVtab, trilite_trigram trigram){
   int rc = SQLITE_OK;
+  *ppExpr = NULL;
 
-  sqlite3_blob *pBlob;
-  char *zTable = sqlite3_mprintf("%s_index", pTrgVtab->zName);
-  /* Open the blob */
-  rc = sqlite3_blob_open(pTrgVtab->db, pTrgVtab->zDb, zTable, "doclist", trigram, 0, &pBlob);
-  sqlite3_free(zTable);
+  /* Doclist of sealed segments, read in place */
+  const unsigned char *docList;
+  int nDocList, iVersion;
+  if(sealDocList(pTrgVtab, trigram, &docList, &nDocList, &iVersion)){
+    rc = exprSealedTrigram(ppExpr, pTrgVtab, docList, nDocList, iVersion);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  int i;
+  for(i = 0; i < pTrgVtab->nSegments; i++){
+    expr *pSegExpr;
+    /* Trigrams beyond the sealed directory are read from %_chunks */
+    if(trigram < SEALED_DIRECTORY_ENTRIES && sealCovers(pTrgVtab, pTrgVtab->aSegments[i])) continue;
+    rc = exprSegmentTrigram(&pSegExpr, pTrgVtab, SEGMENT_KEY(pTrgVtab->aSegments[i], trigram));
+    if(rc != SQLITE_OK) break;
+    if(!pSegExpr) continue;
+    if(*ppExpr)
+      rc = exprOperator(ppExpr, *ppExpr, pSegExpr, EXPR_OR);
+    else
+      *ppExpr = pSegExpr;
+    if(rc != SQLITE_OK){
+      exprRelease(pSegExpr);
+      break;
+    }
+  }
+
+  /* Doclist pending in the current transaction, read without flushing it */
+  if(rc == SQLITE_OK){
+    sqlite3_int64 *aIds;
+    trilite_masks *aMasks;
+    int nIds;
+    expr *pPendingExpr = NULL;
+    rc = hashFind(pTrgVtab->pAdded, trigram, &aIds, &aMasks, &nIds);
+    if(rc == SQLITE_OK)
+      rc = exprPending(&pPendingExpr, aIds, aMasks, nIds);
+    if(rc == SQLITE_OK && pPendingExpr){
+      if(*ppExpr)
+        rc = exprOperator(ppExpr, *ppExpr, pPendingExpr, EXPR_OR);
+      else
+        *ppExpr = pPendingExpr;
+      if(rc != SQLITE_OK)
+        exprRelease(pPendingExpr);
+    }
+  }
 
-  /* If we didn't get a blob */
   if(rc != SQLITE_OK){
+    exprRelease(*ppExpr);
     *ppExpr = NULL;
+  }
+  return rc;
+}
+
+/** Create an expression for matching a substring by its bigrams, or by its
+ * character if it's a single character, see bigrams.c
+ * Bigrams don't tell if they're adjacent, so this only rules out documents
+ * without them. */
+int exprBigrams(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const unsigned char *string, int nString){
+  int rc = SQLITE_OK;
+  *ppExpr = NULL;
+  assert(pTrgVtab->pBigrams);
+
+  sqlite3_int64 *aKeys;
+  int nKeys;
+  rc = bigramsKeys(pTrgVtab, string, nString, &aKeys, &nKeys);
+  if(rc != SQLITE_OK) return rc;
+  if(nKeys == 0){
+    *pAll = true;
     return SQLITE_OK;
   }
-  /* Get size of blob */
-  int nSize = sqlite3_blob_bytes(pBlob);
 
-  /* Allocate space for expr and doclist at the same time */
-  *ppExpr = (expr*)sqlite3_malloc(sizeof(expr) + nSize);
+  int i;
+  for(i = 0; i < nKeys; i++){
+    expr *pBitmapExpr;
+    rc = exprBitmap(&pBitmapExpr, pTrgVtab, aKeys[i]);
+    if(rc != SQLITE_OK) break;
+    /* A bigram in no documents, nothing matches */
+    if(!pBitmapExpr){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+      *pAll = false;
+      break;
+    }
+    if(*ppExpr)
+      rc = exprOperator(ppExpr, *ppExpr, pBitmapExpr, EXPR_AND);
+    else
+      *ppExpr = pBitmapExpr;
+    if(rc != SQLITE_OK){
+      exprRelease(pBitmapExpr);
+      break;
+    }
+  }
+  sqlite3_free(aKeys);
+
+  if(rc != SQLITE_OK){
+    exprRelease(*ppExpr);
+    *ppExpr = NULL;
+  }
+  return rc;
+}
+
+/** Create a bitmap expression from the bitmaps of the bigram with key, and
+ * its ids pending in the current transaction */
+static int exprBitmap(expr **ppExpr, trilite_vtab *pTrgVtab, sqlite3_int64 key){
+  /* Allocate space for expr and reader at the same time */
+  *ppExpr = (expr*)sqlite3_malloc(sizeof(expr) + sizeof(bitmap_reader));
+  if(!*ppExpr) return SQLITE_NOMEM;
+  bitmap_reader *pReader = (bitmap_reader*)(*ppExpr + 1);
 
   /* Set the expr */
-  (*ppExpr)->eType                 = EXPR_TRIGRAM;
-  (*ppExpr)->expr.trigram.docList  = ((unsigned char*)(*ppExpr)) + sizeof(expr);
-  (*ppExpr)->expr.trigram.nSize    = nSize;
+  (*ppExpr)->eType                 = EXPR_BITMAP;
+  (*ppExpr)->expr.bitmap.pReader   = pReader;
+
+  /* Read first bitmap, a bigram without bitmaps matches nothing */
+  if(!bitmapReaderOpen(pReader, pTrgVtab, key)){
+    exprRelease(*ppExpr);
+    *ppExpr = NULL;
+  }
+
+  /* Ids pending in the current transaction, masks aren't known for bigrams */
+  sqlite3_int64 *aIds;
+  int nIds;
+  expr *pPendingExpr = NULL;
+  int rc = bigramsPending(pTrgVtab, key, &aIds, &nIds);
+  if(rc == SQLITE_OK)
+    rc = exprPending(&pPendingExpr, aIds, NULL, nIds);
+  if(rc == SQLITE_OK && pPendingExpr){
+    if(*ppExpr)
+      rc = exprOperator(ppExpr, *ppExpr, pPendingExpr, EXPR_OR);
+    else
+      *ppExpr = pPendingExpr;
+    if(rc != SQLITE_OK)
+      exprRelease(pPendingExpr);
+  }
+  if(rc != SQLITE_OK){
+    exprRelease(*ppExpr);
+    *ppExpr = NULL;
+  }
+  return rc;
+}
 
-  /* Read doclist into memory */
-  sqlite3_blob_read(pBlob, (*ppExpr)->expr.trigram.docList, nSize, 0);
+/** Create a pending expression from ids in ascending order and their masks,
+ * which may be NULL if masks aren't known. The expression takes over aIds and
+ * aMasks, they're released if there's no ids, and *ppExpr is NULL. */
+static int exprPending(expr **ppExpr, sqlite3_int64 *aIds, trilite_masks *aMasks, int nIds){
+  *ppExpr = NULL;
+  if(nIds == 0){
+    sqlite3_free(aIds);
+    sqlite3_free(aMasks);
+    return SQLITE_OK;
+  }
+  *ppExpr = (expr*)sqlite3_malloc(sizeof(expr));
+  if(!*ppExpr){
+    sqlite3_free(aIds);
+    sqlite3_free(aMasks);
+    return SQLITE_NOMEM;
+  }
+  (*ppExpr)->eType                  = EXPR_PENDING;
+  (*ppExpr)->expr.pending.aIds      = aIds;
+  (*ppExpr)->expr.pending.aMasks    = aMasks;
+  (*ppExpr)->expr.pending.nIds      = nIds;
+  (*ppExpr)->expr.pending.iId       = 0;
+  return SQLITE_OK;
+}
 
-  /* Release blob */
-  sqlite3_blob_close(pBlob);
+/** Create a trigram expression from the doclist stored with key */
+static int exprSegmentTrigram(expr **ppExpr, trilite_vtab *pTrgVtab, sqlite3_int64 key){
+  /* Allocate space for expr and reader at the same time */
+  *ppExpr = (expr*)sqlite3_malloc(sizeof(expr) + sizeof(chunk_reader));
+  if(!*ppExpr) return SQLITE_NOMEM;
+  chunk_reader *pReader = (chunk_reader*)(*ppExpr + 1);
 
-  /* Read first id */
-  int read = readVarInt((*ppExpr)->expr.trigram.docList, &(*ppExpr)->expr.trigram.curId);
-  (*ppExpr)->expr.trigram.curId   += DELTA_LIST_OFFSET;
-  (*ppExpr)->expr.trigram.nSize   -= read;
-  (*ppExpr)->expr.trigram.docList += read;
+  /* Set the expr */
+  (*ppExpr)->eType                 = EXPR_TRIGRAM;
+  (*ppExpr)->expr.trigram.pReader  = pReader;
+
+  /* Read first chunk, a missing doclist matches nothing */
+  int rc = SQLITE_OK;
+  if(!chunkReaderOpen(pReader, pTrgVtab, key)){
+    rc = pReader->rc;
+    exprRelease(*ppExpr);
+    *ppExpr = NULL;
+  }
 
   return rc;
 }
 
+/** Create a trigram expression from a doclist of a sealed index */
+static int exprSealedTrigram(expr **ppExpr, trilite_vtab *pTrgVtab, const unsigned char *docList, int nDocList, int iVersion){
+  /* Allocate space for expr and reader at the same time */
+  *ppExpr = (expr*)sqlite3_malloc(sizeof(expr) + sizeof(chunk_reader));
+  if(!*ppExpr) return SQLITE_NOMEM;
+  chunk_reader *pReader = (chunk_reader*)(*ppExpr + 1);
+
+  /* Set the expr */
+  (*ppExpr)->eType                 = EXPR_TRIGRAM;
+  (*ppExpr)->expr.trigram.pReader  = pReader;
+
+  if(!chunkReaderOpenSealed(pReader, pTrgVtab, docList, nDocList, iVersion)){
+    exprRelease(*ppExpr);
+    *ppExpr = NULL;
+  }
+
+  return SQLITE_OK;
+}
+
 /** Create an operator expression */
 int exprOperator(expr** ppExpr, expr* pExpr1, expr* pExpr2, expr_type eType){
   assert(eType & EXPR_OP);
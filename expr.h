@@ -12,18 +12,22 @@ enum expr_type{
   EXPR_TRIGRAM  = 1,
   EXPR_OP       = 1 << 1,
   EXPR_AND      = EXPR_OP | (1 << 2),
-  EXPR_OR       = EXPR_OP | (1 << 3)
+  EXPR_OR       = EXPR_OP | (1 << 3),
+  EXPR_SUBSTRING= 1 << 4,
+  EXPR_BITMAP   = 1 << 5,
+  EXPR_PENDING  = 1 << 6
 };
 
 typedef enum expr_type expr_type;
 
-int exprParsePatterns(expr**, bool*, trilite_vtab*, int, sqlite3_value**);
-int  exprParse(expr**, bool*, trilite_vtab*, const unsigned char*, int);
+int exprParsePatterns(expr**, bool*, bool*, trilite_vtab*, int, sqlite3_value**);
+int  exprParse(expr**, bool*, bool*, trilite_vtab*, const unsigned char*, int);
 void exprRelease(expr*);
-bool exprNextResult(expr**, sqlite3_int64*);
+bool exprNextResult(expr**, sqlite3_int64*, int*);
 
-int exprSubstring(expr**, bool*, trilite_vtab*, const unsigned char*, int);
+int exprSubstring(expr**, bool*, bool*, trilite_vtab*, const unsigned char*, int, bool);
 int exprTrigram(expr**, trilite_vtab*, trilite_trigram);
+int exprBigrams(expr**, bool*, trilite_vtab*, const unsigned char*, int);
 int exprOperator(expr**, expr*, expr*, expr_type);
 
 #endif /* TRILITE_EXPR_H */
@@ -28,12 +28,24 @@ typedef struct hash_entry hash_entry;
 struct hash_table{
   /** Current memory usage by the hash table */
   int memory;
+  /** Ids are stored as uint32_t rather than sqlite3_int64 */
+  bool compact;
   /** Keys, each key contains a linked list of trigrams */
   hash_entry *keys[HASH_TABLE_ENTRIES];
 };
 
-/** Simple macro for getting the doclist pointer from hash_entry */
-#define DOCLIST(pEntry)             ((sqlite3_int64*)(pEntry + 1))
+/** Size of an id in the doclist of a hash_entry */
+#define ID_SIZE(pTable)             ((pTable)->compact ? sizeof(uint32_t) : sizeof(sqlite3_int64))
+
+/** Simple macro for getting the doclist pointer from hash_entry, the doclist
+ * holds uint32_t ids for compact tables, sqlite3_int64 ids otherwise */
+#define DOCLIST(pEntry)             ((unsigned char*)(pEntry + 1))
+
+/** Get the masks of the doclist from hash_entry, stored after all slots */
+#define MASKS(pTable, pEntry)       ((trilite_masks*)(DOCLIST(pEntry) + ((pEntry)->nDocList + (pEntry)->nSizeAvail) * ID_SIZE(pTable)))
+
+/** Size of a slot in a hash_entry, id and masks */
+#define SLOT_SIZE(pTable)           (ID_SIZE(pTable) + sizeof(trilite_masks))
 
 /** Hash entry, for a given trigram, chained with all trigrams that have the same key */
 struct hash_entry{
@@ -50,23 +62,28 @@ struct hash_entry{
   int nDocList;
 
   /** doclist is stored at this location, you can get the doclist of a
-   * hash_entry using the DOCLIST(pEntry) macro. */
+   * hash_entry using the DOCLIST(pEntry) macro, followed by masks for each
+   * slot, see the MASKS(pEntry) macro. */
 };
 
 static bool findEntry(hash_table*, trilite_trigram, hash_entry**, hash_entry**);
+static void copyIds(hash_table*, hash_entry*, sqlite3_int64*);
 
-/** Allocate a new hash table, output it to ppTable */
-int hashCreate(hash_table** ppTable){
+/** Allocate a new hash table, output it to ppTable
+ * With compact, ids must be in the range of uint32_t, and take half the memory. */
+int hashCreate(hash_table** ppTable, bool compact){
   *ppTable = (hash_table*)sqlite3_malloc(sizeof(hash_table));
   if(!*ppTable) return SQLITE_NOMEM;
   memset(*ppTable, 0, sizeof(hash_table));
   (*ppTable)->memory = 0;
+  (*ppTable)->compact = compact;
   return SQLITE_OK;
 }
 
 /** Release all resources held by the hash table */
 void hashRelease(hash_table *pTable){
   int i;
+  if(!pTable) return;
   for(i = 0; i < HASH_TABLE_ENTRIES; i++){
     hash_entry *pEntry = pTable->keys[i];
     while(pEntry){
@@ -85,23 +102,48 @@ int hashMemoryUsage(hash_table* pTable){
 }
 
 
-/** Find doclist for trigram in hash table 
- * Returns pointer to doclist, NULL if not found.
- * Number of entries in doclist is output as *pnDocList (0 if doclist == NULL).
- */
-sqlite3_int64* hashFind(hash_table *pTable, trilite_trigram trigram, int *pnDocList){
+/** Find doclist for trigram in hash table
+ * A copy of the ids is output as *pIds and their masks as *pMasks, both
+ * allocated with sqlite3_malloc, and the number of ids as *pnIds. Outputs NULL
+ * and 0 ids, if not found. */
+int hashFind(hash_table *pTable, trilite_trigram trigram, sqlite3_int64 **pIds, trilite_masks **pMasks, int *pnIds){
   hash_entry *pEntry;
   hash_entry *pPrevEntry;
-  if(findEntry(pTable, trigram, &pEntry, &pPrevEntry)){
-    *pnDocList = pEntry->nDocList;
-    return DOCLIST(pEntry);
+  *pIds   = NULL;
+  *pMasks = NULL;
+  *pnIds  = 0;
+  if(!findEntry(pTable, trigram, &pEntry, &pPrevEntry) || pEntry->nDocList == 0)
+    return SQLITE_OK;
+  *pIds   = (sqlite3_int64*)sqlite3_malloc(sizeof(sqlite3_int64) * pEntry->nDocList);
+  *pMasks = (trilite_masks*)sqlite3_malloc(sizeof(trilite_masks) * pEntry->nDocList);
+  if(!*pIds || !*pMasks){
+    sqlite3_free(*pIds);
+    sqlite3_free(*pMasks);
+    *pIds   = NULL;
+    *pMasks = NULL;
+    return SQLITE_NOMEM;
   }
-  *pnDocList = 0;
-  return NULL;
+  copyIds(pTable, pEntry, *pIds);
+  memcpy(*pMasks, MASKS(pTable, pEntry), sizeof(trilite_masks) * pEntry->nDocList);
+  *pnIds = pEntry->nDocList;
+  return SQLITE_OK;
+}
+
+/** Copy ids of the doclist of pEntry to ids, as sqlite3_int64 */
+static void copyIds(hash_table *pTable, hash_entry *pEntry, sqlite3_int64 *ids){
+  int i;
+  if(!pTable->compact){
+    memcpy(ids, DOCLIST(pEntry), sizeof(sqlite3_int64) * pEntry->nDocList);
+    return;
+  }
+  const uint32_t *docList = (const uint32_t*)DOCLIST(pEntry);
+  for(i = 0; i < pEntry->nDocList; i++)
+    ids[i] = docList[i];
 }
 
-/** Insert document id in hash */
-bool hashInsert(hash_table *pTable, trilite_trigram trigram, sqlite3_int64 id){
+/** Insert document id with masks in hash
+ * Returns false, if id was already here, masks are merged with the present. */
+bool hashInsert(hash_table *pTable, trilite_trigram trigram, sqlite3_int64 id, trilite_masks masks){
   hash_entry *pEntry;
   hash_entry *pPrevEntry;
   if(findEntry(pTable, trigram, &pEntry, &pPrevEntry)){
@@ -109,18 +151,21 @@ bool hashInsert(hash_table *pTable, trilite_trigram trigram, sqlite3_int64 id){
     if(!pEntry->nSizeAvail){
       assert(ALLOCATION_FACTOR >= 1);
       int slots = pEntry->nDocList * ALLOCATION_FACTOR + 1;
-      pEntry = (hash_entry*)sqlite3_realloc(pEntry, sizeof(hash_entry) + sizeof(sqlite3_int64) * slots);
+      pEntry = (hash_entry*)sqlite3_realloc(pEntry, sizeof(hash_entry) + SLOT_SIZE(pTable) * slots);
+      /* Move masks after the new slots */
+      trilite_masks *oldMasks = MASKS(pTable, pEntry);
       pEntry->nSizeAvail = slots - pEntry->nDocList;
-      pTable->memory += pEntry->nSizeAvail * sizeof(sqlite3_int64);
+      memmove(MASKS(pTable, pEntry), oldMasks, pEntry->nDocList * sizeof(trilite_masks));
+      pTable->memory += pEntry->nSizeAvail * SLOT_SIZE(pTable);
     }
   }else{
     /* If there was not entry for this trigram let's allocate one */
-    pEntry = (hash_entry*)sqlite3_malloc(sizeof(hash_entry) + sizeof(sqlite_int64) * MIN_ALLOCATION);
+    pEntry = (hash_entry*)sqlite3_malloc(sizeof(hash_entry) + SLOT_SIZE(pTable) * MIN_ALLOCATION);
     pEntry->nDocList    = 0;
     pEntry->nSizeAvail  = MIN_ALLOCATION;
     pEntry->next        = NULL;
     pEntry->trigram     = trigram;
-    pTable->memory += sizeof(hash_entry) + sizeof(sqlite_int64) * MIN_ALLOCATION;
+    pTable->memory += sizeof(hash_entry) + SLOT_SIZE(pTable) * MIN_ALLOCATION;
   }
   /* Create/Update references */
   if(pPrevEntry)
@@ -131,15 +176,36 @@ bool hashInsert(hash_table *pTable, trilite_trigram trigram, sqlite3_int64 id){
   /* Insert id into docList, move ids as necessary */
   int i;
   /* TODO A cute little binary search might be nice */
-  sqlite3_int64 *docList = DOCLIST(pEntry);
-  for(i = 0; i < pEntry->nDocList; i++)
-    if(docList[i] >= id) break;
+  unsigned char *docList = DOCLIST(pEntry);
+  trilite_masks *docMasks = MASKS(pTable, pEntry);
+  bool found = false;
+  if(pTable->compact){
+    assert(0 <= id && id <= (sqlite3_int64)UINT32_MAX);
+    uint32_t *ids = (uint32_t*)docList;
+    for(i = 0; i < pEntry->nDocList; i++)
+      if(ids[i] >= id) break;
+    found = i < pEntry->nDocList && ids[i] == id;
+  }else{
+    sqlite3_int64 *ids = (sqlite3_int64*)docList;
+    for(i = 0; i < pEntry->nDocList; i++)
+      if(ids[i] >= id) break;
+    found = i < pEntry->nDocList && ids[i] == id;
+  }
   /* Return false, if id was already here */
-  if(i < pEntry->nDocList && docList[i] == id) return false;
+  if(found){
+    docMasks[i] |= masks;
+    return false;
+  }
   /* Move all ids > id */
-  memmove(docList + i + 1, docList + i, (pEntry->nDocList - i) * sizeof(sqlite3_int64));
+  int nIdSize = ID_SIZE(pTable);
+  memmove(docList + (i + 1) * nIdSize, docList + i * nIdSize, (pEntry->nDocList - i) * nIdSize);
+  memmove(docMasks + i + 1, docMasks + i, (pEntry->nDocList - i) * sizeof(trilite_masks));
   /* Insert id */
-  docList[i] = id;
+  if(pTable->compact)
+    ((uint32_t*)docList)[i] = (uint32_t)id;
+  else
+    ((sqlite3_int64*)docList)[i] = id;
+  docMasks[i] = masks;
 
   /* Update available size */
   pEntry->nDocList += 1;
@@ -181,6 +247,10 @@ struct hash_table_cursor{
   int iOffset;
   hash_entry *pDelete;
   hash_table *pTable;
+  /** Ids of the last entry popped from a compact table, as sqlite3_int64 */
+  sqlite3_int64 *aIds;
+  /** Number of ids allocated for aIds */
+  int nIdsAlloc;
 };
 
 /** Allocate and open a hash table cursor */
@@ -190,17 +260,24 @@ int hashOpen(hash_table *pTable, hash_table_cursor **ppCur){
   (*ppCur)->iOffset = 0;
   (*ppCur)->pDelete = NULL;
   (*ppCur)->pTable  = pTable;
+  (*ppCur)->aIds    = NULL;
+  (*ppCur)->nIdsAlloc = 0;
   return SQLITE_OK;
 }
 
 /** Return and remove the next trigram and doclist
  * Returns false, if at end of hash table
- * The trigram is returned as *pTrigram, list of ids as *ids, and length of *pIds
- * as *nIds. Pointers will be deallocated on next call to either hashPop or
- * hashClose.
+ * The trigram is returned as *pTrigram, list of ids as *ids, masks of each id as
+ * *pMasks, and length of *pIds as *nIds. Pointers will be deallocated on next
+ * call to either hashPop or hashClose.
+ * Also returns false, if ids of a compact table can't be allocated, the entry is
+ * then left in the hash table, and SQLITE_NOMEM is output as *pRc, which is
+ * SQLITE_OK otherwise.
  */
-bool hashPop(hash_table_cursor *pCur,
-             trilite_trigram *pTrigram, sqlite3_int64 **pIds, int *nIds){
+bool hashPop(hash_table_cursor *pCur, trilite_trigram *pTrigram,
+             sqlite3_int64 **pIds, trilite_masks **pMasks, int *nIds, int *pRc){
+  *pRc = SQLITE_OK;
+
   /* Release anything waiting for release */
   if(pCur->pDelete){
     sqlite3_free(pCur->pDelete);
@@ -215,17 +292,34 @@ bool hashPop(hash_table_cursor *pCur,
   if(pCur->iOffset >= HASH_TABLE_ENTRIES)
     return false;
 
+  /* Ids of compact tables are returned as sqlite3_int64 */
+  hash_entry *pEntry = pCur->pTable->keys[pCur->iOffset];
+  if(pCur->pTable->compact && pCur->nIdsAlloc < pEntry->nDocList){
+    sqlite3_int64 *aIds = (sqlite3_int64*)sqlite3_realloc(pCur->aIds, sizeof(sqlite3_int64) * pEntry->nDocList);
+    if(!aIds){
+      *pRc = SQLITE_NOMEM;
+      return false;
+    }
+    pCur->aIds = aIds;
+    pCur->nIdsAlloc = pEntry->nDocList;
+  }
+
   /* Set the entry we wish to delete */
-  pCur->pDelete = pCur->pTable->keys[pCur->iOffset];
+  pCur->pDelete = pEntry;
   /* Remove it from the hash table */
   pCur->pTable->keys[pCur->iOffset] = pCur->pDelete->next;
 
   /* Update memory usage */
-  pCur->pTable->memory -= sizeof(hash_entry) + (pCur->pDelete->nDocList + pCur->pDelete->nSizeAvail) * sizeof(sqlite3_int64);
+  pCur->pTable->memory -= sizeof(hash_entry) + (pCur->pDelete->nDocList + pCur->pDelete->nSizeAvail) * SLOT_SIZE(pCur->pTable);
 
   /* Set return values */
   *pTrigram = pCur->pDelete->trigram;
-  *pIds     = DOCLIST(pCur->pDelete);
+  if(pCur->pTable->compact){
+    copyIds(pCur->pTable, pCur->pDelete, pCur->aIds);
+    *pIds   = pCur->aIds;
+  }else
+    *pIds   = (sqlite3_int64*)DOCLIST(pCur->pDelete);
+  *pMasks   = MASKS(pCur->pTable, pCur->pDelete);
   *nIds     = pCur->pDelete->nDocList;
   return true; 
 }
@@ -238,6 +332,7 @@ void hashClose(hash_table_cursor *pCur){
     pCur->pDelete = NULL;
   }
   /* Release the cursor */
+  sqlite3_free(pCur->aIds);
   sqlite3_free(pCur);
   pCur = NULL;
 }
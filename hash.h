@@ -7,15 +7,15 @@
 
 #include <stdbool.h>
 
-int hashCreate(hash_table**);
+int hashCreate(hash_table**, bool);
 void hashRelease(hash_table*);
 int hashMemoryUsage(hash_table*);
-sqlite3_int64* hashFind(hash_table*, trilite_trigram, int*);
-bool hashInsert(hash_table*, trilite_trigram, sqlite3_int64);
+int hashFind(hash_table*, trilite_trigram, sqlite3_int64**, trilite_masks**, int*);
+bool hashInsert(hash_table*, trilite_trigram, sqlite3_int64, trilite_masks);
 bool hashRemove(hash_table*, trilite_trigram, sqlite3_int64);
 
 int hashOpen(hash_table*, hash_table_cursor**);
-bool hashPop(hash_table_cursor*, trilite_trigram*, sqlite3_int64**, int*);
+bool hashPop(hash_table_cursor*, trilite_trigram*, sqlite3_int64**, trilite_masks**, int*, int*);
 void hashClose(hash_table_cursor*);
 
 #endif /* TRILITE_HASH_H */
@@ -0,0 +1,167 @@
+#include "lz.h"
+#include "config.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+/** A small LZ77 codec, in the spirit of LZ4
+ * Data is encoded as sequences of literals followed by a match, a copy of
+ * earlier output. Each sequence starts with a token, literal length in the
+ * high 4 bits and match length in the low 4 bits, a length of 15 is extended
+ * by bytes until a byte less than 255. Literals follow the token, then the
+ * offset of the match as 2 bytes little endian and the extended match length.
+ * The last sequence has no match, so decoding ends after its literals.
+ *
+ * Data is compressed and decompressed with a prefix, which is not encoded, but
+ * matches may refer to it. This is used for compressing with a dictionary.
+ */
+
+#define MAX(a,b)    ((a) < (b) ? (b) : (a))
+#define MIN(a,b)    ((a) > (b) ? (b) : (a))
+
+/** Minimum length of a match */
+#define LZ_MIN_MATCH      4
+
+/** Maximum offset of a match */
+#define LZ_MAX_OFFSET     65535
+
+/** Number of bits in hash of LZ_MIN_MATCH bytes */
+#define LZ_HASH_BITS      14
+
+/** Hash of LZ_MIN_MATCH bytes at p */
+#define LZ_HASH(p)        ((read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS))
+
+static uint32_t read32(const unsigned char*);
+static unsigned char *writeLength(unsigned char*, int);
+static unsigned char *writeSequence(unsigned char*, const unsigned char*, int, int, int);
+
+/** Compress buf[nPrefix..nBuf) to dst, with buf[0..nPrefix) as prefix
+ * dst must have space for LZ_BOUND(nBuf - nPrefix) bytes.
+ * Returns number of bytes written to dst, or -1 if out of memory */
+int lzCompress(const unsigned char *buf, int nPrefix, int nBuf, unsigned char *dst){
+  int *table = (int*)sqlite3_malloc(sizeof(int) << LZ_HASH_BITS);
+  if(!table) return -1;
+  memset(table, 0xFF, sizeof(int) << LZ_HASH_BITS);
+
+  /* Hash the prefix, so matches can refer to it */
+  int i;
+  for(i = MAX(0, nPrefix - LZ_MAX_OFFSET); i + LZ_MIN_MATCH <= nPrefix; i++)
+    table[LZ_HASH(buf + i)] = i;
+
+  unsigned char *pOut = dst;
+  int anchor = nPrefix;
+  i = nPrefix;
+  while(i + LZ_MIN_MATCH <= nBuf){
+    uint32_t h = LZ_HASH(buf + i);
+    int candidate = table[h];
+    table[h] = i;
+    if(candidate < 0 || i - candidate > LZ_MAX_OFFSET || memcmp(buf + candidate, buf + i, LZ_MIN_MATCH) != 0){
+      i++;
+      continue;
+    }
+    /* Extend the match as far as possible */
+    int length = LZ_MIN_MATCH;
+    while(i + length < nBuf && buf[candidate + length] == buf[i + length])
+      length++;
+    pOut = writeSequence(pOut, buf + anchor, i - anchor, i - candidate, length);
+    /* Hash positions within the match */
+    int end = i + length;
+    for(i++; i < end && i + LZ_MIN_MATCH <= nBuf; i++)
+      table[LZ_HASH(buf + i)] = i;
+    i = end;
+    anchor = end;
+  }
+
+  /* Last literals */
+  pOut = writeSequence(pOut, buf + anchor, nBuf - anchor, 0, 0);
+  sqlite3_free(table);
+  assert(pOut - dst <= LZ_BOUND(nBuf - nPrefix));
+  return pOut - dst;
+}
+
+/** Decompress src of nSrc bytes to buf[nPrefix..nBuf), with buf[0..nPrefix)
+ * holding the prefix it was compressed with.
+ * Returns SQLITE_CORRUPT, if src doesn't decompress to exactly nBuf bytes */
+int lzDecompress(const unsigned char *src, int nSrc, unsigned char *buf, int nPrefix, int nBuf){
+  const unsigned char *pIn  = src;
+  const unsigned char *pEnd = src + nSrc;
+  unsigned char *pOut       = buf + nPrefix;
+  unsigned char *pOutEnd    = buf + nBuf;
+  while(pIn < pEnd){
+    int token = *pIn++;
+    /* Literals */
+    int length = token >> 4;
+    if(length == 15){
+      int b;
+      do{
+        if(pIn >= pEnd) return SQLITE_CORRUPT;
+        b = *pIn++;
+        length += b;
+      }while(b == 255);
+    }
+    if(length > pEnd - pIn || length > pOutEnd - pOut) return SQLITE_CORRUPT;
+    memcpy(pOut, pIn, length);
+    pOut += length;
+    pIn  += length;
+    /* The last sequence has no match */
+    if(pIn == pEnd) break;
+    /* Match */
+    if(pEnd - pIn < 2) return SQLITE_CORRUPT;
+    int offset = pIn[0] | (pIn[1] << 8);
+    pIn += 2;
+    length = (token & 15) + LZ_MIN_MATCH;
+    if((token & 15) == 15){
+      int b;
+      do{
+        if(pIn >= pEnd) return SQLITE_CORRUPT;
+        b = *pIn++;
+        length += b;
+      }while(b == 255);
+    }
+    if(offset == 0 || offset > pOut - buf || length > pOutEnd - pOut) return SQLITE_CORRUPT;
+    /* Copy byte by byte, as the match may overlap the output */
+    const unsigned char *pMatch = pOut - offset;
+    while(length--)
+      *pOut++ = *pMatch++;
+  }
+  return pOut == pOutEnd ? SQLITE_OK : SQLITE_CORRUPT;
+}
+
+/** Read 4 bytes at p */
+static uint32_t read32(const unsigned char *p){
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/** Write remainder of a length of 15 or more, returns end of output */
+static unsigned char *writeLength(unsigned char *pOut, int length){
+  length -= 15;
+  while(length >= 255){
+    *pOut++ = 255;
+    length -= 255;
+  }
+  *pOut++ = (unsigned char)length;
+  return pOut;
+}
+
+/** Write a sequence of nLiterals literals and a match, a sequence without
+ * match is written if length is 0. Returns end of output */
+static unsigned char *writeSequence(unsigned char *pOut, const unsigned char *literals, int nLiterals, int offset, int length){
+  int matchLength = length ? length - LZ_MIN_MATCH : 0;
+  *pOut++ = (unsigned char)((MIN(nLiterals, 15) << 4) | MIN(matchLength, 15));
+  if(nLiterals >= 15)
+    pOut = writeLength(pOut, nLiterals);
+  memcpy(pOut, literals, nLiterals);
+  pOut += nLiterals;
+  if(length){
+    *pOut++ = (unsigned char)(offset & 0xFF);
+    *pOut++ = (unsigned char)(offset >> 8);
+    if(matchLength >= 15)
+      pOut = writeLength(pOut, matchLength);
+  }
+  return pOut;
+}
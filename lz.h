@@ -0,0 +1,12 @@
+#ifndef TRILITE_LZ_H
+#define TRILITE_LZ_H
+
+#include <sqlite3ext.h>
+
+/** Maximum size of data compressed from n bytes */
+#define LZ_BOUND(n)       ((n) + (n) / 255 + 16)
+
+int lzCompress(const unsigned char*, int, int, unsigned char*);
+int lzDecompress(const unsigned char*, int, unsigned char*, int, int);
+
+#endif /* TRILITE_LZ_H */
@@ -7,11 +7,15 @@ const sqlite3_api_routines *sqlite3_api;
 #include "scanstr.h"
 #include "cursor.h"
 #include "regexp.h"
+#include "utf8.h"
 
 #include <assert.h>
 
 #include <string.h>
 
+#define MAX(a,b)    ((a) < (b) ? (b) : (a))
+#define MIN(a,b)    ((a) > (b) ? (b) : (a))
+
 typedef enum pattern_type pattern_type;
 
 /** Different pattern types */
@@ -43,13 +47,34 @@ struct aux_pattern_data{
 
   /** Length of pattern */
   int nPattern;
+
+  /** True, if lastResult is the result for document lastDocId */
+  bool hasLast;
+
+  /** Document id of the last document matched, without extents */
+  sqlite3_int64 lastDocId;
+
+  /** Result for the last document matched, ids sharing a document reuse it */
+  bool lastResult;
+
+  /** Case folded codepoints of the pattern, for case-insensitive patterns on
+   * tables with the utf8 option, NULL until needed */
+  uint32_t *aFolded;
+
+  /** Number of codepoints in aFolded */
+  int nFolded;
 };
 
+static bool matchBlocks(trilite_cursor*, aux_pattern_data*, const unsigned char*, int, const int*, int);
+static const unsigned char *scanicase(const unsigned char*, int, const unsigned char*, int);
+
 /** Release auxiliary data structure */
 void matchAuxDataFree(aux_pattern_data *pAuxData){
   if(pAuxData->pRegExp)
     regexpRelease(pAuxData->pRegExp);
   pAuxData->pRegExp = NULL;
+  sqlite3_free(pAuxData->aFolded);
+  pAuxData->aFolded = NULL;
   sqlite3_free(pAuxData);
 }
 
@@ -101,6 +126,9 @@ void matchCreate(aux_pattern_data **ppAuxData, const unsigned char *pattern, int
     return;
   }
 
+  (*ppAuxData)->hasLast = false;
+  (*ppAuxData)->aFolded = NULL;
+  (*ppAuxData)->nFolded = 0;
   memcpy((*ppAuxData)->pattern, pattern + offset, nPattern - offset);
   (*ppAuxData)->pattern[nPattern - offset] = '\0';
   (*ppAuxData)->nPattern = nPattern - offset;
@@ -150,13 +178,44 @@ void matchFunction(sqlite3_context* pCtx, int argc, sqlite3_value** argv){
   }
   
 
+  /* Ids sharing a document, see dedup.c, are only matched once */
+  sqlite3_int64 docId = triliteDocId(pTrgCur);
+  bool cache = !(pAuxData->eType & PATTERN_EXTENTS);
+  if(cache && pAuxData->hasLast && pAuxData->lastDocId == docId){
+    sqlite3_result_int(pCtx, pAuxData->lastResult ? 1 : 0);
+    return;
+  }
+
   /* Get the text from the cursor */
   const unsigned char *text;
   int nText;
-  triliteText(pTrgCur, &text, &nText);
+  int rc = triliteText(pTrgCur, &text, &nText);
+  if(rc != SQLITE_OK){
+    sqlite3_result_error_code(pCtx, rc);
+    return;
+  }
+
+  /* Case-insensitive patterns are matched by codepoints on utf8 tables */
+  bool utf8 = (pAuxData->eType & PATTERN_ISUBSTR) && triliteUtf8(pTrgCur);
+  if(utf8 && !pAuxData->aFolded){
+    pAuxData->aFolded = (uint32_t*)sqlite3_malloc(sizeof(uint32_t) * (pAuxData->nPattern + 1));
+    if(!pAuxData->aFolded){
+      sqlite3_result_error_nomem(pCtx);
+      return;
+    }
+    pAuxData->nFolded = utf8Decode(pAuxData->pattern, pAuxData->nPattern, true, pAuxData->aFolded);
+  }
 
   bool retval = false;
-  if(pAuxData->eType & PATTERN_SUBSTR){
+  int *aBlocks;
+  int nBlocks;
+  /* Blocks are indexed by byte trigrams, they can't be used with codepoints */
+  if(pAuxData->eType & (PATTERN_SUBSTR | PATTERN_ISUBSTR) && !utf8 &&
+     triliteBlocks(pTrgCur, nText, pAuxData->pattern, pAuxData->nPattern, &aBlocks, &nBlocks)){
+    /* Large documents indexed by blocks, only scan candidate blocks */
+    retval = matchBlocks(pTrgCur, pAuxData, text, nText, aBlocks, nBlocks);
+    sqlite3_free(aBlocks);
+  } else if(pAuxData->eType & PATTERN_SUBSTR){
     const unsigned char *start = scanstr(text, nText, pAuxData->pattern, pAuxData->nPattern);
     retval = start != NULL;
     /* If output extents is requested */
@@ -167,6 +226,16 @@ void matchFunction(sqlite3_context* pCtx, int argc, sqlite3_value** argv){
         start = scanstr(end, nText - (end - text), pAuxData->pattern, pAuxData->nPattern);
       }
     }
+  } else if(utf8){
+    const unsigned char *end;
+    const unsigned char *start = utf8Search(text, nText, pAuxData->aFolded, pAuxData->nFolded, &end);
+    retval = start != NULL;
+    if(pAuxData->eType & PATTERN_EXTENTS && pAuxData->nFolded > 0){
+      while(start){
+        triliteAddExtents(pTrgCur, start - text, end - text);
+        start = utf8Search(end, nText - (end - text), pAuxData->aFolded, pAuxData->nFolded, &end);
+      }
+    }
   } else if(pAuxData->eType & PATTERN_ISUBSTR){
     const char *start = strcasestr((const char*)text, (const char*)pAuxData->pattern);
     retval = start != NULL;
@@ -193,6 +262,12 @@ void matchFunction(sqlite3_context* pCtx, int argc, sqlite3_value** argv){
     return;
   }
 
+  if(cache){
+    pAuxData->hasLast    = true;
+    pAuxData->lastDocId  = docId;
+    pAuxData->lastResult = retval;
+  }
+
   /* Return true (1) if pattern in a substring of text */
   if(retval){
     sqlite3_result_int(pCtx, 1);
@@ -200,3 +275,47 @@ void matchFunction(sqlite3_context* pCtx, int argc, sqlite3_value** argv){
     sqlite3_result_int(pCtx, 0);
   }
 }
+
+/** Match substring pattern against candidate blocks of a large document
+ * Candidate blocks from triliteBlocks holds all blocks where an occurrence may
+ * start, the scan of each block extends nPattern - 1 bytes into the next, so
+ * occurrences crossing a block boundary are found too. Extents are recorded
+ * as when scanning the entire text.
+ * Returns true, if text holds the pattern */
+static bool matchBlocks(trilite_cursor *pTrgCur, aux_pattern_data *pAuxData, const unsigned char *text,
+                        int nText, const int *aBlocks, int nBlocks){
+  int nPattern = pAuxData->nPattern;
+  bool retval = false;
+  int from = 0;   /* Offset after the last extent recorded */
+  int i;
+  for(i = 0; i < nBlocks; i++){
+    /* Occurrences must start in [start, limit), and end before end */
+    int start = MAX(aBlocks[i] * DOCUMENT_BLOCK_SIZE, from);
+    int limit = MIN((aBlocks[i] + 1) * DOCUMENT_BLOCK_SIZE, nText);
+    int end   = MIN(limit + nPattern - 1, nText);
+    while(start < limit){
+      const unsigned char *match;
+      if(pAuxData->eType & PATTERN_SUBSTR)
+        match = scanstr(text + start, end - start, pAuxData->pattern, nPattern);
+      else
+        match = scanicase(text + start, end - start, pAuxData->pattern, nPattern);
+      if(!match || match - text >= limit) break;
+      retval = true;
+      if(!(pAuxData->eType & PATTERN_EXTENTS)) return true;
+      triliteAddExtents(pTrgCur, match - text, match - text + nPattern);
+      start = from = match - text + nPattern;
+    }
+  }
+  return retval;
+}
+
+/** Find first case-insensitive occurrence of pattern in text of nText bytes
+ * Returns NULL, if there is no such occurrence */
+static const unsigned char *scanicase(const unsigned char *text, int nText, const unsigned char *pattern, int nPattern){
+  int i;
+  for(i = 0; i + nPattern <= nText; i++){
+    if(strncasecmp((const char*)text + i, (const char*)pattern, nPattern) == 0)
+      return text + i;
+  }
+  return NULL;
+}
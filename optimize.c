@@ -0,0 +1,384 @@
+#include "optimize.h"
+#include "vtable.h"
+#include "segment.h"
+#include "store.h"
+#include "stop.h"
+#include "hash.h"
+#include "trigram.h"
+#include "bigrams.h"
+#include "tombstone.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+/* Doclists are delta encoded, so they're smaller and faster to decode when
+ * documents sharing trigrams have ids close to each other. Ids given on insert
+ * rarely have this property, so INSERT INTO t(contents) VALUES('optimize')
+ * reassigns the internal document ids, such that similar documents get
+ * adjacent document ids.
+ *
+ * Documents are clustered by sorting them by a MinHash signature of their set
+ * of trigrams, documents sharing the trigram with the smallest hash end up
+ * next to each other, and so on. The sorted documents are given the existing
+ * document ids in ascending order, so the set of document ids doesn't change.
+ * Rows of %_content, %_blocks, %_always and %_signatures are moved to the new
+ * document ids, and all segments are rewritten as a single segment with the
+ * new ids. Postings of deleted documents are dropped, as only documents in
+ * %_content are given new ids, so tombstones are cleared, see tombstone.c.
+ *
+ * Ids seen by users are kept in %_docids, which maps each id to the document id
+ * it's stored under. Tables without %_docids store documents under their id.
+ *
+ * Stop trigrams are recomputed at the same time, see stop.c. Document
+ * frequency of other trigrams is the length of their doclist, while stop
+ * trigrams are counted when loading the documents.
+ */
+
+typedef struct optimize_doc optimize_doc;
+
+/** Document being clustered */
+struct optimize_doc{
+  /** Current document id */
+  sqlite3_int64 docId;
+
+  /** Index of docId in the sorted list of document ids */
+  int iOrder;
+
+  /** MinHash signature of the trigrams of the document */
+  uint32_t signature[OPTIMIZE_SIGNATURE_SIZE];
+};
+
+/** Multipliers of the hash functions used for signatures */
+static const uint64_t aSeeds[] = {
+  0x9E3779B97F4A7C15ULL,
+  0xC2B2AE3D27D4EB4FULL,
+  0x165667B19E3779F9ULL,
+  0xD6E8FEB86659FD93ULL
+};
+
+static int loadDocuments(trilite_vtab*, optimize_doc**, int*, int*);
+static void computeSignature(optimize_doc*, const unsigned char*, int);
+static int countStopTrigrams(trilite_vtab*, const unsigned char*, int, int, int*);
+static int updateStopTrigrams(trilite_vtab*, const int*, sqlite3_int64);
+static int reindexTrigrams(trilite_vtab*, const trilite_trigram*, int);
+static int moveDocuments(trilite_vtab*, const sqlite3_int64*, const sqlite3_int64*, int);
+static int compareDocuments(const void*, const void*);
+
+
+/** Reassign document ids so similar documents are adjacent, rewrite
+ * %_content, %_blocks, the index and %_bigrams to match, and recompute stop
+ * trigrams. Ids must be mapped through %_docids already. */
+int optimizeIndex(trilite_vtab *pTrgVtab){
+  optimize_doc *aDocs = NULL;
+  int *aStopDocs = NULL;
+  int nDocs = 0;
+  int rc, i;
+
+  assert(sizeof(aSeeds) / sizeof(aSeeds[0]) >= OPTIMIZE_SIGNATURE_SIZE);
+
+  /* Flush pending doclists and content, so everything is reassigned */
+  rc = triliteSync((sqlite3_vtab*)pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+
+  assert(pTrgVtab->mapIds);
+
+  /* Tables from before %_stop and %_always have neither */
+  char *zSql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS %Q.'%q_stop' (trigram INTEGER PRIMARY KEY);"
+                               "CREATE TABLE IF NOT EXISTS %Q.'%q_always' (id INTEGER PRIMARY KEY);",
+                               pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Number of documents each stop trigram is in, and the last document it
+   * was counted for */
+  if(pTrgVtab->nStop > 0){
+    aStopDocs = (int*)sqlite3_malloc(sizeof(int) * pTrgVtab->nStop * 2);
+    if(!aStopDocs) return SQLITE_NOMEM;
+    memset(aStopDocs, 0, sizeof(int) * pTrgVtab->nStop * 2);
+  }
+
+  rc = loadDocuments(pTrgVtab, &aDocs, &nDocs, aStopDocs);
+  if(rc != SQLITE_OK || nDocs == 0){
+    sqlite3_free(aDocs);
+    sqlite3_free(aStopDocs);
+    return rc;
+  }
+  sqlite3_int64 nMaxDocs = stopMaxDocs(pTrgVtab, nDocs);
+
+  /* Documents are loaded in order of document id, aOld is this order */
+  sqlite3_int64 *aOld = (sqlite3_int64*)sqlite3_malloc(sizeof(sqlite3_int64) * nDocs * 2);
+  if(!aOld){
+    sqlite3_free(aDocs);
+    sqlite3_free(aStopDocs);
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 *aNew = aOld + nDocs;
+  for(i = 0; i < nDocs; i++){
+    aDocs[i].iOrder = i;
+    aOld[i] = aDocs[i].docId;
+  }
+
+  /* Cluster documents, and give them the document ids in ascending order */
+  qsort(aDocs, nDocs, sizeof(optimize_doc), compareDocuments);
+  for(i = 0; i < nDocs; i++)
+    aNew[aDocs[i].iOrder] = aOld[i];
+  sqlite3_free(aDocs);
+
+  rc = moveDocuments(pTrgVtab, aOld, aNew, nDocs);
+  if(rc == SQLITE_OK)
+    rc = segmentRemap(pTrgVtab, aOld, aNew, nDocs, nMaxDocs);
+  if(rc == SQLITE_OK && pTrgVtab->pBigrams)
+    rc = bigramsRemap(pTrgVtab, aOld, aNew, nDocs);
+  if(rc == SQLITE_OK)
+    rc = tombstoneClear(pTrgVtab);
+  if(rc == SQLITE_OK)
+    rc = updateStopTrigrams(pTrgVtab, aStopDocs, nMaxDocs);
+  if(rc == SQLITE_OK)
+    rc = stopLoad(pTrgVtab);
+
+  trilite_log("Reassigned document ids of %i documents", nDocs);
+  sqlite3_free(aOld);
+  sqlite3_free(aStopDocs);
+  return rc;
+}
+
+/** Load document ids and signatures of all documents, in order of document id
+ * Documents are output as *paDocs, allocated with sqlite3_malloc, and the
+ * number of documents as *pnDocs. Documents with each stop trigram are
+ * counted in aStopDocs, see countStopTrigrams. */
+static int loadDocuments(trilite_vtab *pTrgVtab, optimize_doc **paDocs, int *pnDocs, int *aStopDocs){
+  sqlite3_stmt *pStmt;
+  int nAlloc = 0;
+  int rc;
+
+  *paDocs = NULL;
+  *pnDocs = 0;
+
+  char *zSql = sqlite3_mprintf("SELECT id, text FROM %Q.'%q_content' ORDER BY id", pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  while(rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW){
+    if(*pnDocs == nAlloc){
+      nAlloc = nAlloc * 2 + 1024;
+      optimize_doc *aDocs = (optimize_doc*)sqlite3_realloc(*paDocs, sizeof(optimize_doc) * nAlloc);
+      if(!aDocs){
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      *paDocs = aDocs;
+    }
+
+    /* Text may have to be fetched from the content store */
+    const unsigned char *text;
+    int nText;
+    if(pTrgVtab->pStore && sqlite3_column_type(pStmt, 1) == SQLITE_BLOB){
+      rc = storeFetch(pTrgVtab, sqlite3_column_blob(pStmt, 1), sqlite3_column_bytes(pStmt, 1), &text, &nText);
+      if(rc != SQLITE_OK) break;
+    }else{
+      text  = sqlite3_column_text(pStmt, 1);
+      nText = sqlite3_column_bytes(pStmt, 1);
+    }
+
+    optimize_doc *pDoc = &(*paDocs)[(*pnDocs)++];
+    pDoc->docId = sqlite3_column_int64(pStmt, 0);
+    computeSignature(pDoc, text, nText);
+    if(aStopDocs)
+      rc = countStopTrigrams(pTrgVtab, text, nText, *pnDocs, aStopDocs);
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+/** Compute MinHash signature of the trigrams of text
+ * Documents without trigrams get a signature that sorts after all others */
+static void computeSignature(optimize_doc *pDoc, const unsigned char *text, int nText){
+  int i, k;
+  for(k = 0; k < OPTIMIZE_SIGNATURE_SIZE; k++)
+    pDoc->signature[k] = UINT32_MAX;
+  for(i = 0; i + 3 <= nText; i++){
+    uint64_t trigram = (uint64_t)HASH_TRIGRAM(text + i) + 1;
+    for(k = 0; k < OPTIMIZE_SIGNATURE_SIZE; k++){
+      uint32_t h = (uint32_t)((trigram * aSeeds[k]) >> 32);
+      if(h < pDoc->signature[k])
+        pDoc->signature[k] = h;
+    }
+  }
+}
+
+/** Count document iDoc, numbered from 1, for each stop trigram in text
+ * aStopDocs holds the number of documents for each stop trigram, followed by
+ * the last document counted for each stop trigram */
+static int countStopTrigrams(trilite_vtab *pTrgVtab, const unsigned char *text, int nText, int iDoc, int *aStopDocs){
+  int *aLast = aStopDocs + pTrgVtab->nStop;
+  trilite_trigram *aKeys;
+  trilite_masks *aMasks;
+  int nKeys, i;
+  int rc = trigramIndexKeys(pTrgVtab, text, nText, &aKeys, &aMasks, &nKeys);
+  if(rc != SQLITE_OK) return rc;
+  for(i = 0; i < nKeys; i++){
+    int iStop = stopIndex(pTrgVtab, aKeys[i]);
+    if(iStop < 0 || aLast[iStop] == iDoc) continue;
+    aLast[iStop] = iDoc;
+    aStopDocs[iStop]++;
+  }
+  sqlite3_free(aKeys);
+  return SQLITE_OK;
+}
+
+/** Remove stop trigrams in no more than nMaxDocs documents, and index them
+ * again. aStopDocs holds the number of documents for each stop trigram. */
+static int updateStopTrigrams(trilite_vtab *pTrgVtab, const int *aStopDocs, sqlite3_int64 nMaxDocs){
+  int nTrigrams = 0;
+  int rc = SQLITE_OK;
+  int i;
+  if(pTrgVtab->nStop == 0) return SQLITE_OK;
+
+  trilite_trigram *aTrigrams = (trilite_trigram*)sqlite3_malloc(sizeof(trilite_trigram) * pTrgVtab->nStop);
+  if(!aTrigrams) return SQLITE_NOMEM;
+  for(i = 0; i < pTrgVtab->nStop && rc == SQLITE_OK; i++){
+    if(aStopDocs[i] > nMaxDocs) continue;
+    aTrigrams[nTrigrams++] = pTrgVtab->aStop[i];
+    rc = stopRemove(pTrgVtab, pTrgVtab->aStop[i]);
+  }
+  /* Stop trigrams are sorted, so aTrigrams is too */
+  if(rc == SQLITE_OK && nTrigrams > 0)
+    rc = reindexTrigrams(pTrgVtab, aTrigrams, nTrigrams);
+  sqlite3_free(aTrigrams);
+  return rc;
+}
+
+/** Index the sorted trigrams aTrigrams for all documents, and flush them
+ * Used for trigrams that were stop trigrams, and have no doclists. */
+static int reindexTrigrams(trilite_vtab *pTrgVtab, const trilite_trigram *aTrigrams, int nTrigrams){
+  sqlite3_stmt *pStmt;
+  int rc;
+
+  trilite_log("Indexing %i trigrams that are no longer stop trigrams", nTrigrams);
+
+  /* Always-candidates aren't indexed by trigrams */
+  char *zSql = sqlite3_mprintf("SELECT id, text FROM %Q.'%q_content'"
+                               " WHERE id NOT IN (SELECT id FROM %Q.'%q_always') ORDER BY id",
+                               pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  while(rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW){
+    const unsigned char *text;
+    int nText;
+    if(pTrgVtab->pStore && sqlite3_column_type(pStmt, 1) == SQLITE_BLOB){
+      rc = storeFetch(pTrgVtab, sqlite3_column_blob(pStmt, 1), sqlite3_column_bytes(pStmt, 1), &text, &nText);
+      if(rc != SQLITE_OK) break;
+    }else{
+      text  = sqlite3_column_text(pStmt, 1);
+      nText = sqlite3_column_bytes(pStmt, 1);
+    }
+    sqlite3_int64 docId = sqlite3_column_int64(pStmt, 0);
+
+    /* Masks of each occurrence are merged by hashInsert */
+    trilite_trigram *aKeys;
+    trilite_masks *aMasks;
+    int nKeys, k;
+    rc = trigramIndexKeys(pTrgVtab, text, nText, &aKeys, &aMasks, &nKeys);
+    for(k = 0; k < nKeys; k++){
+      int lo = 0, hi = nTrigrams;
+      while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(aTrigrams[mid] < aKeys[k])
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if(lo == nTrigrams || aTrigrams[lo] != aKeys[k]) continue;
+      hashInsert(pTrgVtab->pAdded, aKeys[k], docId, aMasks[k]);
+    }
+    sqlite3_free(aKeys);
+    if(rc != SQLITE_OK) break;
+    if(hashMemoryUsage(pTrgVtab->pAdded) > MAX_PENDING_BYTES)
+      rc = triliteSync((sqlite3_vtab*)pTrgVtab);
+  }
+  sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Pending doclists are flushed as a new segment */
+  return triliteSync((sqlite3_vtab*)pTrgVtab);
+}
+
+/** Move rows of %_content, %_docids, %_blocks, %_always, %_hashes and
+ * %_signatures from document id aOld[i] to aNew[i], where aNew is a
+ * permutation of aOld, and aOld is sorted.
+ * Rows are first moved to temporary document ids after the largest, as the
+ * new document id may still be in use. */
+static int moveDocuments(trilite_vtab *pTrgVtab, const sqlite3_int64 *aOld, const sqlite3_int64 *aNew, int nDocs){
+  const char *azSql[] = {
+    "UPDATE %Q.'%q_content' SET id = ?1 WHERE id = ?2",
+    "UPDATE %Q.'%q_docids' SET docid = ?1 WHERE docid = ?2",
+    "UPDATE %Q.'%q_blocks' SET id = ?1 WHERE id = ?2",
+    "UPDATE %Q.'%q_always' SET id = ?1 WHERE id = ?2",
+    "UPDATE %Q.'%q_hashes' SET docid = ?1 WHERE docid = ?2",
+    "UPDATE %Q.'%q_signatures' SET id = ?1 WHERE id = ?2"
+  };
+  sqlite3_stmt *aStmts[sizeof(azSql) / sizeof(azSql[0])];
+  int nStmts = 0;
+  int rc = SQLITE_OK;
+  int i, j, iPass;
+
+  /* Temporary document ids must not overflow */
+  sqlite3_int64 base = aOld[nDocs - 1];
+  if(base > SQLITE3_INT64_MAX - nDocs){
+    triliteError(pTrgVtab, "OPTIMIZE: Document ids are too large to be reassigned");
+    return SQLITE_ERROR;
+  }
+  base++;
+
+  for(i = 0; i < (int)(sizeof(azSql) / sizeof(azSql[0])) && rc == SQLITE_OK; i++){
+    char *zSql = sqlite3_mprintf(azSql[i], pTrgVtab->zDb, pTrgVtab->zName);
+    if(!zSql){
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    /* Tables from before %_blocks, %_always, %_hashes or %_signatures have
+     * nothing to move there */
+    if(sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &aStmts[nStmts], 0) == SQLITE_OK)
+      nStmts++;
+    sqlite3_free(zSql);
+  }
+
+  for(iPass = 0; iPass < 2 && rc == SQLITE_OK; iPass++){
+    for(i = 0; i < nDocs && rc == SQLITE_OK; i++){
+      if(aOld[i] == aNew[i]) continue;
+      for(j = 0; j < nStmts && rc == SQLITE_OK; j++){
+        sqlite3_bind_int64(aStmts[j], 1, iPass == 0 ? base + i : aNew[i]);
+        sqlite3_bind_int64(aStmts[j], 2, iPass == 0 ? aOld[i] : base + i);
+        sqlite3_step(aStmts[j]);
+        rc = sqlite3_reset(aStmts[j]);
+      }
+    }
+  }
+
+  for(j = 0; j < nStmts; j++)
+    sqlite3_finalize(aStmts[j]);
+  return rc;
+}
+
+/** Compare documents by signature for qsort, ties are kept in document order */
+static int compareDocuments(const void *pA, const void *pB){
+  const optimize_doc *a = (const optimize_doc*)pA;
+  const optimize_doc *b = (const optimize_doc*)pB;
+  int k;
+  for(k = 0; k < OPTIMIZE_SIGNATURE_SIZE; k++){
+    if(a->signature[k] != b->signature[k])
+      return a->signature[k] < b->signature[k] ? -1 : 1;
+  }
+  return a->docId < b->docId ? -1 : a->docId > b->docId;
+}
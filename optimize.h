@@ -0,0 +1,10 @@
+#ifndef TRILITE_OPTIMIZE_H
+#define TRILITE_OPTIMIZE_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+
+int optimizeIndex(trilite_vtab*);
+
+#endif /* TRILITE_OPTIMIZE_H */
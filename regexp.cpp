@@ -23,12 +23,15 @@ extern "C" {
 #include <stdbool.h>
 
 #include <string>
+#include <vector>
+#include <string.h>
 
 
 #include <re2/re2.h>
 #include <re2/prefilter.h>
 
-static int exprFromPreFilter(expr**, bool*, trilite_vtab*, re2::Prefilter*);
+static int exprFromPreFilter(expr**, bool*, bool*, trilite_vtab*, re2::Prefilter*);
+static int exprFromAnchors(expr**, bool*, trilite_vtab*, const unsigned char*, int);
 
 /* Handling the special case when an expr accepts everything
  * In trilite expr cannot match everything, this because the case where we have
@@ -48,8 +51,9 @@ static int exprFromPreFilter(expr**, bool*, trilite_vtab*, re2::Prefilter*);
 
 
 /** Construct a filter expression from a regular expression
- * Returns SQLITE_ERROR and sets user relevant error message on error */
-int regexpPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const unsigned char *expr, int nExpr){
+ * Returns SQLITE_ERROR and sets user relevant error message on error, sets
+ * *pStopAll as exprSubstring does */
+int regexpPreFilter(expr **ppExpr, bool *pAll, bool *pStopAll, trilite_vtab *pTrgVtab, const unsigned char *expr, int nExpr){
   int rc = SQLITE_OK;
 
   *ppExpr = NULL;
@@ -131,12 +135,30 @@ int regexpPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const uns
     return SQLITE_ERROR;
   }
 
-  rc = exprFromPreFilter(ppExpr, pAll, pTrgVtab, pf);
+  rc = exprFromPreFilter(ppExpr, pAll, pStopAll, pTrgVtab, pf);
   assert(rc == SQLITE_OK);
 
   /* Release the prefilter */
   delete pf;
 
+  /* Anchored literals must hold too, unless nothing matches anyway */
+  if(rc == SQLITE_OK && pTrgVtab->anchors && (*ppExpr || *pAll)){
+    struct expr *pAnchors;
+    bool all;
+    rc = exprFromAnchors(&pAnchors, &all, pTrgVtab, expr, nExpr);
+    if(rc == SQLITE_OK && pAnchors){
+      if(*ppExpr)
+        rc = exprOperator(ppExpr, *ppExpr, pAnchors, EXPR_AND);
+      else
+        *ppExpr = pAnchors;
+      *pAll = false;
+    }else if(rc == SQLITE_OK && !all){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+      *pAll = false;
+    }
+  }
+
   return rc;
 }
 
@@ -144,7 +166,7 @@ int regexpPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const uns
  * Returns SQLITE_OK on success, outputs expression as *ppExpr, if NULL, *all
  * determines if it's because everything matches the expr or nothing matches the
  * expression, ie. *all == true, implies everything matches the expression */
-static int exprFromPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, re2::Prefilter* pf){
+static int exprFromPreFilter(expr **ppExpr, bool *pAll, bool *pStopAll, trilite_vtab *pTrgVtab, re2::Prefilter* pf){
   int rc = SQLITE_OK;
   assert(pf && pAll);
   *ppExpr = NULL;
@@ -159,8 +181,11 @@ static int exprFromPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab,
 
   /* If we have an atom it's a substring */
   if(pf->op() == re2::Prefilter::ATOM){
-    /* Construct expr from substring */
-    return exprSubstring(ppExpr, pAll, pTrgVtab, (const unsigned char*)pf->atom().c_str(), pf->atom().size());
+    /* Construct expr from substring, atoms of re2 prefilters are lower case
+     * so they can only use folded trigrams. Atoms are UTF-8, so on tables
+     * with the utf8 option they're broken into codepoint trigrams too. Atoms
+     * shorter than a trigram use bigrams with the bigrams option */
+    return exprSubstring(ppExpr, pAll, pStopAll, pTrgVtab, (const unsigned char*)pf->atom().c_str(), pf->atom().size(), false);
   }
 
   /* Get the operator type */
@@ -177,7 +202,7 @@ static int exprFromPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab,
   for(i = 0; i < subs->size(); i++){
     bool all;
     expr *pExpr = NULL;
-    rc = exprFromPreFilter(&pExpr, &all, pTrgVtab, (*subs)[i]);
+    rc = exprFromPreFilter(&pExpr, &all, pStopAll, pTrgVtab, (*subs)[i]);
     assert(rc == SQLITE_OK);
     /* Abort if we get an error */
     if(rc != SQLITE_OK){
@@ -227,6 +252,271 @@ static int exprFromPreFilter(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab,
 }
 
 
+/***************************** Anchored Regexps ******************************/
+
+/* Prefilters of re2 have no anchors, ^#include is prefiltered as #include. On
+ * tables with the anchors option, literals following or preceding an anchor
+ * at the top level of the expression are also matched as substrings with
+ * boundary markers, these substrings have boundary grams, see trigram.c.
+ * Expressions are only scanned as far as it's safe, unless they're understood
+ * anchors are ignored, and top level alternatives make them optional. */
+
+/** Type of a token at the top level of a regular expression */
+enum anchor_token_type{
+  TOKEN_LITERAL,
+  TOKEN_OTHER,
+  TOKEN_DOCUMENT_START,
+  TOKEN_DOCUMENT_END,
+  TOKEN_LINE_START,
+  TOKEN_LINE_END,
+  TOKEN_WORD
+};
+
+/** Token at the top level of a regular expression */
+struct anchor_token{
+  /** Type of token */
+  anchor_token_type eType;
+
+  /** Offset of a literal character in the expression */
+  int iStart;
+
+  /** Number of bytes in a literal character */
+  int nBytes;
+};
+
+static bool anchorTokens(const unsigned char*, int, std::vector<anchor_token>*);
+static bool anchorMultiLineFlag(const unsigned char*, int, int);
+static int anchorSkipClass(const unsigned char*, int, int);
+static int anchorRepeat(const unsigned char*, int, int);
+static bool anchorWordChar(const unsigned char*, const anchor_token&);
+
+/** Construct an expr from the anchored literals of a regular expression
+ * Output as exprFromPreFilter does, *pAll is true if there's no anchored
+ * literals. */
+static int exprFromAnchors(expr **ppExpr, bool *pAll, trilite_vtab *pTrgVtab, const unsigned char *z, int n){
+  *ppExpr = NULL;
+  *pAll = true;
+  std::vector<anchor_token> tokens;
+  if(!anchorTokens(z, n, &tokens)) return SQLITE_OK;
+
+  /* Substrings with markers, for each anchor */
+  std::vector<std::string> substrings;
+  int nTokens = tokens.size();
+  int t, u;
+  for(t = 0; t < nTokens; t++){
+    anchor_token_type eType = tokens[t].eType;
+    std::string lit;
+    if(eType == TOKEN_DOCUMENT_START || eType == TOKEN_LINE_START){
+      /* Literal following the start of the document or a line */
+      bool line = eType == TOKEN_LINE_START;
+      std::string marker(2, line ? BOUNDARY_LINE : BOUNDARY_DOCUMENT);
+      for(u = t + 1; u < nTokens && tokens[u].eType == TOKEN_LITERAL; u++){
+        if(line && z[tokens[u].iStart] == '\n') break;
+        lit.append((const char*)z + tokens[u].iStart, tokens[u].nBytes);
+      }
+      if(lit.empty()) continue;
+      bool closed = u < nTokens && tokens[u].eType == (line ? TOKEN_LINE_END : TOKEN_DOCUMENT_END);
+      substrings.push_back(marker + lit + (closed ? marker : ""));
+    }else if(eType == TOKEN_DOCUMENT_END || eType == TOKEN_LINE_END){
+      /* Literal preceding the end of the document or a line, unless it's
+       * also anchored at the start */
+      bool line = eType == TOKEN_LINE_END;
+      std::string marker(2, line ? BOUNDARY_LINE : BOUNDARY_DOCUMENT);
+      for(u = t - 1; u >= 0 && tokens[u].eType == TOKEN_LITERAL; u--){
+        if(line && z[tokens[u].iStart] == '\n') break;
+        lit.insert(0, (const char*)z + tokens[u].iStart, tokens[u].nBytes);
+      }
+      if(lit.empty()) continue;
+      if(u >= 0 && tokens[u].eType == (line ? TOKEN_LINE_START : TOKEN_DOCUMENT_START)) continue;
+      substrings.push_back(lit + marker);
+    }else if(eType == TOKEN_WORD){
+      std::string marker(2, BOUNDARY_WORD);
+      /* Word starting after \b */
+      for(u = t + 1; u < nTokens && anchorWordChar(z, tokens[u]); u++)
+        lit.append((const char*)z + tokens[u].iStart, tokens[u].nBytes);
+      if(!lit.empty()){
+        bool closed = u < nTokens && (tokens[u].eType == TOKEN_LITERAL || tokens[u].eType == TOKEN_WORD ||
+                                      tokens[u].eType == TOKEN_DOCUMENT_END || tokens[u].eType == TOKEN_LINE_END);
+        substrings.push_back(marker + lit + (closed ? marker : ""));
+      }
+      /* Word ending before \b, unless it's also bounded by \b at the start */
+      lit.clear();
+      for(u = t - 1; u >= 0 && anchorWordChar(z, tokens[u]); u--)
+        lit.insert(0, (const char*)z + tokens[u].iStart, tokens[u].nBytes);
+      if(lit.empty() || (u >= 0 && tokens[u].eType == TOKEN_WORD)) continue;
+      bool closed = u >= 0 && (tokens[u].eType == TOKEN_LITERAL || tokens[u].eType == TOKEN_DOCUMENT_START ||
+                               tokens[u].eType == TOKEN_LINE_START);
+      substrings.push_back((closed ? marker : "") + lit + marker);
+    }
+  }
+
+  /* Each substring must be in a match */
+  size_t i;
+  for(i = 0; i < substrings.size(); i++){
+    expr *pExpr;
+    bool all, stopAll = false;
+    /* Anchored substrings only narrow the prefilter, so their stop trigrams
+     * don't allow full table scans */
+    int rc = exprSubstring(&pExpr, &all, &stopAll, pTrgVtab, (const unsigned char*)substrings[i].c_str(), substrings[i].size(), false);
+    if(rc != SQLITE_OK || (!pExpr && !all)){
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+      *pAll = false;
+      return rc;
+    }
+    if(!pExpr) continue;
+    if(*ppExpr)
+      rc = exprOperator(ppExpr, *ppExpr, pExpr, EXPR_AND);
+    else
+      *ppExpr = pExpr;
+    if(rc != SQLITE_OK){
+      exprRelease(pExpr);
+      exprRelease(*ppExpr);
+      *ppExpr = NULL;
+      *pAll = false;
+      return rc;
+    }
+  }
+  if(*ppExpr) *pAll = false;
+  return SQLITE_OK;
+}
+
+/** Break n bytes of regular expression z into tokens at the top level
+ * Returns false, if anchors of the expression can't be used, because it has
+ * alternatives at the top level, or syntax that isn't understood here. */
+static bool anchorTokens(const unsigned char *z, int n, std::vector<anchor_token> *pTokens){
+  bool multiLine = false;
+  int i = 0;
+
+  /* Flags at the start apply to the entire expression */
+  if(n >= 2 && z[0] == '(' && z[1] == '?'){
+    int j = 2;
+    while(j < n && z[j] && strchr("imsU-", z[j])) j++;
+    if(j < n && z[j] == ')'){
+      multiLine = anchorMultiLineFlag(z, n, 2);
+      i = j + 1;
+    }
+  }
+
+  while(i < n){
+    unsigned char c = z[i];
+    anchor_token token = {TOKEN_OTHER, i, 1};
+    if(c == '|' || IS_BOUNDARY(c) || c == 0){
+      return false;
+    }else if(c == '('){
+      /* Groups are other tokens, unless they change what ^ and $ match */
+      int depth = 0;
+      for(; i < n; i++){
+        if(z[i] == '\\')
+          i++;
+        else if(z[i] == '[')
+          i = anchorSkipClass(z, n, i) - 1;
+        else if(z[i] == '('){
+          depth++;
+          if(i + 1 < n && z[i + 1] == '?' && anchorMultiLineFlag(z, n, i + 2))
+            return false;
+        }else if(z[i] == ')' && --depth == 0)
+          break;
+      }
+      i++;
+    }else if(c == '['){
+      i = anchorSkipClass(z, n, i);
+    }else if(c == '\\'){
+      if(i + 1 >= n) return false;
+      unsigned char d = z[i + 1];
+      if(d == 'b')
+        token.eType = TOKEN_WORD;
+      else if(d == 'A')
+        token.eType = TOKEN_DOCUMENT_START;
+      else if(d == 'z')
+        token.eType = TOKEN_DOCUMENT_END;
+      else if(d && strchr("BdDwWsSntrfv", d))
+        token.eType = TOKEN_OTHER;
+      else if(d < 0x80 && !IS_WORD_CHAR(d) && !IS_BOUNDARY(d) && d){
+        token.eType  = TOKEN_LITERAL;
+        token.iStart = i + 1;
+      }else
+        return false;
+      i += 2;
+    }else if(c == '^'){
+      token.eType = multiLine ? TOKEN_LINE_START : TOKEN_DOCUMENT_START;
+      i++;
+    }else if(c == '$'){
+      token.eType = multiLine ? TOKEN_LINE_END : TOKEN_DOCUMENT_END;
+      i++;
+    }else if(c == '*' || c == '+' || c == '?' || (c == '{' && anchorRepeat(z, n, i) > i)){
+      /* Repetition of the previous token, it's no longer a literal */
+      if(pTokens->empty() || (pTokens->back().eType != TOKEN_LITERAL && pTokens->back().eType != TOKEN_OTHER))
+        return false;
+      pTokens->back().eType = TOKEN_OTHER;
+      i = c == '{' ? anchorRepeat(z, n, i) : i + 1;
+      /* Non-greedy repetition */
+      if(i < n && z[i] == '?') i++;
+      continue;
+    }else if(c == '.'){
+      i++;
+    }else{
+      /* Literal character, all bytes of a UTF-8 sequence */
+      token.eType = TOKEN_LITERAL;
+      i++;
+      if(c >= 0xC0){
+        while(i < n && (z[i] & 0xC0) == 0x80) i++;
+      }
+      token.nBytes = i - token.iStart;
+    }
+    pTokens->push_back(token);
+  }
+  return true;
+}
+
+/** True if the flags of a group starting at z[i] include m, flags that
+ * make ^ and $ match at lines */
+static bool anchorMultiLineFlag(const unsigned char *z, int n, int i){
+  for(; i < n && z[i] && strchr("imsU-", z[i]); i++){
+    if(z[i] == 'm') return true;
+  }
+  return false;
+}
+
+/** Offset following the character class starting at z[i] */
+static int anchorSkipClass(const unsigned char *z, int n, int i){
+  i++;
+  if(i < n && z[i] == '^') i++;
+  if(i < n && z[i] == ']') i++;
+  while(i < n && z[i] != ']'){
+    if(z[i] == '\\')
+      i += 2;
+    else if(z[i] == '[' && i + 1 < n && z[i + 1] == ':'){
+      /* Named class, such as [:alpha:] */
+      int j = i + 2;
+      while(j + 1 < n && !(z[j] == ':' && z[j + 1] == ']')) j++;
+      i = j + 2;
+    }else
+      i++;
+  }
+  return i + 1;
+}
+
+/** Offset following the repetition {n}, {n,} or {n,m} starting at z[i], or i
+ * if it's not a repetition, then { is a literal */
+static int anchorRepeat(const unsigned char *z, int n, int i){
+  int j = i + 1;
+  if(j >= n || z[j] < '0' || z[j] > '9') return i;
+  while(j < n && z[j] >= '0' && z[j] <= '9') j++;
+  if(j < n && z[j] == ','){
+    j++;
+    while(j < n && z[j] >= '0' && z[j] <= '9') j++;
+  }
+  if(j >= n || z[j] != '}') return i;
+  return j + 1;
+}
+
+/** True if token is a literal word character */
+static bool anchorWordChar(const unsigned char *z, const anchor_token &token){
+  return token.eType == TOKEN_LITERAL && token.nBytes == 1 && IS_WORD_CHAR(z[token.iStart]);
+}
+
+
 
 /************************ Regular Expression Wrapper *************************/
 
@@ -6,7 +6,7 @@
 
 #include "config.h"
 
-int regexpPreFilter(expr**, bool*, trilite_vtab*, const unsigned char*, int);
+int regexpPreFilter(expr**, bool*, bool*, trilite_vtab*, const unsigned char*, int);
 
 /*TODO Add refernece counting to regular expressions */
 /* and reuse previously compiled expressions, when loading from cursor */
@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include "seal.h"
+#include "vtable.h"
+#include "doclist.h"
+#include "chunk.h"
+#include "segment.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A sealed index is a snapshot of the doclists of all segments, written to a
+ * standalone file with INSERT INTO t(contents) VALUES('seal=<path>'). As the
+ * command writes files, the table can only be used directly, not by triggers
+ * or views, see triliteConnect. The file is memory mapped when connecting, and queries read doclists of the segments
+ * it covers in place, rather than fetching chunks from %_chunks.
+ *
+ * The file starts with a header, holding the format version of doclists and
+ * the segments sealed. At SEALED_DIRECTORY_OFFSET follows a directory with an
+ * entry for each of the 2^24 trigrams, holding offset and size of its doclist,
+ * and after the directory the doclists follow one after another. Entries for
+ * trigrams without a doclist are zero, and are never written, so they don't
+ * take up space on file systems with sparse files. Trigrams beyond the
+ * directory, exact-case trigrams and codepoint trigrams of the exactcase and
+ * utf8 options, aren't sealed, queries read them from %_chunks, where they are
+ * kept.
+ *
+ * Integers are stored in native byte order, so sealed files can't be moved
+ * between machines of different byte order. Segments written after sealing
+ * are read from %_chunks as usual. When a sealed segment is merged into
+ * another the file is no longer used, until the index is sealed again.
+ */
+
+/** Magic bytes at the start of a sealed index */
+#define SEALED_MAGIC              "TRILITE\x1a"
+
+/** Size of the magic bytes */
+#define SEALED_MAGIC_SIZE         8
+
+/** Size of the header, not counting the list of segments */
+#define SEALED_HEADER_SIZE        24
+
+/** Size of a directory entry */
+#define SEALED_ENTRY_SIZE         16
+
+/** Offset of the doclists */
+#define SEALED_DOCLISTS_OFFSET    (SEALED_DIRECTORY_OFFSET + (sqlite3_int64)SEALED_ENTRY_SIZE * SEALED_DIRECTORY_ENTRIES)
+
+/** Header of a sealed index, followed by nSegments segments as int32_t */
+typedef struct sealed_header sealed_header;
+struct sealed_header{
+  /** SEALED_MAGIC */
+  char magic[SEALED_MAGIC_SIZE];
+
+  /** Format version of the doclists */
+  uint32_t version;
+
+  /** Number of segments sealed */
+  uint32_t nSegments;
+
+  /** Size of the file in bytes */
+  uint64_t nSize;
+};
+
+/** Entry in the directory of a sealed index */
+typedef struct sealed_entry sealed_entry;
+struct sealed_entry{
+  /** Offset of the doclist in the file */
+  uint64_t offset;
+
+  /** Size of the doclist in bytes, 0 if there's no doclist */
+  uint32_t size;
+
+  /** Reserved, always 0 */
+  uint32_t reserved;
+};
+
+/** Memory mapped sealed index */
+struct sealed_index{
+  /** Mapped file */
+  const unsigned char *map;
+
+  /** Size of mapped file */
+  size_t nMap;
+
+  /** Format version of the doclists */
+  int iVersion;
+
+  /** Number of segments sealed */
+  int nSegments;
+
+  /** Segments sealed, within the map */
+  const int32_t *aSegments;
+
+  /** All sealed segments still exist, see sealValidate */
+  bool valid;
+};
+
+static int sealTrigram(trilite_vtab*, int, trilite_trigram, sqlite3_int64*, sqlite3_int64*);
+static int nextKey(sqlite3_stmt*, int, trilite_trigram, sqlite3_int64*);
+static int mapSealed(trilite_vtab*, const char*);
+static int sealedPath(trilite_vtab*, char**);
+
+
+/** Seal all segments of the index to the file zPath
+ * Pending doclists are flushed first. The file is written next to zPath and
+ * renamed when the transaction commits, see sealCommit, so connections that
+ * have the old file mapped can keep reading it, and a rolled back transaction
+ * leaves no file behind. The path is stored in %_config, so it's mapped when
+ * others connect. Only the sealed index recorded there may be replaced, an
+ * existing file at any other path is left untouched. */
+int sealWrite(trilite_vtab *pTrgVtab, const char *zPath){
+  sqlite3_stmt *pStmt = NULL;
+  int rc = SQLITE_OK;
+  int i;
+
+  /* A sealed index written earlier in this transaction is replaced */
+  sealRollback(pTrgVtab);
+
+  /* Refuse to overwrite files that aren't the sealed index of this table */
+  struct stat st;
+  if(lstat(zPath, &st) == 0){
+    char *zSealed;
+    rc = sealedPath(pTrgVtab, &zSealed);
+    if(rc != SQLITE_OK) return rc;
+    bool replaces = zSealed && strcmp(zSealed, zPath) == 0;
+    sqlite3_free(zSealed);
+    if(!replaces){
+      triliteError(pTrgVtab, "SEAL: '%s' exists and isn't the sealed index of this table", zPath);
+      return SQLITE_ERROR;
+    }
+  }
+
+  /* Flush pending doclists, and find the segments to seal */
+  rc = triliteSync((sqlite3_vtab*)pTrgVtab);
+  if(rc == SQLITE_OK)
+    rc = segmentLoad(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+  int nSegments = pTrgVtab->nSegments;
+  if(SEALED_HEADER_SIZE + sizeof(int32_t) * nSegments > SEALED_DIRECTORY_OFFSET){
+    triliteError(pTrgVtab, "SEAL: Too many segments to seal, %i segments", nSegments);
+    return SQLITE_ERROR;
+  }
+
+  char *zTemp = sqlite3_mprintf("%s-tmp", zPath);
+  sqlite3_int64 *aNext = (sqlite3_int64*)sqlite3_malloc(sizeof(sqlite3_int64) * (nSegments + 1));
+  if(!zTemp || !aNext){
+    sqlite3_free(zTemp);
+    sqlite3_free(aNext);
+    return SQLITE_NOMEM;
+  }
+  int fd = open(zTemp, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(fd < 0){
+    triliteError(pTrgVtab, "SEAL: Can't create '%s'", zTemp);
+    sqlite3_free(zTemp);
+    sqlite3_free(aNext);
+    return SQLITE_CANTOPEN;
+  }
+
+  /* Select smallest key in a range of %_chunks */
+  char *zSql = sqlite3_mprintf("SELECT trigram FROM %Q.'%q_chunks' WHERE trigram >= ? AND trigram <= ? ORDER BY trigram LIMIT 1",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql)
+    rc = SQLITE_NOMEM;
+  else
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+
+  /* Find first key of each segment */
+  for(i = 0; i < nSegments && rc == SQLITE_OK; i++)
+    rc = nextKey(pStmt, pTrgVtab->aSegments[i], 0, &aNext[i]);
+
+  /* Write doclists in order of trigrams, with the union of all segments */
+  sqlite3_int64 offset = SEALED_DOCLISTS_OFFSET;
+  while(rc == SQLITE_OK){
+    sqlite3_int64 trigram = -1;
+    for(i = 0; i < nSegments; i++){
+      if(aNext[i] < 0) continue;
+      if(trigram < 0 || KEY_TRIGRAM(aNext[i]) < trigram)
+        trigram = KEY_TRIGRAM(aNext[i]);
+    }
+    if(trigram < 0) break;
+    /* Exact-case and codepoint trigrams sort last, they aren't sealed */
+    if(trigram >= SEALED_DIRECTORY_ENTRIES) break;
+    rc = sealTrigram(pTrgVtab, fd, (trilite_trigram)trigram, aNext, &offset);
+    for(i = 0; i < nSegments && rc == SQLITE_OK; i++){
+      if(aNext[i] != SEGMENT_KEY(pTrgVtab->aSegments[i], trigram)) continue;
+      if(trigram < TRIGRAM_MAX)
+        rc = nextKey(pStmt, pTrgVtab->aSegments[i], (trilite_trigram)trigram + 1, &aNext[i]);
+      else
+        aNext[i] = -1;
+    }
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(aNext);
+
+  /* Write header and segments */
+  if(rc == SQLITE_OK){
+    sealed_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEALED_MAGIC, SEALED_MAGIC_SIZE);
+    header.version   = pTrgVtab->formatVersion;
+    header.nSegments = nSegments;
+    header.nSize     = offset;
+    assert(sizeof(header) == SEALED_HEADER_SIZE);
+    for(i = 0; i < nSegments && rc == SQLITE_OK; i++){
+      int32_t iSegment = pTrgVtab->aSegments[i];
+      if(pwrite(fd, &iSegment, sizeof(iSegment), SEALED_HEADER_SIZE + sizeof(iSegment) * i) != sizeof(iSegment))
+        rc = SQLITE_IOERR;
+    }
+    if(rc == SQLITE_OK && pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+      rc = SQLITE_IOERR;
+    /* Directory entries after the last doclist may not have been written */
+    if(rc == SQLITE_OK && ftruncate(fd, offset) != 0)
+      rc = SQLITE_IOERR;
+    if(rc == SQLITE_OK && fsync(fd) != 0)
+      rc = SQLITE_IOERR;
+  }
+  close(fd);
+  if(rc == SQLITE_IOERR)
+    triliteError(pTrgVtab, "SEAL: Failed to write '%s'", zTemp);
+
+  /* Record path of the sealed index, it's moved in place on commit */
+  if(rc == SQLITE_OK){
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_config' (key, value) VALUES ('sealed', %Q);",
+                           pTrgVtab->zDb, pTrgVtab->zName, zPath);
+    if(!zSql)
+      rc = SQLITE_NOMEM;
+    else
+      rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+  }
+  if(rc == SQLITE_OK){
+    pTrgVtab->zSealPath = sqlite3_mprintf("%s", zPath);
+    if(!pTrgVtab->zSealPath) rc = SQLITE_NOMEM;
+  }
+  if(rc != SQLITE_OK){
+    unlink(zTemp);
+    sqlite3_free(zTemp);
+    return rc;
+  }
+  pTrgVtab->zSealTemp = zTemp;
+
+  trilite_log("Sealed %i segments to %s, %lli bytes", nSegments, zTemp, offset);
+  return SQLITE_OK;
+}
+
+/** Map the sealed index recorded in %_config, if any
+ * A sealed index that can't be mapped is ignored, queries then read all
+ * segments from %_chunks. */
+int sealOpen(trilite_vtab *pTrgVtab){
+  char *zPath;
+  int rc = sealedPath(pTrgVtab, &zPath);
+  if(rc != SQLITE_OK) return rc;
+
+  sealClose(pTrgVtab->pSealed);
+  pTrgVtab->pSealed = NULL;
+  if(!zPath) return SQLITE_OK;
+  rc = mapSealed(pTrgVtab, zPath);
+  sqlite3_free(zPath);
+  return rc;
+}
+
+/** Move the sealed index written by this transaction in place and map it,
+ * called when the transaction commits */
+void sealCommit(trilite_vtab *pTrgVtab){
+  if(!pTrgVtab->zSealTemp) return;
+  if(rename(pTrgVtab->zSealTemp, pTrgVtab->zSealPath) != 0){
+    trilite_log("Failed to rename sealed index to %s", pTrgVtab->zSealPath);
+    unlink(pTrgVtab->zSealTemp);
+  }else{
+    sealClose(pTrgVtab->pSealed);
+    pTrgVtab->pSealed = NULL;
+    mapSealed(pTrgVtab, pTrgVtab->zSealPath);
+  }
+  sqlite3_free(pTrgVtab->zSealTemp);
+  sqlite3_free(pTrgVtab->zSealPath);
+  pTrgVtab->zSealTemp = NULL;
+  pTrgVtab->zSealPath = NULL;
+}
+
+/** Remove the sealed index written by this transaction, called when the
+ * transaction is rolled back */
+void sealRollback(trilite_vtab *pTrgVtab){
+  if(!pTrgVtab->zSealTemp) return;
+  unlink(pTrgVtab->zSealTemp);
+  sqlite3_free(pTrgVtab->zSealTemp);
+  sqlite3_free(pTrgVtab->zSealPath);
+  pTrgVtab->zSealTemp = NULL;
+  pTrgVtab->zSealPath = NULL;
+}
+
+/** Unmap and release sealed index */
+void sealClose(sealed_index *pSealed){
+  if(!pSealed) return;
+  munmap((void*)pSealed->map, pSealed->nMap);
+  sqlite3_free(pSealed);
+}
+
+/** Check that all sealed segments are still in the segments loaded by
+ * segmentLoad, otherwise the sealed index isn't used */
+void sealValidate(trilite_vtab *pTrgVtab){
+  sealed_index *pSealed = pTrgVtab->pSealed;
+  if(!pSealed) return;
+  int i, j;
+  pSealed->valid = true;
+  for(i = 0; i < pSealed->nSegments && pSealed->valid; i++){
+    for(j = 0; j < pTrgVtab->nSegments; j++)
+      if(pTrgVtab->aSegments[j] == pSealed->aSegments[i]) break;
+    pSealed->valid = j < pTrgVtab->nSegments;
+  }
+  if(!pSealed->valid)
+    trilite_log("Sealed segments have been merged, ignoring sealed index");
+}
+
+/** True, if doclists of iSegment are read from the sealed index */
+bool sealCovers(trilite_vtab *pTrgVtab, int iSegment){
+  sealed_index *pSealed = pTrgVtab->pSealed;
+  if(!pSealed || !pSealed->valid) return false;
+  int i;
+  for(i = 0; i < pSealed->nSegments; i++)
+    if(pSealed->aSegments[i] == iSegment) return true;
+  return false;
+}
+
+/** Get doclist of trigram from the sealed index, in place
+ * Returns false, if the sealed index isn't used or has no doclist for the
+ * trigram. Otherwise the doclist is output as *pDocList of *pnDocList bytes in
+ * format version *piVersion, valid until the sealed index is closed. */
+bool sealDocList(trilite_vtab *pTrgVtab, trilite_trigram trigram, const unsigned char **pDocList, int *pnDocList, int *piVersion){
+  sealed_index *pSealed = pTrgVtab->pSealed;
+  if(!pSealed || !pSealed->valid || trigram >= SEALED_DIRECTORY_ENTRIES) return false;
+  sealed_entry entry;
+  memcpy(&entry, pSealed->map + SEALED_DIRECTORY_OFFSET + (sqlite3_int64)SEALED_ENTRY_SIZE * trigram, sizeof(entry));
+  if(entry.size == 0 || entry.offset < SEALED_DOCLISTS_OFFSET || entry.offset + entry.size > pSealed->nMap)
+    return false;
+  *pDocList  = pSealed->map + entry.offset;
+  *pnDocList = (int)entry.size;
+  *piVersion = pSealed->iVersion;
+  return true;
+}
+
+
+/** Write union of the doclists of trigram in segments, where aNext holds the
+ * key, to fd at *pOffset, and its directory entry. *pOffset is advanced past
+ * the doclist */
+static int sealTrigram(trilite_vtab *pTrgVtab, int fd, trilite_trigram trigram, sqlite3_int64 *aNext, sqlite3_int64 *pOffset){
+  int nSegments = pTrgVtab->nSegments;
+  int rc = SQLITE_OK;
+  int i;
+
+  chunk_reader *aReaders = (chunk_reader*)sqlite3_malloc(sizeof(chunk_reader) * nSegments);
+  bool *aValid = (bool*)sqlite3_malloc(sizeof(bool) * nSegments);
+  if(!aReaders || !aValid){
+    sqlite3_free(aReaders);
+    sqlite3_free(aValid);
+    return SQLITE_NOMEM;
+  }
+  memset(aReaders, 0, sizeof(chunk_reader) * nSegments);
+
+  /* Open doclists of segments that have the trigram */
+  int nValid = 0, iLast = -1;
+  for(i = 0; i < nSegments && rc == SQLITE_OK; i++){
+    aValid[i] = aNext[i] == SEGMENT_KEY(pTrgVtab->aSegments[i], trigram) &&
+                chunkReaderOpen(&aReaders[i], pTrgVtab, aNext[i]);
+    rc = aReaders[i].rc;
+    if(aValid[i]){
+      nValid++;
+      iLast = i;
+    }
+  }
+
+  doclist_writer writer;
+  docListWriterInit(&writer);
+  if(rc == SQLITE_OK && nValid == 1){
+    /* Chunks of a single doclist are appended without decoding */
+    chunk_reader *pReader = &aReaders[iLast];
+    do{
+      rc = docListWriterAppend(&writer, pReader->chunk, pReader->nChunk, pTrgVtab->formatVersion);
+    }while(rc == SQLITE_OK && chunkReaderNextChunk(pReader));
+    if(rc == SQLITE_OK)
+      rc = pReader->rc;
+  }else{
+    /* Otherwise, write the union one id at the time, merging masks */
+    while(rc == SQLITE_OK){
+      sqlite3_int64 id = 0;
+      bool found = false;
+      for(i = 0; i < nSegments; i++){
+        if(aValid[i] && (!found || aReaders[i].reader.curId < id)){
+          id = aReaders[i].reader.curId;
+          found = true;
+        }
+      }
+      if(!found) break;
+      trilite_masks masks = 0;
+      for(i = 0; i < nSegments; i++){
+        if(aValid[i] && aReaders[i].reader.curId == id){
+          masks |= docListMasks(&aReaders[i].reader);
+          aValid[i] = chunkReaderAdvance(&aReaders[i]);
+          if(rc == SQLITE_OK)
+            rc = aReaders[i].rc;
+        }
+      }
+      if(rc == SQLITE_OK)
+        rc = docListWriterAdd(&writer, id, masks);
+    }
+  }
+  for(i = 0; i < nSegments; i++)
+    chunkReaderRelease(&aReaders[i]);
+  sqlite3_free(aReaders);
+  sqlite3_free(aValid);
+
+  unsigned char *docList;
+  int nDocList;
+  if(rc == SQLITE_OK)
+    rc = docListWriterFinish(&writer, &docList, &nDocList);
+  else
+    docListWriterRelease(&writer);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Write doclist and its directory entry */
+  sealed_entry entry;
+  entry.offset   = *pOffset;
+  entry.size     = nDocList;
+  entry.reserved = 0;
+  if(nDocList > 0){
+    if(pwrite(fd, docList, nDocList, *pOffset) != nDocList ||
+       pwrite(fd, &entry, sizeof(entry), SEALED_DIRECTORY_OFFSET + (sqlite3_int64)SEALED_ENTRY_SIZE * trigram) != sizeof(entry))
+      rc = SQLITE_IOERR;
+    *pOffset += nDocList;
+  }
+  sqlite3_free(docList);
+  return rc;
+}
+
+/** Find smallest key of iSegment, with a trigram of at least trigram
+ * Outputs -1 as *pKey, if there's no such key */
+static int nextKey(sqlite3_stmt *pStmt, int iSegment, trilite_trigram trigram, sqlite3_int64 *pKey){
+  sqlite3_bind_int64(pStmt, 1, SEGMENT_KEY(iSegment, trigram));
+  sqlite3_bind_int64(pStmt, 2, SEGMENT_KEY(iSegment, TRIGRAM_MAX));
+  if(sqlite3_step(pStmt) == SQLITE_ROW)
+    *pKey = sqlite3_column_int64(pStmt, 0);
+  else
+    *pKey = -1;
+  return sqlite3_reset(pStmt);
+}
+
+/** Map the sealed index at zPath, files that can't be mapped are ignored */
+static int mapSealed(trilite_vtab *pTrgVtab, const char *zPath){
+  int fd = open(zPath, O_RDONLY);
+  if(fd < 0) return SQLITE_OK;
+
+  /* Map the file, the mapping stays valid after closing it */
+  struct stat st;
+  void *map = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && st.st_size >= SEALED_DOCLISTS_OFFSET)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    trilite_log("Can't map sealed index, ignoring it");
+    return SQLITE_OK;
+  }
+
+  /* Check header */
+  sealed_header header;
+  memcpy(&header, map, sizeof(header));
+  if(memcmp(header.magic, SEALED_MAGIC, SEALED_MAGIC_SIZE) != 0 ||
+     header.version < 3 || header.version > TRILITE_FORMAT_VERSION ||
+     header.nSize != (uint64_t)st.st_size ||
+     SEALED_HEADER_SIZE + sizeof(int32_t) * header.nSegments > SEALED_DIRECTORY_OFFSET){
+    trilite_log("Invalid sealed index, ignoring it");
+    munmap(map, st.st_size);
+    return SQLITE_OK;
+  }
+
+  sealed_index *pSealed = (sealed_index*)sqlite3_malloc(sizeof(sealed_index));
+  if(!pSealed){
+    munmap(map, st.st_size);
+    return SQLITE_NOMEM;
+  }
+  pSealed->map       = (const unsigned char*)map;
+  pSealed->nMap      = st.st_size;
+  pSealed->iVersion  = header.version;
+  pSealed->nSegments = header.nSegments;
+  pSealed->aSegments = (const int32_t*)(pSealed->map + SEALED_HEADER_SIZE);
+  pSealed->valid     = false;
+  pTrgVtab->pSealed  = pSealed;
+  return SQLITE_OK;
+}
+
+/** Path of the sealed index recorded in %_config as *pzPath, NULL if the index
+ * hasn't been sealed. The path must be released with sqlite3_free. */
+static int sealedPath(trilite_vtab *pTrgVtab, char **pzPath){
+  sqlite3_stmt *pStmt;
+  *pzPath = NULL;
+
+  char *zSql = sqlite3_mprintf("SELECT value FROM %Q.'%q_config' WHERE key = 'sealed'",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  /* Legacy tables have no %_config, and can't be sealed */
+  if(rc != SQLITE_OK) return SQLITE_OK;
+
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    *pzPath = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+    if(!*pzPath){
+      sqlite3_finalize(pStmt);
+      return SQLITE_NOMEM;
+    }
+  }
+  return sqlite3_finalize(pStmt);
+}
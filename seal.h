@@ -0,0 +1,18 @@
+#ifndef TRILITE_SEAL_H
+#define TRILITE_SEAL_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+
+int sealWrite(trilite_vtab*, const char*);
+int sealOpen(trilite_vtab*);
+void sealCommit(trilite_vtab*);
+void sealRollback(trilite_vtab*);
+void sealClose(sealed_index*);
+void sealValidate(trilite_vtab*);
+bool sealCovers(trilite_vtab*, int);
+bool sealDocList(trilite_vtab*, trilite_trigram, const unsigned char**, int*, int*);
+
+#endif /* TRILITE_SEAL_H */
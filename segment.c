@@ -0,0 +1,669 @@
+#include "segment.h"
+#include "vtable.h"
+#include "doclist.h"
+#include "chunk.h"
+#include "stop.h"
+#include "tombstone.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* The index is a set of segments, each flush of pending doclists writes a new
+ * segment, rather than rewriting the doclists of the trigrams touched. Queries
+ * take the union of a trigram's doclists across all segments.
+ *
+ * Segments are merged using a tiered policy, when there's MERGE_FANIN segments
+ * of the same level, they are merged into a new segment of the next level.
+ * Merging is done incrementally, a little at each flush, one trigram at the
+ * time. The doclists of a trigram are moved from the input segments to the
+ * output segment, so queries see each id at all times, whether the trigram has
+ * been merged or not. Postings of deleted documents are dropped from doclists
+ * as they're merged, see tombstone.c.
+ *
+ * Doclists are stored in %_chunks with SEGMENT_KEY(segment, trigram) as key.
+ * Segments are listed in %_segments, where inputs of an ongoing merge have the
+ * output segment in the merge column.
+ */
+
+typedef struct segment_merge segment_merge;
+typedef struct segment_posting segment_posting;
+
+/** State of an ongoing merge */
+struct segment_merge{
+  /** Output segment */
+  int iOutput;
+
+  /** Number of input segments */
+  int nInputs;
+
+  /** Input segments */
+  int aInputs[MERGE_FANIN];
+
+  /** Smallest remaining key of each input, -1 if input is exhausted */
+  sqlite3_int64 aNext[MERGE_FANIN];
+
+  /** Select smallest key in a range of %_chunks */
+  sqlite3_stmt *stmt_next_key;
+
+  /** Delete chunks of doclist from %_chunks */
+  sqlite3_stmt *stmt_delete_doclist;
+
+  /** Tombstones of deleted documents, dropped from the output */
+  tombstone_reader tombstones;
+};
+
+/** Posting collected when rewriting doclists, see segmentRemap */
+struct segment_posting{
+  /** Document id */
+  sqlite3_int64 id;
+
+  /** Masks of the id */
+  trilite_masks masks;
+};
+
+static int levelForSize(sqlite3_int64);
+static int execSql(trilite_vtab*, char*);
+static int mergeOpen(trilite_vtab*, segment_merge*, bool*);
+static int mergeStart(trilite_vtab*, segment_merge*, bool*);
+static int mergeNextKey(segment_merge*, int);
+static int mergeTrigram(trilite_vtab*, segment_merge*, trilite_trigram, sqlite3_int64*);
+static int mergeFinish(trilite_vtab*, segment_merge*);
+static void mergeClose(segment_merge*);
+static int remapTrigram(trilite_vtab*, int, trilite_trigram, const sqlite3_int64*, const sqlite3_int64*,
+                        const sqlite3_int64*, int, sqlite3_int64, segment_posting**, int*, sqlite3_int64*);
+static int nextSegmentKey(sqlite3_stmt*, int, trilite_trigram, sqlite3_int64*);
+static int comparePostings(const void*, const void*);
+
+/** Load list of segments for querying
+ * Tables from before segments was introduced have all doclists in segment 0 */
+int segmentLoad(trilite_vtab *pTrgVtab){
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+
+  pTrgVtab->nSegments = 0;
+  if(pTrgVtab->formatVersion < 2){
+    pTrgVtab->aSegments = (int*)sqlite3_realloc(pTrgVtab->aSegments, sizeof(int));
+    if(!pTrgVtab->aSegments) return SQLITE_NOMEM;
+    pTrgVtab->aSegments[pTrgVtab->nSegments++] = 0;
+    return SQLITE_OK;
+  }
+
+  char *zSql = sqlite3_mprintf("SELECT segment, (SELECT count(*) FROM %Q.'%q_segments') FROM %Q.'%q_segments' ORDER BY segment",
+                               pTrgVtab->zDb, pTrgVtab->zName,
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  while(sqlite3_step(pStmt) == SQLITE_ROW){
+    /* Allocate space for all segments at the first row */
+    if(pTrgVtab->nSegments == 0){
+      int nSegments = sqlite3_column_int(pStmt, 1);
+      int *aSegments = (int*)sqlite3_realloc(pTrgVtab->aSegments, sizeof(int) * nSegments);
+      if(!aSegments){
+        sqlite3_finalize(pStmt);
+        return SQLITE_NOMEM;
+      }
+      pTrgVtab->aSegments = aSegments;
+    }
+    pTrgVtab->aSegments[pTrgVtab->nSegments++] = sqlite3_column_int(pStmt, 0);
+  }
+  rc = sqlite3_finalize(pStmt);
+
+  trilite_log("Loaded %i segments", pTrgVtab->nSegments);
+  return rc;
+}
+
+/** Create a new empty segment of level 0, output its id as *piSegment */
+int segmentCreate(trilite_vtab *pTrgVtab, int *piSegment){
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+
+  /* Segment ids are never reused while the segment exists */
+  char *zSql = sqlite3_mprintf("SELECT coalesce(max(segment) + 1, 0) FROM %Q.'%q_segments'",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  if(sqlite3_step(pStmt) == SQLITE_ROW)
+    *piSegment = sqlite3_column_int(pStmt, 0);
+  rc = sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK) return rc;
+
+  trilite_log("Creating segment %i", *piSegment);
+
+  return execSql(pTrgVtab, sqlite3_mprintf(
+    "INSERT INTO %Q.'%q_segments' (segment, level, size) VALUES (%d, 0, 0)",
+    pTrgVtab->zDb, pTrgVtab->zName, *piSegment));
+}
+
+/** Record size of a segment written by a flush */
+int segmentFinish(trilite_vtab *pTrgVtab, int iSegment, sqlite3_int64 nSize){
+  return execSql(pTrgVtab, sqlite3_mprintf(
+    "UPDATE %Q.'%q_segments' SET size = %lld WHERE segment = %d",
+    pTrgVtab->zDb, pTrgVtab->zName, nSize, iSegment));
+}
+
+/** Do merge work, until nBudget bytes have been written or there's nothing to
+ * merge. If there's more than MAX_SEGMENTS segments, merging continues until
+ * there's nothing to merge, regardless of budget. */
+int segmentMerge(trilite_vtab *pTrgVtab, sqlite3_int64 nBudget){
+  segment_merge merge;
+  int rc = SQLITE_OK;
+  bool found;
+  bool unlimited = pTrgVtab->nSegments > MAX_SEGMENTS;
+
+  while(unlimited || nBudget > 0){
+    rc = mergeOpen(pTrgVtab, &merge, &found);
+    if(rc != SQLITE_OK || !found) break;
+
+    /* Merge trigrams in order until budget is exhausted */
+    for(;;){
+      /* Find smallest trigram remaining in inputs */
+      sqlite3_int64 trigram = -1;
+      int i;
+      for(i = 0; i < merge.nInputs; i++){
+        if(merge.aNext[i] < 0) continue;
+        sqlite3_int64 t = KEY_TRIGRAM(merge.aNext[i]);
+        if(trigram < 0 || t < trigram)
+          trigram = t;
+      }
+      if(trigram < 0){
+        rc = mergeFinish(pTrgVtab, &merge);
+        break;
+      }
+      if(!unlimited && nBudget <= 0) break;
+      rc = mergeTrigram(pTrgVtab, &merge, (trilite_trigram)trigram, &nBudget);
+      if(rc != SQLITE_OK) break;
+    }
+    mergeClose(&merge);
+    if(rc != SQLITE_OK) break;
+  }
+  return rc;
+}
+
+/** Register doclists of a table without %_segments as segment 0 */
+int segmentUpgrade(trilite_vtab *pTrgVtab){
+  sqlite3_stmt *pStmt;
+  sqlite3_int64 nSize = 0;
+  int rc;
+
+  rc = execSql(pTrgVtab, sqlite3_mprintf(
+    "CREATE TABLE IF NOT EXISTS %Q.'%q_segments' (segment INTEGER PRIMARY KEY, level INTEGER, size INTEGER, merge INTEGER);",
+    pTrgVtab->zDb, pTrgVtab->zName));
+  if(rc != SQLITE_OK) return rc;
+
+  char *zSql = sqlite3_mprintf("SELECT coalesce(sum(length(doclist)), 0) FROM %Q.'%q_index'",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  if(sqlite3_step(pStmt) == SQLITE_ROW)
+    nSize = sqlite3_column_int64(pStmt, 0);
+  rc = sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK || nSize == 0) return rc;
+
+  /* Give it a level by size, so we don't merge it with the next small flush */
+  return execSql(pTrgVtab, sqlite3_mprintf(
+    "INSERT INTO %Q.'%q_segments' (segment, level, size) VALUES (0, %d, %lld)",
+    pTrgVtab->zDb, pTrgVtab->zName, levelForSize(nSize), nSize));
+}
+
+/** Rewrite all segments as a single segment, with document ids mapped from
+ * aOld[i] to aNew[i], where aOld is sorted in ascending order. Postings of ids
+ * not in aOld are dropped. The new segment is given a level by its size, and
+ * replaces all other segments, including inputs of an ongoing merge.
+ * Trigrams in more than nMaxDocs documents are made stop trigrams, and their
+ * doclists are dropped, see stop.c. Pending doclists must have been flushed. */
+int segmentRemap(trilite_vtab *pTrgVtab, const sqlite3_int64 *aOld, const sqlite3_int64 *aNew, int nIds, sqlite3_int64 nMaxDocs){
+  sqlite3_stmt *pStmt = NULL;
+  segment_posting *aPostings = NULL;
+  int nAlloc = 0;
+  sqlite3_int64 nSize = 0;
+  int iOutput;
+  int rc, i;
+
+  rc = segmentLoad(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+  int nSegments = pTrgVtab->nSegments;
+  if(nSegments == 0) return SQLITE_OK;
+
+  sqlite3_int64 *aNext = (sqlite3_int64*)sqlite3_malloc(sizeof(sqlite3_int64) * nSegments);
+  if(!aNext) return SQLITE_NOMEM;
+
+  /* Select smallest key in a range of %_chunks */
+  char *zSql = sqlite3_mprintf("SELECT trigram FROM %Q.'%q_chunks' WHERE trigram >= ? AND trigram <= ? ORDER BY trigram LIMIT 1",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql)
+    rc = SQLITE_NOMEM;
+  else
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+
+  /* Output segment has a larger id than any input, so it's never read here */
+  if(rc == SQLITE_OK)
+    rc = segmentCreate(pTrgVtab, &iOutput);
+  for(i = 0; i < nSegments && rc == SQLITE_OK; i++)
+    rc = nextSegmentKey(pStmt, pTrgVtab->aSegments[i], 0, &aNext[i]);
+
+  /* Rewrite doclists in order of trigrams */
+  while(rc == SQLITE_OK){
+    sqlite3_int64 trigram = -1;
+    for(i = 0; i < nSegments; i++){
+      if(aNext[i] < 0) continue;
+      if(trigram < 0 || KEY_TRIGRAM(aNext[i]) < trigram)
+        trigram = KEY_TRIGRAM(aNext[i]);
+    }
+    if(trigram < 0) break;
+    rc = remapTrigram(pTrgVtab, iOutput, (trilite_trigram)trigram, aNext, aOld, aNew, nIds,
+                      nMaxDocs, &aPostings, &nAlloc, &nSize);
+    for(i = 0; i < nSegments && rc == SQLITE_OK; i++){
+      if(aNext[i] != SEGMENT_KEY(pTrgVtab->aSegments[i], trigram)) continue;
+      if(trigram < TRIGRAM_MAX)
+        rc = nextSegmentKey(pStmt, pTrgVtab->aSegments[i], (trilite_trigram)trigram + 1, &aNext[i]);
+      else
+        aNext[i] = -1;
+    }
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(aPostings);
+
+  /* Remove the old segments and their doclists */
+  for(i = 0; i < nSegments && rc == SQLITE_OK; i++){
+    rc = execSql(pTrgVtab, sqlite3_mprintf(
+      "DELETE FROM %Q.'%q_chunks' WHERE trigram >= %lld AND trigram <= %lld;"
+      "DELETE FROM %Q.'%q_segments' WHERE segment = %d;",
+      pTrgVtab->zDb, pTrgVtab->zName,
+      SEGMENT_KEY(pTrgVtab->aSegments[i], 0), SEGMENT_KEY(pTrgVtab->aSegments[i], TRIGRAM_MAX),
+      pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->aSegments[i]));
+  }
+  sqlite3_free(aNext);
+  if(rc == SQLITE_OK){
+    rc = execSql(pTrgVtab, sqlite3_mprintf(
+      "UPDATE %Q.'%q_segments' SET level = %d, size = %lld WHERE segment = %d",
+      pTrgVtab->zDb, pTrgVtab->zName, levelForSize(nSize), nSize, iOutput));
+  }
+  if(rc == SQLITE_OK)
+    rc = segmentLoad(pTrgVtab);
+
+  trilite_log("Remapped %i segments into segment %i, %lli bytes", nSegments, iOutput, nSize);
+  return rc;
+}
+
+/** Level of a segment with nSize bytes */
+static int levelForSize(sqlite3_int64 nSize){
+  int level = 0;
+  while(nSize > MERGE_LEVEL_SIZE){
+    nSize /= MERGE_FANIN;
+    level++;
+  }
+  return level;
+}
+
+/** Execute and release zSql, which may be NULL if allocation failed */
+static int execSql(trilite_vtab *pTrgVtab, char *zSql){
+  int rc;
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/*********************************** Merge ***********************************/
+
+/** Open ongoing merge or start a new merge, *pFound is false if there's
+ * nothing to merge. Must be closed with mergeClose if found. */
+static int mergeOpen(trilite_vtab *pTrgVtab, segment_merge *pMerge, bool *pFound){
+  sqlite3_stmt *pStmt;
+  char *zDb = pTrgVtab->zDb;
+  char *zName = pTrgVtab->zName;
+  int rc = SQLITE_OK;
+  int i;
+
+  memset(pMerge, 0, sizeof(segment_merge));
+  *pFound = false;
+
+  /* Find inputs of ongoing merge */
+  char *zSql = sqlite3_mprintf("SELECT segment, merge FROM %Q.'%q_segments' WHERE merge IS NOT NULL ORDER BY segment",
+                               zDb, zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  while(sqlite3_step(pStmt) == SQLITE_ROW && pMerge->nInputs < MERGE_FANIN){
+    pMerge->aInputs[pMerge->nInputs++] = sqlite3_column_int(pStmt, 0);
+    pMerge->iOutput = sqlite3_column_int(pStmt, 1);
+  }
+  rc = sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Start a new merge, if there's no ongoing merge */
+  if(pMerge->nInputs == 0){
+    rc = mergeStart(pTrgVtab, pMerge, pFound);
+    if(rc != SQLITE_OK || !*pFound) return rc;
+  }
+  *pFound = true;
+
+  /* Prepare statements */
+  zSql = sqlite3_mprintf("SELECT trigram FROM %Q.'%q_chunks' WHERE trigram >= ? AND trigram <= ? ORDER BY trigram LIMIT 1", zDb, zName);
+  if(zSql) rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pMerge->stmt_next_key, 0);
+  sqlite3_free(zSql);
+  if(rc == SQLITE_OK){
+    zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_chunks' WHERE trigram = ?", zDb, zName);
+    if(zSql) rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pMerge->stmt_delete_doclist, 0);
+    sqlite3_free(zSql);
+  }
+  if(!zSql) rc = SQLITE_NOMEM;
+
+  /* Find first key of each input */
+  for(i = 0; i < pMerge->nInputs && rc == SQLITE_OK; i++)
+    rc = mergeNextKey(pMerge, i);
+
+  /* Ids of deleted documents to drop */
+  if(rc == SQLITE_OK)
+    rc = tombstoneReaderOpen(&pMerge->tombstones, pTrgVtab);
+
+  if(rc != SQLITE_OK)
+    mergeClose(pMerge);
+  return rc;
+}
+
+/** Start a new merge of MERGE_FANIN segments from the lowest level that has
+ * that many segments, *pFound is false if no level has enough segments */
+static int mergeStart(trilite_vtab *pTrgVtab, segment_merge *pMerge, bool *pFound){
+  sqlite3_stmt *pStmt;
+  char *zDb = pTrgVtab->zDb;
+  char *zName = pTrgVtab->zName;
+  int rc = SQLITE_OK;
+  int level = -1;
+
+  char *zSql = sqlite3_mprintf(
+    "SELECT level FROM %Q.'%q_segments' GROUP BY level HAVING count(*) >= %d ORDER BY level LIMIT 1",
+    zDb, zName, MERGE_FANIN);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  if(sqlite3_step(pStmt) == SQLITE_ROW)
+    level = sqlite3_column_int(pStmt, 0);
+  rc = sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK || level < 0) return rc;
+
+  /* Pick the oldest segments of the level */
+  zSql = sqlite3_mprintf("SELECT segment FROM %Q.'%q_segments' WHERE level = %d ORDER BY segment LIMIT %d",
+                         zDb, zName, level, MERGE_FANIN);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  while(sqlite3_step(pStmt) == SQLITE_ROW)
+    pMerge->aInputs[pMerge->nInputs++] = sqlite3_column_int(pStmt, 0);
+  rc = sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK) return rc;
+  assert(pMerge->nInputs == MERGE_FANIN);
+
+  /* Create output segment at the next level */
+  rc = segmentCreate(pTrgVtab, &pMerge->iOutput);
+  if(rc != SQLITE_OK) return rc;
+  rc = execSql(pTrgVtab, sqlite3_mprintf(
+    "UPDATE %Q.'%q_segments' SET level = %d WHERE segment = %d;"
+    "UPDATE %Q.'%q_segments' SET merge = %d WHERE level = %d AND segment IN (%d, %d, %d, %d);",
+    zDb, zName, level + 1, pMerge->iOutput,
+    zDb, zName, pMerge->iOutput, level,
+    pMerge->aInputs[0], pMerge->aInputs[1], pMerge->aInputs[2], pMerge->aInputs[3]));
+  if(rc != SQLITE_OK) return rc;
+
+  trilite_log("Merging segments %i, %i, %i, %i into %i",
+              pMerge->aInputs[0], pMerge->aInputs[1], pMerge->aInputs[2], pMerge->aInputs[3],
+              pMerge->iOutput);
+  *pFound = true;
+  return rc;
+}
+
+/** Find smallest key remaining in input i */
+static int mergeNextKey(segment_merge *pMerge, int i){
+  sqlite3_stmt *pStmt = pMerge->stmt_next_key;
+  sqlite3_bind_int64(pStmt, 1, SEGMENT_KEY(pMerge->aInputs[i], 0));
+  sqlite3_bind_int64(pStmt, 2, SEGMENT_KEY(pMerge->aInputs[i], TRIGRAM_MAX));
+  if(sqlite3_step(pStmt) == SQLITE_ROW)
+    pMerge->aNext[i] = sqlite3_column_int64(pStmt, 0);
+  else
+    pMerge->aNext[i] = -1;
+  return sqlite3_reset(pStmt);
+}
+
+/** Move doclists of trigram from inputs to output, as a single doclist
+ * Subtracts the number of bytes written from *pnBudget */
+static int mergeTrigram(trilite_vtab *pTrgVtab, segment_merge *pMerge, trilite_trigram trigram, sqlite3_int64 *pnBudget){
+  chunk_reader aReaders[MERGE_FANIN];
+  bool aValid[MERGE_FANIN];
+  chunk_writer writer;
+  int rc = SQLITE_OK;
+  int i;
+
+  chunkWriterInit(&writer, pTrgVtab, SEGMENT_KEY(pMerge->iOutput, trigram));
+  memset(aReaders, 0, sizeof(aReaders));
+  memset(aValid, 0, sizeof(aValid));
+
+  /* Open doclists of inputs that have the trigram */
+  for(i = 0; i < pMerge->nInputs && rc == SQLITE_OK; i++){
+    if(pMerge->aNext[i] != SEGMENT_KEY(pMerge->aInputs[i], trigram)) continue;
+    aValid[i] = chunkReaderOpen(&aReaders[i], pTrgVtab, pMerge->aNext[i]);
+    rc = aReaders[i].rc;
+  }
+
+  /* Order doclists by first id */
+  int aOrder[MERGE_FANIN];
+  int nOrder = 0;
+  for(i = 0; i < pMerge->nInputs; i++){
+    if(!aValid[i]) continue;
+    int j = nOrder++;
+    while(j > 0 && aReaders[aOrder[j - 1]].reader.curId > aReaders[i].reader.curId){
+      aOrder[j] = aOrder[j - 1];
+      j--;
+    }
+    aOrder[j] = i;
+  }
+
+  /* If the doclists don't overlap, which is the common case as ids are usually
+   * assigned in ascending order, their chunks can be appended without decoding,
+   * unless they hold ids of deleted documents */
+  bool decode = false;
+  for(i = 0; i < nOrder && !decode && rc == SQLITE_OK; i++){
+    if(i + 1 == nOrder && !pMerge->tombstones.any) break;
+    sqlite3_int64 lastId;
+    rc = chunkLastId(pTrgVtab, aReaders[aOrder[i]].key, &lastId);
+    if(i + 1 < nOrder)
+      decode = lastId >= aReaders[aOrder[i + 1]].reader.curId;
+    decode = decode || tombstoneReaderRange(&pMerge->tombstones, aReaders[aOrder[i]].reader.curId, lastId);
+  }
+  if(rc == SQLITE_OK)
+    rc = pMerge->tombstones.rc;
+  for(i = 0; i < nOrder && !decode && rc == SQLITE_OK; i++){
+    chunk_reader *pReader = &aReaders[aOrder[i]];
+    do{
+      rc = chunkWriterAppend(&writer, pReader->chunk, pReader->nChunk, pReader->chunkId);
+    }while(rc == SQLITE_OK && chunkReaderNextChunk(pReader));
+    if(rc == SQLITE_OK)
+      rc = pReader->rc;
+  }
+
+  /* Otherwise, write the union of the doclists one id at the time, without
+   * deleted documents */
+  while(decode && rc == SQLITE_OK){
+    sqlite3_int64 id = 0;
+    bool found = false;
+    for(i = 0; i < pMerge->nInputs; i++){
+      if(aValid[i] && (!found || aReaders[i].reader.curId < id)){
+        id = aReaders[i].reader.curId;
+        found = true;
+      }
+    }
+    if(!found) break;
+    /* Masks of an id present in several inputs are merged */
+    trilite_masks masks = 0;
+    for(i = 0; i < pMerge->nInputs; i++){
+      if(aValid[i] && aReaders[i].reader.curId == id){
+        masks |= docListMasks(&aReaders[i].reader);
+        aValid[i] = chunkReaderAdvance(&aReaders[i]);
+        if(rc == SQLITE_OK)
+          rc = aReaders[i].rc;
+      }
+    }
+    /* A doclist that failed to read isn't at its end, don't write it as one */
+    if(rc != SQLITE_OK) break;
+    if(!tombstoneReaderCheck(&pMerge->tombstones, id))
+      rc = chunkWriterAdd(&writer, id, masks);
+    if(rc == SQLITE_OK)
+      rc = pMerge->tombstones.rc;
+  }
+  for(i = 0; i < pMerge->nInputs; i++)
+    chunkReaderRelease(&aReaders[i]);
+
+  /* Store the last chunk of the output */
+  if(rc == SQLITE_OK)
+    rc = chunkWriterFinish(&writer);
+  else
+    chunkWriterRelease(&writer);
+  if(rc != SQLITE_OK) return rc;
+  *pnBudget -= writer.nWritten;
+
+  /* Remove doclists from inputs */
+  for(i = 0; i < pMerge->nInputs && rc == SQLITE_OK; i++){
+    if(pMerge->aNext[i] != SEGMENT_KEY(pMerge->aInputs[i], trigram)) continue;
+    sqlite3_bind_int64(pMerge->stmt_delete_doclist, 1, pMerge->aNext[i]);
+    sqlite3_step(pMerge->stmt_delete_doclist);
+    rc = sqlite3_reset(pMerge->stmt_delete_doclist);
+    if(rc == SQLITE_OK)
+      rc = mergeNextKey(pMerge, i);
+  }
+
+  /* Track size of output */
+  if(rc == SQLITE_OK){
+    rc = execSql(pTrgVtab, sqlite3_mprintf(
+      "UPDATE %Q.'%q_segments' SET size = size + %lld WHERE segment = %d",
+      pTrgVtab->zDb, pTrgVtab->zName, writer.nWritten, pMerge->iOutput));
+  }
+  return rc;
+}
+
+/** Remove the inputs of a completed merge */
+static int mergeFinish(trilite_vtab *pTrgVtab, segment_merge *pMerge){
+  trilite_log("Finished merge into segment %i", pMerge->iOutput);
+  return execSql(pTrgVtab, sqlite3_mprintf(
+    "DELETE FROM %Q.'%q_segments' WHERE merge = %d",
+    pTrgVtab->zDb, pTrgVtab->zName, pMerge->iOutput));
+}
+
+/** Release statements held by merge */
+static void mergeClose(segment_merge *pMerge){
+  sqlite3_finalize(pMerge->stmt_next_key);
+  sqlite3_finalize(pMerge->stmt_delete_doclist);
+  tombstoneReaderClose(&pMerge->tombstones);
+  memset(pMerge, 0, sizeof(segment_merge));
+}
+
+/********************************** Remap ************************************/
+
+/** Write the doclists of trigram in all segments, where aNext holds the key, as
+ * a single doclist of segment iOutput, with ids mapped as in segmentRemap.
+ * If the trigram is in more than nMaxDocs documents it's made a stop trigram
+ * instead. Postings are collected in *paPostings of *pnAlloc entries, which is
+ * grown as needed and reused between trigrams. Adds bytes written to *pnSize */
+static int remapTrigram(trilite_vtab *pTrgVtab, int iOutput, trilite_trigram trigram, const sqlite3_int64 *aNext,
+                        const sqlite3_int64 *aOld, const sqlite3_int64 *aNew, int nIds, sqlite3_int64 nMaxDocs,
+                        segment_posting **paPostings, int *pnAlloc, sqlite3_int64 *pnSize){
+  chunk_writer writer;
+  int nPostings = 0;
+  int rc = SQLITE_OK;
+  int i;
+
+  /* Collect postings of all segments with mapped ids */
+  for(i = 0; i < pTrgVtab->nSegments && rc == SQLITE_OK; i++){
+    chunk_reader reader;
+    if(aNext[i] != SEGMENT_KEY(pTrgVtab->aSegments[i], trigram)) continue;
+    bool more = chunkReaderOpen(&reader, pTrgVtab, aNext[i]);
+    while(more){
+      /* Find id in aOld by binary search */
+      int lo = 0, hi = nIds;
+      while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(aOld[mid] < reader.reader.curId)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if(lo < nIds && aOld[lo] == reader.reader.curId){
+        if(nPostings == *pnAlloc){
+          int nAlloc = *pnAlloc * 2 + DOCLIST_BLOCK_SIZE;
+          segment_posting *aPostings = (segment_posting*)sqlite3_realloc(*paPostings, sizeof(segment_posting) * nAlloc);
+          if(!aPostings){
+            rc = SQLITE_NOMEM;
+            break;
+          }
+          *paPostings = aPostings;
+          *pnAlloc = nAlloc;
+        }
+        (*paPostings)[nPostings].id    = aNew[lo];
+        (*paPostings)[nPostings].masks = docListMasks(&reader.reader);
+        nPostings++;
+      }
+      more = chunkReaderAdvance(&reader);
+    }
+    if(rc == SQLITE_OK)
+      rc = reader.rc;
+    chunkReaderRelease(&reader);
+  }
+  if(rc != SQLITE_OK || nPostings == 0) return rc;
+
+  /* Write postings in order of the new ids, an id present in more than one
+   * segment has its masks merged */
+  qsort(*paPostings, nPostings, sizeof(segment_posting), comparePostings);
+  if(nPostings > nMaxDocs){
+    sqlite3_int64 nDocs = 1;
+    for(i = 1; i < nPostings; i++)
+      nDocs += (*paPostings)[i].id != (*paPostings)[i - 1].id;
+    if(nDocs > nMaxDocs){
+      trilite_log("Trigram %u in %lli documents is a stop trigram", trigram, nDocs);
+      return stopAdd(pTrgVtab, trigram);
+    }
+  }
+  chunkWriterInit(&writer, pTrgVtab, SEGMENT_KEY(iOutput, trigram));
+  for(i = 0; i < nPostings && rc == SQLITE_OK; i++){
+    trilite_masks masks = (*paPostings)[i].masks;
+    while(i + 1 < nPostings && (*paPostings)[i + 1].id == (*paPostings)[i].id)
+      masks |= (*paPostings)[++i].masks;
+    rc = chunkWriterAdd(&writer, (*paPostings)[i].id, masks);
+  }
+  if(rc == SQLITE_OK)
+    rc = chunkWriterFinish(&writer);
+  else
+    chunkWriterRelease(&writer);
+  *pnSize += writer.nWritten;
+  return rc;
+}
+
+/** Find smallest key of iSegment, with a trigram of at least trigram
+ * Outputs -1 as *pKey, if there's no such key */
+static int nextSegmentKey(sqlite3_stmt *pStmt, int iSegment, trilite_trigram trigram, sqlite3_int64 *pKey){
+  sqlite3_bind_int64(pStmt, 1, SEGMENT_KEY(iSegment, trigram));
+  sqlite3_bind_int64(pStmt, 2, SEGMENT_KEY(iSegment, TRIGRAM_MAX));
+  if(sqlite3_step(pStmt) == SQLITE_ROW)
+    *pKey = sqlite3_column_int64(pStmt, 0);
+  else
+    *pKey = -1;
+  return sqlite3_reset(pStmt);
+}
+
+/** Compare postings by id for qsort */
+static int comparePostings(const void *pA, const void *pB){
+  sqlite3_int64 a = ((const segment_posting*)pA)->id;
+  sqlite3_int64 b = ((const segment_posting*)pB)->id;
+  return a < b ? -1 : a > b;
+}
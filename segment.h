@@ -0,0 +1,15 @@
+#ifndef TRILITE_SEGMENT_H
+#define TRILITE_SEGMENT_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+
+int segmentLoad(trilite_vtab*);
+int segmentCreate(trilite_vtab*, int*);
+int segmentFinish(trilite_vtab*, int, sqlite3_int64);
+int segmentMerge(trilite_vtab*, sqlite3_int64);
+int segmentUpgrade(trilite_vtab*);
+int segmentRemap(trilite_vtab*, const sqlite3_int64*, const sqlite3_int64*, int, sqlite3_int64);
+
+#endif /* TRILITE_SEGMENT_H */
@@ -0,0 +1,166 @@
+#include "signature.h"
+#include "vtable.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+/* Candidates of a match scan are verified by the match function, which needs
+ * the text of the document. For large documents fetching the text is the most
+ * expensive part of a match scan, and for substrings made of common trigrams
+ * most candidates are rejected once fetched.
+ *
+ * With the signature option, each document also has a Bloom signature of its
+ * 4- and 5-grams in %_signatures, a fixed number of bytes given by the option.
+ * Before fetching a candidate, the cursor tests the grams of the substring
+ * patterns of the query against its signature, and skips the candidate if a
+ * gram is not in it. The signature is read through a single blob handle held
+ * by the cursor, which is moved from row to row with sqlite3_blob_reopen, and
+ * only the bytes holding probed bits are read.
+ *
+ * Grams are hashed with ASCII case folding, so a signature serves both case
+ * sensitive and case-insensitive patterns. Case-insensitive patterns on tables
+ * with the utf8 option are folded by codepoint, so they aren't probed.
+ * Documents without a signature, and documents whose signature can't be read,
+ * are never rejected.
+ */
+
+/** 64 bit FNV-1a hash of the folded gram of nGram bytes */
+static uint64_t gramHash(const unsigned char *gram, int nGram){
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  int i;
+  for(i = 0; i < nGram; i++){
+    hash ^= LOWER(gram[i]);
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/** Bit k of the SIGNATURE_HASHES bits of a gram with hash in a signature of
+ * nBits bits, derived from the two halves of the hash */
+static uint32_t probeBit(uint64_t hash, int k, uint32_t nBits){
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  return (h1 + (uint32_t)k * h2) % nBits;
+}
+
+/** Compute the signature of a text and store it as the signature of document
+ * id in %_signatures, replacing any signature it had */
+int signatureAdd(trilite_vtab *pTrgVtab, sqlite3_int64 id, const unsigned char *zText, int nText){
+  int nSize = pTrgVtab->signatureSize;
+  uint32_t nBits = (uint32_t)nSize * BITSPERBYTE;
+  assert(nSize > 0);
+
+  unsigned char *signature = (unsigned char*)sqlite3_malloc(nSize);
+  if(!signature) return SQLITE_NOMEM;
+  memset(signature, 0, nSize);
+
+  int nGram, i, k;
+  for(nGram = SIGNATURE_MIN_GRAM; nGram <= SIGNATURE_MAX_GRAM; nGram++){
+    for(i = 0; i + nGram <= nText; i++){
+      uint64_t hash = gramHash(zText + i, nGram);
+      for(k = 0; k < SIGNATURE_HASHES; k++){
+        uint32_t bit = probeBit(hash, k, nBits);
+        signature[bit / BITSPERBYTE] |= 1 << (bit % BITSPERBYTE);
+      }
+    }
+  }
+
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_insert_signature;
+  sqlite3_bind_int64(pStmt, 1, id);
+  sqlite3_bind_blob(pStmt, 2, signature, nSize, sqlite3_free);
+  sqlite3_step(pStmt);
+  return sqlite3_reset(pStmt);
+}
+
+/** Substring of a substring pattern, returns NULL for other patterns
+ * The length of the substring is output as *pnString, and *pFold is set, if
+ * the pattern is case-insensitive. */
+static const unsigned char *patternSubstring(const unsigned char *pattern, int nPattern, int *pnString, bool *pFold){
+  const char *azPrefixes[] = {"substr:", "isubstr:", "substr-extents:", "isubstr-extents:"};
+  int i;
+  for(i = 0; i < (int)(sizeof(azPrefixes) / sizeof(azPrefixes[0])); i++){
+    int nPrefix = strlen(azPrefixes[i]);
+    if(nPattern >= nPrefix && strncmp((const char*)pattern, azPrefixes[i], nPrefix) == 0){
+      *pnString = nPattern - nPrefix;
+      *pFold = azPrefixes[i][0] == 'i';
+      return pattern + nPrefix;
+    }
+  }
+  return NULL;
+}
+
+/** Hashes of the grams of the substring patterns among argv, that must all be
+ * in the signature of a matching document, at most SIGNATURE_MAX_PROBES of
+ * them, 5-grams first. Hashes are output as *paProbes, which must be released
+ * with sqlite3_free, and the number of hashes as *pnProbes. */
+int signatureProbes(trilite_vtab *pTrgVtab, int argc, sqlite3_value **argv, uint64_t **paProbes, int *pnProbes){
+  *pnProbes = 0;
+  *paProbes = (uint64_t*)sqlite3_malloc(sizeof(uint64_t) * SIGNATURE_MAX_PROBES);
+  if(!*paProbes) return SQLITE_NOMEM;
+
+  int nGram, i, j, k;
+  for(nGram = SIGNATURE_MAX_GRAM; nGram >= SIGNATURE_MIN_GRAM; nGram--){
+    for(i = 0; i < argc; i++){
+      const unsigned char *pattern = sqlite3_value_text(argv[i]);
+      int nPattern = sqlite3_value_bytes(argv[i]);
+      int nString;
+      bool fold;
+      const unsigned char *string = pattern ? patternSubstring(pattern, nPattern, &nString, &fold) : NULL;
+      if(!string || (fold && pTrgVtab->utf8)) continue;
+      for(j = 0; j + nGram <= nString && *pnProbes < SIGNATURE_MAX_PROBES; j++){
+        uint64_t hash = gramHash(string + j, nGram);
+        for(k = 0; k < *pnProbes; k++)
+          if((*paProbes)[k] == hash) break;
+        if(k == *pnProbes)
+          (*paProbes)[(*pnProbes)++] = hash;
+      }
+    }
+  }
+  return SQLITE_OK;
+}
+
+/** Check signature of document id for the grams hashed in aProbes
+ * *ppBlob is a blob handle on %_signatures, opened when NULL, and moved to the
+ * signature of id otherwise. It's closed and set NULL, if id has no signature.
+ * Returns true, if a gram is not in the signature, so the document can't match */
+bool signatureReject(trilite_vtab *pTrgVtab, sqlite3_blob **ppBlob, const uint64_t *aProbes, int nProbes, sqlite3_int64 id){
+  int rc;
+  if(*ppBlob)
+    rc = sqlite3_blob_reopen(*ppBlob, id);
+  else{
+    char *zTable = sqlite3_mprintf("%s_signatures", pTrgVtab->zName);
+    if(!zTable) return false;
+    rc = sqlite3_blob_open(pTrgVtab->db, pTrgVtab->zDb, zTable, "signature", id, 0, ppBlob);
+    sqlite3_free(zTable);
+  }
+
+  /* A handle that failed to move is aborted, a new one is opened next time */
+  if(rc != SQLITE_OK){
+    sqlite3_blob_close(*ppBlob);
+    *ppBlob = NULL;
+    return false;
+  }
+
+  uint32_t nBits = (uint32_t)sqlite3_blob_bytes(*ppBlob) * BITSPERBYTE;
+  if(nBits == 0) return false;
+
+  int i, k;
+  for(i = 0; i < nProbes; i++){
+    for(k = 0; k < SIGNATURE_HASHES; k++){
+      uint32_t bit = probeBit(aProbes[i], k, nBits);
+      unsigned char byte;
+      if(sqlite3_blob_read(*ppBlob, &byte, 1, bit / BITSPERBYTE) != SQLITE_OK){
+        sqlite3_blob_close(*ppBlob);
+        *ppBlob = NULL;
+        return false;
+      }
+      if(!(byte & (1 << (bit % BITSPERBYTE)))){
+        trilite_log("Candidate %lli rejected by signature", id);
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,14 @@
+#ifndef TRILITE_SIGNATURE_H
+#define TRILITE_SIGNATURE_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+int signatureAdd(trilite_vtab*, sqlite3_int64, const unsigned char*, int);
+int signatureProbes(trilite_vtab*, int, sqlite3_value**, uint64_t**, int*);
+bool signatureReject(trilite_vtab*, sqlite3_blob**, const uint64_t*, int, sqlite3_int64);
+
+#endif /* TRILITE_SIGNATURE_H */
@@ -0,0 +1,105 @@
+#include "stop.h"
+#include "vtable.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+/* Trigrams present in almost every document are useless for filtering, and
+ * their doclists are large to store and slow to write. With the stopfreq
+ * option, trigrams present in more than stopfreq percent of the documents are
+ * stop trigrams, listed in %_stop. Stop trigrams have no doclists, they're not
+ * indexed on insert, and queries treat them as matching all documents.
+ *
+ * The set of stop trigrams is recomputed when the index is optimized, see
+ * optimize.c, doclists of new stop trigrams are dropped, and trigrams that are
+ * no longer stop trigrams are indexed again. Stop trigrams are kept as a sorted
+ * array on the virtual table, loaded when connecting, at the start of each
+ * transaction and by each match scan, as another connection may have
+ * optimized the index. They're forgotten on rollback, as a rolled back
+ * optimize may have changed them.
+ */
+
+/** Load stop trigrams from %_stop, tables from before %_stop have none */
+int stopLoad(trilite_vtab *pTrgVtab){
+  sqlite3_stmt *pStmt;
+  int rc;
+
+  sqlite3_free(pTrgVtab->aStop);
+  pTrgVtab->aStop = NULL;
+  pTrgVtab->nStop = 0;
+
+  char *zSql = sqlite3_mprintf("SELECT trigram, (SELECT count(*) FROM %Q.'%q_stop') FROM %Q.'%q_stop' ORDER BY trigram",
+                               pTrgVtab->zDb, pTrgVtab->zName,
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return SQLITE_OK;
+
+  while(sqlite3_step(pStmt) == SQLITE_ROW){
+    /* Allocate space for all stop trigrams at the first row */
+    if(!pTrgVtab->aStop){
+      int nStop = sqlite3_column_int(pStmt, 1);
+      pTrgVtab->aStop = (trilite_trigram*)sqlite3_malloc(sizeof(trilite_trigram) * nStop);
+      if(!pTrgVtab->aStop){
+        sqlite3_finalize(pStmt);
+        return SQLITE_NOMEM;
+      }
+    }
+    pTrgVtab->aStop[pTrgVtab->nStop++] = (trilite_trigram)sqlite3_column_int64(pStmt, 0);
+  }
+  rc = sqlite3_finalize(pStmt);
+
+  trilite_log("Loaded %i stop trigrams", pTrgVtab->nStop);
+  return rc;
+}
+
+/** True, if trigram is a stop trigram */
+bool stopTrigram(trilite_vtab *pTrgVtab, trilite_trigram trigram){
+  return stopIndex(pTrgVtab, trigram) >= 0;
+}
+
+/** Index of trigram in the stop trigrams of the virtual table, -1 if trigram
+ * isn't a stop trigram */
+int stopIndex(trilite_vtab *pTrgVtab, trilite_trigram trigram){
+  int lo = 0, hi = pTrgVtab->nStop;
+  while(lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    if(pTrgVtab->aStop[mid] < trigram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < pTrgVtab->nStop && pTrgVtab->aStop[lo] == trigram ? lo : -1;
+}
+
+/** Record trigram as stop trigram in %_stop
+ * Stop trigrams on the virtual table are not updated until stopLoad. */
+int stopAdd(trilite_vtab *pTrgVtab, trilite_trigram trigram){
+  char *zSql = sqlite3_mprintf("INSERT OR IGNORE INTO %Q.'%q_stop' (trigram) VALUES (%lld);",
+                               pTrgVtab->zDb, pTrgVtab->zName, (sqlite3_int64)trigram);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/** Remove trigram from %_stop, its doclist must be indexed again */
+int stopRemove(trilite_vtab *pTrgVtab, trilite_trigram trigram){
+  char *zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_stop' WHERE trigram = %lld;",
+                               pTrgVtab->zDb, pTrgVtab->zName, (sqlite3_int64)trigram);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/** Largest number of documents a trigram can be in, in a table of nDocs
+ * documents, without being a stop trigram */
+sqlite3_int64 stopMaxDocs(trilite_vtab *pTrgVtab, int nDocs){
+  if(pTrgVtab->stopFreq == 0 || nDocs < STOP_MIN_DOCUMENTS)
+    return SQLITE3_INT64_MAX;
+  return (sqlite3_int64)nDocs * pTrgVtab->stopFreq / 100;
+}
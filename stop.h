@@ -0,0 +1,16 @@
+#ifndef TRILITE_STOP_H
+#define TRILITE_STOP_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+
+int stopLoad(trilite_vtab*);
+bool stopTrigram(trilite_vtab*, trilite_trigram);
+int stopIndex(trilite_vtab*, trilite_trigram);
+int stopAdd(trilite_vtab*, trilite_trigram);
+int stopRemove(trilite_vtab*, trilite_trigram);
+sqlite3_int64 stopMaxDocs(trilite_vtab*, int);
+
+#endif /* TRILITE_STOP_H */
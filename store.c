@@ -0,0 +1,420 @@
+#include "store.h"
+#include "vtable.h"
+#include "varint.h"
+#include "lz.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#define MIN(a,b)    ((a) > (b) ? (b) : (a))
+
+/* With the compress option, documents are appended to blocks of about
+ * CONTENT_BLOCK_SIZE bytes, which are compressed and stored in %_store. The
+ * text column of %_content then holds a locator, the block, offset and size of
+ * the document as varints, rather than the text.
+ *
+ * Blocks are compressed with a shared dictionary as prefix, so small blocks
+ * compress well too. The dictionary is taken from the first block written, and
+ * stored in %_config under the key 'dictionary'.
+ *
+ * Documents are stored with a terminating zero, so the text handed to the
+ * verifier is zero terminated, as text from sqlite is. Blocks are only ever
+ * appended to, the last block is reopened by the first append in transaction,
+ * until it's full.
+ */
+
+typedef struct store_cache store_cache;
+
+/** Decompressed block in the block cache */
+struct store_cache{
+  /** Block number, -1 if the entry is empty */
+  sqlite3_int64 iBlock;
+
+  /** Dictionary followed by the decompressed block */
+  unsigned char *buf;
+
+  /** Size of the decompressed block */
+  int nData;
+
+  /** Clock of last use, for evicting the least recently used entry */
+  unsigned int iLastUse;
+};
+
+/** Content store of a table with the compress option */
+struct content_store{
+  /** Dictionary, if loaded or created */
+  unsigned char *dict;
+
+  /** Size of dictionary, -1 if not loaded */
+  int nDict;
+
+  /** Block being appended to, -1 if none is open */
+  sqlite3_int64 iPending;
+
+  /** Content of the block being appended to */
+  unsigned char *pending;
+
+  /** Size of pending */
+  int nPending;
+
+  /** Bytes allocated for pending */
+  int nPendingAlloc;
+
+  /** Pending has been appended to since it was written */
+  bool dirty;
+
+  /** Block cache */
+  store_cache aCache[CONTENT_CACHE_BLOCKS];
+
+  /** Clock for tracking use of cache entries */
+  unsigned int iClock;
+};
+
+static int loadDictionary(trilite_vtab*);
+static int createDictionary(trilite_vtab*);
+static int reopenLast(trilite_vtab*);
+static int decompressBlock(trilite_vtab*, const unsigned char*, int, int, unsigned char**);
+
+
+/** Allocate a new content store */
+int storeOpen(content_store **ppStore){
+  content_store *pStore = (content_store*)sqlite3_malloc(sizeof(content_store));
+  *ppStore = pStore;
+  if(!pStore) return SQLITE_NOMEM;
+  memset(pStore, 0, sizeof(content_store));
+  pStore->nDict    = -1;
+  pStore->iPending = -1;
+  int i;
+  for(i = 0; i < CONTENT_CACHE_BLOCKS; i++)
+    pStore->aCache[i].iBlock = -1;
+  return SQLITE_OK;
+}
+
+/** Release content store, pending changes must be flushed first */
+void storeClose(content_store *pStore){
+  if(!pStore) return;
+  storeReset(pStore);
+  sqlite3_free(pStore->dict);
+  sqlite3_free(pStore);
+}
+
+/** Forget pending block and cached blocks
+ * Called when a transaction begins, as blocks may have been written by other
+ * connections or rolled back since. The dictionary never changes once stored,
+ * so it's kept. */
+void storeReset(content_store *pStore){
+  sqlite3_free(pStore->pending);
+  pStore->pending       = NULL;
+  pStore->nPending      = 0;
+  pStore->nPendingAlloc = 0;
+  pStore->iPending      = -1;
+  pStore->dirty         = false;
+  int i;
+  for(i = 0; i < CONTENT_CACHE_BLOCKS; i++){
+    sqlite3_free(pStore->aCache[i].buf);
+    pStore->aCache[i].buf    = NULL;
+    pStore->aCache[i].iBlock = -1;
+  }
+}
+
+/** Forget pending block, cached blocks and the dictionary, when a transaction
+ * is rolled back. The dictionary may have been stored by the transaction, so
+ * it's loaded from %_config again, or created anew if it wasn't committed. */
+void storeRollback(content_store *pStore){
+  storeReset(pStore);
+  sqlite3_free(pStore->dict);
+  pStore->dict  = NULL;
+  pStore->nDict = -1;
+}
+
+/** Append text to the content store
+ * Outputs a locator for the text, of at most MAX_LOCATOR_SIZE bytes, which
+ * must be stored in %_content for fetching the text with storeFetch. */
+int storeAppend(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText, unsigned char *locator, int *pnLocator){
+  content_store *pStore = pTrgVtab->pStore;
+  int rc = SQLITE_OK;
+
+  /* Continue last block, if any, on first append */
+  if(pStore->iPending < 0){
+    rc = reopenLast(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Start a new block, if text doesn't fit */
+  if(pStore->nPending > 0 && pStore->nPending + nText + 1 > CONTENT_BLOCK_SIZE){
+    sqlite3_int64 iNext = pStore->iPending + 1;
+    rc = storeFlush(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+    pStore->iPending = iNext;
+  }
+
+  /* Make room for text and terminating zero */
+  if(pStore->nPending + nText + 1 > pStore->nPendingAlloc){
+    int nAlloc = pStore->nPending + nText + 1;
+    if(nAlloc < CONTENT_BLOCK_SIZE)
+      nAlloc = CONTENT_BLOCK_SIZE;
+    unsigned char *pending = (unsigned char*)sqlite3_realloc(pStore->pending, nAlloc);
+    if(!pending) return SQLITE_NOMEM;
+    pStore->pending       = pending;
+    pStore->nPendingAlloc = nAlloc;
+  }
+
+  /* Output locator */
+  int nLocator = 0;
+  nLocator += writeVarInt(locator + nLocator, pStore->iPending);
+  nLocator += writeVarInt(locator + nLocator, pStore->nPending);
+  nLocator += writeVarInt(locator + nLocator, nText);
+  *pnLocator = nLocator;
+
+  /* Append text */
+  memcpy(pStore->pending + pStore->nPending, zText, nText);
+  pStore->pending[pStore->nPending + nText] = '\0';
+  pStore->nPending += nText + 1;
+  pStore->dirty = true;
+
+  /* Write block when it's full */
+  if(pStore->nPending >= CONTENT_BLOCK_SIZE){
+    sqlite3_int64 iNext = pStore->iPending + 1;
+    rc = storeFlush(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+    pStore->iPending = iNext;
+  }
+  return rc;
+}
+
+/** Compress and write pending block to %_store
+ * The pending block is released, so the next append reopens the last block. */
+int storeFlush(trilite_vtab *pTrgVtab){
+  content_store *pStore = pTrgVtab->pStore;
+  int rc = SQLITE_OK;
+
+  if(pStore->dirty){
+    assert(pStore->iPending >= 0);
+    rc = loadDictionary(pTrgVtab);
+    if(rc == SQLITE_OK && pStore->nDict < 0)
+      rc = createDictionary(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+
+    /* Compress with dictionary as prefix */
+    int nBuf = pStore->nDict + pStore->nPending;
+    unsigned char *buf = (unsigned char*)sqlite3_malloc(nBuf);
+    unsigned char *dst = (unsigned char*)sqlite3_malloc(LZ_BOUND(pStore->nPending));
+    if(!buf || !dst){
+      sqlite3_free(buf);
+      sqlite3_free(dst);
+      return SQLITE_NOMEM;
+    }
+    memcpy(buf, pStore->dict, pStore->nDict);
+    memcpy(buf + pStore->nDict, pStore->pending, pStore->nPending);
+    int nDst = lzCompress(buf, pStore->nDict, nBuf, dst);
+    sqlite3_free(buf);
+    if(nDst < 0){
+      sqlite3_free(dst);
+      return SQLITE_NOMEM;
+    }
+
+    trilite_log("Writing block %lli, %i bytes compressed to %i", pStore->iPending, pStore->nPending, nDst);
+
+    /* Insert or replace block */
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_insert_store;
+    sqlite3_bind_int64(pStmt, 1, pStore->iPending);
+    sqlite3_bind_int(pStmt, 2, pStore->nPending);
+    sqlite3_bind_blob(pStmt, 3, dst, nDst, sqlite3_free);
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+    sqlite3_clear_bindings(pStmt);
+    if(rc != SQLITE_OK) return rc;
+
+    /* Cached copy of the block is outdated */
+    int i;
+    for(i = 0; i < CONTENT_CACHE_BLOCKS; i++){
+      if(pStore->aCache[i].iBlock == pStore->iPending){
+        sqlite3_free(pStore->aCache[i].buf);
+        pStore->aCache[i].buf    = NULL;
+        pStore->aCache[i].iBlock = -1;
+      }
+    }
+  }
+
+  /* Release pending block */
+  sqlite3_free(pStore->pending);
+  pStore->pending       = NULL;
+  pStore->nPending      = 0;
+  pStore->nPendingAlloc = 0;
+  pStore->iPending      = -1;
+  pStore->dirty         = false;
+  return rc;
+}
+
+/** Fetch text from its locator
+ * The text is zero terminated, and owned by the content store, it's valid until
+ * the next call to a store function. */
+int storeFetch(trilite_vtab *pTrgVtab, const unsigned char *locator, int nLocator, const unsigned char **pText, int *pnText){
+  content_store *pStore = pTrgVtab->pStore;
+  int rc = SQLITE_OK;
+
+  /* Decode locator, from a zero padded copy, as readVarInt isn't bounded */
+  unsigned char buf[MAX_LOCATOR_SIZE + MAX_VARINT_SIZE];
+  if(nLocator > MAX_LOCATOR_SIZE) return SQLITE_CORRUPT;
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, locator, nLocator);
+  sqlite3_int64 iBlock, offset, size;
+  int n = 0;
+  n += readVarInt(buf + n, &iBlock);
+  n += readVarInt(buf + n, &offset);
+  n += readVarInt(buf + n, &size);
+  if(n != nLocator) return SQLITE_CORRUPT;
+
+  /* Text in the pending block */
+  if(iBlock == pStore->iPending && offset + size < pStore->nPending){
+    *pText  = pStore->pending + offset;
+    *pnText = (int)size;
+    return SQLITE_OK;
+  }
+
+  /* Text in the block cache, pick least recently used entry otherwise */
+  store_cache *pEntry = &pStore->aCache[0];
+  int i;
+  for(i = 0; i < CONTENT_CACHE_BLOCKS; i++){
+    store_cache *pCache = &pStore->aCache[i];
+    if(pCache->iBlock == iBlock && offset + size < pCache->nData){
+      pEntry = pCache;
+      break;
+    }
+    if(pCache->iLastUse < pEntry->iLastUse)
+      pEntry = pCache;
+  }
+
+  /* Fetch and decompress block, if not cached */
+  if(pEntry->iBlock != iBlock || offset + size >= pEntry->nData){
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_store;
+    sqlite3_bind_int64(pStmt, 1, iBlock);
+    if(sqlite3_step(pStmt) == SQLITE_ROW){
+      int nData = sqlite3_column_int(pStmt, 0);
+      unsigned char *data;
+      rc = decompressBlock(pTrgVtab, sqlite3_column_blob(pStmt, 1), sqlite3_column_bytes(pStmt, 1), nData, &data);
+      if(rc == SQLITE_OK){
+        sqlite3_free(pEntry->buf);
+        pEntry->buf    = data;
+        pEntry->nData  = nData;
+        pEntry->iBlock = iBlock;
+      }
+    }else
+      rc = SQLITE_CORRUPT;
+    sqlite3_reset(pStmt);
+    if(rc != SQLITE_OK) return rc;
+    if(offset + size >= pEntry->nData) return SQLITE_CORRUPT;
+  }
+
+  pEntry->iLastUse = ++pStore->iClock;
+  *pText  = pEntry->buf + pStore->nDict + offset;
+  *pnText = (int)size;
+  return SQLITE_OK;
+}
+
+
+/** Load dictionary from %_config, if stored and not loaded already */
+static int loadDictionary(trilite_vtab *pTrgVtab){
+  content_store *pStore = pTrgVtab->pStore;
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+  if(pStore->nDict >= 0) return SQLITE_OK;
+
+  char *zSql = sqlite3_mprintf("SELECT value FROM %Q.'%q_config' WHERE key = 'dictionary'",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    int nDict = sqlite3_column_bytes(pStmt, 0);
+    pStore->dict = (unsigned char*)sqlite3_malloc(nDict + 1);
+    if(pStore->dict){
+      memcpy(pStore->dict, sqlite3_column_blob(pStmt, 0), nDict);
+      pStore->nDict = nDict;
+    }else
+      rc = SQLITE_NOMEM;
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+/** Create dictionary from the start of the pending block, store it in %_config */
+static int createDictionary(trilite_vtab *pTrgVtab){
+  content_store *pStore = pTrgVtab->pStore;
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+  assert(pStore->nDict < 0);
+
+  int nDict = MIN(pStore->nPending, CONTENT_DICT_SIZE);
+  pStore->dict = (unsigned char*)sqlite3_malloc(nDict + 1);
+  if(!pStore->dict) return SQLITE_NOMEM;
+  memcpy(pStore->dict, pStore->pending, nDict);
+
+  char *zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_config' (key, value) VALUES ('dictionary', ?)",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  sqlite3_bind_blob(pStmt, 1, pStore->dict, nDict, SQLITE_STATIC);
+  sqlite3_step(pStmt);
+  rc = sqlite3_finalize(pStmt);
+  if(rc == SQLITE_OK)
+    pStore->nDict = nDict;
+  return rc;
+}
+
+/** Open last block for appending, if it isn't full, otherwise the next block */
+static int reopenLast(trilite_vtab *pTrgVtab){
+  content_store *pStore = pTrgVtab->pStore;
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_last_store;
+  int rc = SQLITE_OK;
+  assert(pStore->iPending < 0 && !pStore->pending);
+
+  pStore->iPending = 0;
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    sqlite3_int64 iBlock = sqlite3_column_int64(pStmt, 0);
+    int nData = sqlite3_column_int(pStmt, 1);
+    if(nData < CONTENT_BLOCK_SIZE){
+      unsigned char *data;
+      rc = decompressBlock(pTrgVtab, sqlite3_column_blob(pStmt, 2), sqlite3_column_bytes(pStmt, 2), nData, &data);
+      if(rc == SQLITE_OK){
+        /* Move block out of the dictionary prefix */
+        memmove(data, data + pStore->nDict, nData);
+        pStore->pending       = data;
+        pStore->nPending      = nData;
+        pStore->nPendingAlloc = pStore->nDict + nData;
+        pStore->iPending      = iBlock;
+      }
+    }else
+      pStore->iPending = iBlock + 1;
+  }
+  sqlite3_reset(pStmt);
+  return rc;
+}
+
+/** Decompress block of nData bytes, output as *pBuf following the dictionary
+ * *pBuf must be released with sqlite3_free */
+static int decompressBlock(trilite_vtab *pTrgVtab, const unsigned char *src, int nSrc, int nData, unsigned char **pBuf){
+  content_store *pStore = pTrgVtab->pStore;
+  int rc = loadDictionary(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+  /* Blocks are never written without a dictionary */
+  if(pStore->nDict < 0) return SQLITE_CORRUPT;
+
+  unsigned char *buf = (unsigned char*)sqlite3_malloc(pStore->nDict + nData + 1);
+  if(!buf) return SQLITE_NOMEM;
+  memcpy(buf, pStore->dict, pStore->nDict);
+  rc = lzDecompress(src, nSrc, buf, pStore->nDict, pStore->nDict + nData);
+  if(rc != SQLITE_OK){
+    sqlite3_free(buf);
+    return rc;
+  }
+  *pBuf = buf;
+  return SQLITE_OK;
+}
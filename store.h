@@ -0,0 +1,20 @@
+#ifndef TRILITE_STORE_H
+#define TRILITE_STORE_H
+
+#include "config.h"
+#include "varint.h"
+
+#include <sqlite3ext.h>
+
+/** Maximum size of a locator of a document in the content store */
+#define MAX_LOCATOR_SIZE        (3 * MAX_VARINT_SIZE)
+
+int storeOpen(content_store**);
+void storeClose(content_store*);
+void storeReset(content_store*);
+void storeRollback(content_store*);
+int storeAppend(trilite_vtab*, const unsigned char*, int, unsigned char*, int*);
+int storeFlush(trilite_vtab*);
+int storeFetch(trilite_vtab*, const unsigned char*, int, const unsigned char**, int*);
+
+#endif /* TRILITE_STORE_H */
@@ -0,0 +1,153 @@
+#include "streamvbyte.h"
+#include "config.h"
+
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* Stream VByte, as described by Lemire, Kurz and Rupp in "Stream VByte: Faster
+ * Byte-Oriented Integer Compression". Integers are stored as 1 to 4 little
+ * endian bytes, the lengths are stored separately as 2 bit codes, packed four
+ * to a control byte, ahead of all the data bytes. As the control byte for four
+ * integers is known up front, they can be decoded with a single shuffle.
+ *
+ * Layout: [control bytes, (n + 3) / 4][data bytes]
+ */
+
+/** Use the SSSE3 decoder, if the CPU supports it (checked at runtime) */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENABLE_SVB_SSSE3            1
+#include <tmmintrin.h>
+#endif
+
+/** Decoder function type */
+typedef int (*svb_decoder)(const unsigned char*, int, int, uint32_t*);
+
+static int decodeScalar(const unsigned char*, int, int, uint32_t*);
+static const unsigned char *decodeRange(const unsigned char*, const unsigned char*, int, int, uint32_t*);
+static svb_decoder selectDecoder(void);
+static void initDecoder(void);
+
+/** Decoder chosen by selectDecoder on first use, see initDecoder */
+static svb_decoder svbDecoder = NULL;
+
+/** Ensures lookup tables are built and svbDecoder is set once */
+static pthread_once_t svbDecoderOnce = PTHREAD_ONCE_INIT;
+
+/** Number of data bytes used by the integers of a control byte */
+static uint8_t lengthTable[256];
+
+/** Encode n integers from in to out, returns number of bytes written
+ * out must have room for at least SVB_MAX_SIZE(n) bytes */
+int svbEncode(const uint32_t *in, int n, unsigned char *out){
+  unsigned char *ctrl = out;
+  unsigned char *data = out + (n + 3) / 4;
+  int i;
+  memset(ctrl, 0, (n + 3) / 4);
+  for(i = 0; i < n; i++){
+    uint32_t v = in[i];
+    int code;
+    if(v < (1 << 8))        code = 0;
+    else if(v < (1 << 16))  code = 1;
+    else if(v < (1 << 24))  code = 2;
+    else                    code = 3;
+    ctrl[i / 4] |= code << ((i % 4) * 2);
+    /* Write code + 1 bytes in little endian */
+    *data++ = (unsigned char)v;
+    if(code > 0) *data++ = (unsigned char)(v >> BITSPERBYTE);
+    if(code > 1) *data++ = (unsigned char)(v >> (BITSPERBYTE * 2));
+    if(code > 2) *data++ = (unsigned char)(v >> (BITSPERBYTE * 3));
+  }
+  return data - out;
+}
+
+/** Decode n integers from in, which holds nIn bytes, to out
+ * Returns number of bytes read from in */
+int svbDecode(const unsigned char *in, int nIn, int n, uint32_t *out){
+  /* Connections may decode from several threads, the tables they use must be
+   * built before any of them reads svbDecoder */
+  pthread_once(&svbDecoderOnce, initDecoder);
+  return svbDecoder(in, nIn, n, out);
+}
+
+/** Select decoder, called once by svbDecode */
+static void initDecoder(void){
+  svbDecoder = selectDecoder();
+}
+
+/** Portable decoder */
+static int decodeScalar(const unsigned char *in, int nIn, int n, uint32_t *out){
+  const unsigned char *data = decodeRange(in, in + (n + 3) / 4, 0, n, out);
+  assert(data - in <= nIn);
+  return data - in;
+}
+
+/** Decode integers i to n - 1 from data, using control bytes from ctrl
+ * Returns pointer to the first byte after the data read */
+static const unsigned char *decodeRange(const unsigned char *ctrl, const unsigned char *data, int i, int n, uint32_t *out){
+  for(; i < n; i++){
+    int code = (ctrl[i / 4] >> ((i % 4) * 2)) & 3;
+    uint32_t v = data[0];
+    if(code > 0) v |= ((uint32_t)data[1]) << BITSPERBYTE;
+    if(code > 1) v |= ((uint32_t)data[2]) << (BITSPERBYTE * 2);
+    if(code > 2) v |= ((uint32_t)data[3]) << (BITSPERBYTE * 3);
+    out[i] = v;
+    data += code + 1;
+  }
+  return data;
+}
+
+#ifdef ENABLE_SVB_SSSE3
+
+/** Shuffle masks moving the data bytes of a control byte into four integers */
+static uint8_t shuffleTable[256][16];
+
+/** Decoder using pshufb, decoding four integers per control byte
+ * Falls back to decodeRange for the last integers, where a 16 byte load would
+ * read past the end of the input. */
+__attribute__((target("ssse3")))
+static int decodeSSSE3(const unsigned char *in, int nIn, int n, uint32_t *out){
+  const unsigned char *ctrl = in;
+  const unsigned char *data = in + (n + 3) / 4;
+  const unsigned char *end  = in + nIn;
+  int g;
+  for(g = 0; g < n / 4 && data + 16 <= end; g++){
+    __m128i vData    = _mm_loadu_si128((const __m128i*)data);
+    __m128i vShuffle = _mm_loadu_si128((const __m128i*)shuffleTable[ctrl[g]]);
+    _mm_storeu_si128((__m128i*)(out + g * 4), _mm_shuffle_epi8(vData, vShuffle));
+    data += lengthTable[ctrl[g]];
+  }
+  data = decodeRange(ctrl, data, g * 4, n, out);
+  assert(data <= end);
+  return data - in;
+}
+
+#endif /* ENABLE_SVB_SSSE3 */
+
+/** Build lookup tables and pick the fastest decoder supported by this CPU */
+static svb_decoder selectDecoder(void){
+  int c, i;
+  for(c = 0; c < 256; c++){
+    int offset = 0;
+    for(i = 0; i < 4; i++){
+      int len = ((c >> (i * 2)) & 3) + 1;
+#ifdef ENABLE_SVB_SSSE3
+      int j;
+      /* Shuffle index 0x80 (high bit set) zeroes the byte */
+      for(j = 0; j < 4; j++)
+        shuffleTable[c][i * 4 + j] = j < len ? offset + j : 0x80;
+#endif
+      offset += len;
+    }
+    lengthTable[c] = offset;
+  }
+#ifdef ENABLE_SVB_SSSE3
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("ssse3")){
+    trilite_log("Using SSSE3 stream vbyte decoder");
+    return decodeSSSE3;
+  }
+#endif
+  trilite_log("Using scalar stream vbyte decoder");
+  return decodeScalar;
+}
@@ -0,0 +1,12 @@
+#ifndef TRILITE_STREAMVBYTE_H
+#define TRILITE_STREAMVBYTE_H
+
+#include <stdint.h>
+
+/** Maximum number of bytes required to encode n integers */
+#define SVB_MAX_SIZE(n)             (((n) + 3) / 4 + (n) * 4)
+
+int svbEncode(const uint32_t*, int, unsigned char*);
+int svbDecode(const unsigned char*, int, int, uint32_t*);
+
+#endif /* TRILITE_STREAMVBYTE_H */
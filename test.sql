@@ -1,6 +1,6 @@
 select load_extension('./libtrilite.so');
 create virtual table trg using trilite;
--- TriLite current creates two underlying tables
+-- TriLite creates a few underlying tables
 .tables
 -- Wrap insertions into a transaction (not strictly required)
 BEGIN TRANSACTION;
@@ -9,17 +9,161 @@ insert into trg (id, text) VALUES (2, 'bcde');
 insert into trg (id, text) VALUES (3, 'bcdef');
 insert into trg (id, text) VALUES (4, 'abc');
 insert into trg (id, text) VALUES (4, 'abCd');
--- Note that we can only query data after we've committed
--- This is just a detail left out so far.
+-- Documents can be queried before they're committed
+select id from trg WHERE contents MATCH 'substr:bcde';
 COMMIT TRANSACTION;
 -- See we have content
 select * from trg_content;
 -- We also have doclists, Note the trigram is encoded as integer
-select trigram, length(doclist), hex(doclist) from trg_index;
+select trigram, firstid, length(doclist), hex(doclist) from trg_chunks;
 -- Now, let's select something, -extents: tells, to generate extents when matching
 select *, hex(extents(contents)) from trg WHERE contents MATCH 'substr-extents:abc' and contents MATCH 'regexp-extents:bcd';
 -- Okay let's try isubstr
 select "Testing isubstr:";
 select * from trg WHERE contents MATCH 'isubstr-extents:aBc';
+-- Each transaction writes a new index segment, queries read all segments
+BEGIN TRANSACTION;
+insert into trg (id, text) VALUES (6, 'xabcx');
+COMMIT TRANSACTION;
+select segment, level from trg_segments;
+select * from trg WHERE contents MATCH 'substr:abc';
+-- Documents larger than largedoc bytes are also indexed by blocks, so only
+-- blocks that may hold a substring are scanned when matching
+create virtual table big using trilite(largedoc=16);
+insert into big (id, text) VALUES (1, 'a long document with a needle in a haystack');
+select count(*) from big_blocks;
+select *, hex(extents(contents)) from big WHERE contents MATCH 'substr-extents:needle';
+-- With compress=1 documents are stored in compressed blocks in %_store, and
+-- %_content only holds where to find them
+create virtual table packed using trilite(compress=1);
+insert into packed (id, text) VALUES (1, 'compressed abc document');
+insert into packed (id, text) VALUES (2, 'another compressed document');
+select count(*) from packed_store;
+select * from packed WHERE contents MATCH 'substr:compressed';
+-- The dictionary blocks are compressed with may be stored by a transaction
+-- that's rolled back, it's stored again by the next. Attaching the database
+-- again reconnects the table, so blocks are read with the stored dictionary.
+attach 'test-rollback.db' as rb;
+drop table if exists rb.rolled;
+create virtual table rb.rolled using trilite(compress=1);
+BEGIN TRANSACTION;
+insert into rb.rolled (text) VALUES (replace(hex(zeroblob(35000)), '0', 'a'));
+ROLLBACK TRANSACTION;
+insert into rb.rolled (text) VALUES ('kept after rollback');
+detach rb;
+attach 'test-rollback.db' as rb;
+select * from rb.rolled;
+select count(*) from rb.rolled_config WHERE key = 'dictionary';
+detach rb;
+-- Optimize reassigns internal document ids, so similar documents are adjacent
+-- in doclists, ids of rows don't change
+insert into trg (contents) VALUES ('optimize');
+select * from trg WHERE contents MATCH 'substr:abc';
+insert into trg (id, text) VALUES (7, 'abcabc');
+select * from trg WHERE id = 7;
+
+-- Trigrams in more than stopfreq percent of documents are stop trigrams after
+-- optimize, these are not indexed and match all documents
+create virtual table stop using trilite(stopfreq=50);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 1000) INSERT INTO stop (text) SELECT 'common ' || i FROM n;
+insert into stop (contents) VALUES ('optimize');
+select count(*) from stop_stop;
+select count(*) from stop WHERE contents MATCH 'substr:common 99';
+
+-- Documents with more than maxtrigrams distinct trigrams are not indexed by
+-- trigrams, but are candidates for every match scan
+create virtual table blob using trilite(maxtrigrams=8);
+insert into blob (text) VALUES ('abcdef');
+insert into blob (text) VALUES ('0123456789abcdefghijklmnopqrstuvwxyz');
+select count(*) from blob_always;
+select id from blob WHERE contents MATCH 'substr:cde';
+select id from blob WHERE contents MATCH 'substr:xyz';
+
+-- Identical texts are stored and indexed once with dedup
+create virtual table dup using trilite(dedup=1);
+insert into dup (text) VALUES ('vendored library');
+insert into dup (text) VALUES ('vendored library');
+insert into dup (text) VALUES ('another library');
+select count(*) from dup_content;
+select id from dup WHERE contents MATCH 'substr:vendored';
+
+-- With compactids, ids must fit in 32 bits, larger ids fail to insert
+create virtual table c32 using trilite(compactids=1);
+insert into c32 (text) VALUES ('compact ids');
+select id from c32 WHERE contents MATCH 'substr:ids';
+create virtual table exact using trilite(exactcase=1);
+insert into exact (text) VALUES ('HTTPClient');
+insert into exact (text) VALUES ('httpclient');
+select id from exact WHERE contents MATCH 'substr:HTTPClient';
+select id from exact WHERE contents MATCH 'isubstr:HTTPClient';
+create virtual table unicode using trilite(utf8=1);
+insert into unicode (text) VALUES ('Привет, мир');
+insert into unicode (text) VALUES ('ПРИВЕТ');
+select id from unicode WHERE contents MATCH 'isubstr:привет';
+select id from unicode WHERE contents MATCH 'substr:Привет';
+create virtual table sparse using trilite(sparse=1);
+insert into sparse (text) VALUES ('#include <sqlite3ext.h>');
+insert into sparse (text) VALUES ('#include <stdio.h>');
+select id from sparse WHERE contents MATCH 'substr:include <sqlite3';
+create virtual table quad using trilite(gram=4);
+insert into quad (text) VALUES ('quadgram index');
+select id from quad WHERE contents MATCH 'substr:gram';
+select value from quad_config WHERE key = 'gram';
+create virtual table short using trilite(bigrams=1);
+insert into short (text) VALUES ('a.b');
+insert into short (text) VALUES ('x1y');
+select id from short WHERE contents MATCH 'substr:.b';
+select id from short WHERE contents MATCH 'substr:1';
+select id from short WHERE contents MATCH 'regexp:a\.?b';
+create virtual table anchored using trilite(anchors=1);
+insert into anchored (text) VALUES ('#include <stdio.h>');
+insert into anchored (text) VALUES ('/* #include <stdio.h> */');
+select id from anchored WHERE contents MATCH 'regexp:^#include';
+select id from anchored WHERE contents MATCH 'regexp:\bstdio\b';
+-- Words are found before case folding, the Kelvin sign folds to k but isn't a
+-- word character
+create virtual table anchoredunicode using trilite(utf8=1, anchors=1);
+insert into anchoredunicode (text) VALUES ('Kabc def');
+select id from anchoredunicode WHERE contents MATCH 'regexp:\babc';
+create virtual table signed using trilite(signature=64);
+insert into signed (text) VALUES ('int main(void)');
+insert into signed (text) VALUES ('int mainly; void main2(void)');
+select id from signed WHERE contents MATCH 'substr:main(void';
+select id, length(signature) from signed_signatures;
+create virtual table deleted using trilite;
+insert into deleted (text) VALUES ('deleted document');
+insert into deleted (text) VALUES ('kept document');
+insert into deleted (text) VALUES ('updated document');
+delete from deleted WHERE id = 1;
+update deleted SET text = 'rewritten text' WHERE id = 3;
+select id from deleted WHERE contents MATCH 'substr:document';
+select id from deleted WHERE contents MATCH 'substr:rewritten';
+select block, hex(bitmap) from deleted_deleted;
+create virtual table edited using trilite;
+insert into edited (text) VALUES ('int main(void){ return 0; }');
+update edited SET text = 'int main(void){ return 0; }' WHERE id = 1;
+update edited SET text = 'int main(void){ return 1; }' WHERE id = 1;
+select id from edited WHERE contents MATCH 'substr:return 1';
+select id from edited WHERE contents MATCH 'substr:return 0';
+select count(*) from edited_deleted;
+-- Positions are offsets in lines, so lines inserted before others don't change
+-- their postings, substrings spanning lines are matched from the newline
+create virtual table lined using trilite;
+insert into lined (text) VALUES ('int a;' || char(10) || 'return a;');
+update lined SET text = 'int b;' || char(10) || 'int a;' || char(10) || 'return a;' WHERE id = 1;
+select id from lined WHERE contents MATCH 'substr:a;' || char(10) || 'return';
+select id from lined WHERE contents MATCH 'substr:b;' || char(10) || 'return';
+select value from lined_config WHERE key = 'lines';
+-- Sealing writes the doclists of all segments to a file, that's used when the
+-- transaction commits, documents inserted later are read from %_chunks
+create virtual table sealed using trilite;
+insert into sealed (text) VALUES ('sealed document');
+insert into sealed (text) VALUES ('another sealed document');
+insert into sealed (contents) VALUES ('seal=test-seal.idx');
+insert into sealed (text) VALUES ('document after sealing');
+delete from sealed WHERE id = 1;
+select id from sealed WHERE contents MATCH 'substr:document';
+select id from sealed WHERE contents MATCH 'substr:sealed';
+select value from sealed_config WHERE key = 'sealed';
 ;
 select text from trg where contents MATCH 'substr-extents:' AND id = 1;
@@ -0,0 +1,359 @@
+#include "tombstone.h"
+#include "vtable.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX(a,b)    ((a) < (b) ? (b) : (a))
+#define MIN(a,b)    ((a) > (b) ? (b) : (a))
+
+/* Rewriting every doclist holding a document would make a delete as expensive
+ * as reindexing the table. Instead, the document id of a deleted document is
+ * tombstoned in %_deleted, and its postings are left in the doclists. Match
+ * scans load the tombstones and skip the ids, before fetching candidates, see
+ * triliteNext. Merging segments drops postings of tombstoned ids from the
+ * doclists merged, and optimize drops all of them, as it only keeps documents
+ * in %_content. Tombstones are cleared by optimize.
+ *
+ * Tombstones are stored as bitmaps of TOMBSTONE_BITMAP_IDS ids keyed by block,
+ * without trailing zero bytes, and only if they have a bit set.
+ *
+ * A document id may be reused by a later insert. The tombstone is then
+ * removed, and postings of the deleted document left in doclists only add
+ * candidates, that are verified as any other. Rows of the id in %_blocks,
+ * %_always and %_signatures are deleted with the document, as they could rule
+ * out the new document, see indexRemoveText.
+ *
+ * Deletes and reinserts are pending in a tombstone_set, until they're written
+ * to the bitmaps when the transaction is synced.
+ */
+
+/** Block of the bitmap holding id, ids are divided rounding down */
+#define BITMAP_BLOCK(id)    ((id) >= 0 ? (id) / TOMBSTONE_BITMAP_IDS : -((-(id) - 1) / TOMBSTONE_BITMAP_IDS) - 1)
+
+/** Bit of id in the bitmap of its block */
+#define BITMAP_BIT(id)      ((int)((id) - BITMAP_BLOCK(id) * TOMBSTONE_BITMAP_IDS))
+
+/** Initial number of pending changes allocated */
+#define MIN_CHANGES_ALLOCATION    256
+
+/** Pending tombstones of this transaction */
+struct tombstone_set{
+  /** Pending changes, in order of addition */
+  tombstone_change *aChanges;
+
+  /** Number of pending changes */
+  int nChanges;
+
+  /** Number of changes allocated for aChanges */
+  int nAlloc;
+
+  /** Whether %_deleted has rows, -1 if unknown */
+  int stored;
+};
+
+static int addChange(tombstone_set*, sqlite3_int64, bool);
+static int storedTombstones(trilite_vtab*, bool*);
+static int compareChanges(const void*, const void*);
+static int findPending(const tombstone_reader*, sqlite3_int64);
+static bool seekBitmap(tombstone_reader*, sqlite3_int64);
+static int fetchBitmap(tombstone_reader*, sqlite3_int64);
+
+
+/** Allocate a new tombstone set, for pending tombstones */
+int tombstoneOpen(tombstone_set **ppTombstones){
+  tombstone_set *pTombstones = (tombstone_set*)sqlite3_malloc(sizeof(tombstone_set));
+  *ppTombstones = pTombstones;
+  if(!pTombstones) return SQLITE_NOMEM;
+  memset(pTombstones, 0, sizeof(tombstone_set));
+  pTombstones->stored = -1;
+  return SQLITE_OK;
+}
+
+/** Release tombstone set, pending tombstones must be flushed first */
+void tombstoneClose(tombstone_set *pTombstones){
+  if(!pTombstones) return;
+  tombstoneReset(pTombstones);
+  sqlite3_free(pTombstones);
+}
+
+/** Forget pending tombstones, called when rolling back, and when starting a
+ * transaction, as others may have written tombstones */
+void tombstoneReset(tombstone_set *pTombstones){
+  sqlite3_free(pTombstones->aChanges);
+  pTombstones->aChanges = NULL;
+  pTombstones->nChanges = 0;
+  pTombstones->nAlloc   = 0;
+  pTombstones->stored   = -1;
+}
+
+/** Tombstone document id of a deleted document */
+int tombstoneAdd(trilite_vtab *pTrgVtab, sqlite3_int64 id){
+  trilite_log("Tombstoning document %lli", id);
+  return addChange(pTrgVtab->pTombstones, id, true);
+}
+
+/** Remove tombstone of document id, if it has one, called when a document is
+ * inserted, as the id may have been deleted before */
+int tombstoneRestore(trilite_vtab *pTrgVtab, sqlite3_int64 id){
+  tombstone_set *pTombstones = pTrgVtab->pTombstones;
+
+  /* Tables without tombstones don't pay for this on every insert */
+  if(pTombstones->nChanges == 0){
+    bool stored;
+    int rc = storedTombstones(pTrgVtab, &stored);
+    if(rc != SQLITE_OK || !stored) return rc;
+  }
+  return addChange(pTombstones, id, false);
+}
+
+/** Write pending tombstones to the bitmaps of %_deleted */
+int tombstoneFlush(trilite_vtab *pTrgVtab){
+  tombstone_set *pTombstones = pTrgVtab->pTombstones;
+  tombstone_change *aChanges = pTombstones->aChanges;
+  int nChanges = pTombstones->nChanges;
+  bool stored = pTombstones->stored > 0;
+  int rc = SQLITE_OK;
+
+  /* Group changes by bitmap, in order of addition for each id */
+  qsort(aChanges, nChanges, sizeof(tombstone_change), compareChanges);
+
+  unsigned char bitmap[TOMBSTONE_BITMAP_IDS / BITSPERBYTE];
+  int i = 0;
+  while(i < nChanges && rc == SQLITE_OK){
+    sqlite3_int64 block = BITMAP_BLOCK(aChanges[i].id);
+
+    /* Start from the stored bitmap, if there's one */
+    memset(bitmap, 0, sizeof(bitmap));
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_deleted;
+    sqlite3_bind_int64(pStmt, 1, block);
+    bool found = sqlite3_step(pStmt) == SQLITE_ROW && sqlite3_column_int64(pStmt, 0) == block;
+    if(found){
+      const void *blob = sqlite3_column_blob(pStmt, 1);
+      memcpy(bitmap, blob, MIN(sqlite3_column_bytes(pStmt, 1), (int)sizeof(bitmap)));
+    }
+    rc = sqlite3_reset(pStmt);
+    if(rc != SQLITE_OK) break;
+
+    /* Apply changes, the last change of an id comes last */
+    bool changed = false;
+    for(; i < nChanges && BITMAP_BLOCK(aChanges[i].id) == block; i++){
+      int bit = BITMAP_BIT(aChanges[i].id);
+      unsigned char byte = bitmap[bit / BITSPERBYTE];
+      if(aChanges[i].deleted)
+        bitmap[bit / BITSPERBYTE] |= 1 << (bit % BITSPERBYTE);
+      else
+        bitmap[bit / BITSPERBYTE] &= ~(1 << (bit % BITSPERBYTE));
+      changed = changed || byte != bitmap[bit / BITSPERBYTE];
+    }
+    if(!changed) continue;
+
+    /* Store bitmap without trailing zeros, or delete it if it's empty */
+    int nBitmap = sizeof(bitmap);
+    while(nBitmap > 0 && !bitmap[nBitmap - 1])
+      nBitmap--;
+    if(nBitmap > 0){
+      pStmt = pTrgVtab->stmt_insert_deleted;
+      sqlite3_bind_int64(pStmt, 1, block);
+      sqlite3_bind_blob(pStmt, 2, bitmap, nBitmap, SQLITE_STATIC);
+      stored = true;
+    }else if(found){
+      pStmt = pTrgVtab->stmt_delete_deleted;
+      sqlite3_bind_int64(pStmt, 1, block);
+    }else
+      continue;
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+  }
+
+  tombstoneReset(pTombstones);
+  if(rc == SQLITE_OK && stored)
+    pTombstones->stored = 1;
+  return rc;
+}
+
+/** Open a reader for the tombstones of this table, to check candidates of a
+ * match scan or postings of a merge. Pending tombstones are copied, as ids may
+ * be deleted while scanning. The reader must be closed with
+ * tombstoneReaderClose, even if this fails. Tables from before %_deleted have
+ * no tombstones. */
+int tombstoneReaderOpen(tombstone_reader *pReader, trilite_vtab *pTrgVtab){
+  tombstone_set *pTombstones = pTrgVtab->pTombstones;
+  memset(pReader, 0, sizeof(tombstone_reader));
+  pReader->pTrgVtab   = pTrgVtab;
+  pReader->block      = SQLITE3_INT64_MIN;
+  pReader->firstEmpty = 0;
+  pReader->lastEmpty  = -1;
+  if(pTrgVtab->formatVersion < 6) return SQLITE_OK;
+
+  /* Keep the last pending change of each id, changes are sorted, so it comes
+   * last */
+  int nChanges = pTombstones->nChanges;
+  if(nChanges > 0){
+    pReader->aPending = (tombstone_change*)sqlite3_malloc(sizeof(tombstone_change) * nChanges);
+    if(!pReader->aPending) return SQLITE_NOMEM;
+    qsort(pTombstones->aChanges, nChanges, sizeof(tombstone_change), compareChanges);
+    int i;
+    for(i = 0; i < nChanges; i++){
+      if(i + 1 < nChanges && pTombstones->aChanges[i + 1].id == pTombstones->aChanges[i].id)
+        continue;
+      pReader->aPending[pReader->nPending++] = pTombstones->aChanges[i];
+    }
+  }
+
+  /* Fetch the first bitmap, blocks before it are known to be empty */
+  pReader->rc = fetchBitmap(pReader, SQLITE3_INT64_MIN);
+  pReader->any = pReader->nPending > 0 || pReader->lastEmpty < SQLITE3_INT64_MAX;
+  return pReader->rc;
+}
+
+/** Release pending tombstones held by reader */
+void tombstoneReaderClose(tombstone_reader *pReader){
+  sqlite3_free(pReader->aPending);
+  pReader->aPending = NULL;
+  pReader->nPending = 0;
+  pReader->any      = false;
+}
+
+/** True, if document id is tombstoned
+ * Only the bitmap of one block is held, so checking ids in ascending order
+ * fetches each bitmap once. Errors are left in pReader->rc. */
+bool tombstoneReaderCheck(tombstone_reader *pReader, sqlite3_int64 id){
+  if(!pReader->any) return false;
+
+  /* The last pending change of an id replaces any stored tombstone */
+  int i = findPending(pReader, id);
+  if(i < pReader->nPending && pReader->aPending[i].id == id)
+    return pReader->aPending[i].deleted;
+
+  if(!seekBitmap(pReader, BITMAP_BLOCK(id))) return false;
+  int bit = BITMAP_BIT(id);
+  return bit / BITSPERBYTE < pReader->nBitmap &&
+         (pReader->bitmap[bit / BITSPERBYTE] & (1 << (bit % BITSPERBYTE)));
+}
+
+/** True, if an id from first to last may be tombstoned, a stored tombstone of
+ * a reinserted id may also be reported. Errors are left in pReader->rc. */
+bool tombstoneReaderRange(tombstone_reader *pReader, sqlite3_int64 first, sqlite3_int64 last){
+  if(!pReader->any) return false;
+
+  int i;
+  for(i = findPending(pReader, first); i < pReader->nPending && pReader->aPending[i].id <= last; i++){
+    if(pReader->aPending[i].deleted) return true;
+  }
+
+  sqlite3_int64 block = BITMAP_BLOCK(first);
+  sqlite3_int64 lastBlock = BITMAP_BLOCK(last);
+  while(block <= lastBlock){
+    if(!seekBitmap(pReader, block)){
+      /* Skip blocks known to be empty */
+      if(pReader->rc != SQLITE_OK || pReader->lastEmpty >= lastBlock) break;
+      block = pReader->lastEmpty + 1;
+      continue;
+    }
+    int bit  = block == BITMAP_BLOCK(first) ? BITMAP_BIT(first) : 0;
+    int nBit = block == lastBlock ? BITMAP_BIT(last) + 1 : TOMBSTONE_BITMAP_IDS;
+    nBit = MIN(nBit, pReader->nBitmap * BITSPERBYTE);
+    for(; bit < nBit; bit++){
+      if(pReader->bitmap[bit / BITSPERBYTE] & (1 << (bit % BITSPERBYTE)))
+        return true;
+    }
+    block++;
+  }
+  return false;
+}
+
+/** Remove all tombstones, called when no doclist holds a tombstoned id */
+int tombstoneClear(trilite_vtab *pTrgVtab){
+  tombstoneReset(pTrgVtab->pTombstones);
+  char *zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_deleted'", pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if(rc == SQLITE_OK)
+    pTrgVtab->pTombstones->stored = 0;
+  return rc;
+}
+
+/** Add a pending change */
+static int addChange(tombstone_set *pTombstones, sqlite3_int64 id, bool deleted){
+  if(pTombstones->nChanges == pTombstones->nAlloc){
+    int nAlloc = MAX(pTombstones->nAlloc * 2, MIN_CHANGES_ALLOCATION);
+    tombstone_change *aChanges = (tombstone_change*)sqlite3_realloc(pTombstones->aChanges, sizeof(tombstone_change) * nAlloc);
+    if(!aChanges) return SQLITE_NOMEM;
+    pTombstones->aChanges = aChanges;
+    pTombstones->nAlloc   = nAlloc;
+  }
+  tombstone_change *pChange = &pTombstones->aChanges[pTombstones->nChanges];
+  pChange->id      = id;
+  pChange->deleted = deleted;
+  pChange->iOrder  = pTombstones->nChanges++;
+  return SQLITE_OK;
+}
+
+/** Check if %_deleted has rows, the answer is cached until the transaction
+ * ends or tombstones are written */
+static int storedTombstones(trilite_vtab *pTrgVtab, bool *pStored){
+  tombstone_set *pTombstones = pTrgVtab->pTombstones;
+  if(pTombstones->stored < 0){
+    /* Fetch the first bitmap, if any */
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_deleted;
+    sqlite3_bind_int64(pStmt, 1, SQLITE3_INT64_MIN);
+    bool found = sqlite3_step(pStmt) == SQLITE_ROW;
+    int rc = sqlite3_reset(pStmt);
+    if(rc != SQLITE_OK) return rc;
+    pTombstones->stored = found ? 1 : 0;
+  }
+  *pStored = pTombstones->stored > 0;
+  return SQLITE_OK;
+}
+
+/** Compare changes for sorting, by id then order */
+static int compareChanges(const void *pChange1, const void *pChange2){
+  const tombstone_change *p1 = (const tombstone_change*)pChange1;
+  const tombstone_change *p2 = (const tombstone_change*)pChange2;
+  if(p1->id != p2->id)
+    return (p1->id > p2->id) - (p1->id < p2->id);
+  return p1->iOrder - p2->iOrder;
+}
+
+/** Index of the first pending change of reader for id or a larger id */
+static int findPending(const tombstone_reader *pReader, sqlite3_int64 id){
+  int lo = 0, hi = pReader->nPending;
+  while(lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    if(pReader->aPending[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/** Make the bitmap of block current, returns false if it isn't stored */
+static bool seekBitmap(tombstone_reader *pReader, sqlite3_int64 block){
+  if(block == pReader->block) return true;
+  if(pReader->firstEmpty <= block && block <= pReader->lastEmpty) return false;
+  if(pReader->rc != SQLITE_OK) return false;
+  pReader->rc = fetchBitmap(pReader, block);
+  return block == pReader->block;
+}
+
+/** Fetch the first bitmap from block or later, blocks before it are empty */
+static int fetchBitmap(tombstone_reader *pReader, sqlite3_int64 block){
+  sqlite3_stmt *pStmt = pReader->pTrgVtab->stmt_fetch_deleted;
+  sqlite3_bind_int64(pStmt, 1, block);
+  pReader->firstEmpty = block;
+  pReader->lastEmpty  = SQLITE3_INT64_MAX;
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    pReader->block     = sqlite3_column_int64(pStmt, 0);
+    pReader->lastEmpty = pReader->block - 1;
+    const void *blob   = sqlite3_column_blob(pStmt, 1);
+    pReader->nBitmap   = MIN(sqlite3_column_bytes(pStmt, 1), (int)sizeof(pReader->bitmap));
+    memcpy(pReader->bitmap, blob, pReader->nBitmap);
+  }
+  return sqlite3_reset(pStmt);
+}
@@ -0,0 +1,68 @@
+#ifndef TRILITE_TOMBSTONE_H
+#define TRILITE_TOMBSTONE_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+
+/** Pending change, a document id deleted or reinserted */
+struct tombstone_change{
+  /** Document id */
+  sqlite3_int64 id;
+
+  /** True, if the document was deleted, false if it was reinserted */
+  bool deleted;
+
+  /** Order of the change, later changes of an id take precedence */
+  int iOrder;
+};
+
+/** Reader checking ids against tombstones, see tombstone.c
+ * Only the current bitmap is held in memory, the bitmap of another block is
+ * fetched when it's needed, unless the block is known to have none. */
+struct tombstone_reader{
+  /** Virtual table the bitmaps are read from */
+  trilite_vtab *pTrgVtab;
+
+  /** False, if no id is tombstoned */
+  bool any;
+
+  /** Pending changes when the reader was opened, the last change of each id
+   * in ascending order of id */
+  tombstone_change *aPending;
+
+  /** Number of pending changes */
+  int nPending;
+
+  /** Block of the current bitmap */
+  sqlite3_int64 block;
+
+  /** Current bitmap, trailing zero bytes aren't stored */
+  unsigned char bitmap[TOMBSTONE_BITMAP_IDS / BITSPERBYTE];
+
+  /** Size of bitmap in bytes */
+  int nBitmap;
+
+  /** Range of blocks known to have no bitmap, empty if first is after last */
+  sqlite3_int64 firstEmpty;
+  sqlite3_int64 lastEmpty;
+
+  /** Error from fetching bitmaps, ids aren't tombstoned after an error */
+  int rc;
+};
+
+int tombstoneOpen(tombstone_set**);
+void tombstoneClose(tombstone_set*);
+void tombstoneReset(tombstone_set*);
+int tombstoneAdd(trilite_vtab*, sqlite3_int64);
+int tombstoneRestore(trilite_vtab*, sqlite3_int64);
+int tombstoneFlush(trilite_vtab*);
+int tombstoneClear(trilite_vtab*);
+
+int tombstoneReaderOpen(tombstone_reader*, trilite_vtab*);
+void tombstoneReaderClose(tombstone_reader*);
+bool tombstoneReaderCheck(tombstone_reader*, sqlite3_int64);
+bool tombstoneReaderRange(tombstone_reader*, sqlite3_int64, sqlite3_int64);
+
+#endif /* TRILITE_TOMBSTONE_H */
@@ -0,0 +1,531 @@
+#include "trigram.h"
+#include "vtable.h"
+#include "utf8.h"
+
+const sqlite3_api_routines *sqlite3_api;
+
+#include <string.h>
+#include <assert.h>
+
+/* Texts and substring patterns are broken into trigrams the same way, so the
+ * trigrams of a substring are among the trigrams of every text holding it.
+ * Trigrams are three bytes, or three codepoints with the utf8 option, see
+ * utf8.c, and positions are counted in the same unit. With the gram option
+ * trigrams are grams of another length, longer grams are hashed.
+ *
+ * With the sparse option texts are also indexed by sparse grams, longer grams
+ * chosen by the weights of the bigrams in the text. A gram longer than
+ * trigrams is a sparse gram, if the bigrams at its ends both weigh more than
+ * every bigram within it. Whether a gram is sparse only depends on its
+ * own characters, so sparse grams of a substring are sparse grams of every
+ * text holding it. A text of n characters has less than n sparse grams.
+ * Substrings are covered by the sparse grams and trigrams of the substring,
+ * that aren't within another, these are few and long, so they have short
+ * doclists.
+ *
+ * With the anchors option texts are also indexed by boundary grams, the grams
+ * of each document, line and word, with two boundary markers before and after
+ * it, that hold a marker. Anchored regexps are matched by substrings with the
+ * markers, ^#include on a line as "\2\2#include", their grams are among the
+ * grams and boundary grams of every text holding a match.
+ *
+ * Position masks of tables with line positions hold the offset of each gram
+ * from the start of its line, the character following the last newline before
+ * it. Inserting or deleting lines then leaves the masks of the lines following
+ * them, so an edit only posts the keys of the lines it changes. Grams starting
+ * with markers are positioned before the start of their segment, in its line.
+ * Substrings holding a newline know the offsets of the trigrams following it,
+ * see exprSubstring. */
+
+/** Multiplier of the rolling hash of sparse grams */
+#define SPARSE_HASH_MULTIPLIER    UINT64_C(0x100000001B3)
+
+/** Position of a gram at pos for its position mask, relative to the line of
+ * character start if there's line starts aLines, see trigramLines */
+#define GRAM_POS(aLines, pos, start)  ((aLines) ? (pos) - (aLines)[start] : (pos))
+
+static void trigramBoundary(trilite_vtab*, const uint32_t*, const int*, int, int, uint32_t, trilite_trigram*, trilite_masks*, int*);
+static int trigramLines(trilite_vtab*, const uint32_t*, int, int**);
+static trilite_trigram trigramKey(trilite_vtab*, const uint32_t*);
+static trilite_trigram trigramHash(const uint32_t*, int, bool);
+static int trigramSparseGrams(const uint32_t*, int, int, int**, int*);
+static uint64_t trigramMix(uint64_t);
+
+/** Extract the trigram at each position of nText bytes from zText
+ * Trigrams are grams of gramSize characters, with the gram option. They're
+ * case folded, unless exact is true, then they're exact-case trigrams, see
+ * the exactcase option. The masks of each trigram holds its position, from the
+ * start of its line with line positions, and the folded character following
+ * it, if any.
+ * Trigrams are output as *paTrigrams and their masks as *paMasks, allocated
+ * together, so only *paTrigrams must be released with sqlite3_free. The
+ * number of trigrams is output as *pnTrigrams, both are NULL if it's 0. */
+int trigramExtract(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText, bool exact,
+                   trilite_trigram **paTrigrams, trilite_masks **paMasks, int *pnTrigrams){
+  int nGram = pTrgVtab->gramSize;
+  *paTrigrams = NULL;
+  *paMasks    = NULL;
+  *pnTrigrams = 0;
+  if(nText < nGram) return SQLITE_OK;
+
+  /* Characters of the text, folded and exact, unless trigrams are bytes */
+  uint32_t *aChars = NULL, *aExact = NULL;
+  int nChars = nText;
+  if(pTrgVtab->utf8 || nGram != 3){
+    aChars = trigramChars(pTrgVtab, zText, nText, true, &nChars);
+    if(aChars && exact)
+      aExact = trigramChars(pTrgVtab, zText, nText, false, &nChars);
+    if(!aChars || (exact && !aExact)){
+      sqlite3_free(aChars);
+      return SQLITE_NOMEM;
+    }
+  }
+  if(nChars < nGram){
+    sqlite3_free(aChars);
+    sqlite3_free(aExact);
+    return SQLITE_OK;
+  }
+
+  int n = nChars - nGram + 1;
+  trilite_trigram *aTrigrams = (trilite_trigram*)sqlite3_malloc((sizeof(trilite_trigram) + sizeof(trilite_masks)) * n);
+  if(!aTrigrams){
+    sqlite3_free(aChars);
+    sqlite3_free(aExact);
+    return SQLITE_NOMEM;
+  }
+  trilite_masks *aMasks = (trilite_masks*)(aTrigrams + n);
+
+  int pos, line = 0;
+  for(pos = 0; pos < n; pos++){
+    /* Lines start after newlines */
+    if(pTrgVtab->linePositions && pos > 0 && (aChars ? aChars[pos - 1] : zText[pos - 1]) == '\n')
+      line = pos;
+    trilite_masks masks = MASK_POS(pos - line);
+    if(!aChars){
+      aTrigrams[pos] = exact ? HASH_EXACT_TRIGRAM(zText + pos) : HASH_TRIGRAM(zText + pos);
+      if(pos + 3 < nChars && !IS_BOUNDARY(zText[pos + 3]))
+        masks |= MASK_NEXT(zText[pos + 3]);
+    }else{
+      const uint32_t *aGram = (exact ? aExact : aChars) + pos;
+      if(nGram == 3)
+        aTrigrams[pos] = utf8Trigram(aGram, exact);
+      else
+        aTrigrams[pos] = trigramHash(aGram, nGram, exact);
+      if(pos + nGram < nChars && !IS_BOUNDARY(aChars[pos + nGram]))
+        masks |= MASK_NEXT_CODEPOINT(aChars[pos + nGram]);
+    }
+    aMasks[pos] = masks;
+  }
+  sqlite3_free(aChars);
+  sqlite3_free(aExact);
+
+  *paTrigrams = aTrigrams;
+  *paMasks    = aMasks;
+  *pnTrigrams = n;
+  return SQLITE_OK;
+}
+
+/** Extract the boundary grams of nText bytes from zText, for indexing a text
+ * with the anchors option. Grams of the document, each line and each word are
+ * output with masks as trigramExtract does, positions of grams starting with
+ * markers are before the boundary. */
+int trigramBoundaries(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText,
+                      trilite_trigram **paGrams, trilite_masks **paMasks, int *pnGrams){
+  *paGrams  = NULL;
+  *paMasks  = NULL;
+  *pnGrams  = 0;
+  if(nText == 0) return SQLITE_OK;
+
+  /* Lines and words are found from the characters before folding, as folding
+   * may turn other codepoints into ASCII word characters, and grams are keyed
+   * by the folded characters */
+  int nChars;
+  uint32_t *aChars = trigramChars(pTrgVtab, zText, nText, true, &nChars);
+  uint32_t *aRaw = aChars ? trigramChars(pTrgVtab, zText, nText, false, &nChars) : NULL;
+  int *aLines = NULL;
+  if(!aChars || !aRaw || trigramLines(pTrgVtab, aRaw, nChars, &aLines) != SQLITE_OK){
+    sqlite3_free(aChars);
+    sqlite3_free(aRaw);
+    return SQLITE_NOMEM;
+  }
+
+  /* No more than four grams for the document, each line and each word */
+  int nAlloc = 4 * (2 * nChars + 2);
+  trilite_trigram *aGrams = (trilite_trigram*)sqlite3_malloc((sizeof(trilite_trigram) + sizeof(trilite_masks)) * nAlloc);
+  if(!aGrams){
+    sqlite3_free(aChars);
+    sqlite3_free(aRaw);
+    sqlite3_free(aLines);
+    return SQLITE_NOMEM;
+  }
+  trilite_masks *aMasks = (trilite_masks*)(aGrams + nAlloc);
+  int nGrams = 0;
+
+  trigramBoundary(pTrgVtab, aChars, aLines, 0, nChars, BOUNDARY_DOCUMENT, aGrams, aMasks, &nGrams);
+
+  int start = 0, i;
+  for(i = 0; i <= nChars; i++){
+    if(i < nChars && aRaw[i] != '\n') continue;
+    if(i > start)
+      trigramBoundary(pTrgVtab, aChars, aLines, start, i, BOUNDARY_LINE, aGrams, aMasks, &nGrams);
+    start = i + 1;
+  }
+
+  /* Words are ASCII letters, digits and underscores, as for \b in regexps */
+  for(i = 0; i < nChars; i++){
+    if(!IS_WORD_CHAR(aRaw[i])) continue;
+    start = i;
+    while(i < nChars && IS_WORD_CHAR(aRaw[i])) i++;
+    trigramBoundary(pTrgVtab, aChars, aLines, start, i, BOUNDARY_WORD, aGrams, aMasks, &nGrams);
+  }
+  assert(nGrams <= nAlloc);
+  sqlite3_free(aChars);
+  sqlite3_free(aRaw);
+  sqlite3_free(aLines);
+
+  *paGrams  = aGrams;
+  *paMasks  = aMasks;
+  *pnGrams  = nGrams;
+  return SQLITE_OK;
+}
+
+/** Add the boundary grams of characters start to end of aChars with marker
+ * to aGrams and aMasks at *pnGrams. Segments shorter than a gram have grams
+ * with markers on both sides. Positions are relative to the line starts
+ * aLines, unless it's NULL. */
+static void trigramBoundary(trilite_vtab *pTrgVtab, const uint32_t *aChars, const int *aLines, int start, int end, uint32_t marker,
+                            trilite_trigram *aGrams, trilite_masks *aMasks, int *pnGrams){
+  int nGram = pTrgVtab->gramSize;
+  uint32_t aBuf[MAX_GRAM_SIZE + 4];
+  bool whole = end - start < nGram;
+
+  /* Grams starting with markers, position of aBuf[j] is start - 2 + j */
+  int nBuf = 0, k, j;
+  aBuf[nBuf++] = marker;
+  aBuf[nBuf++] = marker;
+  for(k = start; k < end && k < start + nGram; k++)
+    aBuf[nBuf++] = aChars[k];
+  if(whole){
+    aBuf[nBuf++] = marker;
+    aBuf[nBuf++] = marker;
+  }
+  for(j = 0; j + nGram <= nBuf && (whole || j < 2); j++){
+    aGrams[*pnGrams] = trigramKey(pTrgVtab, aBuf + j);
+    int pos = start - 2 + j;
+    aMasks[*pnGrams] = MASK_POS(GRAM_POS(aLines, pos, pos < start ? start : pos));
+    if(j + nGram < nBuf && !IS_BOUNDARY(aBuf[j + nGram]))
+      aMasks[*pnGrams] |= MASK_NEXT_CODEPOINT(aBuf[j + nGram]);
+    (*pnGrams)++;
+  }
+  if(whole) return;
+
+  /* Grams ending with markers, position of aBuf[j] is end - nGram + 1 + j */
+  nBuf = 0;
+  for(k = end - nGram + 1; k < end; k++)
+    aBuf[nBuf++] = aChars[k];
+  aBuf[nBuf++] = marker;
+  aBuf[nBuf++] = marker;
+  for(j = 0; j < 2; j++){
+    aGrams[*pnGrams] = trigramKey(pTrgVtab, aBuf + j);
+    int pos = end - nGram + 1 + j;
+    aMasks[*pnGrams] = MASK_POS(GRAM_POS(aLines, pos, pos));
+    (*pnGrams)++;
+  }
+}
+
+/** Key of the folded gram of gramSize characters aGram, as trigramExtract
+ * computes it */
+static trilite_trigram trigramKey(trilite_vtab *pTrgVtab, const uint32_t *aGram){
+  if(pTrgVtab->gramSize != 3)
+    return trigramHash(aGram, pTrgVtab->gramSize, false);
+  if(pTrgVtab->utf8)
+    return utf8Trigram(aGram, false);
+  return aGram[0] | (aGram[1] << BITSPERBYTE) | (aGram[2] << (BITSPERBYTE*2));
+}
+
+/** Key of the gram of nChars characters aChars, hashed as sparse grams are
+ * Exact-case grams are keyed apart from folded grams. */
+static trilite_trigram trigramHash(const uint32_t *aChars, int nChars, bool exact){
+  uint64_t h = 0;
+  int i;
+  for(i = 0; i < nChars; i++)
+    h = h * SPARSE_HASH_MULTIPLIER + aChars[i] + 1;
+  if(exact)
+    h += UINT64_C(0x9E3779B97F4A7C15);
+  return (trilite_trigram)(trigramMix(h) >> 32) | TRIGRAM_HASHED;
+}
+
+/** Extract the sparse grams longer than trigrams of nText bytes from zText,
+ * for indexing a text with the sparse option. Grams are hashed,
+ * and output with masks as trigramExtract does. */
+int trigramSparse(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText,
+                  trilite_trigram **paGrams, trilite_masks **paMasks, int *pnGrams){
+  *paGrams  = NULL;
+  *paMasks  = NULL;
+  *pnGrams  = 0;
+
+  int nChars;
+  uint32_t *aChars = trigramChars(pTrgVtab, zText, nText, true, &nChars);
+  if(!aChars) return SQLITE_NOMEM;
+  int *aGrams, nGrams;
+  int rc = trigramSparseGrams(aChars, nChars, pTrgVtab->gramSize, &aGrams, &nGrams);
+  if(rc != SQLITE_OK || nGrams == 0){
+    sqlite3_free(aChars);
+    sqlite3_free(aGrams);
+    return rc;
+  }
+
+  int *aLines = NULL;
+  trilite_trigram *aKeys = (trilite_trigram*)sqlite3_malloc((sizeof(trilite_trigram) + sizeof(trilite_masks)) * nGrams);
+  if(!aKeys || trigramLines(pTrgVtab, aChars, nChars, &aLines) != SQLITE_OK){
+    sqlite3_free(aKeys);
+    sqlite3_free(aChars);
+    sqlite3_free(aGrams);
+    return SQLITE_NOMEM;
+  }
+  trilite_masks *aMasks = (trilite_masks*)(aKeys + nGrams);
+  int i;
+  for(i = 0; i < nGrams; i++){
+    int start = aGrams[i * 3], end = aGrams[i * 3 + 1];
+    aKeys[i] = (trilite_trigram)aGrams[i * 3 + 2];
+    aMasks[i] = MASK_POS(GRAM_POS(aLines, start, start));
+    if(end < nChars)
+      aMasks[i] |= MASK_NEXT_CODEPOINT(aChars[end]);
+  }
+  sqlite3_free(aChars);
+  sqlite3_free(aGrams);
+  sqlite3_free(aLines);
+
+  *paGrams  = aKeys;
+  *paMasks  = aMasks;
+  *pnGrams  = nGrams;
+  return SQLITE_OK;
+}
+
+/** Cover nText bytes of substring from zText with the trigrams and sparse
+ * grams of it, that aren't within another of them, for matching a substring
+ * with the sparse option. Grams are output as *paGrams, their offsets in the
+ * substring as *paOffsets and their masks as *paMasks, allocated together, so
+ * only *paGrams must be released with sqlite3_free. */
+int trigramCover(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText,
+                 trilite_trigram **paGrams, int **paOffsets, trilite_masks **paMasks, int *pnGrams){
+  *paGrams    = NULL;
+  *paOffsets  = NULL;
+  *paMasks    = NULL;
+  *pnGrams    = 0;
+
+  /* Trigrams at each offset */
+  trilite_trigram *aTrigrams;
+  trilite_masks *aTrigramMasks;
+  int nTrigrams;
+  int rc = trigramExtract(pTrgVtab, zText, nText, false, &aTrigrams, &aTrigramMasks, &nTrigrams);
+  if(rc != SQLITE_OK || nTrigrams == 0) return rc;
+
+  /* Sparse grams, ordered by end */
+  int nChars;
+  uint32_t *aChars = trigramChars(pTrgVtab, zText, nText, true, &nChars);
+  int *aGrams = NULL, nGrams = 0;
+  if(!aChars)
+    rc = SQLITE_NOMEM;
+  else
+    rc = trigramSparseGrams(aChars, nChars, pTrgVtab->gramSize, &aGrams, &nGrams);
+
+  int n = nTrigrams + nGrams;
+  trilite_trigram *aKeys = NULL;
+  if(rc == SQLITE_OK){
+    aKeys = (trilite_trigram*)sqlite3_malloc((sizeof(trilite_trigram) + sizeof(int) + sizeof(trilite_masks)) * n);
+    if(!aKeys) rc = SQLITE_NOMEM;
+  }
+  if(rc != SQLITE_OK){
+    sqlite3_free(aTrigrams);
+    sqlite3_free(aChars);
+    sqlite3_free(aGrams);
+    return rc;
+  }
+  int *aOffsets = (int*)(aKeys + n);
+  trilite_masks *aMasks = (trilite_masks*)(aOffsets + n);
+
+  /* A sparse gram ending at end, is within the sparse gram that starts before
+   * it and ends at or after end, so gram i is only kept if no later gram
+   * starts at or before it. Trigram at offset k is within a sparse gram, if
+   * it's between the start and end of any. */
+  unsigned char *aCovered = (unsigned char*)aChars;
+  memset(aCovered, 0, nTrigrams);
+  int nKeys = 0, minStart = nChars, i;
+  for(i = nGrams - 1; i >= 0; i--){
+    int start = aGrams[i * 3], end = aGrams[i * 3 + 1];
+    int k;
+    for(k = start; k + pTrgVtab->gramSize <= end; k++)
+      aCovered[k] = 1;
+    if(start >= minStart) continue;
+    minStart = start;
+    aKeys[nKeys]    = (trilite_trigram)aGrams[i * 3 + 2];
+    aOffsets[nKeys] = start;
+    aMasks[nKeys]   = MASK_NEXT_BITS(aTrigramMasks[end - pTrgVtab->gramSize]);
+    nKeys++;
+  }
+  for(i = 0; i < nTrigrams; i++){
+    if(aCovered[i]) continue;
+    aKeys[nKeys]    = aTrigrams[i];
+    aOffsets[nKeys] = i;
+    aMasks[nKeys]   = MASK_NEXT_BITS(aTrigramMasks[i]);
+    nKeys++;
+  }
+  sqlite3_free(aTrigrams);
+  sqlite3_free(aChars);
+  sqlite3_free(aGrams);
+
+  *paGrams    = aKeys;
+  *paOffsets  = aOffsets;
+  *paMasks    = aMasks;
+  *pnGrams    = nKeys;
+  return SQLITE_OK;
+}
+
+/** Extract all keys a text of nText bytes from zText is indexed by, trigrams,
+ * exact-case trigrams with the exactcase option, sparse grams with the sparse
+ * option and boundary grams with the anchors option. Keys and masks are output as trigramExtract does, keys may
+ * be repeated. */
+int trigramIndexKeys(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText,
+                     trilite_trigram **paKeys, trilite_masks **paMasks, int *pnKeys){
+  trilite_trigram *aParts[4] = {NULL, NULL, NULL, NULL};
+  trilite_masks *aPartMasks[4];
+  int anParts[4] = {0, 0, 0, 0};
+  int rc = trigramExtract(pTrgVtab, zText, nText, false, &aParts[0], &aPartMasks[0], &anParts[0]);
+  if(rc == SQLITE_OK && pTrgVtab->exactCase)
+    rc = trigramExtract(pTrgVtab, zText, nText, true, &aParts[1], &aPartMasks[1], &anParts[1]);
+  if(rc == SQLITE_OK && pTrgVtab->sparse)
+    rc = trigramSparse(pTrgVtab, zText, nText, &aParts[2], &aPartMasks[2], &anParts[2]);
+  if(rc == SQLITE_OK && pTrgVtab->anchors)
+    rc = trigramBoundaries(pTrgVtab, zText, nText, &aParts[3], &aPartMasks[3], &anParts[3]);
+
+  int n = anParts[0] + anParts[1] + anParts[2] + anParts[3];
+  *paKeys  = NULL;
+  *paMasks = NULL;
+  *pnKeys  = 0;
+  if(rc == SQLITE_OK && n > 0){
+    *paKeys = (trilite_trigram*)sqlite3_malloc((sizeof(trilite_trigram) + sizeof(trilite_masks)) * n);
+    if(*paKeys){
+      *paMasks = (trilite_masks*)(*paKeys + n);
+      int i;
+      for(i = 0; i < 4; i++){
+        memcpy(*paKeys + *pnKeys, aParts[i], sizeof(trilite_trigram) * anParts[i]);
+        memcpy(*paMasks + *pnKeys, aPartMasks[i], sizeof(trilite_masks) * anParts[i]);
+        *pnKeys += anParts[i];
+      }
+    }else
+      rc = SQLITE_NOMEM;
+  }
+  sqlite3_free(aParts[0]);
+  sqlite3_free(aParts[1]);
+  sqlite3_free(aParts[2]);
+  sqlite3_free(aParts[3]);
+  return rc;
+}
+
+/** Characters of nText bytes from zText, bytes or codepoints with the utf8
+ * option, case folded if fold is true. Allocated with sqlite3_malloc with
+ * room for nText characters, or NULL if out of memory. Number of characters
+ * is output as *pnChars */
+uint32_t *trigramChars(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText, bool fold, int *pnChars){
+  uint32_t *aChars = (uint32_t*)sqlite3_malloc(sizeof(uint32_t) * (nText + 1));
+  if(!aChars) return NULL;
+  if(pTrgVtab->utf8){
+    *pnChars = utf8Decode(zText, nText, fold, aChars);
+  }else{
+    int i;
+    for(i = 0; i < nText; i++)
+      aChars[i] = fold ? LOWER(zText[i]) : zText[i];
+    *pnChars = nText;
+  }
+  return aChars;
+}
+
+/** Start of the line of each of nChars characters aChars, the character
+ * following the last newline before it, for position masks of tables with
+ * line positions. Output as *paLines, allocated with sqlite3_malloc, or NULL
+ * if the table doesn't have line positions. */
+static int trigramLines(trilite_vtab *pTrgVtab, const uint32_t *aChars, int nChars, int **paLines){
+  *paLines = NULL;
+  if(!pTrgVtab->linePositions) return SQLITE_OK;
+  int *aLines = (int*)sqlite3_malloc(sizeof(int) * (nChars + 1));
+  if(!aLines) return SQLITE_NOMEM;
+  int i, line = 0;
+  for(i = 0; i < nChars; i++){
+    if(i > 0 && aChars[i - 1] == '\n')
+      line = i;
+    aLines[i] = line;
+  }
+  *paLines = aLines;
+  return SQLITE_OK;
+}
+
+/** Find sparse grams of more than nGram characters of nChars characters
+ * aChars. Grams are output as *paGrams, allocated with sqlite3_malloc, as
+ * triples of start, end and key, ordered by end. The number of grams is
+ * output as *pnGrams. */
+static int trigramSparseGrams(const uint32_t *aChars, int nChars, int nGram, int **paGrams, int *pnGrams){
+  *paGrams = NULL;
+  *pnGrams = 0;
+  int nBigrams = nChars - 1;
+  if(nBigrams < 3) return SQLITE_OK;
+
+  /* Weight of each bigram, stack of bigrams, prefix hashes and powers */
+  uint32_t *aWeights = (uint32_t*)sqlite3_malloc(sizeof(uint32_t) * nBigrams * 2);
+  uint64_t *aHashes = (uint64_t*)sqlite3_malloc(sizeof(uint64_t) * (nChars + 1) * 2);
+  int *aGrams = (int*)sqlite3_malloc(sizeof(int) * 3 * nBigrams);
+  if(!aWeights || !aHashes || !aGrams){
+    sqlite3_free(aWeights);
+    sqlite3_free(aHashes);
+    sqlite3_free(aGrams);
+    return SQLITE_NOMEM;
+  }
+  uint32_t *aStack = aWeights + nBigrams;
+  uint64_t *aPowers = aHashes + nChars + 1;
+
+  int i;
+  aHashes[0] = 0;
+  aPowers[0] = 1;
+  for(i = 0; i < nChars; i++){
+    aHashes[i + 1] = aHashes[i] * SPARSE_HASH_MULTIPLIER + aChars[i] + 1;
+    aPowers[i + 1] = aPowers[i] * SPARSE_HASH_MULTIPLIER;
+  }
+  for(i = 0; i < nBigrams; i++)
+    aWeights[i] = (uint32_t)trigramMix(((uint64_t)aChars[i] << 32) | aChars[i + 1]);
+
+  /* Bigrams on the stack are visible from bigram j, nothing between them
+   * weighs more. When bigram p is popped by a heavier bigram j, and the bigram
+   * i below p weighs more than p, the bigrams within i and j weigh no more than
+   * p, so the gram from bigram i to j is sparse. */
+  int nStack = 0, nGrams = 0, j;
+  for(j = 0; j < nBigrams; j++){
+    while(nStack > 0 && aWeights[aStack[nStack - 1]] < aWeights[j]){
+      uint32_t p = aStack[--nStack];
+      if(nStack == 0 || aWeights[aStack[nStack - 1]] <= aWeights[p]) continue;
+      int start = aStack[nStack - 1], end = j + 2;
+      if(end - start <= nGram) continue;
+      uint64_t h = aHashes[end] - aHashes[start] * aPowers[end - start];
+      aGrams[nGrams * 3]     = start;
+      aGrams[nGrams * 3 + 1] = end;
+      aGrams[nGrams * 3 + 2] = (int)((uint32_t)(trigramMix(h) >> 32) | TRIGRAM_HASHED);
+      nGrams++;
+    }
+    aStack[nStack++] = j;
+  }
+  sqlite3_free(aWeights);
+  sqlite3_free(aHashes);
+
+  *paGrams = aGrams;
+  *pnGrams = nGrams;
+  return SQLITE_OK;
+}
+
+/** Mix the bits of a 64 bit value */
+static uint64_t trigramMix(uint64_t h){
+  h ^= h >> 33;
+  h *= UINT64_C(0xFF51AFD7ED558CCD);
+  h ^= h >> 33;
+  h *= UINT64_C(0xC4CEB9FE1A85EC53);
+  h ^= h >> 33;
+  return h;
+}
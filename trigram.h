@@ -0,0 +1,16 @@
+#ifndef TRILITE_TRIGRAM_H
+#define TRILITE_TRIGRAM_H
+
+#include "config.h"
+
+#include <sqlite3ext.h>
+#include <stdbool.h>
+
+int trigramExtract(trilite_vtab*, const unsigned char*, int, bool, trilite_trigram**, trilite_masks**, int*);
+int trigramSparse(trilite_vtab*, const unsigned char*, int, trilite_trigram**, trilite_masks**, int*);
+int trigramBoundaries(trilite_vtab*, const unsigned char*, int, trilite_trigram**, trilite_masks**, int*);
+int trigramCover(trilite_vtab*, const unsigned char*, int, trilite_trigram**, int**, trilite_masks**, int*);
+uint32_t *trigramChars(trilite_vtab*, const unsigned char*, int, bool, int*);
+int trigramIndexKeys(trilite_vtab*, const unsigned char*, int, trilite_trigram**, trilite_masks**, int*);
+
+#endif /* TRILITE_TRIGRAM_H */
@@ -26,7 +26,7 @@ static const sqlite3_module triliteModule = {
   /* xBegin        */ triliteBegin,
   /* xSync         */ triliteSync,
   /* xCommit       */ triliteCommit,
-  /* xRollback     */ 0,
+  /* xRollback     */ triliteRollback,
   /* xFindFunction */ triliteFindFunction,
   /* xRename */       triliteRename,
   
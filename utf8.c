@@ -0,0 +1,213 @@
+#include "utf8.h"
+
+#include <stddef.h>
+
+/* With the utf8 option, texts are indexed by trigrams of three codepoints
+ * rather than three bytes, so in non-Latin scripts a trigram covers three
+ * characters, not one. Codepoints are case folded with simple Unicode case
+ * folding, for the scripts listed in aFoldRanges.
+ *
+ * Trigrams of ASCII codepoints are keyed as byte trigrams, other trigrams are
+ * hashed to keys with TRIGRAM_HASHED set, so they don't collide with byte
+ * trigrams. Invalid UTF-8 is decoded a byte at a time, as codepoints that
+ * can't be encoded, see UTF8_INVALID. */
+
+/** Codepoint for an invalid byte b, a lone low surrogate, as these can't occur
+ * in valid UTF-8 */
+#define UTF8_INVALID(b)     (0xDC00 | (b))
+
+/** Range of codepoints folded by adding delta, if stride is 2 only every other
+ * codepoint from first is folded */
+typedef struct fold_range fold_range;
+struct fold_range{
+  uint32_t first;
+  uint32_t last;
+  int32_t  delta;
+  uint32_t stride;
+};
+
+/** Ranges of simple case folding, ordered by first codepoint */
+static const fold_range aFoldRanges[] = {
+  {0x0041, 0x005A,     32, 1},    /* Basic Latin */
+  {0x00B5, 0x00B5,    775, 1},    /* Micro sign */
+  {0x00C0, 0x00D6,     32, 1},    /* Latin-1 */
+  {0x00D8, 0x00DE,     32, 1},
+  {0x0100, 0x012F,      1, 2},    /* Latin Extended-A */
+  {0x0132, 0x0137,      1, 2},
+  {0x0139, 0x0148,      1, 2},
+  {0x014A, 0x0177,      1, 2},
+  {0x0178, 0x0178,   -121, 1},
+  {0x0179, 0x017E,      1, 2},
+  {0x017F, 0x017F,   -268, 1},    /* Long s */
+  {0x01CD, 0x01DC,      1, 2},    /* Latin Extended-B */
+  {0x01DE, 0x01EF,      1, 2},
+  {0x01F8, 0x021F,      1, 2},
+  {0x0222, 0x0233,      1, 2},
+  {0x0345, 0x0345,    116, 1},    /* Combining iota */
+  {0x0370, 0x0373,      1, 2},    /* Greek */
+  {0x0376, 0x0376,      1, 1},
+  {0x037F, 0x037F,    116, 1},
+  {0x0386, 0x0386,     38, 1},
+  {0x0388, 0x038A,     37, 1},
+  {0x038C, 0x038C,     64, 1},
+  {0x038E, 0x038F,     63, 1},
+  {0x0391, 0x03A1,     32, 1},
+  {0x03A3, 0x03AB,     32, 1},
+  {0x03C2, 0x03C2,      1, 1},    /* Final sigma */
+  {0x03D8, 0x03EF,      1, 2},
+  {0x0400, 0x040F,     80, 1},    /* Cyrillic */
+  {0x0410, 0x042F,     32, 1},
+  {0x0460, 0x0481,      1, 2},
+  {0x048A, 0x04BF,      1, 2},
+  {0x04C0, 0x04C0,     15, 1},
+  {0x04C1, 0x04CE,      1, 2},
+  {0x04D0, 0x052F,      1, 2},
+  {0x0531, 0x0556,     48, 1},    /* Armenian */
+  {0x10A0, 0x10C5,   7264, 1},    /* Georgian */
+  {0x1E00, 0x1E95,      1, 2},    /* Latin Extended Additional */
+  {0x1E9B, 0x1E9B,    -58, 1},
+  {0x1E9E, 0x1E9E,  -7615, 1},    /* Capital sharp s */
+  {0x1EA0, 0x1EFF,      1, 2},
+  {0x1F08, 0x1F0F,     -8, 1},    /* Greek Extended */
+  {0x1F18, 0x1F1D,     -8, 1},
+  {0x1F28, 0x1F2F,     -8, 1},
+  {0x1F38, 0x1F3F,     -8, 1},
+  {0x1F48, 0x1F4D,     -8, 1},
+  {0x1F59, 0x1F5F,     -8, 2},
+  {0x1F68, 0x1F6F,     -8, 1},
+  {0x2126, 0x2126,  -7517, 1},    /* Ohm sign */
+  {0x212A, 0x212A,  -8383, 1},    /* Kelvin sign */
+  {0x212B, 0x212B,  -8262, 1},    /* Angstrom sign */
+  {0x2132, 0x2132,     28, 1},
+  {0x2160, 0x216F,     16, 1},    /* Roman numerals */
+  {0x2183, 0x2183,      1, 1},
+  {0x24B6, 0x24CF,     26, 1},    /* Circled letters */
+  {0x2C00, 0x2C2F,     48, 1},    /* Glagolitic */
+  {0x2C80, 0x2CE3,      1, 2},    /* Coptic */
+  {0xA640, 0xA66D,      1, 2},    /* Cyrillic Extended-B */
+  {0xA680, 0xA69B,      1, 2},
+  {0xA722, 0xA72F,      1, 2},    /* Latin Extended-D */
+  {0xA732, 0xA76F,      1, 2},
+  {0xA779, 0xA77C,      1, 2},
+  {0xA77E, 0xA787,      1, 2},
+  {0xFF21, 0xFF3A,     32, 1},    /* Fullwidth Latin */
+  {0x10400, 0x10427,   40, 1}     /* Deseret */
+};
+
+/** Decode the codepoint at the start of nText bytes of UTF-8 from zText as
+ * *pCp, nText must be at least 1.
+ * Returns the number of bytes decoded */
+static int utf8DecodeOne(const unsigned char *zText, int nText, uint32_t *pCp){
+  unsigned char c = zText[0];
+  int extra = 0;
+  uint32_t min = 0;
+  if(c < 0x80){
+    *pCp = c;
+    return 1;
+  }else if((c & 0xE0) == 0xC0){
+    extra = 1; min = 0x80;
+  }else if((c & 0xF0) == 0xE0){
+    extra = 2; min = 0x800;
+  }else if((c & 0xF8) == 0xF0){
+    extra = 3; min = 0x10000;
+  }
+  *pCp = UTF8_INVALID(c);
+  if(extra == 0 || extra >= nText)
+    return 1;
+  uint32_t v = c & (0x3F >> extra);
+  int i;
+  for(i = 1; i <= extra; i++){
+    if((zText[i] & 0xC0) != 0x80) return 1;
+    v = (v << 6) | (zText[i] & 0x3F);
+  }
+  /* Overlong encodings and surrogates are invalid too */
+  if(v < min || v > 0x10FFFF || (0xD800 <= v && v <= 0xDFFF))
+    return 1;
+  *pCp = v;
+  return extra + 1;
+}
+
+/** Decode nText bytes of UTF-8 from zText as codepoints to aCp, which must
+ * have room for nText codepoints. Codepoints are case folded if fold is true.
+ * Returns the number of codepoints */
+int utf8Decode(const unsigned char *zText, int nText, bool fold, uint32_t *aCp){
+  int nCp = 0;
+  int i = 0;
+  while(i < nText){
+    uint32_t cp;
+    i += utf8DecodeOne(zText + i, nText - i, &cp);
+    aCp[nCp++] = fold ? utf8Fold(cp) : cp;
+  }
+  return nCp;
+}
+
+/** Simple case folding of codepoint cp */
+uint32_t utf8Fold(uint32_t cp){
+  if(cp < 0x80)
+    return LOWER(cp);
+  int lo = 0, hi = sizeof(aFoldRanges) / sizeof(aFoldRanges[0]);
+  while(lo < hi){
+    int mid = lo + (hi - lo) / 2;
+    if(aFoldRanges[mid].last < cp)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo == sizeof(aFoldRanges) / sizeof(aFoldRanges[0]) || cp < aFoldRanges[lo].first)
+    return cp;
+  if((cp - aFoldRanges[lo].first) % aFoldRanges[lo].stride != 0)
+    return cp;
+  return (uint32_t)((int32_t)cp + aFoldRanges[lo].delta);
+}
+
+/** Key of the trigram of the three codepoints aCp
+ * Exact-case trigrams, of codepoints that aren't folded, are keyed apart from
+ * folded trigrams, see the exactcase option. */
+trilite_trigram utf8Trigram(const uint32_t *aCp, bool exact){
+  if((aCp[0] | aCp[1] | aCp[2]) < 0x80){
+    trilite_trigram trigram = aCp[0] | (aCp[1] << BITSPERBYTE) | (aCp[2] << (BITSPERBYTE*2));
+    return exact ? trigram | TRIGRAM_EXACT : trigram;
+  }
+  /* Codepoints are at most 21 bits, mix them into a 64 bit hash */
+  uint64_t h = (uint64_t)aCp[0] | ((uint64_t)aCp[1] << 21) | ((uint64_t)aCp[2] << 42);
+  if(exact)
+    h += UINT64_C(0x9E3779B97F4A7C15);
+  h ^= h >> 33;
+  h *= UINT64_C(0xFF51AFD7ED558CCD);
+  h ^= h >> 33;
+  h *= UINT64_C(0xC4CEB9FE1A85EC53);
+  h ^= h >> 33;
+  return (trilite_trigram)(h >> 32) | TRIGRAM_HASHED;
+}
+
+/** Find the first occurrence of the nPattern case folded codepoints aPattern
+ * in nText bytes of UTF-8 from zText, comparing case folded codepoints.
+ * Returns the start of the occurrence, and outputs its end as *pzEnd, the
+ * occurrence may be longer or shorter than the pattern in bytes.
+ * Returns NULL, if there is no such occurrence */
+const unsigned char *utf8Search(const unsigned char *zText, int nText, const uint32_t *aPattern,
+                                int nPattern, const unsigned char **pzEnd){
+  int start = 0;
+  if(nPattern == 0){
+    *pzEnd = zText;
+    return zText;
+  }
+  while(start < nText){
+    uint32_t cp;
+    int first = utf8DecodeOne(zText + start, nText - start, &cp);
+    if(utf8Fold(cp) == aPattern[0]){
+      int i = start + first, j = 1;
+      while(j < nPattern && i < nText){
+        i += utf8DecodeOne(zText + i, nText - i, &cp);
+        if(utf8Fold(cp) != aPattern[j]) break;
+        j++;
+      }
+      if(j == nPattern){
+        *pzEnd = zText + i;
+        return zText + start;
+      }
+    }
+    start += first;
+  }
+  return NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef TRILITE_UTF8_H
+#define TRILITE_UTF8_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+int utf8Decode(const unsigned char*, int, bool, uint32_t*);
+uint32_t utf8Fold(uint32_t);
+trilite_trigram utf8Trigram(const uint32_t*, bool);
+const unsigned char *utf8Search(const unsigned char*, int, const uint32_t*, int, const unsigned char**);
+
+#endif /* TRILITE_UTF8_H */
@@ -1,9 +1,22 @@
 #include "vtable.h"
 #include "config.h"
-#include "varint.h"
+#include "doclist.h"
+#include "chunk.h"
 #include "hash.h"
 #include "match.h"
 #include "cursor.h"
+#include "segment.h"
+#include "blocks.h"
+#include "store.h"
+#include "seal.h"
+#include "optimize.h"
+#include "stop.h"
+#include "always.h"
+#include "dedup.h"
+#include "trigram.h"
+#include "bigrams.h"
+#include "signature.h"
+#include "tombstone.h"
 
 const sqlite3_api_routines *sqlite3_api;
 
@@ -11,6 +24,7 @@ const sqlite3_api_routines *sqlite3_api;
 #include <assert.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 
 /** Cost of a full table scan
@@ -25,9 +39,28 @@ const sqlite3_api_routines *sqlite3_api;
 #define COST_ROW_LOOKUP     1
 
 
-static int saveDocList(trilite_vtab*, trilite_trigram, sqlite3_int64*, int);
-static int indexAddText(trilite_vtab*, sqlite3_int64, sqlite3_value*);
+static int saveDocList(trilite_vtab*, int, trilite_trigram, sqlite3_int64*, trilite_masks*, int, sqlite3_int64*);
+static int loadConfig(trilite_vtab*, char**);
+static int parseOptions(trilite_vtab*, int, const char *const*, char**);
+static int parseBoolOption(const char*, int, const char*, bool*, char**);
+static int parseIntOption(const char*, int, const char*, long, long, int*, char**);
+static bool tableExists(trilite_vtab*, const char*);
+static int indexUpgrade(trilite_vtab*);
+static int indexConvertToChunks(trilite_vtab*);
+static int indexConvertChunks(trilite_vtab*);
+static int runCommand(trilite_vtab*, sqlite3_value*);
+static int bindText(trilite_vtab*, sqlite3_stmt*, int, sqlite3_value*);
+static int createDocIds(trilite_vtab*);
+static int checkCompactId(trilite_vtab*, sqlite3_value*, sqlite3_int64);
+static int insertDocId(trilite_vtab*, sqlite3_value*, sqlite3_int64*, sqlite3_int64*, bool);
+static int deleteDocId(trilite_vtab*, sqlite3_value*, sqlite3_int64*, bool*);
+static int insertRow(trilite_vtab*, sqlite3_value*, sqlite3_value*, sqlite3_int64*);
+static int deleteRow(trilite_vtab*, sqlite3_value*);
+static int updateRow(trilite_vtab*, sqlite3_value*, sqlite3_value*, sqlite3_value*, sqlite3_int64*);
+static int indexTextKeys(trilite_vtab*, const unsigned char*, int, trilite_trigram**, trilite_masks**, int*);
+static int indexAddText(trilite_vtab*, sqlite3_int64, const unsigned char*, int, sqlite3_value*);
 static int indexRemoveText(trilite_vtab*, sqlite3_int64);
+static int compareKeys(const void*, const void*);
 static int prepareSql(trilite_vtab*);
 static int finalizeSql(trilite_vtab*);
 
@@ -41,9 +74,31 @@ int triliteCreate(sqlite3 *db, void *pAux, int argc, const char *const *argv, sq
   /* Create tables */
   zSql = sqlite3_mprintf(
     "CREATE TABLE %Q.'%q_content' (id INTEGER PRIMARY KEY, text TEXT);"
-    "CREATE TABLE %Q.'%q_index' (trigram INTEGER PRIMARY KEY, doclist BLOB);",
+    "CREATE TABLE %Q.'%q_chunks' (trigram INTEGER, firstid INTEGER, doclist BLOB, PRIMARY KEY (trigram, firstid)) WITHOUT ROWID;"
+    "CREATE TABLE %Q.'%q_segments' (segment INTEGER PRIMARY KEY, level INTEGER, size INTEGER, merge INTEGER);"
+    "CREATE TABLE %Q.'%q_blocks' (id INTEGER, trigram INTEGER, blocks BLOB, PRIMARY KEY (id, trigram)) WITHOUT ROWID;"
+    "CREATE TABLE %Q.'%q_store' (block INTEGER PRIMARY KEY, size INTEGER, data BLOB);"
+    "CREATE TABLE %Q.'%q_stop' (trigram INTEGER PRIMARY KEY);"
+    "CREATE TABLE %Q.'%q_always' (id INTEGER PRIMARY KEY);"
+    "CREATE TABLE %Q.'%q_hashes' (hash INTEGER PRIMARY KEY, docid INTEGER);"
+    "CREATE TABLE %Q.'%q_bigrams' (bigram INTEGER, block INTEGER, bitmap BLOB, PRIMARY KEY (bigram, block)) WITHOUT ROWID;"
+    "CREATE TABLE %Q.'%q_signatures' (id INTEGER PRIMARY KEY, signature BLOB);"
+    "CREATE TABLE %Q.'%q_deleted' (block INTEGER PRIMARY KEY, bitmap BLOB);"
+    "CREATE TABLE %Q.'%q_config' (key TEXT PRIMARY KEY, value);"
+    "INSERT INTO %Q.'%q_config' (key, value) VALUES ('version', %d);",
     argv[1], argv[2],
-    argv[1], argv[2]);
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2],
+    argv[1], argv[2], TRILITE_FORMAT_VERSION);
   rc = sqlite3_exec(db, zSql, NULL, NULL, pzErr);
   sqlite3_free(zSql);
 
@@ -52,7 +107,29 @@ int triliteCreate(sqlite3 *db, void *pAux, int argc, const char *const *argv, sq
 
   /* Create the virtual table */
   rc = triliteConnect(db, pAux, argc, argv, ppVtab, pzErr);
-  
+  if(rc != SQLITE_OK)
+    return rc;
+
+  /* Gram size is stored, so it's known regardless of the options given, and
+   * new tables have line positions */
+  zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_config' (key, value) VALUES ('gram', %d), ('lines', 1);",
+                         argv[1], argv[2], ((trilite_vtab*)*ppVtab)->gramSize);
+  ((trilite_vtab*)*ppVtab)->linePositions = true;
+  if(!zSql)
+    rc = SQLITE_NOMEM;
+  else
+    rc = sqlite3_exec(db, zSql, NULL, NULL, pzErr);
+  sqlite3_free(zSql);
+
+  /* Deduplicated documents are shared by ids mapped through %_docids */
+  if(rc == SQLITE_OK && ((trilite_vtab*)*ppVtab)->dedup)
+    rc = createDocIds((trilite_vtab*)*ppVtab);
+
+  /* The table isn't returned on error, release it */
+  if(rc != SQLITE_OK){
+    triliteDisconnect(*ppVtab);
+    *ppVtab = NULL;
+  }
   return rc;
 }
 
@@ -74,9 +151,6 @@ int triliteConnect(sqlite3 *db, void *pAux, int argc, const char *const *argv, s
   pTrgVtab->zName = (char*)(pTrgVtab + 1) + nDb + 1;
   memcpy(pTrgVtab->zDb, argv[1], nDb);
   memcpy(pTrgVtab->zName, argv[2], nName);
- 
-  /* Allocate hash table */
-  hashCreate(&pTrgVtab->pAdded);
 
   /* Set database connection */
   pTrgVtab->db = db;
@@ -84,20 +158,109 @@ int triliteConnect(sqlite3 *db, void *pAux, int argc, const char *const *argv, s
   /* Default values for various settings */
   pTrgVtab->forbidFullMatchScan = true;
   pTrgVtab->maxRegExpMemory     = 8<<20;  /* About 8 MiB */
+  pTrgVtab->largeDocSize        = 0;
+  pTrgVtab->gramSize            = DEFAULT_GRAM_SIZE;
+
+  /* Options given when the table was created */
+  rc = parseOptions(pTrgVtab, argc - 3, argv + 3, pzErr);
+  if(rc != SQLITE_OK)
+    goto abort;
+
+  /* Allocate hash table, ids are known to fit 32 bits with compactids */
+  rc = hashCreate(&pTrgVtab->pAdded, pTrgVtab->compactIds);
+  if(rc != SQLITE_OK)
+    goto abort;
+
+  /* Allocate set of pending tombstones */
+  rc = tombstoneOpen(&pTrgVtab->pTombstones);
+  if(rc != SQLITE_OK)
+    goto abort;
   
+  /* Load format version, before preparing statements for it */
+  rc = loadConfig(pTrgVtab, pzErr);
+  if(rc != SQLITE_OK)
+    goto abort;
+
+  /* Tables from before %_blocks can't index large documents by blocks */
+  if(pTrgVtab->largeDocSize > 0 && !tableExists(pTrgVtab, "blocks")){
+    trilite_log("No %%_blocks table, ignoring largedoc option");
+    pTrgVtab->largeDocSize = 0;
+  }
+
+  /* Tables from before %_store store documents uncompressed */
+  if(pTrgVtab->pStore && !tableExists(pTrgVtab, "store")){
+    trilite_log("No %%_store table, ignoring compress option");
+    storeClose(pTrgVtab->pStore);
+    pTrgVtab->pStore = NULL;
+  }
+
+  /* Tables from before %_always index all documents by trigrams */
+  if(pTrgVtab->maxTrigrams > 0 && !tableExists(pTrgVtab, "always")){
+    trilite_log("No %%_always table, ignoring maxtrigrams option");
+    pTrgVtab->maxTrigrams = 0;
+  }
+
+  /* Ids are mapped to document ids, once document ids have been reassigned */
+  pTrgVtab->mapIds = tableExists(pTrgVtab, "docids");
+
+  /* Tables from before %_hashes store every text, the table is created with
+   * %_docids when creating the table */
+  if(pTrgVtab->dedup && !tableExists(pTrgVtab, "hashes")){
+    trilite_log("No %%_hashes table, ignoring dedup option");
+    pTrgVtab->dedup = false;
+  }
+
+  /* Tables from before %_bigrams are only indexed by trigrams */
+  if(pTrgVtab->pBigrams && !tableExists(pTrgVtab, "bigrams")){
+    trilite_log("No %%_bigrams table, ignoring bigrams option");
+    bigramsClose(pTrgVtab->pBigrams);
+    pTrgVtab->pBigrams = NULL;
+  }
+
+  /* Tables from before %_signatures have no signatures of documents */
+  if(pTrgVtab->signatureSize > 0 && !tableExists(pTrgVtab, "signatures")){
+    trilite_log("No %%_signatures table, ignoring signature option");
+    pTrgVtab->signatureSize = 0;
+  }
+
   /* Prepare sql statements */
   rc = prepareSql(pTrgVtab);
   if(rc != SQLITE_OK)
-    return rc;
+    goto abort;
+
+  /* Load stop trigrams */
+  rc = stopLoad(pTrgVtab);
+  if(rc != SQLITE_OK)
+    goto abort;
+
+  /* Map sealed index, if the index has been sealed */
+  rc = sealOpen(pTrgVtab);
+  if(rc != SQLITE_OK)
+    goto abort;
   
   /* Declare virtual table */
   rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER PRIMARY KEY, text TEXT, contents HIDDEN)");
   if(rc != SQLITE_OK)
-    return rc;
+    goto abort;
+
+  /* Commands write files, such as seal=PATH, so triggers and views of an
+   * untrusted database must not run them */
+  rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  if(rc != SQLITE_OK)
+    goto abort;
   
   /* Return the virtual table */
   *ppVtab = (sqlite3_vtab*)pTrgVtab;
   return rc;
+abort:
+  /* The table isn't returned, so its error message is output as *pzErr */
+  if(!*pzErr){
+    *pzErr = pTrgVtab->base.zErrMsg;
+    pTrgVtab->base.zErrMsg = NULL;
+  }
+  sqlite3_free(pTrgVtab->base.zErrMsg);
+  triliteDisconnect((sqlite3_vtab*)pTrgVtab);
+  return rc;
 }
 
 
@@ -114,13 +277,24 @@ int triliteRename(sqlite3_vtab *pVtab, const char* zNewName){
   
   /* Update database tables */
   zSql = sqlite3_mprintf(
-    "ALTER TABLE %Q.'%q_content' RENAME TO '%q_content';"
-    "ALTER TABLE %Q.'%q_index'   RENAME TO '%q_index';",
-    pTrgVtab->zDb, pTrgVtab->zName, zNewName,
+    "ALTER TABLE %Q.'%q_content' RENAME TO '%q_content';",
     pTrgVtab->zDb, pTrgVtab->zName, zNewName);
   rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
   sqlite3_free(zSql);
   if(rc != SQLITE_OK) return rc;
+
+  /* Other tables depend on the format version the table was created with */
+  const char *azTables[] = {"index", "chunks", "segments", "blocks", "store", "docids", "stop", "always", "hashes", "bigrams", "signatures", "deleted", "config"};
+  int i;
+  for(i = 0; i < (int)(sizeof(azTables) / sizeof(azTables[0])); i++){
+    if(!tableExists(pTrgVtab, azTables[i])) continue;
+    zSql = sqlite3_mprintf(
+      "ALTER TABLE %Q.'%q_%s' RENAME TO '%q_%s';",
+      pTrgVtab->zDb, pTrgVtab->zName, azTables[i], zNewName, azTables[i]);
+    rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+    if(rc != SQLITE_OK) return rc;
+  }
   
   /* Delete all the current sql statements */
   rc = finalizeSql(pTrgVtab);
@@ -151,76 +325,38 @@ int triliteUpdate(sqlite3_vtab* pVtab, int argc, sqlite3_value **argv, sqlite_in
   /* handled at all */
   
   /* With respect to the HIDDEN contents column we simply ignore whatever value */
-  /* is provided for it, maybe it would be better to raise an error on insert of */
-  /* a none NULL value in this column. */
+  /* is provided for it on update. Inserting a value into it runs a command, */
+  /* see runCommand. */
+
+  /* Upgrade legacy tables before writing anything */
+  if(pTrgVtab->formatVersion < TRILITE_FORMAT_VERSION){
+    rc = indexUpgrade(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Run command inserted into the contents column */
+  if(argc > 1 && type == SQLITE_NULL && sqlite3_value_type(argv[4]) != SQLITE_NULL)
+    return runCommand(pTrgVtab, argv[4]);
 
   /* Delete row argv[0] */
   if(argc == 1){
     trilite_log("Deleting row: %lli", sqlite3_value_int64(argv[0]));
-  
-    /* Remove text from index */
-    rc = indexRemoveText(pTrgVtab, sqlite3_value_int64(argv[0]));
-    if(rc != SQLITE_OK) return rc;
-    
-    /* Execute delete statement */
-    sqlite3_bind_value(pTrgVtab->stmt_delete_content, 1, argv[0]);
-    sqlite3_step(pTrgVtab->stmt_delete_content);
-    rc = sqlite3_reset(pTrgVtab->stmt_delete_content);
-    sqlite3_clear_bindings(pTrgVtab->stmt_delete_content);
-    
-    return rc;
+    return deleteRow(pTrgVtab, argv[0]);
   }
   
-  
   /* Insert new row */
   if(argc > 1 && type == SQLITE_NULL){
     /* Notice that we get the desired rowid as argv[1] and argv[2] because we */
     /* have id as alias of rowid in our table definition, anyways, */
     /* noworries this makes argv[3] the text. */
     /* Insert argv[3] as text with argv[1] as rowid (argv[1] may be NULL) */
-    sqlite3_bind_value(pTrgVtab->stmt_insert_content, 1, argv[1]);
-    sqlite3_bind_value(pTrgVtab->stmt_insert_content, 2, argv[3]);
-    
-    sqlite3_step(pTrgVtab->stmt_insert_content);
-    rc = sqlite3_reset(pTrgVtab->stmt_insert_content);
-    sqlite3_clear_bindings(pTrgVtab->stmt_insert_content);
-    if(rc != SQLITE_OK) return rc;
-    
-    /* Output rowid */
-    *pRowid = sqlite3_last_insert_rowid(pTrgVtab->db);
-    
-    trilite_log("Inserted row, got id: %lli", *pRowid);
-    
-    /* Add to text index */
-    rc = indexAddText(pTrgVtab, *pRowid, argv[3]);
-    
-    return rc;
+    return insertRow(pTrgVtab, argv[1], argv[3], pRowid);
   }
   
   /* Update existing row */
   if(argc > 1 && type != SQLITE_NULL){
-    /* Remove text from index */
-    rc = indexRemoveText(pTrgVtab, sqlite3_value_int64(argv[0]));
-    if(rc != SQLITE_OK) return rc;
-    
-    /* Notice that we get the desired rowid as argv[1] and argv[2] because we */
-    /* have id as alias of rowid in our table definition, anyways, */
-    /* noworries this makes argv[3] the text. */
-    /* Update set text = argv[3], id = argv[1]  where id = argv[0] */
-    sqlite3_bind_value(pTrgVtab->stmt_update_content, 1, argv[1]);
-    sqlite3_bind_value(pTrgVtab->stmt_update_content, 2, argv[3]);
-    sqlite3_bind_value(pTrgVtab->stmt_update_content, 3, argv[0]);
-    
-    sqlite3_step(pTrgVtab->stmt_update_content);
-    rc = sqlite3_reset(pTrgVtab->stmt_update_content);
-    sqlite3_clear_bindings(pTrgVtab->stmt_update_content);
-    if(rc != SQLITE_OK) return rc;
-    
+    rc = updateRow(pTrgVtab, argv[0], argv[1], argv[3], pRowid);
     trilite_log("Updated row: %lli (new id: %lli)", sqlite3_value_int64(argv[0]), sqlite3_value_int64(argv[1]));
-    
-    /* Add to text index */
-    rc = indexAddText(pTrgVtab, sqlite3_value_int64(argv[1]), argv[2]);
-    
     return rc;
   }
   assert(false);
@@ -230,8 +366,19 @@ int triliteUpdate(sqlite3_vtab* pVtab, int argc, sqlite3_value **argv, sqlite_in
 
 /** Begin transaction, necessary to ensure that triliteCommit is called */
 int triliteBegin(sqlite3_vtab *pVtab){
+  trilite_vtab* pTrgVtab = (trilite_vtab*)pVtab;
   trilite_log(" -- BEGIN TRANSACTION -- ");
-  return SQLITE_OK;
+
+  /* Blocks may have been written by others, since we cached them */
+  if(pTrgVtab->pStore)
+    storeReset(pTrgVtab->pStore);
+
+  /* Tombstones may have been written by others too */
+  tombstoneReset(pTrgVtab->pTombstones);
+
+  /* Stop trigrams may have changed, if others optimized the index, texts
+   * must be indexed by the current ones */
+  return stopLoad(pTrgVtab);
 }
 
 /** Sync things prior to commit or rollback
@@ -247,15 +394,25 @@ int triliteSync(sqlite3_vtab *pVtab){
 
   /* Open hash cursor, for popping of doclists */
   hash_table_cursor *pCur;
-  hashOpen(pTrgVtab->pAdded, &pCur);
+  rc = hashOpen(pTrgVtab->pAdded, &pCur);
+  if(rc != SQLITE_OK) return rc;
 
   trilite_log(" -- SYNC TRANSACTION -- ");
 
+  /* Pending doclists are written to a new segment, created when needed */
+  int iSegment = -1;
+  sqlite3_int64 nSegmentSize = 0;
+
   trilite_trigram trigram;
   sqlite_int64 *ids;
+  trilite_masks *masks;
   int nIds;
-  while(hashPop(pCur, &trigram, &ids, &nIds)){
-    rc = saveDocList(pTrgVtab, trigram, ids, nIds);
+  while(rc == SQLITE_OK && hashPop(pCur, &trigram, &ids, &masks, &nIds, &rc)){
+    if(iSegment < 0){
+      rc = segmentCreate(pTrgVtab, &iSegment);
+      assert(rc == SQLITE_OK);
+    }
+    rc = saveDocList(pTrgVtab, iSegment, trigram, ids, masks, nIds, &nSegmentSize);
     trilite_log("save: %i, nids: %i", trigram, nIds);
     assert(rc == SQLITE_OK);
   }
@@ -264,15 +421,70 @@ int triliteSync(sqlite3_vtab *pVtab){
   hashClose(pCur);
   pCur = NULL;
 
+  /* Doclists left in the hash table must not be lost by committing */
+  if(rc != SQLITE_OK) return rc;
+
+  /* Merge pending bigrams into their bitmaps */
+  if(pTrgVtab->pBigrams){
+    rc = bigramsFlush(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Write pending block of the content store */
+  if(pTrgVtab->pStore){
+    rc = storeFlush(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Write pending tombstones, before merging drops the ids they list */
+  rc = tombstoneFlush(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Record segment size and do merge work proportional to it */
+  if(iSegment >= 0){
+    rc = segmentFinish(pTrgVtab, iSegment, nSegmentSize);
+    if(rc == SQLITE_OK)
+      rc = segmentLoad(pTrgVtab);
+    if(rc == SQLITE_OK)
+      rc = segmentMerge(pTrgVtab, nSegmentSize * MERGE_WORK_FACTOR);
+  }
+
   return rc;
 }
 
 /** Commit pending changes to doclists */
 int triliteCommit(sqlite3_vtab *pVtab){
   trilite_log(" -- END TRANSACTION -- ");
+  sealCommit((trilite_vtab*)pVtab);
   return SQLITE_OK;
 }
 
+/** Rollback, forget pending changes to doclists and the content store
+ * Pending doclists must not be flushed by a later transaction, as the rows they
+ * list were rolled back. */
+int triliteRollback(sqlite3_vtab *pVtab){
+  trilite_vtab* pTrgVtab = (trilite_vtab*)pVtab;
+  trilite_log(" -- ROLLBACK TRANSACTION -- ");
+
+  hashRelease(pTrgVtab->pAdded);
+  pTrgVtab->pAdded = NULL;
+  int rc = hashCreate(&pTrgVtab->pAdded, pTrgVtab->compactIds);
+
+  if(pTrgVtab->pBigrams)
+    bigramsReset(pTrgVtab->pBigrams);
+  if(pTrgVtab->pStore)
+    storeRollback(pTrgVtab->pStore);
+  tombstoneReset(pTrgVtab->pTombstones);
+  sealRollback(pTrgVtab);
+
+  /* Stop trigrams of a rolled back optimize are forgotten, they're loaded
+   * again by the next transaction or match scan */
+  sqlite3_free(pTrgVtab->aStop);
+  pTrgVtab->aStop = NULL;
+  pTrgVtab->nStop = 0;
+  return rc;
+}
+
 
 
 /** Select index
@@ -446,6 +658,25 @@ int triliteDisconnect(sqlite3_vtab *pVtab){
   /* Release hash table */
   hashRelease(pTrgVtab->pAdded);
 
+  /* Release list of segments */
+  sqlite3_free(pTrgVtab->aSegments);
+
+  /* Release stop trigrams */
+  sqlite3_free(pTrgVtab->aStop);
+
+  /* Release content store */
+  storeClose(pTrgVtab->pStore);
+
+  /* Release pending bigrams */
+  bigramsClose(pTrgVtab->pBigrams);
+
+  /* Release pending tombstones */
+  tombstoneClose(pTrgVtab->pTombstones);
+
+  /* Unmap sealed index, and remove one that was never committed */
+  sealClose(pTrgVtab->pSealed);
+  sealRollback(pTrgVtab);
+
   /* Release virtual table */
   sqlite3_free(pVtab);
   
@@ -461,7 +692,31 @@ int triliteDestroy(sqlite3_vtab *pVtab){
   /* Drop tables */
   zSql = sqlite3_mprintf(
     "DROP TABLE '%q'.'%q_content';"
-    "DROP TABLE '%q'.'%q_index';",
+    "DROP TABLE IF EXISTS '%q'.'%q_index';"
+    "DROP TABLE IF EXISTS '%q'.'%q_chunks';"
+    "DROP TABLE IF EXISTS '%q'.'%q_segments';"
+    "DROP TABLE IF EXISTS '%q'.'%q_blocks';"
+    "DROP TABLE IF EXISTS '%q'.'%q_store';"
+    "DROP TABLE IF EXISTS '%q'.'%q_docids';"
+    "DROP TABLE IF EXISTS '%q'.'%q_stop';"
+    "DROP TABLE IF EXISTS '%q'.'%q_always';"
+    "DROP TABLE IF EXISTS '%q'.'%q_hashes';"
+    "DROP TABLE IF EXISTS '%q'.'%q_bigrams';"
+    "DROP TABLE IF EXISTS '%q'.'%q_signatures';"
+    "DROP TABLE IF EXISTS '%q'.'%q_deleted';"
+    "DROP TABLE IF EXISTS '%q'.'%q_config';",
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName,
     pTrgVtab->zDb, pTrgVtab->zName,
     pTrgVtab->zDb, pTrgVtab->zName);
   rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
@@ -494,156 +749,899 @@ void triliteError(trilite_vtab *pTrgVtab, const char *format, ...){
 }
 
 
-/** Add a text to the trigram index */
-static int indexAddText(trilite_vtab *pTrgVtab, sqlite3_int64 id, sqlite3_value *vText){
-  /* Get the text */
+/** Run a command given by inserting into the contents column, as in
+ * INSERT INTO t(contents) VALUES('seal=/path/to/file'). Commands are:
+ *   seal=PATH    Write all segments to a sealed index at PATH, see seal.c
+ *   optimize     Reassign document ids, so similar documents are adjacent,
+ *                see optimize.c
+ */
+static int runCommand(trilite_vtab *pTrgVtab, sqlite3_value *vCommand){
+  const char *zCommand = (const char*)sqlite3_value_text(vCommand);
+  if(!zCommand) return SQLITE_NOMEM;
+
+  if(strncmp(zCommand, "seal=", 5) == 0 && zCommand[5])
+    return sealWrite(pTrgVtab, zCommand + 5);
+
+  if(strcmp(zCommand, "optimize") == 0){
+    int rc = SQLITE_OK;
+    if(!pTrgVtab->mapIds)
+      rc = createDocIds(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+    return optimizeIndex(pTrgVtab);
+  }
+
+  triliteError(pTrgVtab, "Unknown command: '%s'", zCommand);
+  return SQLITE_ERROR;
+}
+
+/** Bind text of a document to parameter i of a statement on %_content
+ * With a content store, the text is appended to it and its locator is bound
+ * rather than the text. */
+static int bindText(trilite_vtab *pTrgVtab, sqlite3_stmt *pStmt, int i, sqlite3_value *vText){
+  if(!pTrgVtab->pStore || sqlite3_value_type(vText) == SQLITE_NULL)
+    return sqlite3_bind_value(pStmt, i, vText);
+
   const unsigned char *zText = sqlite3_value_text(vText);
   int nText = sqlite3_value_bytes(vText);
+  unsigned char locator[MAX_LOCATOR_SIZE];
+  int nLocator;
+  int rc = storeAppend(pTrgVtab, zText, nText, locator, &nLocator);
+  if(rc != SQLITE_OK) return rc;
+  return sqlite3_bind_blob(pStmt, i, locator, nLocator, SQLITE_TRANSIENT);
+}
+
+/** Check that an id fits in 32 bits, for tables with compactids
+ * The id is vId, unless vId is NULL, then it's id. A NULL value is always
+ * valid. Fails with SQLITE_CONSTRAINT, if the id is out of range. */
+static int checkCompactId(trilite_vtab *pTrgVtab, sqlite3_value *vId, sqlite3_int64 id){
+  if(!pTrgVtab->compactIds) return SQLITE_OK;
+  if(vId){
+    if(sqlite3_value_type(vId) == SQLITE_NULL) return SQLITE_OK;
+    id = sqlite3_value_int64(vId);
+  }
+  if(0 <= id && id <= (sqlite3_int64)UINT32_MAX) return SQLITE_OK;
+  triliteError(pTrgVtab, "INSERT: Id %lli is out of range, ids must fit in 32 bits with compactids", id);
+  return SQLITE_CONSTRAINT;
+}
+
+/** Create %_docids with all ids mapped to themselves, and prepare statements
+ * to map ids from now on. A document id may be shared by more than one id, see
+ * dedup.c */
+static int createDocIds(trilite_vtab *pTrgVtab){
+  char *zSql = sqlite3_mprintf(
+    "CREATE TABLE IF NOT EXISTS %Q.'%q_docids' (id INTEGER PRIMARY KEY, docid INTEGER, UNIQUE (docid, id));"
+    "INSERT INTO %Q.'%q_docids' (id, docid) SELECT id, id FROM %Q.'%q_content';",
+    pTrgVtab->zDb, pTrgVtab->zName,
+    pTrgVtab->zDb, pTrgVtab->zName, pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  int rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Statements must map ids from now on */
+  rc = finalizeSql(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+  pTrgVtab->mapIds = true;
+  return prepareSql(pTrgVtab);
+}
+
+/** Insert id into %_docids for a new document, with the next document id
+ * The id is the next id, if vId is NULL. The id is output as *pId and the
+ * document id as *pDocId, unless shared is true, then *pDocId is the document
+ * id of an existing document. Fails with SQLITE_CONSTRAINT, if the id exists. */
+static int insertDocId(trilite_vtab *pTrgVtab, sqlite3_value *vId, sqlite3_int64 *pId, sqlite3_int64 *pDocId, bool shared){
+  int rc;
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_next_docid;
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    *pId    = sqlite3_column_int64(pStmt, 0);
+    if(!shared)
+      *pDocId = sqlite3_column_int64(pStmt, 1);
+  }
+  rc = sqlite3_reset(pStmt);
+  if(rc != SQLITE_OK) return rc;
+  if(sqlite3_value_type(vId) != SQLITE_NULL)
+    *pId = sqlite3_value_int64(vId);
+
+  pStmt = pTrgVtab->stmt_insert_docid;
+  sqlite3_bind_int64(pStmt, 1, *pId);
+  sqlite3_bind_int64(pStmt, 2, *pDocId);
+  sqlite3_step(pStmt);
+  return sqlite3_reset(pStmt);
+}
+
+/** Delete id from %_docids, the document id it was mapped to is output as
+ * *pDocId, and *pShared is set true if other ids share the document. If the
+ * id doesn't exist, *pDocId is the id itself. */
+static int deleteDocId(trilite_vtab *pTrgVtab, sqlite3_value *vId, sqlite3_int64 *pDocId, bool *pShared){
+  int rc;
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_find_docid;
+  *pDocId  = sqlite3_value_int64(vId);
+  *pShared = false;
+  sqlite3_bind_value(pStmt, 1, vId);
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    *pDocId  = sqlite3_column_int64(pStmt, 0);
+    *pShared = sqlite3_column_int64(pStmt, 1) > 1;
+  }
+  rc = sqlite3_reset(pStmt);
+  if(rc != SQLITE_OK) return rc;
+
+  pStmt = pTrgVtab->stmt_delete_docid;
+  sqlite3_bind_value(pStmt, 1, vId);
+  sqlite3_step(pStmt);
+  return sqlite3_reset(pStmt);
+}
+
+/** Insert vText as a new row with id vId, which may be NULL, the id is output
+ * as *pRowid. If ids are mapped, the text is stored under a new document id. */
+static int insertRow(trilite_vtab *pTrgVtab, sqlite3_value *vId, sqlite3_value *vText, sqlite3_int64 *pRowid){
+  sqlite3_int64 docId, hash = 0;
+  bool dedup = pTrgVtab->dedup && sqlite3_value_type(vText) != SQLITE_NULL;
+  int rc = checkCompactId(pTrgVtab, vId, 0);
+  if(rc != SQLITE_OK) return rc;
+  if(pTrgVtab->mapIds){
+    /* Identical texts share a document, nothing more is stored or indexed */
+    bool shared = false;
+    if(dedup){
+      rc = dedupFind(pTrgVtab, vText, &hash, &docId, &shared);
+      if(rc != SQLITE_OK) return rc;
+    }
+    rc = insertDocId(pTrgVtab, vId, pRowid, &docId, shared);
+    if(rc == SQLITE_OK)
+      rc = checkCompactId(pTrgVtab, NULL, *pRowid);
+    if(rc == SQLITE_OK)
+      rc = checkCompactId(pTrgVtab, NULL, docId);
+    if(rc != SQLITE_OK || shared) return rc;
+    sqlite3_bind_int64(pTrgVtab->stmt_insert_content, 1, docId);
+  }else
+    sqlite3_bind_value(pTrgVtab->stmt_insert_content, 1, vId);
+  rc = bindText(pTrgVtab, pTrgVtab->stmt_insert_content, 2, vText);
+  if(rc != SQLITE_OK) return rc;
   
-  /* Don't insert anything for empty texts */
-  if(nText == 0) return SQLITE_OK;
+  sqlite3_step(pTrgVtab->stmt_insert_content);
+  rc = sqlite3_reset(pTrgVtab->stmt_insert_content);
+  sqlite3_clear_bindings(pTrgVtab->stmt_insert_content);
+  if(rc != SQLITE_OK) return rc;
   
-  trilite_log("Adding docid: %lli to index with '%s'", id, zText);
+  /* Output rowid */
+  if(!pTrgVtab->mapIds){
+    *pRowid = sqlite3_last_insert_rowid(pTrgVtab->db);
+    docId = *pRowid;
+    rc = checkCompactId(pTrgVtab, NULL, docId);
+    if(rc != SQLITE_OK) return rc;
+  }
+  
+  trilite_log("Inserted row, got id: %lli", *pRowid);
+
+  /* Later identical texts share this document */
+  if(dedup && pTrgVtab->mapIds){
+    rc = dedupAdd(pTrgVtab, hash, docId);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* The document id may be of a deleted document */
+  rc = tombstoneRestore(pTrgVtab, docId);
+  if(rc != SQLITE_OK) return rc;
+  
+  /* Add to text index */
+  return indexAddText(pTrgVtab, docId, NULL, 0, vText);
+}
+
+/** Delete row with id vId, its document is removed from the index unless
+ * other ids share it */
+static int deleteRow(trilite_vtab *pTrgVtab, sqlite3_value *vId){
+  sqlite3_int64 docId = sqlite3_value_int64(vId);
+  int rc;
+
+  /* Shared documents are kept for the other ids */
+  if(pTrgVtab->mapIds){
+    bool shared;
+    rc = deleteDocId(pTrgVtab, vId, &docId, &shared);
+    if(rc != SQLITE_OK || shared) return rc;
+  }
+
+  /* Remove text from index */
+  rc = indexRemoveText(pTrgVtab, docId);
+  if(rc != SQLITE_OK) return rc;
   
-  /* List of trigrams seen so far (Just allocate plenty of memory) */
-  uint32_t *trigrams = (uint32_t*)sqlite3_malloc(sizeof(uint32_t) * nText);
+  /* Execute delete statement */
+  sqlite3_bind_int64(pTrgVtab->stmt_delete_content, 1, docId);
+  sqlite3_step(pTrgVtab->stmt_delete_content);
+  rc = sqlite3_reset(pTrgVtab->stmt_delete_content);
+  sqlite3_clear_bindings(pTrgVtab->stmt_delete_content);
+  return rc;
+}
+
+/** Update row vOldId to id vId and text vText, the id is output as *pRowid
+ * If the id is kept, nothing is done for an identical text, and otherwise only
+ * what the old text doesn't have is added to the index, see indexAddText. A
+ * new id, or a deduplicated document, is deleted and inserted anew. */
+static int updateRow(trilite_vtab *pTrgVtab, sqlite3_value *vOldId, sqlite3_value *vId, sqlite3_value *vText, sqlite3_int64 *pRowid){
+  sqlite3_int64 docId = sqlite3_value_int64(vOldId);
+  int rc;
+
+  /* Check the new id, before deleting the old row */
+  rc = checkCompactId(pTrgVtab, vId, 0);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Rows given a new id are deleted and inserted */
+  if(sqlite3_value_type(vId) == SQLITE_NULL || sqlite3_value_int64(vId) != docId){
+    rc = deleteRow(pTrgVtab, vOldId);
+    if(rc != SQLITE_OK) return rc;
+    return insertRow(pTrgVtab, vId, vText, pRowid);
+  }
+  *pRowid = docId;
+
+  /* Find the document id */
+  if(pTrgVtab->mapIds){
+    sqlite3_stmt *pStmt = pTrgVtab->stmt_find_docid;
+    sqlite3_bind_value(pStmt, 1, vOldId);
+    if(sqlite3_step(pStmt) == SQLITE_ROW)
+      docId = sqlite3_column_int64(pStmt, 0);
+    rc = sqlite3_reset(pStmt);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Fetch the old text, from the content store if it's stored there, it's
+   * copied as the store may be appended to */
+  sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_content;
+  unsigned char *zOld = NULL;
+  int nOld = 0;
+  bool found = false, oldNull = false;
+  sqlite3_bind_int64(pStmt, 1, docId);
+  if(sqlite3_step(pStmt) == SQLITE_ROW){
+    const unsigned char *zText;
+    if(pTrgVtab->pStore && sqlite3_column_type(pStmt, 0) == SQLITE_BLOB){
+      rc = storeFetch(pTrgVtab, (const unsigned char*)sqlite3_column_blob(pStmt, 0),
+                      sqlite3_column_bytes(pStmt, 0), &zText, &nOld);
+    }else{
+      oldNull = sqlite3_column_type(pStmt, 0) == SQLITE_NULL;
+      zText = sqlite3_column_text(pStmt, 0);
+      nOld = sqlite3_column_bytes(pStmt, 0);
+    }
+    if(rc == SQLITE_OK){
+      zOld = (unsigned char*)sqlite3_malloc(nOld + 1);
+      if(!zOld) rc = SQLITE_NOMEM;
+      else if(nOld > 0) memcpy(zOld, zText, nOld);
+      found = zOld != NULL;
+    }
+  }
+  int rc2 = sqlite3_reset(pStmt);
+  if(rc == SQLITE_OK) rc = rc2;
+  if(rc != SQLITE_OK){
+    sqlite3_free(zOld);
+    return rc;
+  }
+
+  /* Nothing changes for an identical text */
+  const unsigned char *zText = sqlite3_value_text(vText);
+  int nText = sqlite3_value_bytes(vText);
+  if(found && oldNull == (sqlite3_value_type(vText) == SQLITE_NULL) &&
+     nOld == nText && (nText == 0 || memcmp(zOld, zText, nText) == 0)){
+    trilite_log("Text of row %lli is unchanged", *pRowid);
+    sqlite3_free(zOld);
+    return SQLITE_OK;
+  }
+
+  /* Deduplicated texts are shared by hash, so they're deleted and inserted */
+  if(!found || pTrgVtab->dedup){
+    sqlite3_free(zOld);
+    rc = deleteRow(pTrgVtab, vOldId);
+    if(rc != SQLITE_OK) return rc;
+    return insertRow(pTrgVtab, vId, vText, pRowid);
+  }
+
+  /* Replace the text */
+  rc = bindText(pTrgVtab, pTrgVtab->stmt_update_content, 1, vText);
+  if(rc == SQLITE_OK){
+    sqlite3_bind_int64(pTrgVtab->stmt_update_content, 2, docId);
+    sqlite3_step(pTrgVtab->stmt_update_content);
+    rc = sqlite3_reset(pTrgVtab->stmt_update_content);
+  }
+  sqlite3_clear_bindings(pTrgVtab->stmt_update_content);
+
+  /* Add what the old text doesn't have to the index */
+  if(rc == SQLITE_OK)
+    rc = indexAddText(pTrgVtab, docId, zOld, nOld, vText);
+  sqlite3_free(zOld);
+  return rc;
+}
+
+/** Distinct keys of a text with their merged masks, for adding it to the index
+ * Stop trigrams are left out. Keys are output as *pTrigrams and masks as
+ * *pMasks, allocated with sqlite3_malloc, and the number of keys as
+ * *pnTrigrams, which is -1 if the text is an always-candidate. */
+static int indexTextKeys(trilite_vtab *pTrgVtab, const unsigned char *zText, int nText,
+                         trilite_trigram **pTrigrams, trilite_masks **pMasks, int *pnTrigrams){
+  *pTrigrams = NULL;
+  *pMasks = NULL;
+  *pnTrigrams = 0;
+
+  /* Keys of the text, trigrams and the exact-case trigrams and sparse grams
+   * of tables with the exactcase and sparse options */
+  trilite_trigram *aKeys;
+  trilite_masks *aKeyMasks;
+  int nKeys;
+  int rc = trigramIndexKeys(pTrgVtab, zText, nText, &aKeys, &aKeyMasks, &nKeys);
+  if(rc != SQLITE_OK) return rc;
+
+  /* List of trigrams seen so far and their masks (Just allocate plenty of memory) */
+  uint32_t *trigrams = (uint32_t*)sqlite3_malloc(sizeof(uint32_t) * (nKeys + 1));
+  trilite_masks *masks = (trilite_masks*)sqlite3_malloc(sizeof(trilite_masks) * (nKeys + 1));
   int nTrigrams = 0;
-  if(!trigrams) return SQLITE_NOMEM;
+  if(!trigrams || !masks){
+    sqlite3_free(trigrams);
+    sqlite3_free(masks);
+    sqlite3_free(aKeys);
+    return SQLITE_NOMEM;
+  }
   
-  int pos;
-  for(pos = 0; pos <= nText - 3; pos++){
-    /* Convert byte values of trigram to int as use as trigram */
-    uint32_t trigram = HASH_TRIGRAM(zText + pos);
+  int k;
+  for(k = 0; k < nKeys; k++){
+    uint32_t trigram = aKeys[k];
+    /* Masks for this occurrence, position and the character following it */
+    trilite_masks m = aKeyMasks[k];
+
+    /* Stop trigrams are not indexed */
+    if(pTrgVtab->nStop > 0 && stopTrigram(pTrgVtab, trigram))
+      continue;
 
-    /* Continue if we've seen this trigram before */
+    /* Merge masks if we've seen this trigram before */
     int i;
     for(i = 0; i < nTrigrams; i++)
       if(trigrams[i] == trigram) break;
-    if(i < nTrigrams) continue;
+    if(i < nTrigrams){
+      masks[i] |= m;
+      continue;
+    }
     
-    trilite_log("Found new trigram '%c%c%c'", zText[pos], zText[pos + 1], zText[pos + 2]);
+    trilite_log("Found new trigram %u", trigram);
     
+    /* Documents with too many distinct trigrams are always-candidates */
+    if(pTrgVtab->maxTrigrams > 0 && nTrigrams == pTrgVtab->maxTrigrams){
+      nTrigrams = -1;
+      break;
+    }
+
     /* Add trigram to list of trigrams */
-    trigrams[nTrigrams++] = trigram;
+    trigrams[nTrigrams]  = trigram;
+    masks[nTrigrams++]   = m;
+  }
+  sqlite3_free(aKeys);
 
-    /* Insert id for trigram in hash table for added doclists */
-    hashInsert(pTrgVtab->pAdded, trigram, id);
+  *pTrigrams = trigrams;
+  *pMasks = masks;
+  *pnTrigrams = nTrigrams;
+  return SQLITE_OK;
+}
+
+/** Add a text to the trigram index
+ * If the document had an old text zOld of nOld bytes, which is NULL for new
+ * documents, only keys the old text doesn't have, or has with other masks, are
+ * added. The postings of the old text stay in the index, those of keys only in
+ * the old text just add candidates. With line positions an edit costs about
+ * the size of the lines it changes, in older tables inserting or deleting a
+ * run of other than a multiple of 8 characters also changes the position
+ * masks of the keys following it. */
+static int indexAddText(trilite_vtab *pTrgVtab, sqlite3_int64 id, const unsigned char *zOld, int nOld, sqlite3_value *vText){
+  /* Get the text */
+  const unsigned char *zText = sqlite3_value_text(vText);
+  int nText = sqlite3_value_bytes(vText);
+  int rc;
+  
+  /* Blocks of the old text are replaced */
+  if(zOld && pTrgVtab->largeDocSize > 0 && nOld > pTrgVtab->largeDocSize){
+    char *zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_blocks' WHERE id = %lld;",
+                                 pTrgVtab->zDb, pTrgVtab->zName, id);
+    if(!zSql) return SQLITE_NOMEM;
+    rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Don't insert anything for empty texts */
+  if(nText == 0) return SQLITE_OK;
+  
+  trilite_log("Adding docid: %lli to index with '%s'", id, zText);
+  
+  /* Keys of the old text as key and masks in a single sortable value */
+  uint64_t *aOld = NULL;
+  int nOldKeys = 0;
+  bool oldAlways = false;
+  trilite_trigram *trigrams;
+  trilite_masks *masks;
+  int nTrigrams, i;
+  if(zOld && nOld > 0){
+    rc = indexTextKeys(pTrgVtab, zOld, nOld, &trigrams, &masks, &nTrigrams);
+    if(rc != SQLITE_OK) return rc;
+    oldAlways = nTrigrams < 0;
+    if(nTrigrams > 0)
+      aOld = (uint64_t*)sqlite3_malloc(sizeof(uint64_t) * nTrigrams);
+    for(i = 0; aOld && i < nTrigrams; i++)
+      aOld[nOldKeys++] = ((uint64_t)trigrams[i] << 16) | (uint64_t)masks[i];
+    sqlite3_free(trigrams);
+    sqlite3_free(masks);
+    if(nTrigrams > 0 && !aOld) return SQLITE_NOMEM;
+    qsort(aOld, nOldKeys, sizeof(uint64_t), compareKeys);
+  }
+
+  rc = indexTextKeys(pTrgVtab, zText, nText, &trigrams, &masks, &nTrigrams);
+  if(rc != SQLITE_OK){
+    sqlite3_free(aOld);
+    return rc;
+  }
+
+  /* Insert id for trigrams in hash table for added doclists, unless the old
+   * text has the trigram with masks covering the new */
+  for(i = 0; i < nTrigrams; i++){
+    int lo = 0, hi = nOldKeys;
+    while(lo < hi){
+      int mid = lo + (hi - lo) / 2;
+      if((trilite_trigram)(aOld[mid] >> 16) < trigrams[i])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if(lo < nOldKeys && (trilite_trigram)(aOld[lo] >> 16) == trigrams[i] &&
+       (masks[i] & ~(trilite_masks)aOld[lo]) == 0)
+      continue;
+    hashInsert(pTrgVtab->pAdded, trigrams[i], id, masks[i]);
   }
   
   /* Release list of trigrams */
+  sqlite3_free(aOld);
   sqlite3_free(trigrams);
+  sqlite3_free(masks);
+
+  if(nTrigrams < 0 && !oldAlways){
+    rc = alwaysAdd(pTrgVtab, id);
+    if(rc != SQLITE_OK) return rc;
+  }else if(nTrigrams >= 0 && oldAlways){
+    rc = alwaysRemove(pTrgVtab, id);
+    if(rc != SQLITE_OK) return rc;
+  }
   
-  if(hashMemoryUsage(pTrgVtab->pAdded) > MAX_PENDING_BYTES)
+  /* Index large documents by blocks too */
+  if(pTrgVtab->largeDocSize > 0 && nText > pTrgVtab->largeDocSize){
+    rc = blocksIndexText(pTrgVtab, id, zText, nText);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Index bigrams too, for substrings shorter than a trigram */
+  int nPending = hashMemoryUsage(pTrgVtab->pAdded);
+  if(pTrgVtab->pBigrams){
+    if(zOld)
+      rc = bigramsUpdateText(pTrgVtab, id, zOld, nOld, zText, nText);
+    else
+      rc = bigramsAddText(pTrgVtab, id, zText, nText);
+    if(rc != SQLITE_OK) return rc;
+    nPending += bigramsMemoryUsage(pTrgVtab->pBigrams);
+  }
+
+  /* Signature of the text, so candidates can be rejected without it */
+  if(pTrgVtab->signatureSize > 0){
+    rc = signatureAdd(pTrgVtab, id, zText, nText);
+    if(rc != SQLITE_OK) return rc;
+  }
+  
+  if(nPending > MAX_PENDING_BYTES)
     triliteSync((sqlite3_vtab*)pTrgVtab);
 
   return SQLITE_OK;
 }
 
-/** Save docList to database
- * We assume the docList is sorted in ascending order of ids */
-static int saveDocList(trilite_vtab *pTrgVtab, trilite_trigram trigram, sqlite3_int64 *ids, int nIds){
+/** Save docList to segment iSegment, adding its size to *pnSize
+ * We assume the docList is sorted in ascending order of ids. Each flush writes
+ * a new segment, so there's no existing doclist to merge with. */
+static int saveDocList(trilite_vtab *pTrgVtab, int iSegment, trilite_trigram trigram, sqlite3_int64 *ids, trilite_masks *masks, int nIds, sqlite3_int64 *pnSize){
   int rc = SQLITE_OK;
 
-  /* doclist and size */
-  int nSize;
-  unsigned char *docList;
-
-
-  /* Find list for this trigram, if any */
-  sqlite3_stmt *pStmt = pTrgVtab->stmt_fetch_doclist;
-  sqlite3_bind_int64(pStmt, 1, (sqlite_int64)trigram);
-  if((rc = sqlite3_step(pStmt)) == SQLITE_ROW){
-      /* Get old list from query */
-      unsigned char *oldList = (unsigned char*)sqlite3_column_blob(pStmt, 0);
-      int nOldSize           = sqlite3_column_bytes(pStmt, 0);
-      /* Allocate new list */
-      docList = (unsigned char*)sqlite3_malloc(nOldSize + MAX_VARINT_SIZE * nIds);
-      nSize = 0;
-      /* Merge both lists */
-      sqlite3_int64 prevWritten = DELTA_LIST_OFFSET;
-      int i = 0;  /* Offset in ids */
-      int j = 0;  /* Byte offset in oldList */
-      /* Last value read */
-      sqlite3_int64 read = SQLITE3_INT64_MIN;
-      bool read_valid = false;  /* True, if read is valid */
-      /* Read a value from oldList if there's any */
-      if(j < nOldSize){
-        read_valid = true;
-        j += readVarInt(oldList + j, &read);
-        read += DELTA_LIST_OFFSET;
-      }
-      /* Continue looping while there's data */
-      while(i < nIds || read_valid){
-        /* Write everything in ids smaller than read */
-        while(i < nIds && (ids[i] < read || !read_valid)){
-          nSize += writeVarInt(docList + nSize, ids[i] - prevWritten);
-          prevWritten = ids[i];
-          i += 1;
-        }
-        /* Write while read is valid and smaller than next ids, or ids is at end */
-        while(read_valid && (i >= nIds || read < ids[i])){
-          nSize += writeVarInt(docList + nSize, read - prevWritten);
-          prevWritten = read;
-          read_valid = false;
-          if(j < nOldSize){
-            read_valid = true;
-            sqlite3_int64 prevRead = read;
-            j += readVarInt(oldList + j, &read);
-            read += prevRead;
-          }
-        }
-        /* If we have two of the same id */
-        if(read_valid && i < nIds && ids[i] == read){
-          /* Write once */
-          nSize += writeVarInt(docList + nSize, read - prevWritten);
-          prevWritten = read;
-          /* Advance oldList */
-          read_valid = false;
-          if(j < nOldSize){
-            read_valid = true;
-            sqlite3_int64 prevRead = read;
-            j += readVarInt(oldList + j, &read);
-            read += prevRead;
-          }
-          /* Advanced ids */
-          i += 1;
-        }
-      }
-  }else{
-    /* Allocate memory for new docList as we didn't get any from query */
-    assert(rc == SQLITE_DONE);    
-    docList = (unsigned char*)sqlite3_malloc(MAX_VARINT_SIZE * nIds);
-    nSize = 0;
-    sqlite3_int64 prev = DELTA_LIST_OFFSET;
-    int i;
-    for(i = 0; i < nIds; i++){
-      nSize += writeVarInt(docList + nSize, ids[i] - prev);
-      prev = ids[i];
+  /* Encode ids as chunks */
+  chunk_writer writer;
+  chunkWriterInit(&writer, pTrgVtab, SEGMENT_KEY(iSegment, trigram));
+  int i;
+  for(i = 0; i < nIds && rc == SQLITE_OK; i++)
+    rc = chunkWriterAdd(&writer, ids[i], masks[i]);
+  if(rc == SQLITE_OK)
+    rc = chunkWriterFinish(&writer);
+  else
+    chunkWriterRelease(&writer);
+
+  *pnSize += writer.nWritten;
+  return rc;
+}
+
+/** Parse options given as arguments to CREATE VIRTUAL TABLE
+ * Options are given as name=value, the following options are supported:
+ *   largedoc=N   Documents larger than N bytes are also indexed by blocks of
+ *                DOCUMENT_BLOCK_SIZE, see blocks.c
+ *   compress=B   Store documents in compressed blocks if B is 1, see store.c
+ *   stopfreq=P   Trigrams in more than P percent of the documents are stop
+ *                trigrams when optimizing, 0 to disable, see stop.c
+ *   maxtrigrams=N  Documents with more than N distinct trigrams are candidates
+ *                for every match scan instead, 0 to disable, see always.c
+ *   dedup=B      Store and index identical texts once if B is 1, see dedup.c
+ *   compactids=B Limit ids and document ids to 32 bits if B is 1, pending
+ *                doclists take half the memory
+ *   exactcase=B  Also index trigrams without case folding if B is 1, so
+ *                case sensitive substrings have fewer candidates
+ *   utf8=B       Index trigrams of UTF-8 codepoints rather than bytes if B
+ *                is 1, with Unicode case folding, see utf8.c
+ *   sparse=B     Also index sparse grams if B is 1, substrings are matched
+ *                by a few long grams rather than every trigram, see trigram.c
+ *   gram=N       Index grams of N characters rather than trigrams, N from 3
+ *                to MAX_GRAM_SIZE, substrings shorter than N match all
+ *   bigrams=B    Also index bigrams as bitmaps if B is 1, so substrings
+ *                shorter than a trigram have candidates, see bigrams.c
+ *   anchors=B    Also index boundary grams of the document, lines and words
+ *                if B is 1, for regexps anchored by ^, $ and \b
+ *   signature=N  Store a Bloom signature of N bytes of the 4- and 5-grams of
+ *                each document, candidates of substring patterns are tested
+ *                against it before their text is fetched, 0 to disable, see
+ *                signature.c
+ * Returns SQLITE_ERROR and outputs an error message as *pzErr for invalid
+ * options. */
+static int parseOptions(trilite_vtab *pTrgVtab, int nOptions, const char *const *azOptions, char **pzErr){
+  int i, rc = SQLITE_OK;
+  for(i = 0; i < nOptions && rc == SQLITE_OK; i++){
+    const char *zOption = azOptions[i];
+    bool value;
+    while(*zOption == ' ') zOption++;
+    if(strncmp(zOption, "largedoc=", 9) == 0)
+      rc = parseIntOption(zOption, 9, "largedoc", 0, INT32_MAX, &pTrgVtab->largeDocSize, pzErr);
+    else if(strncmp(zOption, "stopfreq=", 9) == 0)
+      rc = parseIntOption(zOption, 9, "stopfreq", 0, 100, &pTrgVtab->stopFreq, pzErr);
+    else if(strncmp(zOption, "gram=", 5) == 0)
+      rc = parseIntOption(zOption, 5, "gram", 3, MAX_GRAM_SIZE, &pTrgVtab->gramSize, pzErr);
+    else if(strncmp(zOption, "maxtrigrams=", 12) == 0)
+      rc = parseIntOption(zOption, 12, "maxtrigrams", 0, INT32_MAX, &pTrgVtab->maxTrigrams, pzErr);
+    else if(strncmp(zOption, "signature=", 10) == 0)
+      rc = parseIntOption(zOption, 10, "signature", 0, MAX_SIGNATURE_SIZE, &pTrgVtab->signatureSize, pzErr);
+    else if(strncmp(zOption, "dedup=", 6) == 0)
+      rc = parseBoolOption(zOption, 6, "dedup", &pTrgVtab->dedup, pzErr);
+    else if(strncmp(zOption, "compactids=", 11) == 0)
+      rc = parseBoolOption(zOption, 11, "compactids", &pTrgVtab->compactIds, pzErr);
+    else if(strncmp(zOption, "exactcase=", 10) == 0)
+      rc = parseBoolOption(zOption, 10, "exactcase", &pTrgVtab->exactCase, pzErr);
+    else if(strncmp(zOption, "utf8=", 5) == 0)
+      rc = parseBoolOption(zOption, 5, "utf8", &pTrgVtab->utf8, pzErr);
+    else if(strncmp(zOption, "sparse=", 7) == 0)
+      rc = parseBoolOption(zOption, 7, "sparse", &pTrgVtab->sparse, pzErr);
+    else if(strncmp(zOption, "anchors=", 8) == 0)
+      rc = parseBoolOption(zOption, 8, "anchors", &pTrgVtab->anchors, pzErr);
+    else if(strncmp(zOption, "compress=", 9) == 0){
+      rc = parseBoolOption(zOption, 9, "compress", &value, pzErr);
+      if(rc != SQLITE_OK) break;
+      storeClose(pTrgVtab->pStore);
+      pTrgVtab->pStore = NULL;
+      if(value)
+        rc = storeOpen(&pTrgVtab->pStore);
+    }else if(strncmp(zOption, "bigrams=", 8) == 0){
+      rc = parseBoolOption(zOption, 8, "bigrams", &value, pzErr);
+      if(rc != SQLITE_OK) break;
+      bigramsClose(pTrgVtab->pBigrams);
+      pTrgVtab->pBigrams = NULL;
+      if(value)
+        rc = bigramsOpen(&pTrgVtab->pBigrams);
+    }else{
+      *pzErr = sqlite3_mprintf("Unknown option: '%s'", zOption);
+      rc = SQLITE_ERROR;
     }
   }
-  /* Reset stmt */
-  rc = sqlite3_reset(pTrgVtab->stmt_fetch_doclist);
-  assert(rc == SQLITE_OK);
+  return rc;
+}
 
-  /*Insert docList */
-  rc = sqlite3_bind_int64(pTrgVtab->stmt_update_doclist, 1, (sqlite_int64)trigram);
-  assert(rc == SQLITE_OK);
-  rc = sqlite3_bind_blob(pTrgVtab->stmt_update_doclist, 2, docList, nSize, sqlite3_free);
-  assert(rc == SQLITE_OK);
-  /* Evaluate */
-  rc = sqlite3_step(pTrgVtab->stmt_update_doclist);
-  assert(rc == SQLITE_DONE);
-  rc = sqlite3_reset(pTrgVtab->stmt_update_doclist);
-  assert(rc == SQLITE_OK);
+/** Parse value of option zName=B, which starts nPrefix bytes into zOption, as
+ * *pValue. Returns SQLITE_ERROR and outputs an error message as *pzErr, if
+ * the value isn't 0 or 1 */
+static int parseBoolOption(const char *zOption, int nPrefix, const char *zName, bool *pValue, char **pzErr){
+  const char *zValue = zOption + nPrefix;
+  int n = strlen(zValue);
+  while(n > 0 && zValue[n - 1] == ' ') n--;
+  if(n != 1 || (*zValue != '0' && *zValue != '1')){
+    *pzErr = sqlite3_mprintf("Invalid value for %s option: '%s'", zName, zValue);
+    return SQLITE_ERROR;
+  }
+  *pValue = *zValue == '1';
+  return SQLITE_OK;
+}
+
+/** Parse value of option zName=N, which starts nPrefix bytes into zOption, as
+ * *pValue. Returns SQLITE_ERROR and outputs an error message as *pzErr, if
+ * the value isn't an integer from min to max */
+static int parseIntOption(const char *zOption, int nPrefix, const char *zName, long min, long max, int *pValue, char **pzErr){
+  const char *zValue = zOption + nPrefix;
+  char *zEnd;
+  long value = strtol(zValue, &zEnd, 10);
+  while(*zEnd == ' ') zEnd++;
+  if(zEnd == zValue || *zEnd || value < min || value > max){
+    *pzErr = sqlite3_mprintf("Invalid value for %s option: '%s'", zName, zValue);
+    return SQLITE_ERROR;
+  }
+  *pValue = (int)value;
+  return SQLITE_OK;
+}
+
+/** Load format version, gram size and line positions from %_config, tables
+ * without it are legacy tables, tables without a gram size are indexed by
+ * trigrams.
+ * Returns SQLITE_ERROR and outputs an error message as *pzErr for tables of a
+ * newer format. */
+static int loadConfig(trilite_vtab *pTrgVtab, char **pzErr){
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+
+  char *zSql = sqlite3_mprintf("SELECT key, value FROM %Q.'%q_config' WHERE key IN ('version', 'gram', 'lines')",
+                               pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+
+  /* No %_config table, must be a legacy table */
+  if(rc != SQLITE_OK){
+    trilite_log("No %%_config table, assuming legacy format");
+    pTrgVtab->formatVersion = 0;
+    return SQLITE_OK;
+  }
+
+  pTrgVtab->formatVersion = 0;
+  while(sqlite3_step(pStmt) == SQLITE_ROW){
+    const char *zKey = (const char*)sqlite3_column_text(pStmt, 0);
+    int value = sqlite3_column_int(pStmt, 1);
+    if(strcmp(zKey, "version") == 0)
+      pTrgVtab->formatVersion = value;
+    else if(strcmp(zKey, "lines") == 0)
+      pTrgVtab->linePositions = value != 0;
+    else if(value >= 3 && value <= MAX_GRAM_SIZE)
+      pTrgVtab->gramSize = value;
+  }
+  rc = sqlite3_finalize(pStmt);
+
+  /* Refuse tables written by a newer version */
+  if(rc == SQLITE_OK && pTrgVtab->formatVersion > TRILITE_FORMAT_VERSION){
+    *pzErr = sqlite3_mprintf("Table format version %i is not supported", pTrgVtab->formatVersion);
+    rc = SQLITE_ERROR;
+  }
+  return rc;
+}
+
+/** Check if the table %_<zSuffix> exists */
+static bool tableExists(trilite_vtab *pTrgVtab, const char *zSuffix){
+  sqlite3_stmt *pStmt;
+  bool exists = false;
+  char *zSql = sqlite3_mprintf("SELECT 1 FROM %Q.sqlite_master WHERE type = 'table' AND name = '%q_%q'",
+                               pTrgVtab->zDb, pTrgVtab->zName, zSuffix);
+  if(!zSql) return false;
+  if(sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0) == SQLITE_OK){
+    exists = sqlite3_step(pStmt) == SQLITE_ROW;
+    sqlite3_finalize(pStmt);
+  }
+  sqlite3_free(zSql);
+  return exists;
+}
+
+/** Upgrade tables from an older format version to the current format
+ * Tables without segments get their doclists registered as segment 0,
+ * doclists are moved from %_index to %_chunks, and %_deleted is created. */
+static int indexUpgrade(trilite_vtab *pTrgVtab){
+  int rc = SQLITE_OK;
+  assert(pTrgVtab->formatVersion < TRILITE_FORMAT_VERSION);
+
+  trilite_log("Upgrading index from format version %i", pTrgVtab->formatVersion);
+
+  /* Create %_config table */
+  char *zSql = sqlite3_mprintf(
+    "CREATE TABLE IF NOT EXISTS %Q.'%q_config' (key TEXT PRIMARY KEY, value);",
+    pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Create %_segments */
+  if(pTrgVtab->formatVersion < 2){
+    rc = segmentUpgrade(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Move doclists to %_chunks, this also rewrites legacy doclists */
+  if(pTrgVtab->formatVersion < 3){
+    rc = indexConvertToChunks(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }else if(pTrgVtab->formatVersion < 4){
+    /* Add masks to doclists in %_chunks */
+    rc = indexConvertChunks(pTrgVtab);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Create %_deleted, statements on it are prepared for the new version */
+  bool tombstones = pTrgVtab->formatVersion < 6;
+  if(tombstones){
+    zSql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS %Q.'%q_deleted' (block INTEGER PRIMARY KEY, bitmap BLOB);",
+                           pTrgVtab->zDb, pTrgVtab->zName);
+    if(!zSql) return SQLITE_NOMEM;
+    rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+    if(rc != SQLITE_OK) return rc;
+  }
+
+  /* Record the new format version */
+  zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_config' (key, value) VALUES ('version', %d);",
+                         pTrgVtab->zDb, pTrgVtab->zName, TRILITE_FORMAT_VERSION);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  pTrgVtab->formatVersion = TRILITE_FORMAT_VERSION;
+  if(tombstones){
+    rc = finalizeSql(pTrgVtab);
+    if(rc == SQLITE_OK)
+      rc = prepareSql(pTrgVtab);
+  }
+  return rc;
+}
+
+/** Move doclists from %_index to %_chunks, splitting them into chunks
+ * Doclists are read and written one at a time, and %_index is emptied at the
+ * end. It can't be dropped here, as tables can't be dropped while statements
+ * are running. Statements are prepared for the current format when done. */
+static int indexConvertToChunks(trilite_vtab *pTrgVtab){
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+  int iVersion = pTrgVtab->formatVersion;
+  assert(iVersion < 3);
+
+  /* Create %_chunks and prepare statements for it */
+  char *zSql = sqlite3_mprintf(
+    "CREATE TABLE IF NOT EXISTS %Q.'%q_chunks' (trigram INTEGER, firstid INTEGER, doclist BLOB, PRIMARY KEY (trigram, firstid)) WITHOUT ROWID;",
+    pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+  rc = finalizeSql(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+  pTrgVtab->formatVersion = TRILITE_FORMAT_VERSION;
+  rc = prepareSql(pTrgVtab);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Select next doclist in order of keys */
+  zSql = sqlite3_mprintf("SELECT trigram, doclist FROM %Q.'%q_index' WHERE trigram > ? ORDER BY trigram LIMIT 1",
+                         pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  sqlite3_int64 key = -1;
+  sqlite3_bind_int64(pStmt, 1, key);
+  while(rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW){
+    key = sqlite3_column_int64(pStmt, 0);
+    /* Convert doclist, the %_index row is not changed while we read it */
+    doclist_reader reader;
+    chunk_writer writer;
+    chunkWriterInit(&writer, pTrgVtab, key);
+    bool more = docListReaderInit(&reader, sqlite3_column_blob(pStmt, 1), sqlite3_column_bytes(pStmt, 1), iVersion);
+    while(more && rc == SQLITE_OK){
+      rc = chunkWriterAdd(&writer, reader.curId, docListMasks(&reader));
+      more = docListAdvance(&reader);
+    }
+    sqlite3_reset(pStmt);
+    if(rc == SQLITE_OK)
+      rc = chunkWriterFinish(&writer);
+    else
+      chunkWriterRelease(&writer);
+    sqlite3_bind_int64(pStmt, 1, key);
+  }
+  sqlite3_finalize(pStmt);
+  if(rc != SQLITE_OK) return rc;
 
+  /* Empty %_index */
+  zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_index';", pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
   return rc;
 }
 
-/** Remove text from trigram index */
+/** Rewrite chunks in %_chunks from format version 3, where ids have no masks
+ * Each chunk is rewritten in place with MASKS_ALL, so chunks grow by the size
+ * of masks, but keep their first id. */
+static int indexConvertChunks(trilite_vtab *pTrgVtab){
+  sqlite3_stmt *pSelect, *pUpdate;
+  int rc = SQLITE_OK;
+  int iVersion = pTrgVtab->formatVersion;
+  assert(iVersion == 3);
+
+  /* Select next chunk in order of keys */
+  char *zSql = sqlite3_mprintf(
+    "SELECT trigram, firstid, doclist FROM %Q.'%q_chunks' WHERE (trigram, firstid) > (?1, ?2)"
+    " ORDER BY trigram, firstid LIMIT 1",
+    pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql) return SQLITE_NOMEM;
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pSelect, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK) return rc;
+
+  zSql = sqlite3_mprintf("UPDATE %Q.'%q_chunks' SET doclist = ?3 WHERE trigram = ?1 AND firstid = ?2",
+                         pTrgVtab->zDb, pTrgVtab->zName);
+  if(!zSql){
+    sqlite3_finalize(pSelect);
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pUpdate, 0);
+  sqlite3_free(zSql);
+  if(rc != SQLITE_OK){
+    sqlite3_finalize(pSelect);
+    return rc;
+  }
+
+  sqlite3_int64 key = -1, chunkId = SQLITE3_INT64_MIN;
+  sqlite3_bind_int64(pSelect, 1, key);
+  sqlite3_bind_int64(pSelect, 2, chunkId);
+  while(rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW){
+    key     = sqlite3_column_int64(pSelect, 0);
+    chunkId = sqlite3_column_int64(pSelect, 1);
+    /* Re-encode chunk with masks */
+    doclist_reader reader;
+    doclist_writer writer;
+    docListWriterInit(&writer);
+    bool more = docListReaderInit(&reader, sqlite3_column_blob(pSelect, 2), sqlite3_column_bytes(pSelect, 2), iVersion);
+    while(more && rc == SQLITE_OK){
+      rc = docListWriterAdd(&writer, reader.curId, MASKS_ALL);
+      more = docListAdvance(&reader);
+    }
+    sqlite3_reset(pSelect);
+    unsigned char *chunk;
+    int nChunk;
+    if(rc == SQLITE_OK)
+      rc = docListWriterFinish(&writer, &chunk, &nChunk);
+    else
+      docListWriterRelease(&writer);
+    if(rc == SQLITE_OK){
+      sqlite3_bind_int64(pUpdate, 1, key);
+      sqlite3_bind_int64(pUpdate, 2, chunkId);
+      sqlite3_bind_blob(pUpdate, 3, chunk, nChunk, sqlite3_free);
+      sqlite3_step(pUpdate);
+      rc = sqlite3_reset(pUpdate);
+    }
+    sqlite3_bind_int64(pSelect, 1, key);
+    sqlite3_bind_int64(pSelect, 2, chunkId);
+  }
+  sqlite3_finalize(pSelect);
+  sqlite3_finalize(pUpdate);
+  return rc;
+}
+
+/** Remove the text of document id from the index, by tombstoning the id, see
+ * tombstone.c. Doclists aren't touched, rows of other tables keyed by the id
+ * are deleted, as they could rule out a later document with the same id. */
 static int indexRemoveText(trilite_vtab *pTrgVtab, sqlite3_int64 id){
-  /*TODO: Implement this function */
-  assert(0);
-  return SQLITE_INTERNAL;
+  int rc = tombstoneAdd(pTrgVtab, id);
+  if(rc != SQLITE_OK) return rc;
+
+  /* Tables with rows keyed by the document id, for the options given */
+  const char *azTables[]  = {"blocks", "always", "signatures", "hashes"};
+  const char *azColumns[] = {"id", "id", "id", "docid"};
+  bool aUsed[] = {pTrgVtab->largeDocSize > 0, pTrgVtab->maxTrigrams > 0, pTrgVtab->signatureSize > 0,
+                  pTrgVtab->mapIds && pTrgVtab->dedup};
+  int i;
+  for(i = 0; i < (int)(sizeof(azTables) / sizeof(azTables[0])) && rc == SQLITE_OK; i++){
+    if(!aUsed[i]) continue;
+    char *zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_%s' WHERE %s = %lld;",
+                                 pTrgVtab->zDb, pTrgVtab->zName, azTables[i], azColumns[i], id);
+    if(!zSql) return SQLITE_NOMEM;
+    rc = sqlite3_exec(pTrgVtab->db, zSql, NULL, NULL, NULL);
+    sqlite3_free(zSql);
+  }
+  return rc;
+}
+
+/** Compare keys of a text packed with their masks, see indexAddText */
+static int compareKeys(const void *pA, const void *pB){
+  uint64_t a = *(const uint64_t*)pA;
+  uint64_t b = *(const uint64_t*)pB;
+  return a < b ? -1 : a > b;
 }
 
 /****************************** Sql Statements *******************************/
@@ -667,21 +1665,159 @@ static int prepareSql(trilite_vtab *pTrgVtab){
   sqlite3_free(zSql);
   assert(rc == SQLITE_OK);
 
-  /* Update row in %_content */
-  zSql = sqlite3_mprintf("UPDATE %Q.'%q_content' SET id = ?, text = ? WHERE id = ?", zDb, zName);
+  /* Select text from %_content */
+  zSql = sqlite3_mprintf("SELECT text FROM %Q.'%q_content' WHERE id = ?", zDb, zName);
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_content, 0);
+  sqlite3_free(zSql);
+  assert(rc == SQLITE_OK);
+
+  /* Update text in %_content */
+  zSql = sqlite3_mprintf("UPDATE %Q.'%q_content' SET text = ? WHERE id = ?", zDb, zName);
   rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_update_content, 0);
   sqlite3_free(zSql);
   assert(rc == SQLITE_OK);
 
-  /* Select row from %_index */
-  zSql = sqlite3_mprintf("SELECT doclist FROM %Q.'%q_index' WHERE trigram = ?", zDb, zName);
-  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_doclist, 0);
+  /* Blocks of large documents in %_blocks */
+  if(pTrgVtab->largeDocSize > 0){
+    zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_blocks' (id, trigram, blocks) VALUES (?, ?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_blocks, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("SELECT blocks FROM %Q.'%q_blocks' WHERE id = ? AND trigram = ?", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_blocks, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Map ids to document ids in %_docids */
+  if(pTrgVtab->mapIds){
+    zSql = sqlite3_mprintf("SELECT coalesce((SELECT max(id) FROM %Q.'%q_docids'), 0) + 1,"
+                           " coalesce((SELECT max(id) FROM %Q.'%q_content'), 0) + 1", zDb, zName, zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_next_docid, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_docids' (id, docid) VALUES (?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_docid, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("SELECT docid, (SELECT count(*) FROM %Q.'%q_docids' WHERE docid = m.docid)"
+                           " FROM %Q.'%q_docids' m WHERE id = ?", zDb, zName, zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_find_docid, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_docids' WHERE id = ?", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_delete_docid, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Hashes of documents in %_hashes, for deduplicated tables */
+  if(pTrgVtab->mapIds && pTrgVtab->dedup){
+    zSql = sqlite3_mprintf("SELECT h.docid, c.text FROM %Q.'%q_hashes' h, %Q.'%q_content' c"
+                           " WHERE h.hash = ? AND c.id = h.docid", zDb, zName, zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_find_hash, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("INSERT OR IGNORE INTO %Q.'%q_hashes' (hash, docid) VALUES (?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_hash, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Compressed blocks of documents in %_store */
+  if(pTrgVtab->pStore){
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_store' (block, size, data) VALUES (?, ?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_store, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("SELECT size, data FROM %Q.'%q_store' WHERE block = ?", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_store, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("SELECT block, size, data FROM %Q.'%q_store' ORDER BY block DESC LIMIT 1", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_last_store, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Bitmaps of bigrams in %_bigrams */
+  if(pTrgVtab->pBigrams){
+    zSql = sqlite3_mprintf("SELECT block, bitmap FROM %Q.'%q_bigrams' WHERE bigram = ? AND block >= ? ORDER BY block LIMIT 1", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_bitmap, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_bigrams' (bigram, block, bitmap) VALUES (?, ?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_bitmap, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Signatures of documents in %_signatures */
+  if(pTrgVtab->signatureSize > 0){
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_signatures' (id, signature) VALUES (?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_signature, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Bitmaps of tombstones in %_deleted, tables from before format version 6
+   * are upgraded before anything is deleted */
+  if(pTrgVtab->formatVersion >= 6){
+    zSql = sqlite3_mprintf("SELECT block, bitmap FROM %Q.'%q_deleted' WHERE block >= ? ORDER BY block LIMIT 1", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_deleted, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_deleted' (block, bitmap) VALUES (?, ?)", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_deleted, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+
+    zSql = sqlite3_mprintf("DELETE FROM %Q.'%q_deleted' WHERE block = ?", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_delete_deleted, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+  }
+
+  /* Tables from before format version 3 store doclists in %_index */
+  if(pTrgVtab->formatVersion < 3){
+    /* Select row from %_index */
+    zSql = sqlite3_mprintf("SELECT doclist FROM %Q.'%q_index' WHERE trigram = ?", zDb, zName);
+    rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_doclist, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+    return rc;
+  }
+
+  /* Select first chunk after a given chunk from %_chunks */
+  zSql = sqlite3_mprintf("SELECT firstid, doclist FROM %Q.'%q_chunks' WHERE trigram = ? AND firstid > ? ORDER BY firstid LIMIT 1", zDb, zName);
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_fetch_chunk, 0);
+  sqlite3_free(zSql);
+  assert(rc == SQLITE_OK);
+
+  /* Select last chunk in a range of first ids from %_chunks */
+  zSql = sqlite3_mprintf("SELECT firstid, doclist FROM %Q.'%q_chunks' WHERE trigram = ? AND firstid > ? AND firstid <= ? ORDER BY firstid DESC LIMIT 1", zDb, zName);
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_seek_chunk, 0);
   sqlite3_free(zSql);
   assert(rc == SQLITE_OK);
 
-  /* Update (insert) row into %_index */
-  zSql = sqlite3_mprintf("INSERT OR REPLACE INTO %Q.'%q_index' (trigram, doclist) VALUES (?, ?)", zDb, zName);
-  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_update_doclist, 0);
+  /* Select last chunk of a doclist from %_chunks */
+  zSql = sqlite3_mprintf("SELECT doclist FROM %Q.'%q_chunks' WHERE trigram = ? ORDER BY firstid DESC LIMIT 1", zDb, zName);
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_last_chunk, 0);
+  sqlite3_free(zSql);
+  assert(rc == SQLITE_OK);
+
+  /* Insert chunk into %_chunks */
+  zSql = sqlite3_mprintf("INSERT INTO %Q.'%q_chunks' (trigram, firstid, doclist) VALUES (?, ?, ?)", zDb, zName);
+  rc = sqlite3_prepare_v2(pTrgVtab->db, zSql, -1, &pTrgVtab->stmt_insert_chunk, 0);
   sqlite3_free(zSql);
   assert(rc == SQLITE_OK);
   
@@ -703,7 +1839,12 @@ static int finalizeSql(trilite_vtab *pTrgVtab){
   pTrgVtab->stmt_insert_content = NULL;
   assert(rc == SQLITE_OK);
 
-  /* Update row in %_content */
+  /* Select text from %_content */
+  rc = sqlite3_finalize(pTrgVtab->stmt_fetch_content);
+  pTrgVtab->stmt_fetch_content = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Update text in %_content */
   rc = sqlite3_finalize(pTrgVtab->stmt_update_content);
   pTrgVtab->stmt_update_content = NULL;
   assert(rc == SQLITE_OK);
@@ -713,9 +1854,85 @@ static int finalizeSql(trilite_vtab *pTrgVtab){
   pTrgVtab->stmt_fetch_doclist = NULL;
   assert(rc == SQLITE_OK);
   
-  /* Update (insert) row in %_index */
-  rc = sqlite3_finalize(pTrgVtab->stmt_update_doclist);
-  pTrgVtab->stmt_update_doclist = NULL;    
+  /* Select chunks from %_chunks */
+  rc = sqlite3_finalize(pTrgVtab->stmt_fetch_chunk);
+  pTrgVtab->stmt_fetch_chunk = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_seek_chunk);
+  pTrgVtab->stmt_seek_chunk = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_last_chunk);
+  pTrgVtab->stmt_last_chunk = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Insert chunk into %_chunks */
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_chunk);
+  pTrgVtab->stmt_insert_chunk = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Insert and select blocks of large documents */
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_blocks);
+  pTrgVtab->stmt_insert_blocks = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_fetch_blocks);
+  pTrgVtab->stmt_fetch_blocks = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Statements on %_docids */
+  rc = sqlite3_finalize(pTrgVtab->stmt_next_docid);
+  pTrgVtab->stmt_next_docid = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_docid);
+  pTrgVtab->stmt_insert_docid = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_find_docid);
+  pTrgVtab->stmt_find_docid = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_delete_docid);
+  pTrgVtab->stmt_delete_docid = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Statements on %_hashes */
+  rc = sqlite3_finalize(pTrgVtab->stmt_find_hash);
+  pTrgVtab->stmt_find_hash = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_hash);
+  pTrgVtab->stmt_insert_hash = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Statements on %_store */
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_store);
+  pTrgVtab->stmt_insert_store = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_fetch_store);
+  pTrgVtab->stmt_fetch_store = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_last_store);
+  pTrgVtab->stmt_last_store = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Statements on %_bigrams */
+  rc = sqlite3_finalize(pTrgVtab->stmt_fetch_bitmap);
+  pTrgVtab->stmt_fetch_bitmap = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_bitmap);
+  pTrgVtab->stmt_insert_bitmap = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Insert signature into %_signatures */
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_signature);
+  pTrgVtab->stmt_insert_signature = NULL;
+  assert(rc == SQLITE_OK);
+
+  /* Statements on %_deleted */
+  rc = sqlite3_finalize(pTrgVtab->stmt_fetch_deleted);
+  pTrgVtab->stmt_fetch_deleted = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_insert_deleted);
+  pTrgVtab->stmt_insert_deleted = NULL;
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_finalize(pTrgVtab->stmt_delete_deleted);
+  pTrgVtab->stmt_delete_deleted = NULL;
   assert(rc == SQLITE_OK);
   
   /* It's too late to care about errors where, maybe an assert than none occur would be appropriate */
@@ -25,15 +25,79 @@ struct trilite_vtab {
   
   /** Insert row into %_content */
   sqlite3_stmt *stmt_insert_content;
-  
-  /** Update row in %_content */
+
+  /** Select text of a row from %_content */
+  sqlite3_stmt *stmt_fetch_content;
+
+  /** Update text of a row in %_content */
   sqlite3_stmt *stmt_update_content;
-  
-  /** Select row from %_index */
+
+  /** Select row from %_index, only for tables from before %_chunks */
   sqlite3_stmt *stmt_fetch_doclist;
 
-  /** Update/insert row in %_index */ 
-  sqlite3_stmt *stmt_update_doclist;
+  /** Select first chunk after a given chunk from %_chunks */
+  sqlite3_stmt *stmt_fetch_chunk;
+
+  /** Select last chunk in a range of first ids from %_chunks */
+  sqlite3_stmt *stmt_seek_chunk;
+
+  /** Select last chunk of a doclist from %_chunks */
+  sqlite3_stmt *stmt_last_chunk;
+
+  /** Insert chunk into %_chunks */
+  sqlite3_stmt *stmt_insert_chunk;
+
+  /** Insert blocks of a trigram in a large document into %_blocks */
+  sqlite3_stmt *stmt_insert_blocks;
+
+  /** Select blocks of a trigram in a large document from %_blocks */
+  sqlite3_stmt *stmt_fetch_blocks;
+
+  /** Insert or replace block in %_store */
+  sqlite3_stmt *stmt_insert_store;
+
+  /** Select block from %_store */
+  sqlite3_stmt *stmt_fetch_store;
+
+  /** Select last block from %_store */
+  sqlite3_stmt *stmt_last_store;
+
+  /** Select next id and document id, for tables with %_docids */
+  sqlite3_stmt *stmt_next_docid;
+
+  /** Insert row into %_docids */
+  sqlite3_stmt *stmt_insert_docid;
+
+  /** Select document id of an id from %_docids, and whether other ids share
+   * it */
+  sqlite3_stmt *stmt_find_docid;
+
+  /** Delete row from %_docids */
+  sqlite3_stmt *stmt_delete_docid;
+
+  /** Select document and text by hash from %_hashes, for deduplicated tables */
+  sqlite3_stmt *stmt_find_hash;
+
+  /** Insert hash of a document into %_hashes, for deduplicated tables */
+  sqlite3_stmt *stmt_insert_hash;
+
+  /** Select first bitmap of a bigram from a block on from %_bigrams */
+  sqlite3_stmt *stmt_fetch_bitmap;
+
+  /** Insert or replace bitmap in %_bigrams */
+  sqlite3_stmt *stmt_insert_bitmap;
+
+  /** Insert or replace signature of a document in %_signatures */
+  sqlite3_stmt *stmt_insert_signature;
+
+  /** Select first bitmap of tombstones from a block on from %_deleted */
+  sqlite3_stmt *stmt_fetch_deleted;
+
+  /** Insert or replace bitmap of tombstones in %_deleted */
+  sqlite3_stmt *stmt_insert_deleted;
+
+  /** Delete bitmap of tombstones from %_deleted */
+  sqlite3_stmt *stmt_delete_deleted;
 
   /** Hash table of new trigrams and their doclists */
   hash_table *pAdded;
@@ -43,6 +107,90 @@ struct trilite_vtab {
 
   /** Max regexp memory */
   int maxRegExpMemory;
+
+  /** Documents larger than this are also indexed by blocks, 0 to disable */
+  int largeDocSize;
+
+  /** Documents with more distinct trigrams than this are always-candidates,
+   * instead of being indexed by trigrams, 0 to disable, see always.c */
+  int maxTrigrams;
+
+  /** Trigrams in more than this percentage of documents are stop trigrams,
+   * 0 to disable, see stop.c */
+  int stopFreq;
+
+  /** Stop trigrams in ascending order */
+  trilite_trigram *aStop;
+
+  /** Number of stop trigrams in aStop */
+  int nStop;
+
+  /** Content store, if documents are stored compressed, otherwise NULL */
+  content_store *pStore;
+
+  /** Sealed index, if one is mapped, otherwise NULL */
+  sealed_index *pSealed;
+
+  /** Sealed index written by this transaction, renamed to zSealPath when the
+   * transaction commits, otherwise NULL, see sealCommit */
+  char *zSealTemp;
+
+  /** Path of the sealed index written by this transaction */
+  char *zSealPath;
+
+  /** Ids are mapped to document ids through %_docids, see optimize.c */
+  bool mapIds;
+
+  /** Identical texts share a document, see dedup.c */
+  bool dedup;
+
+  /** Ids and document ids are limited to the range of uint32_t */
+  bool compactIds;
+
+  /** Exact-case trigrams are indexed next to the folded, and used for case
+   * sensitive substring patterns */
+  bool exactCase;
+
+  /** Trigrams are trigrams of UTF-8 codepoints rather than bytes, see utf8.c */
+  bool utf8;
+
+  /** Texts are also indexed by sparse grams, and substrings are matched by the
+   * grams covering them, see trigram.c */
+  bool sparse;
+
+  /** Texts are also indexed by boundary grams of the document, lines and
+   * words, used for anchored regexps, see trigram.c */
+  bool anchors;
+
+  /** Pending bigrams, if texts are also indexed by bigrams, otherwise NULL,
+   * see bigrams.c */
+  bigram_index *pBigrams;
+
+  /** Pending tombstones of deleted documents, see tombstone.c */
+  tombstone_set *pTombstones;
+
+  /** Size of the Bloom signature of each document in bytes, 0 if documents
+   * have no signatures, see signature.c */
+  int signatureSize;
+
+  /** Number of characters in trigrams, DEFAULT_GRAM_SIZE unless the gram
+   * option is given, the value given is stored in %_config */
+  int gramSize;
+
+  /** Position masks hold offsets from the start of lines rather than of the
+   * text, so inserting or deleting lines doesn't change the masks of the
+   * lines following them. Set for tables with 'lines' in %_config, which is
+   * stored when creating tables, see trigram.c */
+  bool linePositions;
+
+  /** Format version of the underlying tables, see TRILITE_FORMAT_VERSION */
+  int formatVersion;
+
+  /** Segments of the index, loaded by segmentLoad when querying */
+  int *aSegments;
+
+  /** Number of segments in aSegments */
+  int nSegments;
 };
 
 int triliteCreate(sqlite3*, void*, int, const char *const*, sqlite3_vtab**, char**);
@@ -56,6 +204,7 @@ int triliteFindFunction(sqlite3_vtab*, int, const char*, void (**)(sqlite3_conte
 int triliteBegin(sqlite3_vtab*);
 int triliteSync(sqlite3_vtab*);
 int triliteCommit(sqlite3_vtab*);
+int triliteRollback(sqlite3_vtab*);
 void triliteError(trilite_vtab*, const char*, ...);
 
 #endif /* TRILITE_VTABLE_H */